@@ -0,0 +1,605 @@
+// BenchCheck.cpp : Checks of the engine routines that were rewritten for
+// speed.  Each check runs the current routine and the code it replaced,
+// kept here unchanged as the reference, on the same random input, and
+// reports every case where the two disagree.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include <vector>
+#include <algorithm>
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "untfs.hxx"
+#include "extents.hxx"
+
+#include "SectorsSorter.h"
+#include "BenchCheck.h"
+
+#define CHECK_MAX_REPORTED 10
+
+typedef bool (*SELF_CHECK)(MESSAGE& Message, unsigned int scale, unsigned __int64* cases,
+                           unsigned __int64* mismatches);
+
+// The same fixed sequence as the microbenchmarks, so a failing case can
+// be found again.  Returns 48 random bits.
+static ULONGLONG NextRandom(ULONGLONG* state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 16;
+}
+
+// The mapping pairs routines as they were before NTFS_MAPPING_PAIRS_DECODER:
+// the list is measured, expanded into a MAPPING_PAIR array with BIG_INT
+// byte loops, and then added to the extent list run by run.
+
+static BOOLEAN ReferenceQueryMappingPairsLength(PCVOID CompressedPairs, ULONG MaximumLength, PULONG Length,
+                                                PULONG NumberOfPairs)
+{
+    PBYTE CurrentCountByte;
+    ULONG CurrentLength;
+
+    CurrentCountByte = (PBYTE)CompressedPairs;
+
+    *NumberOfPairs = 0;
+    *Length = 0;
+
+    while (*Length <= MaximumLength && *CurrentCountByte != 0)
+    {
+        CurrentLength = LcnBytesFromCountByte(*CurrentCountByte) + VcnBytesFromCountByte(*CurrentCountByte) + 1;
+
+        (*NumberOfPairs)++;
+        *Length += CurrentLength;
+
+        CurrentCountByte += CurrentLength;
+    }
+
+    (*Length)++;
+
+    return *Length <= MaximumLength;
+}
+
+static BOOLEAN ReferenceExpandMappingPairs(PCVOID CompressedPairs, VCN StartingVcn, ULONG BufferSize,
+                                           ULONG MaximumNumberOfPairs, PMAPPING_PAIR MappingPairs,
+                                           PULONG NumberOfPairs)
+{
+    PBYTE CurrentData;
+    VCN CurrentVcn;
+    LCN CurrentLcn;
+    UCHAR v, l;
+    ULONG CurrentLength;
+    VCN DeltaVcn;
+    LCN DeltaLcn;
+    ULONG PairIndex;
+
+    CurrentData = (PBYTE)CompressedPairs;
+    CurrentVcn = StartingVcn;
+    CurrentLcn = 0;
+    CurrentLength = 0;
+    PairIndex = 0;
+
+    while (CurrentLength < BufferSize && *CurrentData != 0 && PairIndex < MaximumNumberOfPairs)
+    {
+        CurrentLength++;
+
+        if (CurrentLength > BufferSize)
+        {
+            return FALSE;
+        }
+
+        v = VcnBytesFromCountByte(*CurrentData);
+        l = LcnBytesFromCountByte(*CurrentData);
+
+        CurrentData++;
+
+        CurrentLength += v;
+
+        if (v > 8 || CurrentLength > BufferSize)
+        {
+            return FALSE;
+        }
+
+        DeltaVcn.Set(v, CurrentData);
+        CurrentData += v;
+
+        CurrentVcn += DeltaVcn;
+        MappingPairs[PairIndex].NextVcn = CurrentVcn;
+
+        CurrentLength += l;
+
+        if (l > 8 || CurrentLength > BufferSize)
+        {
+            return FALSE;
+        }
+
+        if (l == 0)
+        {
+            MappingPairs[PairIndex].CurrentLcn = LCN_NOT_PRESENT;
+        }
+        else
+        {
+            DeltaLcn.Set(l, CurrentData);
+            CurrentLcn += DeltaLcn;
+            MappingPairs[PairIndex].CurrentLcn = CurrentLcn;
+        }
+
+        CurrentData += l;
+        PairIndex++;
+    }
+
+    *NumberOfPairs = PairIndex;
+
+    return CurrentLength <= BufferSize && *CurrentData == 0 && PairIndex <= MaximumNumberOfPairs;
+}
+
+BOOLEAN ReferenceAddExtents(PNTFS_EXTENT_LIST Extents, VCN StartingVcn, PCVOID CompressedMappingPairs,
+                            ULONG MappingPairsMaximumLength, PBOOLEAN BadMappingPairs)
+{
+    VCN CurrentVcn;
+    ULONG LengthOfCompressedPairs;
+    ULONG NumberOfPairs;
+    PMAPPING_PAIR MappingPairs;
+    ULONG i;
+
+    if (BadMappingPairs != NULL)
+    {
+        *BadMappingPairs = FALSE;
+    }
+
+    if (!ReferenceQueryMappingPairsLength(CompressedMappingPairs, MappingPairsMaximumLength,
+                                          &LengthOfCompressedPairs, &NumberOfPairs))
+    {
+        if (BadMappingPairs != NULL)
+        {
+            *BadMappingPairs = TRUE;
+        }
+
+        return FALSE;
+    }
+
+    MappingPairs = (PMAPPING_PAIR)MALLOC(sizeof(MAPPING_PAIR) * (UINT)max(NumberOfPairs, (ULONG)1));
+
+    if (MappingPairs == NULL)
+    {
+        return FALSE;
+    }
+
+    if (!ReferenceExpandMappingPairs(CompressedMappingPairs, StartingVcn, MappingPairsMaximumLength,
+                                     NumberOfPairs, MappingPairs, &NumberOfPairs))
+    {
+        if (BadMappingPairs != NULL)
+        {
+            *BadMappingPairs = TRUE;
+        }
+
+        FREE(MappingPairs);
+        return FALSE;
+    }
+
+    CurrentVcn = StartingVcn;
+
+    for (i = 0; i < NumberOfPairs; i++)
+    {
+        if (MappingPairs[i].CurrentLcn != LCN_NOT_PRESENT)
+        {
+            if (!Extents->AddExtent(CurrentVcn, MappingPairs[i].CurrentLcn,
+                                    MappingPairs[i].NextVcn - CurrentVcn))
+            {
+                FREE(MappingPairs);
+                return FALSE;
+            }
+        }
+
+        CurrentVcn = MappingPairs[i].NextVcn;
+    }
+
+    if (StartingVcn < Extents->QueryLowestVcn())
+    {
+        Extents->SetLowestVcn(StartingVcn);
+    }
+
+    if (CurrentVcn > Extents->QueryNextVcn())
+    {
+        Extents->SetNextVcn(CurrentVcn);
+    }
+
+    FREE(MappingPairs);
+    return TRUE;
+}
+
+// Returns the number of bytes of the shortest signed field holding value.
+static UCHAR FieldWidth(LONGLONG value)
+{
+    UCHAR width = 1;
+
+    while (width < 8 && (value < -(1LL << (8 * width - 1)) || value >= (1LL << (8 * width - 1))))
+    {
+        width++;
+    }
+
+    return width;
+}
+
+// Returns a value of a random magnitude, from a few bits up to 40, so
+// that fields of every width turn up.
+static LONGLONG RandomMagnitude(ULONGLONG* state)
+{
+    ULONG bits = 1 + (ULONG)(NextRandom(state) % 40);
+
+    return (LONGLONG)(NextRandom(state) & ((1ULL << bits) - 1));
+}
+
+// Encodes a random list of runs, some of them holes, into buffer, and
+// returns its length with the terminating count byte.  Now and then a
+// field is written wider than it needs to be, which is still valid.
+static ULONG RandomMappingPairs(ULONGLONG* state, std::vector<UCHAR>& buffer)
+{
+    ULONG runs = (ULONG)(NextRandom(state) % 40);
+    LONGLONG lcn = 0;
+    ULONG i;
+
+    buffer.clear();
+
+    for (i = 0; i < runs; i++)
+    {
+        LONGLONG length = 1 + RandomMagnitude(state);
+        bool hole = NextRandom(state) % 8 == 0;
+        LONGLONG next = 1 + RandomMagnitude(state);
+        LONGLONG delta = next - lcn;
+        UCHAR v = FieldWidth(length);
+        UCHAR l = hole ? 0 : FieldWidth(delta);
+        UCHAR j;
+
+        if (v < 8 && NextRandom(state) % 16 == 0)
+        {
+            v++;
+        }
+
+        buffer.push_back((UCHAR)(v | (l << 4)));
+
+        for (j = 0; j < v; j++)
+        {
+            buffer.push_back((UCHAR)((ULONGLONG)length >> (8 * j)));
+        }
+
+        for (j = 0; j < l; j++)
+        {
+            buffer.push_back((UCHAR)((ULONGLONG)delta >> (8 * j)));
+        }
+
+        if (!hole)
+        {
+            lcn = next;
+        }
+    }
+
+    buffer.push_back(0);
+
+    return (ULONG)buffer.size();
+}
+
+// Damages the list the way a bad attribute record would: bytes are
+// changed or the buffer is cut short.
+static ULONG DamageMappingPairs(ULONGLONG* state, std::vector<UCHAR>& buffer, ULONG length)
+{
+    ULONG damage = (ULONG)(NextRandom(state) % 4);
+    ULONG i;
+
+    for (i = 0; i < damage && length != 0; i++)
+    {
+        buffer[(size_t)(NextRandom(state) % length)] = (UCHAR)NextRandom(state);
+    }
+
+    if (length != 0 && NextRandom(state) % 4 == 0)
+    {
+        length = (ULONG)(NextRandom(state) % length);
+    }
+
+    return length;
+}
+
+static bool SameExtentLists(PCNTFS_EXTENT_LIST first, PCNTFS_EXTENT_LIST second)
+{
+    VCN firstVcn, secondVcn;
+    LCN firstLcn, secondLcn;
+    BIG_INT firstLength, secondLength;
+    ULONG count;
+    ULONG i;
+
+    if (first->QueryLowestVcn() != second->QueryLowestVcn() || first->QueryNextVcn() != second->QueryNextVcn())
+    {
+        return false;
+    }
+
+    count = first->QueryNumberOfExtents();
+
+    if (count != second->QueryNumberOfExtents())
+    {
+        return false;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (!first->QueryExtent(i, &firstVcn, &firstLcn, &firstLength) ||
+            !second->QueryExtent(i, &secondVcn, &secondLcn, &secondLength) ||
+            firstVcn != secondVcn || firstLcn != secondLcn || firstLength != secondLength)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Decodes random, damaged and plain garbage mapping pairs lists with
+// NTFS_EXTENT_LIST::AddExtents and with the reference.  Both must agree
+// on success and on BadMappingPairs, and a list decoded by both must hold
+// the same extents.  When AddExtents fails, the list must be left as it
+// was.  Some lists are added to an extent list that already holds an
+// extent, which may overlap them.
+static bool CheckAddExtents(MESSAGE& Message, unsigned int scale, unsigned __int64* cases,
+                            unsigned __int64* mismatches)
+{
+    ULONG count = 100000 * scale;
+    ULONGLONG state = 26;
+    std::vector<UCHAR> buffer;
+    NTFS_EXTENT_LIST current;
+    NTFS_EXTENT_LIST reference;
+    NTFS_EXTENT_LIST before;
+    ULONG i, j;
+
+    for (i = 0; i < count; i++)
+    {
+        ULONGLONG kind = NextRandom(&state) % 8;
+        VCN startingVcn = (ULONGLONG)(NextRandom(&state) % 4 == 0 ? 0 : RandomMagnitude(&state));
+        ULONG length;
+        BOOLEAN currentOk, referenceOk;
+        BOOLEAN currentBad, referenceBad;
+        bool same;
+
+        if (kind == 0)
+        {
+            length = (ULONG)(NextRandom(&state) % 64);
+            buffer.resize(length);
+
+            for (j = 0; j < length; j++)
+            {
+                buffer[j] = (UCHAR)NextRandom(&state);
+            }
+        }
+        else
+        {
+            length = RandomMappingPairs(&state, buffer);
+
+            if (kind < 4)
+            {
+                length = DamageMappingPairs(&state, buffer, length);
+            }
+        }
+
+        // The reference may look at the byte just past the list; make it
+        // one that does not end it.
+        buffer.resize(length);
+        buffer.resize(length + 16, 0xFF);
+
+        if (!current.Initialize(startingVcn, startingVcn) || !reference.Initialize(startingVcn, startingVcn))
+        {
+            return false;
+        }
+
+        if (NextRandom(&state) % 4 == 0)
+        {
+            VCN vcn = (ULONGLONG)(startingVcn.GetQuadPart() + (LONGLONG)(NextRandom(&state) % 64));
+            LCN lcn = (ULONGLONG)(1 + RandomMagnitude(&state));
+            BIG_INT runLength = (ULONGLONG)(1 + NextRandom(&state) % 64);
+
+            // The MCB takes only 32-bit VCNs.
+            if (vcn.GetHighPart() == 0 &&
+                (!current.AddExtent(vcn, lcn, runLength) || !reference.AddExtent(vcn, lcn, runLength)))
+            {
+                return false;
+            }
+        }
+
+        if (!before.Initialize(&current))
+        {
+            return false;
+        }
+
+        currentOk = current.AddExtents(startingVcn, &buffer[0], length, &currentBad);
+        referenceOk = ReferenceAddExtents(&reference, startingVcn, &buffer[0], length, &referenceBad);
+
+        same = currentOk == referenceOk && (currentOk || currentBad == referenceBad);
+
+        if (same)
+        {
+            same = currentOk ? SameExtentLists(&current, &reference) : SameExtentLists(&current, &before);
+        }
+
+        (*cases)++;
+
+        if (!same)
+        {
+            if (++*mismatches <= CHECK_MAX_REPORTED)
+            {
+                Message.Out("add_extents: case ", (LONGLONG)i, " of ", (LONGLONG)length,
+                            " bytes differs from the reference.");
+            }
+        }
+    }
+
+    return true;
+}
+
+// SortAndJoinRanges as it was before the radix sort: std::sort, then one
+// pass joining the ranges that touch or overlap.
+static void ReferenceSortAndJoinRanges(std::vector<sectors_range>& ranges)
+{
+    std::vector<sectors_range>::iterator current, last;
+
+    if (ranges.empty())
+    {
+        return;
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+
+    last = ranges.begin();
+
+    for (current = ranges.begin() + 1; current != ranges.end(); ++current)
+    {
+        if (last->contains(current->firstSector) || last->lastSector + 1 == current->firstSector)
+        {
+            if (!last->contains(current->lastSector))
+            {
+                last->lastSector = current->lastSector;
+            }
+            continue;
+        }
+
+        *++last = *current;
+    }
+
+    ranges.erase(last + 1, ranges.end());
+}
+
+// Returns a random range of one of several shapes: packed close together
+// so that many touch, spread over the whole 64 bits, repeating a few
+// starting sectors, or spread over the high bytes only.
+static sectors_range RandomSectorsRange(ULONGLONG* state, ULONG kind, size_t count)
+{
+    unsigned __int64 first, length;
+
+    switch (kind)
+    {
+    case 0:
+        first = NextRandom(state) % (4 * count + 1);
+        length = NextRandom(state) % 4;
+        break;
+
+    case 1:
+        first = (NextRandom(state) << 16) ^ NextRandom(state);
+        length = NextRandom(state) % 1000;
+        break;
+
+    case 2:
+        first = NextRandom(state) % 50;
+        length = NextRandom(state) % 3;
+        break;
+
+    default:
+        first = (NextRandom(state) % 1000) << 40 | NextRandom(state) % (count + 1);
+        length = NextRandom(state) % (1 << 20);
+        break;
+    }
+
+    if (first + length < first)
+    {
+        length = 0;
+    }
+
+    return sectors_range(first, first + length);
+}
+
+// Sorts and joins random arrays of ranges with SortAndJoinRanges and
+// with the reference, on one or several threads, and compares the
+// results.  The sizes reach past the point where the radix sort takes
+// over and past the one where it uses more than one thread.
+static bool CheckSortAndJoinRanges(MESSAGE& Message, unsigned int scale, unsigned __int64* cases,
+                                   unsigned __int64* mismatches)
+{
+    static const size_t sizes[] = { 0, 1, 2, 100, 4095, 4096, 5000, 70000, 600000, 1100000 };
+    static const unsigned threads[] = { 0, 1, 2, 4, 16 };
+    ULONG count = 20 * scale;
+    ULONGLONG state = 40;
+    std::vector<sectors_range> current;
+    std::vector<sectors_range> reference;
+    ULONG i;
+    size_t j;
+
+    for (i = 0; i < count; i++)
+    {
+        size_t size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+        unsigned threadCount = threads[NextRandom(&state) % (sizeof(threads) / sizeof(threads[0]))];
+        ULONG kind = (ULONG)(NextRandom(&state) % 4);
+        bool same;
+
+        current.clear();
+
+        for (j = 0; j < size; j++)
+        {
+            current.push_back(RandomSectorsRange(&state, kind, size));
+        }
+
+        reference = current;
+
+        SortAndJoinRanges(current, threadCount);
+        ReferenceSortAndJoinRanges(reference);
+
+        same = current.size() == reference.size();
+
+        for (j = 0; same && j < current.size(); j++)
+        {
+            same = current[j].firstSector == reference[j].firstSector &&
+                   current[j].lastSector == reference[j].lastSector;
+        }
+
+        (*cases)++;
+
+        if (!same)
+        {
+            if (++*mismatches <= CHECK_MAX_REPORTED)
+            {
+                Message.Out("sort_and_join: case ", (LONGLONG)i, " of ", (LONGLONG)size,
+                            " ranges differs from the reference.");
+            }
+        }
+    }
+
+    return true;
+}
+
+struct CHECK_ENTRY
+{
+    const char* name;
+    SELF_CHECK check;
+};
+
+static const CHECK_ENTRY SelfChecks[] =
+{
+    { "add_extents",        CheckAddExtents },
+    { "sort_and_join",      CheckSortAndJoinRanges },
+};
+
+#define SELF_CHECKS (sizeof(SelfChecks) / sizeof(SelfChecks[0]))
+
+int RunSelfChecks(MESSAGE& Message, unsigned int scale)
+{
+    bool failed = false;
+    size_t i;
+
+    for (i = 0; i < SELF_CHECKS; i++)
+    {
+        unsigned __int64 cases = 0;
+        unsigned __int64 mismatches = 0;
+
+        if (!SelfChecks[i].check(Message, scale, &cases, &mismatches))
+        {
+            Message.Out("Check failed to run: ", std::string(SelfChecks[i].name));
+            failed = true;
+            continue;
+        }
+
+        Message.Out((std::string(SelfChecks[i].name) + ": ").c_str(), (LONGLONG)cases, " cases, ",
+                    (LONGLONG)mismatches, " mismatches.");
+
+        if (mismatches != 0)
+        {
+            failed = true;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+DECLARE_CLASS(NTFS_EXTENT_LIST);
+
+// Checks the routines of the engine that were rewritten for speed
+// against the code they replaced, kept here as the reference, on random
+// and corrupted input.  Every count is multiplied by scale.  Each
+// mismatch is printed.  Returns 0 if every check passed.
+int RunSelfChecks(MESSAGE& Message, unsigned int scale);
+
+// The NTFS_EXTENT_LIST::AddExtents of before NTFS_MAPPING_PAIRS_DECODER,
+// which expands the whole list into an array first.  The checks compare
+// against it and the microbenchmarks time it.
+BOOLEAN ReferenceAddExtents(PNTFS_EXTENT_LIST Extents, VCN StartingVcn, PCVOID CompressedMappingPairs,
+                            ULONG MappingPairsMaximumLength, PBOOLEAN BadMappingPairs);
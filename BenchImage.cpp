@@ -0,0 +1,355 @@
+// BenchImage.cpp : Synthetic NTFS volumes for the benchmark.  Each one
+// lives in an expandable VHD, which diskpart creates, attaches and
+// formats, so the volume is a real NTFS volume made by Windows.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "ntfsvol.hxx"
+
+#include "TextUtils.h"
+#include "SectorsSorter.h"
+#include "MarkVolume.h"
+#include "BenchImage.h"
+
+// The volume is filled with files of this many clusters; the holes
+// left by deleting some of them are the same size.
+#define BENCH_FILE_CLUSTERS 256
+
+static int QueryFullPath(MESSAGE& Message, const std::string& fileName, std::string& path)
+{
+    char buffer[MAX_PATH];
+    DWORD length = GetFullPathNameA(fileName.c_str(), MAX_PATH, buffer, NULL);
+
+    if (length == 0 || length >= MAX_PATH)
+    {
+        Message.Out("Invalid image file name: ", fileName);
+        return 1;
+    }
+
+    path = buffer;
+    return 0;
+}
+
+// Runs script with diskpart.  diskpart's own output is of no use here;
+// it reports a failed command in its exit code.
+static int RunDiskpart(MESSAGE& Message, const std::string& script)
+{
+    char tempPath[MAX_PATH];
+    char scriptFile[MAX_PATH];
+    char commandLine[2 * MAX_PATH];
+    SECURITY_ATTRIBUTES security;
+    STARTUPINFOA startup;
+    PROCESS_INFORMATION process;
+    HANDLE nul;
+    FILE* file;
+    DWORD exitCode = 1;
+
+    if (!GetTempPathA(MAX_PATH, tempPath) || !GetTempFileNameA(tempPath, "NMB", 0, scriptFile))
+    {
+        Message.Out("Cannot create a temporary file.");
+        return 1;
+    }
+
+    file = fopen(scriptFile, "wt");
+
+    if (file == NULL || fputs(script.c_str(), file) < 0 || fclose(file) != 0)
+    {
+        DeleteFileA(scriptFile);
+        Message.Out("Cannot create a temporary file.");
+        return 1;
+    }
+
+    security.nLength = sizeof(security);
+    security.lpSecurityDescriptor = NULL;
+    security.bInheritHandle = TRUE;
+
+    nul = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &security, OPEN_EXISTING, 0, NULL);
+
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup.hStdOutput = nul;
+    startup.hStdError = nul;
+
+    _snprintf(commandLine, sizeof(commandLine) - 1, "diskpart.exe /s \"%s\"", scriptFile);
+    commandLine[sizeof(commandLine) - 1] = '\0';
+
+    if (nul != INVALID_HANDLE_VALUE &&
+        CreateProcessA(NULL, commandLine, NULL, NULL, TRUE, 0, NULL, NULL, &startup, &process))
+    {
+        WaitForSingleObject(process.hProcess, INFINITE);
+        GetExitCodeProcess(process.hProcess, &exitCode);
+        CloseHandle(process.hThread);
+        CloseHandle(process.hProcess);
+    }
+    else
+    {
+        Message.Out("Cannot run diskpart.");
+    }
+
+    if (nul != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(nul);
+    }
+
+    DeleteFileA(scriptFile);
+
+    return exitCode == 0 ? 0 : 1;
+}
+
+// Fills the volume with files up to fillPercent + fragmentPercent of its
+// size, and then deletes every file whose index crosses a multiple of
+// (fillPercent + fragmentPercent) / fragmentPercent, so the holes are
+// spread evenly over the filled part.  The files are extended without
+// being written; NTFS allocates their clusters all the same.
+static int FillVolume(MESSAGE& Message, const std::string& drive, const BENCH_IMAGE_OPTIONS& Options)
+{
+    std::string root = drive + "\\";
+    std::string directory = root + "FILL";
+    DWORD sectorsPerCluster, bytesPerSector, freeClusters, totalClusters;
+    ULARGE_INTEGER available, totalBytes, freeBytes;
+    LARGE_INTEGER fileSize;
+    unsigned int used = Options.fillPercent + Options.fragmentPercent;
+    LONGLONG files, deleted = 0;
+    LONGLONG i;
+    HANDLE file;
+
+    if (used == 0)
+    {
+        return 0;
+    }
+
+    if (!GetDiskFreeSpaceA(root.c_str(), &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters) ||
+        !GetDiskFreeSpaceExA(root.c_str(), &available, &totalBytes, &freeBytes))
+    {
+        Message.Out("Cannot query the size of drive ", drive, ".");
+        return 1;
+    }
+
+    fileSize.QuadPart = (LONGLONG)BENCH_FILE_CLUSTERS * sectorsPerCluster * bytesPerSector;
+    files = (LONGLONG)(totalBytes.QuadPart / 100 * used / fileSize.QuadPart);
+
+    if (!CreateDirectoryA(directory.c_str(), NULL))
+    {
+        Message.Out("Cannot create ", directory, ".");
+        return 1;
+    }
+
+    Message.Out("Writing ", files, " files...");
+
+    for (i = 0; i < files; i++)
+    {
+        std::string name = directory + "\\" + uint64_to_string(i);
+
+        file = CreateFileA(name.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            Message.Out("Cannot create ", name, ".");
+            return 1;
+        }
+
+        if (!SetFilePointerEx(file, fileSize, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+        {
+            DWORD error = GetLastError();
+
+            CloseHandle(file);
+            DeleteFileA(name.c_str());
+
+            // The metadata of that many files takes some room too.
+            if (error == ERROR_DISK_FULL)
+            {
+                Message.Out("The volume is full after ", i, " files.");
+                files = i;
+                break;
+            }
+
+            Message.Out("Cannot write ", name, ".");
+            return 1;
+        }
+
+        CloseHandle(file);
+    }
+
+    for (i = 0; i < files; i++)
+    {
+        if ((i + 1) * Options.fragmentPercent / used != i * Options.fragmentPercent / used)
+        {
+            if (!DeleteFileA((directory + "\\" + uint64_to_string(i)).c_str()))
+            {
+                Message.Out("Cannot delete a file in ", directory, ".");
+                return 1;
+            }
+
+            deleted++;
+        }
+    }
+
+    Message.Out("Files kept: ", files - deleted, ", deleted to leave holes: ", deleted, "");
+    return 0;
+}
+
+// Marks badRuns single clusters, spread evenly over the volume, as bad.
+// The ones that fall in a file are left alone, as in any other run.
+static int MarkBadRuns(MESSAGE& Message, const std::string& drive, unsigned int badRuns)
+{
+    DSTRING NtDriveName;
+    NTFS_VOL NtfsVol;
+    SectorsRangeSorter runTargets;
+    LONGLONG firstSector, sectors, clusterSectors, offset;
+    unsigned int i;
+
+    if (badRuns == 0)
+    {
+        return 0;
+    }
+
+    if (!NtDriveName.Initialize(("\\??\\" + drive).c_str()))
+    {
+        Message.Out("Out of memory.");
+        return 1;
+    }
+
+    if (OpenNtfsVolume(Message, &NtDriveName, drive, NtfsVol))
+    {
+        return 1;
+    }
+
+    firstSector = NtfsVol.QueryHiddenSectors().GetQuadPart();
+    sectors = NtfsVol.QuerySectors().GetQuadPart();
+    clusterSectors = NtfsVol.GetNtfsSa()->QueryClusterFactor();
+
+    for (i = 0; i < badRuns; i++)
+    {
+        offset = (2 * (LONGLONG)i + 1) * sectors / (2 * (LONGLONG)badRuns) / clusterSectors * clusterSectors;
+
+        if (!runTargets.Add(sectors_range(firstSector + offset, firstSector + offset + clusterSectors - 1)))
+        {
+            Message.Out("Cannot write a temporary file while sorting the sectors list.");
+            return 1;
+        }
+    }
+
+    if (!runTargets.Finish())
+    {
+        Message.Out("Cannot write a temporary file while sorting the sectors list.");
+        return 1;
+    }
+
+    Message.Out("Marking ", (LONGLONG)badRuns, " bad runs...");
+
+    if (!NtfsVol.MarkBad(runTargets, &Message))
+    {
+        Message.Out("An error has occurred.");
+        return 1;
+    }
+
+    return 0;
+}
+
+int CreateBenchImage(MESSAGE& Message, const std::string& imageFile, const std::string& drive,
+                     const BENCH_IMAGE_OPTIONS& Options)
+{
+    std::string path;
+    std::string script;
+    int result;
+
+    if (QueryFullPath(Message, imageFile, path))
+    {
+        return 1;
+    }
+
+    if (GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES)
+    {
+        Message.Out("The image file already exists: ", path);
+        return 1;
+    }
+
+    script = "create vdisk file=\"" + path + "\" maximum=" + uint64_to_string(Options.sizeMegabytes) + " type=expandable\n"
+             "attach vdisk\n"
+             "convert mbr\n"
+             "create partition primary\n"
+             "format fs=ntfs quick label=NTFSMARKBAD";
+
+    if (Options.clusterSize != 0)
+    {
+        script += " unit=" + uint64_to_string(Options.clusterSize);
+    }
+
+    script += "\nassign letter=" + drive.substr(0, 1) + "\n";
+
+    Message.Out("Creating ", path, "...");
+
+    if (RunDiskpart(Message, script))
+    {
+        Message.Out("diskpart could not create the image.");
+        return 1;
+    }
+
+    result = FillVolume(Message, drive, Options);
+
+    if (result == 0)
+    {
+        result = MarkBadRuns(Message, drive, Options.badRuns);
+    }
+
+    if (DetachBenchImage(Message, imageFile))
+    {
+        return 1;
+    }
+
+    if (result == 0)
+    {
+        Message.Out("Completed.");
+    }
+
+    return result;
+}
+
+int AttachBenchImage(MESSAGE& Message, const std::string& imageFile, const std::string& drive)
+{
+    std::string path;
+
+    if (QueryFullPath(Message, imageFile, path))
+    {
+        return 1;
+    }
+
+    // Windows may mount the volume under any free letter when the VHD
+    // is attached, so the one asked for is assigned explicitly.
+    if (RunDiskpart(Message, "select vdisk file=\"" + path + "\"\n"
+                             "attach vdisk\n"
+                             "select partition 1\n"
+                             "remove all noerr\n"
+                             "assign letter=" + drive.substr(0, 1) + "\n"))
+    {
+        Message.Out("diskpart could not attach ", path, ".");
+        return 1;
+    }
+
+    return 0;
+}
+
+int DetachBenchImage(MESSAGE& Message, const std::string& imageFile)
+{
+    std::string path;
+
+    if (QueryFullPath(Message, imageFile, path))
+    {
+        return 1;
+    }
+
+    if (RunDiskpart(Message, "select vdisk file=\"" + path + "\"\n"
+                             "detach vdisk\n"))
+    {
+        Message.Out("diskpart could not detach ", path, ".");
+        return 1;
+    }
+
+    return 0;
+}
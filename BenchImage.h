@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+
+// The shape of a synthetic volume for the benchmark.
+struct BENCH_IMAGE_OPTIONS
+{
+    unsigned __int64 sizeMegabytes;
+    unsigned int clusterSize;       // bytes, 0 for the format default
+    unsigned int fillPercent;       // of the volume taken by files
+    unsigned int fragmentPercent;   // of the volume freed in holes between files
+    unsigned int badRuns;           // runs already in the Bad Clusters File
+};
+
+// Creates an expandable VHD at imageFile holding one NTFS volume of the
+// given shape, and detaches it again.  The volume is mounted as drive
+// while it is built: filled with files, some of which are deleted to
+// leave holes spread over the volume, and then badRuns single clusters
+// spread over the volume are marked bad with the marking engine.
+// diskpart does the VHD work, so this needs administrator rights and
+// Windows 7 or later.  Returns 0 on success.
+int CreateBenchImage(MESSAGE& Message, const std::string& imageFile, const std::string& drive,
+                     const BENCH_IMAGE_OPTIONS& Options);
+
+// Attaches the VHD at imageFile and mounts its volume as drive.
+// Returns 0 on success.
+int AttachBenchImage(MESSAGE& Message, const std::string& imageFile, const std::string& drive);
+
+// Detaches the VHD at imageFile.  Returns 0 on success.
+int DetachBenchImage(MESSAGE& Message, const std::string& imageFile);
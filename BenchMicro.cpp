@@ -0,0 +1,780 @@
+// BenchMicro.cpp : Microbenchmarks of the containers under the engine.
+// Each one builds its input untimed, times one access pattern, and keeps
+// a check value computed from the results, so the work cannot be
+// optimized away and two builds can be seen to have done the same work.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include <vector>
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "bitvect.hxx"
+#include "list.hxx"
+#include "iterator.hxx"
+#include "numset.hxx"
+#include "untfs.hxx"
+#include "ntfsbit.hxx"
+#include "extents.hxx"
+
+extern "C" {
+#include "fsrtlp.h"
+}
+
+#include "BenchMicro.h"
+#include "BenchCheck.h"
+
+#define MICRO_FILE_VERSION 1
+
+#define MICRO_HEADER "benchmark                         operations      seconds     ns/op                check"
+#define MICRO_ROW    "%-28s %15I64u %12.6f %9.1f %20I64u"
+
+struct MICRO_RESULT
+{
+    unsigned __int64 operations;
+    double seconds;
+    unsigned __int64 check;
+};
+
+typedef bool (*MICRO_BENCHMARK)(unsigned int scale, MICRO_RESULT* result);
+
+static double QuerySeconds()
+{
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+// A fixed linear congruential sequence, so every build gets the same
+// input.  Returns 48 random bits.
+static ULONGLONG NextRandom(ULONGLONG* state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 16;
+}
+
+// Appends single numbers in ascending order, as the clusters of a sorted
+// sectors list are added.
+static bool NumberSetAppend(unsigned int scale, MICRO_RESULT* result)
+{
+    NUMBER_SET Set;
+    ULONG count = 200000 * scale;
+    double begin;
+    ULONG i;
+
+    if (!Set.Initialize())
+    {
+        return false;
+    }
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < count; i++)
+    {
+        if (!Set.Add((ULONGLONG)i * 2))
+        {
+            return false;
+        }
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count;
+    result->check = Set.QueryNumDisjointRanges();
+    return true;
+}
+
+// Adds single numbers at random points.
+static bool NumberSetRandomInsert(unsigned int scale, MICRO_RESULT* result)
+{
+    NUMBER_SET Set;
+    ULONG count = 20000 * scale;
+    ULONGLONG state = 1;
+    double begin;
+    ULONG i;
+
+    if (!Set.Initialize())
+    {
+        return false;
+    }
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < count; i++)
+    {
+        if (!Set.Add(NextRandom(&state) % ((ULONGLONG)1 << 32)))
+        {
+            return false;
+        }
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count;
+    result->check = Set.QueryCardinality().GetQuadPart();
+    return true;
+}
+
+// Adds short runs with gaps between them in ascending order, the shape
+// of a bad cluster list from a failing disk.
+static bool NumberSetBadRuns(unsigned int scale, MICRO_RESULT* result)
+{
+    NUMBER_SET Set;
+    ULONG count = 200000 * scale;
+    ULONGLONG state = 2;
+    ULONGLONG start = 0;
+    double begin;
+    ULONG i;
+
+    if (!Set.Initialize())
+    {
+        return false;
+    }
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < count; i++)
+    {
+        ULONGLONG length = 1 + NextRandom(&state) % 16;
+
+        if (!Set.Add(start, length))
+        {
+            return false;
+        }
+
+        start += length + 1 + NextRandom(&state) % 1024;
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count;
+    result->check = Set.QueryCardinality().GetQuadPart();
+    return true;
+}
+
+// Looks up random numbers in a set of disjoint runs.
+static bool NumberSetLookup(unsigned int scale, MICRO_RESULT* result)
+{
+    NUMBER_SET Set;
+    ULONG count = 20000 * scale;
+    ULONGLONG state = 3;
+    BIG_INT start, length;
+    double begin;
+    ULONG i;
+
+    if (!Set.Initialize())
+    {
+        return false;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (!Set.Add((ULONGLONG)i * 64, (ULONGLONG)32))
+        {
+            return false;
+        }
+    }
+
+    result->check = 0;
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < count; i++)
+    {
+        if (Set.QueryContainingRange(NextRandom(&state) % ((ULONGLONG)count * 64), &start, &length))
+        {
+            result->check += start.GetQuadPart();
+        }
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count;
+    return true;
+}
+
+// Sets and tests single bits at random in a bitmap of 2^26 bits, the
+// size of the bitmap of a 256 GB volume with 4 KB clusters.
+static bool BitVectorRandomBits(unsigned int scale, MICRO_RESULT* result)
+{
+    BITVECTOR Bits;
+    ULONG size = 1 << 26;
+    ULONG count = 4000000 * scale;
+    ULONGLONG state = 4;
+    double begin;
+    ULONG i;
+
+    if (!Bits.Initialize(size))
+    {
+        return false;
+    }
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < count; i++)
+    {
+        ULONG index = (ULONG)(NextRandom(&state) % size);
+
+        if (Bits.IsBitSet(index))
+        {
+            Bits.ResetBit(index);
+        }
+        else
+        {
+            Bits.SetBit(index);
+        }
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count;
+    result->check = Bits.QueryCountSet();
+    return true;
+}
+
+// Sets runs of bits and counts the set bits of the whole bitmap.
+static bool BitVectorRunsAndCount(unsigned int scale, MICRO_RESULT* result)
+{
+    BITVECTOR Bits;
+    ULONG size = 1 << 26;
+    ULONG count = 200000 * scale;
+    ULONG passes = 10 * scale;
+    ULONGLONG state = 5;
+    double begin;
+    ULONG i;
+
+    if (!Bits.Initialize(size))
+    {
+        return false;
+    }
+
+    result->check = 0;
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < count; i++)
+    {
+        ULONG length = 1 + (ULONG)(NextRandom(&state) % 256);
+
+        Bits.SetBit((ULONG)(NextRandom(&state) % (size - length)), length);
+    }
+
+    for (i = 0; i < passes; i++)
+    {
+        result->check += Bits.QueryCountSet();
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count + (unsigned __int64)passes * size;
+    return true;
+}
+
+// Scans a large, partly allocated volume bitmap for free runs, the way
+// marking checks whether each cluster of a range is in use.
+static bool NtfsBitmapScan(unsigned int scale, MICRO_RESULT* result)
+{
+    NTFS_BITMAP Bitmap;
+    ULONG clusters = 1 << 26;
+    ULONG run = 16;
+    ULONG passes = scale;
+    ULONGLONG state = 6;
+    double begin;
+    ULONG lcn;
+    ULONG i;
+
+    if (!Bitmap.Initialize(clusters, FALSE))
+    {
+        return false;
+    }
+
+    // Allocate about half of the volume, in runs of up to 4096 clusters.
+    for (lcn = 0; lcn < clusters - 8192; )
+    {
+        ULONG length = 1 + (ULONG)(NextRandom(&state) % 4096);
+
+        Bitmap.SetAllocated(lcn, length);
+        lcn += length + 1 + (ULONG)(NextRandom(&state) % 4096);
+    }
+
+    result->check = 0;
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < passes; i++)
+    {
+        for (lcn = 0; lcn + run <= clusters; lcn += run)
+        {
+            if (Bitmap.IsFree(lcn, run))
+            {
+                result->check++;
+            }
+        }
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = (unsigned __int64)passes * (clusters / run);
+    return true;
+}
+
+// Fills a large MCB with count runs.  With identity set, each run maps
+// a VCN to the same LCN with a hole before it, as $BadClus does;
+// otherwise the runs are appended one after another.  The MCB routines
+// raise on failure, so the work is kept apart from any C++ objects.
+static bool FillLargeMcb(PLARGE_MCB Mcb, ULONG count, BOOLEAN identity, ULONGLONG* state)
+{
+    LONGLONG vbn = 0;
+    LONGLONG lbn;
+    LONGLONG length;
+    ULONG i;
+
+    __try
+    {
+        for (i = 0; i < count; i++)
+        {
+            length = 1 + (LONGLONG)(NextRandom(state) % 16);
+
+            if (identity)
+            {
+                vbn += 1 + (LONGLONG)(NextRandom(state) % 1024);
+                lbn = vbn;
+            }
+            else
+            {
+                lbn = vbn * 2 + 1;
+            }
+
+            if (!FsRtlAddLargeMcbEntry(Mcb, vbn, lbn, length))
+            {
+                return false;
+            }
+
+            vbn += length;
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static bool LargeMcbAdd(unsigned int scale, MICRO_RESULT* result, BOOLEAN identity)
+{
+    LARGE_MCB Mcb;
+    ULONG count = 100000 * scale;
+    ULONGLONG state = 7;
+    double begin;
+    bool added;
+
+    FsRtlInitializeLargeMcb(&Mcb, (POOL_TYPE)0);
+
+    begin = QuerySeconds();
+
+    added = FillLargeMcb(&Mcb, count, identity, &state);
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count;
+    result->check = FsRtlNumberOfRunsInLargeMcb(&Mcb);
+
+    FsRtlUninitializeLargeMcb(&Mcb);
+    return added;
+}
+
+static bool LargeMcbAppend(unsigned int scale, MICRO_RESULT* result)
+{
+    return LargeMcbAdd(scale, result, FALSE);
+}
+
+static bool LargeMcbSparseIdentity(unsigned int scale, MICRO_RESULT* result)
+{
+    return LargeMcbAdd(scale, result, TRUE);
+}
+
+// Looks up random VCNs in a sparse identity-mapped MCB.
+static bool LargeMcbLookup(unsigned int scale, MICRO_RESULT* result)
+{
+    LARGE_MCB Mcb;
+    ULONG runs = 100000;
+    ULONG count = 1000000 * scale;
+    ULONGLONG state = 8;
+    LONGLONG lastVbn, lastLbn, lbn;
+    double begin;
+    ULONG i;
+
+    FsRtlInitializeLargeMcb(&Mcb, (POOL_TYPE)0);
+
+    if (!FillLargeMcb(&Mcb, runs, TRUE, &state) ||
+        !FsRtlLookupLastLargeMcbEntry(&Mcb, &lastVbn, &lastLbn))
+    {
+        FsRtlUninitializeLargeMcb(&Mcb);
+        return false;
+    }
+
+    result->check = 0;
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < count; i++)
+    {
+        if (FsRtlLookupLargeMcbEntry(&Mcb, (LONGLONG)(NextRandom(&state) % (lastVbn + 1)),
+                                     &lbn, NULL, NULL, NULL, NULL) && lbn != -1)
+        {
+            result->check++;
+        }
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count;
+
+    FsRtlUninitializeLargeMcb(&Mcb);
+    return true;
+}
+
+// Encodes an extent list of many fragmented runs to mapping pairs and
+// decodes it again, as each attribute record is written and read.
+static bool ExtentListMappingPairs(unsigned int scale, MICRO_RESULT* result)
+{
+    NTFS_EXTENT_LIST Extents;
+    NTFS_EXTENT_LIST Decoded;
+    ULONG runs = 4096;
+    ULONG passes = 100 * scale;
+    ULONG bufferSize = runs * 2 * (1 + 2 * sizeof(LONGLONG)) + 1;
+    ULONGLONG state = 9;
+    PVOID buffer;
+    VCN lowestVcn, nextVcn;
+    ULONG length;
+    LONGLONG vcn = 0;
+    LONGLONG lcn = 0;
+    double begin;
+    ULONG i;
+
+    if (!Extents.Initialize((ULONG)0, (ULONG)0))
+    {
+        return false;
+    }
+
+    for (i = 0; i < runs; i++)
+    {
+        LONGLONG runLength = 1 + (LONGLONG)(NextRandom(&state) % 64);
+
+        lcn += 1 + (LONGLONG)(NextRandom(&state) % 100000);
+
+        if (!Extents.AddExtent((ULONGLONG)vcn, (ULONGLONG)lcn, (ULONGLONG)runLength))
+        {
+            return false;
+        }
+
+        vcn += runLength;
+        lcn += runLength;
+    }
+
+    if ((buffer = MALLOC(bufferSize)) == NULL)
+    {
+        return false;
+    }
+
+    result->check = 0;
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < passes; i++)
+    {
+        if (!Extents.QueryCompressedMappingPairs(&lowestVcn, &nextVcn, &length, bufferSize, buffer) ||
+            !Decoded.Initialize(lowestVcn, buffer, length))
+        {
+            FREE(buffer);
+            return false;
+        }
+
+        result->check += length + Decoded.QueryNumberOfExtents();
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = (unsigned __int64)passes * runs;
+
+    FREE(buffer);
+    return true;
+}
+
+// Decodes a mapping pairs list of many fragmented runs into an extent
+// list, as each attribute record is read.  With reference set, the
+// decoder of before NTFS_MAPPING_PAIRS_DECODER is timed instead.
+static bool ExtentListAddExtents(unsigned int scale, MICRO_RESULT* result, bool reference)
+{
+    NTFS_EXTENT_LIST Extents;
+    NTFS_EXTENT_LIST Decoded;
+    ULONG runs = 4096;
+    ULONG passes = 100 * scale;
+    ULONG bufferSize = runs * (1 + 2 * sizeof(LONGLONG)) + 1;
+    ULONGLONG state = 26;
+    PVOID buffer;
+    VCN lowestVcn, nextVcn;
+    ULONG length;
+    LONGLONG vcn = 0;
+    LONGLONG lcn = 0;
+    BOOLEAN added;
+    double begin;
+    ULONG i;
+
+    if (!Extents.Initialize((ULONG)0, (ULONG)0))
+    {
+        return false;
+    }
+
+    for (i = 0; i < runs; i++)
+    {
+        LONGLONG runLength = 1 + (LONGLONG)(NextRandom(&state) % 64);
+
+        lcn += 1 + (LONGLONG)(NextRandom(&state) % 100000);
+
+        if (!Extents.AddExtent((ULONGLONG)vcn, (ULONGLONG)lcn, (ULONGLONG)runLength))
+        {
+            return false;
+        }
+
+        vcn += runLength;
+        lcn += runLength;
+    }
+
+    if ((buffer = MALLOC(bufferSize)) == NULL)
+    {
+        return false;
+    }
+
+    if (!Extents.QueryCompressedMappingPairs(&lowestVcn, &nextVcn, &length, bufferSize, buffer))
+    {
+        FREE(buffer);
+        return false;
+    }
+
+    result->check = 0;
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < passes; i++)
+    {
+        if (!Decoded.Initialize(lowestVcn, lowestVcn))
+        {
+            FREE(buffer);
+            return false;
+        }
+
+        added = reference ? ReferenceAddExtents(&Decoded, lowestVcn, buffer, length, NULL)
+                          : Decoded.AddExtents(lowestVcn, buffer, length);
+
+        if (!added)
+        {
+            FREE(buffer);
+            return false;
+        }
+
+        result->check += Decoded.QueryNumberOfExtents();
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = (unsigned __int64)passes * runs;
+
+    FREE(buffer);
+    return true;
+}
+
+static bool ExtentListAddExtentsCurrent(unsigned int scale, MICRO_RESULT* result)
+{
+    return ExtentListAddExtents(scale, result, false);
+}
+
+static bool ExtentListAddExtentsReference(unsigned int scale, MICRO_RESULT* result)
+{
+    return ExtentListAddExtents(scale, result, true);
+}
+
+// Appends objects to a LIST and walks it with its iterator.  The
+// objects are made beforehand, so only the list itself is timed.
+static bool ListPutAndIterate(unsigned int scale, MICRO_RESULT* result)
+{
+    LIST List;
+    PITERATOR Iterator;
+    PNUMBER_EXTENT Extent;
+    std::vector<PNUMBER_EXTENT> Extents;
+    ULONG count = 1000000 * scale;
+    double begin;
+    ULONG i;
+
+    if (!List.Initialize())
+    {
+        return false;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if ((Extent = NEW NUMBER_EXTENT) == NULL)
+        {
+            break;
+        }
+
+        Extent->Start = (ULONG)i;
+        Extents.push_back(Extent);
+    }
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < Extents.size(); i++)
+    {
+        if (!List.Put(Extents[i]))
+        {
+            break;
+        }
+    }
+
+    result->seconds = QuerySeconds() - begin;
+
+    if (i != count || (Iterator = List.QueryIterator()) == NULL)
+    {
+        // Whatever did not make it into the list is freed here.
+        for (; i < Extents.size(); i++)
+        {
+            DELETE(Extents[i]);
+        }
+
+        List.DeleteAllMembers();
+        return false;
+    }
+
+    result->check = 0;
+
+    begin = QuerySeconds();
+
+    while ((Extent = (PNUMBER_EXTENT)Iterator->GetNext()) != NULL)
+    {
+        result->check += Extent->Start.GetLowPart();
+    }
+
+    result->seconds += QuerySeconds() - begin;
+    result->operations = 2 * (unsigned __int64)count;
+
+    DELETE(Iterator);
+    List.DeleteAllMembers();
+    return true;
+}
+
+// The BIG_INT arithmetic of cluster and sector conversions.
+static bool BigIntArithmetic(unsigned int scale, MICRO_RESULT* result)
+{
+    ULONG count = 10000000 * scale;
+    ULONGLONG state = 10;
+    BIG_INT sum = (ULONG)0;
+    BIG_INT sector, cluster, offset;
+    BIG_INT factor = (ULONG)8;
+    BIG_INT hidden = (ULONG)2048;
+    double begin;
+    ULONG i;
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < count; i++)
+    {
+        sector = (ULONGLONG)(NextRandom(&state) % ((ULONGLONG)1 << 40));
+        cluster = (sector - hidden) / factor;
+        offset = (sector - hidden) % factor;
+        sum += cluster * factor + offset;
+    }
+
+    result->seconds = QuerySeconds() - begin;
+    result->operations = count;
+    result->check = sum.GetQuadPart();
+    return true;
+}
+
+struct MICRO_ENTRY
+{
+    const char* name;
+    MICRO_BENCHMARK benchmark;
+};
+
+static const MICRO_ENTRY MicroBenchmarks[] =
+{
+    { "numset_append",              NumberSetAppend },
+    { "numset_random_insert",       NumberSetRandomInsert },
+    { "numset_bad_runs",            NumberSetBadRuns },
+    { "numset_lookup",              NumberSetLookup },
+    { "bitvector_random_bits",      BitVectorRandomBits },
+    { "bitvector_runs_and_count",   BitVectorRunsAndCount },
+    { "ntfs_bitmap_scan",           NtfsBitmapScan },
+    { "largemcb_append",            LargeMcbAppend },
+    { "largemcb_sparse_identity",   LargeMcbSparseIdentity },
+    { "largemcb_lookup",            LargeMcbLookup },
+    { "extents_mapping_pairs",      ExtentListMappingPairs },
+    { "extents_add_extents",        ExtentListAddExtentsCurrent },
+    { "extents_add_extents_old",    ExtentListAddExtentsReference },
+    { "list_put_iterate",           ListPutAndIterate },
+    { "bigint_arithmetic",          BigIntArithmetic },
+};
+
+#define MICRO_BENCHMARKS (sizeof(MicroBenchmarks) / sizeof(MicroBenchmarks[0]))
+
+int RunMicroBenchmarks(MESSAGE& Message, const std::string& outputFile, unsigned int scale)
+{
+    MICRO_RESULT results[MICRO_BENCHMARKS];
+    bool succeeded[MICRO_BENCHMARKS];
+    bool failed = false;
+    char row[256];
+    FILE* file;
+    size_t i;
+
+    Message.Out(MICRO_HEADER);
+
+    for (i = 0; i < MICRO_BENCHMARKS; i++)
+    {
+        memset(&results[i], 0, sizeof(results[i]));
+
+        succeeded[i] = MicroBenchmarks[i].benchmark(scale, &results[i]);
+
+        if (!succeeded[i])
+        {
+            Message.Out("Benchmark failed: ", std::string(MicroBenchmarks[i].name));
+            failed = true;
+            continue;
+        }
+
+        _snprintf(row, sizeof(row) - 1, MICRO_ROW, MicroBenchmarks[i].name, results[i].operations,
+                  results[i].seconds, results[i].seconds * 1e9 / max(results[i].operations, (unsigned __int64)1),
+                  results[i].check);
+        row[sizeof(row) - 1] = '\0';
+
+        Message.Out(row);
+    }
+
+    file = fopen(outputFile.c_str(), "wt");
+
+    if (file == NULL)
+    {
+        Message.Out("Cannot write the results file: ", outputFile);
+        return 1;
+    }
+
+    fprintf(file, "{\n  \"version\": %d,\n  \"scale\": %u,\n  \"pointer_bits\": %u,\n  \"benchmarks\": [",
+            MICRO_FILE_VERSION, scale, (unsigned int)(sizeof(PVOID) * 8));
+
+    for (i = 0; i < MICRO_BENCHMARKS; i++)
+    {
+        fprintf(file, "%s\n    { \"name\": \"%s\", \"ok\": %s, \"operations\": %I64u, \"seconds\": %.6f, \"check\": %I64u }",
+                i == 0 ? "" : ",", MicroBenchmarks[i].name, succeeded[i] ? "true" : "false",
+                results[i].operations, results[i].seconds, results[i].check);
+    }
+
+    fprintf(file, "\n  ]\n}\n");
+
+    if (ferror(file))
+    {
+        fclose(file);
+        Message.Out("Cannot write the results file: ", outputFile);
+        return 1;
+    }
+
+    fclose(file);
+
+    Message.Out("Results written to ", outputFile, ".");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+
+// Times the core containers of the engine on their own: NUMBER_SET,
+// BITVECTOR, NTFS_BITMAP, the large MCB routines, the NTFS_EXTENT_LIST
+// mapping pairs codec, LIST and its iterator, and BIG_INT arithmetic,
+// each under the access patterns a marking run puts it through.  Every
+// count is multiplied by scale.  The results are printed, and written
+// to outputFile as JSON so that builds can be compared.  Returns 0 on
+// success.
+int RunMicroBenchmarks(MESSAGE& Message, const std::string& outputFile, unsigned int scale);
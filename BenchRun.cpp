@@ -0,0 +1,511 @@
+// BenchRun.cpp : The benchmark suite.  Each case marks a synthetic list
+// of ranges on a benchmark volume through the same path as a real run,
+// reports what it cost, and puts the volume back as it was.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include <psapi.h>
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "ntfsvol.hxx"
+#include "undojrnl.hxx"
+#include "iostats.hxx"
+
+#include "TextUtils.h"
+#include "SectorsSorter.h"
+#include "MarkVolume.h"
+#include "BenchImage.h"
+#include "BenchRun.h"
+
+#define BENCH_UNDO_FILE "NTFSMARKBAD_BENCH.UNDO"
+
+// The runs written by the undo journal check: UNDO_CHECK_RUNS runs of
+// UNDO_CHECK_RUN_SECTORS sectors, spread over the volume.
+#define UNDO_CHECK_RUNS         8
+#define UNDO_CHECK_RUN_SECTORS  8
+
+// Only volumes with this label are marked, so a case run by hand cannot
+// touch a real volume.
+#define BENCH_VOLUME_LABEL "NTFSMARKBAD"
+
+#define BENCH_HEADER "      ranges    wall_ms  peak_rss_kb      reads     read_bytes     writes    write_bytes   verify_bytes"
+#define BENCH_ROW    "%12I64u %10.1f %12I64u %10I64u %14I64u %10I64u %14I64u %14I64u"
+
+static VOID DiscardMessage(PVOID, const std::string&)
+{
+}
+
+static unsigned __int64 QueryGcd(unsigned __int64 a, unsigned __int64 b)
+{
+    while (b != 0)
+    {
+        unsigned __int64 r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+static bool IsBenchVolume(const std::string& drive)
+{
+    char label[MAX_PATH + 1];
+
+    return GetVolumeInformationA((drive + "\\").c_str(), label, sizeof(label), NULL, NULL, NULL, NULL, 0) &&
+           _stricmp(label, BENCH_VOLUME_LABEL) == 0;
+}
+
+int RunBenchCase(MESSAGE& Message, const std::string& drive, unsigned __int64 rangeCount)
+{
+    MESSAGE Quiet;
+    DSTRING NtDriveName;
+    NTFS_VOL NtfsVol;
+    SectorsRangeSorter runTargets;
+    IO_STATS Stats;
+    IO_STATS_COUNTERS reads, writes, verify;
+    UNDO_JOURNAL UndoJournal;
+    DSTRING UndoJournalName;
+    PROCESS_MEMORY_COUNTERS memory;
+    LONGLONG firstSector, stride, start, ticks;
+    unsigned __int64 step, i;
+    ULONGLONG readCount = 0, readBytes = 0, writeCount = 0, writeBytes = 0;
+    char row[256];
+    ULONG stream;
+    int result;
+
+    if (!IsBenchVolume(drive))
+    {
+        Message.Out("Drive ", drive, " is not a benchmark volume.");
+        return 1;
+    }
+
+    // The engine's own messages would drown the results.
+    Quiet.Initialize();
+    Quiet.SetSink(DiscardMessage, NULL);
+
+    if (!NtDriveName.Initialize(("\\??\\" + drive).c_str()))
+    {
+        Message.Out("Out of memory.");
+        return 1;
+    }
+
+    if (OpenNtfsVolume(Message, &NtDriveName, drive, NtfsVol))
+    {
+        return 1;
+    }
+
+    firstSector = NtfsVol.QueryHiddenSectors().GetQuadPart();
+    stride = rangeCount != 0 ? NtfsVol.QuerySectors().GetQuadPart() / (LONGLONG)rangeCount : 0;
+
+    // Every range must stay apart from the next, or they are joined.
+    if (stride < 2)
+    {
+        Message.Out("The volume is too small for ", (LONGLONG)rangeCount, " ranges.");
+        return 1;
+    }
+
+    if (!Stats.Initialize())
+    {
+        Message.Out("Cannot read the performance counter.");
+        return 1;
+    }
+
+    // The ranges are handed out in the order of a step prime to their
+    // number, so they arrive scattered, as in a list from a disk scan
+    // tool, and the sorter does real work.
+    step = rangeCount / 2 + 1;
+
+    while (QueryGcd(step, rangeCount) != 1)
+    {
+        step++;
+    }
+
+    DeleteFileA(BENCH_UNDO_FILE);
+
+    NtfsVol.SetIoStats(&Stats);
+
+    start = IO_STATS::QueryTicks();
+
+    for (i = 0; i < rangeCount; i++)
+    {
+        LONGLONG sector = firstSector + (LONGLONG)(i * step % rangeCount) * stride;
+
+        if (!runTargets.Add(sectors_range(sector, sector)))
+        {
+            break;
+        }
+    }
+
+    if (i != rangeCount || !runTargets.Finish())
+    {
+        NtfsVol.SetIoStats(NULL);
+        Message.Out("Cannot write a temporary file while sorting the sectors list.");
+        return 1;
+    }
+
+    result = MarkBadOnVolume(Quiet, NtfsVol, BENCH_UNDO_FILE, "", runTargets, 0);
+
+    ticks = IO_STATS::QueryTicks() - start;
+
+    NtfsVol.SetIoPhase(IO_STATS_PHASE_NONE);
+    NtfsVol.SetIoStats(NULL);
+
+    if (result)
+    {
+        Message.Out("Marking ", (LONGLONG)rangeCount, " ranges failed.");
+    }
+
+    // Nothing is journalled when nothing is written.
+    if (GetFileAttributesA(BENCH_UNDO_FILE) != INVALID_FILE_ATTRIBUTES)
+    {
+        if (!UndoJournalName.Initialize(BENCH_UNDO_FILE) ||
+            !UndoJournal.Initialize(&UndoJournalName, NtfsVol.GetNtfsSa()->QuerySerialNumber()) ||
+            !NtfsVol.Lock() ||
+            !UndoJournal.Restore(&NtfsVol, &Quiet))
+        {
+            Message.Out("Cannot restore the volume from ", std::string(BENCH_UNDO_FILE), ".");
+            return 1;
+        }
+
+        DeleteFileA(BENCH_UNDO_FILE);
+    }
+
+    if (result)
+    {
+        return 1;
+    }
+
+    memset(&memory, 0, sizeof(memory));
+    GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory));
+
+    for (stream = 0; stream < IO_STATS_STREAMS; stream++)
+    {
+        Stats.QueryReads(stream, &reads);
+        Stats.QueryWrites(stream, &writes);
+
+        readCount += reads.Operations;
+        readBytes += reads.Bytes;
+        writeCount += writes.Operations;
+        writeBytes += writes.Bytes;
+    }
+
+    Stats.QueryVerify(&verify);
+
+    _snprintf(row, sizeof(row) - 1, BENCH_ROW, rangeCount, Stats.QuerySeconds(ticks) * 1000,
+              (unsigned __int64)memory.PeakWorkingSetSize / 1024, readCount, readBytes,
+              writeCount, writeBytes, verify.Bytes);
+    row[sizeof(row) - 1] = '\0';
+
+    Message.Out(row);
+    return 0;
+}
+
+int RunBenchSuite(MESSAGE& Message, const std::string& imageFile, const std::string& drive,
+                  const std::vector<unsigned __int64>& rangeCounts)
+{
+    char module[MAX_PATH];
+    STARTUPINFOA startup;
+    PROCESS_INFORMATION process;
+    DWORD exitCode;
+    size_t failed = 0;
+    size_t i;
+
+    if (!GetModuleFileNameA(NULL, module, MAX_PATH))
+    {
+        Message.Out("Error.");
+        return 1;
+    }
+
+    if (AttachBenchImage(Message, imageFile, drive))
+    {
+        return 1;
+    }
+
+    if (!IsBenchVolume(drive))
+    {
+        DetachBenchImage(Message, imageFile);
+        Message.Out("The image does not hold a benchmark volume.");
+        return 1;
+    }
+
+    Message.Out(BENCH_HEADER);
+
+    for (i = 0; i < rangeCounts.size(); i++)
+    {
+        std::string text = "\"" + std::string(module) + "\" /CASE " + drive + " " + uint64_to_string(rangeCounts[i]);
+        std::vector<char> commandLine(text.begin(), text.end());
+
+        commandLine.push_back('\0');
+
+        memset(&startup, 0, sizeof(startup));
+        startup.cb = sizeof(startup);
+
+        exitCode = 1;
+
+        if (CreateProcessA(NULL, &commandLine[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process))
+        {
+            WaitForSingleObject(process.hProcess, INFINITE);
+            GetExitCodeProcess(process.hProcess, &exitCode);
+            CloseHandle(process.hThread);
+            CloseHandle(process.hProcess);
+        }
+        else
+        {
+            Message.Out("Cannot start the case of ", (LONGLONG)rangeCounts[i], " ranges.");
+        }
+
+        if (exitCode != 0)
+        {
+            failed++;
+        }
+    }
+
+    if (DetachBenchImage(Message, imageFile))
+    {
+        return 1;
+    }
+
+    return failed != 0 ? 1 : 0;
+}
+
+// Fills the buffer of one run with bytes that differ for each pass and
+// each run, and from what a formatted volume holds.
+static void FillUndoCheckRun(UCHAR* buffer, size_t length, unsigned int pass, unsigned int run)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        buffer[i] = (UCHAR)(0xA5 ^ (pass * 31 + run * 7 + i));
+    }
+}
+
+// Writes the runs through one journalled batch, then puts the saved
+// contents back on the runs from firstUnwritten on, directly, as if the
+// commit had been cut short after writing the runs before it.
+static bool WriteCutShortBatch(NTFS_VOL& NtfsVol, UNDO_JOURNAL& UndoJournal, PCWSTRING UndoJournalName,
+                               const LONGLONG* runs, const std::vector<UCHAR>& saved, ULONG runBytes,
+                               unsigned int pass, unsigned int firstUnwritten)
+{
+    std::vector<UCHAR> data(runBytes);
+    unsigned int i;
+    BOOLEAN r;
+
+    DeleteFileA(BENCH_UNDO_FILE);
+
+    if (!UndoJournal.Initialize(UndoJournalName, NtfsVol.GetNtfsSa()->QuerySerialNumber()))
+    {
+        return false;
+    }
+
+    NtfsVol.SetUndoJournal(&UndoJournal);
+
+    r = NtfsVol.BeginWriteBatch();
+
+    for (i = 0; r && i < UNDO_CHECK_RUNS; i++)
+    {
+        FillUndoCheckRun(&data[0], runBytes, pass, i);
+        r = NtfsVol.Write((ULONGLONG)runs[i], UNDO_CHECK_RUN_SECTORS, &data[0]);
+    }
+
+    if (r)
+    {
+        r = NtfsVol.CommitWriteBatch();
+    }
+    else
+    {
+        NtfsVol.AbortWriteBatch();
+    }
+
+    NtfsVol.SetUndoJournal(NULL);
+
+    for (i = firstUnwritten; r && i < UNDO_CHECK_RUNS; i++)
+    {
+        r = NtfsVol.Write((ULONGLONG)runs[i], UNDO_CHECK_RUN_SECTORS, (PVOID)&saved[i * runBytes]);
+    }
+
+    return r ? true : false;
+}
+
+// Returns whether the runs hold what was saved from them.
+static bool HoldsSavedRuns(NTFS_VOL& NtfsVol, const LONGLONG* runs, const std::vector<UCHAR>& saved,
+                           ULONG runBytes)
+{
+    std::vector<UCHAR> data(runBytes);
+    unsigned int i;
+
+    for (i = 0; i < UNDO_CHECK_RUNS; i++)
+    {
+        if (!NtfsVol.Read((ULONGLONG)runs[i], UNDO_CHECK_RUN_SECTORS, &data[0]) ||
+            memcmp(&data[0], &saved[i * runBytes], runBytes) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Cuts a journalled commit short after each number of runs on the
+// mounted benchmark volume drive and rolls it back, then checks that a
+// changed volume is refused.  The runs are put back as they were found
+// in any case.  Returns 0 if every check passed.
+static int CheckUndoOnVolume(MESSAGE& Message, const std::string& drive)
+{
+    MESSAGE Quiet;
+    DSTRING NtDriveName;
+    NTFS_VOL NtfsVol;
+    UNDO_JOURNAL UndoJournal;
+    DSTRING UndoJournalName;
+    LONGLONG runs[UNDO_CHECK_RUNS];
+    LONGLONG sectors;
+    std::vector<UCHAR> saved;
+    ULONG runBytes;
+    unsigned int written, i;
+    int failed = 0;
+
+    Quiet.Initialize();
+    Quiet.SetSink(DiscardMessage, NULL);
+
+    if (!NtDriveName.Initialize(("\\??\\" + drive).c_str()) ||
+        !UndoJournalName.Initialize(BENCH_UNDO_FILE))
+    {
+        Message.Out("Out of memory.");
+        return 1;
+    }
+
+    if (OpenNtfsVolume(Message, &NtDriveName, drive, NtfsVol) || !NtfsVol.Lock())
+    {
+        Message.Out("Cannot lock ", drive, ".");
+        return 1;
+    }
+
+    sectors = NtfsVol.QuerySectors().GetQuadPart();
+    runBytes = UNDO_CHECK_RUN_SECTORS * NtfsVol.QuerySectorSize();
+    saved.resize(UNDO_CHECK_RUNS * runBytes);
+
+    for (i = 0; i < UNDO_CHECK_RUNS; i++)
+    {
+        runs[i] = (2 * (LONGLONG)i + 1) * sectors / (2 * UNDO_CHECK_RUNS) / UNDO_CHECK_RUN_SECTORS *
+                  UNDO_CHECK_RUN_SECTORS;
+
+        if (!NtfsVol.Read((ULONGLONG)runs[i], UNDO_CHECK_RUN_SECTORS, &saved[i * runBytes]))
+        {
+            Message.Out("Cannot read from ", drive, ".");
+            return 1;
+        }
+    }
+
+    // A commit cut short after each number of runs, from none to all of
+    // them, must be rolled back completely.
+
+    for (written = 0; written <= UNDO_CHECK_RUNS; written++)
+    {
+        if (!WriteCutShortBatch(NtfsVol, UndoJournal, &UndoJournalName, runs, saved, runBytes, written, written))
+        {
+            Message.Out("Cannot write the batch cut short after ", (LONGLONG)written, " runs.");
+            failed = 1;
+            break;
+        }
+
+        if (!UndoJournal.Initialize(&UndoJournalName, NtfsVol.GetNtfsSa()->QuerySerialNumber()) ||
+            !UndoJournal.Restore(&NtfsVol, &Quiet))
+        {
+            Message.Out("Restore failed after a commit cut short after ", (LONGLONG)written, " runs.");
+            failed = 1;
+        }
+        else if (!HoldsSavedRuns(NtfsVol, runs, saved, runBytes))
+        {
+            Message.Out("Restore left the volume changed after a commit cut short after ", (LONGLONG)written, " runs.");
+            failed = 1;
+        }
+    }
+
+    // A run that holds neither what the batch wrote nor what it
+    // overwrote means the volume has changed, and nothing may be put
+    // back.
+
+    if (!failed)
+    {
+        std::vector<UCHAR> other(runBytes);
+
+        written = UNDO_CHECK_RUNS / 2;
+        FillUndoCheckRun(&other[0], runBytes, UNDO_CHECK_RUNS + 1, written);
+
+        if (!WriteCutShortBatch(NtfsVol, UndoJournal, &UndoJournalName, runs, saved, runBytes, 0, written) ||
+            !NtfsVol.Write((ULONGLONG)runs[written], UNDO_CHECK_RUN_SECTORS, &other[0]))
+        {
+            Message.Out("Cannot write the batch of a changed volume.");
+            failed = 1;
+        }
+        else if (!UndoJournal.Initialize(&UndoJournalName, NtfsVol.GetNtfsSa()->QuerySerialNumber()) ||
+                 UndoJournal.Restore(&NtfsVol, &Quiet))
+        {
+            Message.Out("Restore accepted a volume that had changed.");
+            failed = 1;
+        }
+        else
+        {
+            std::vector<UCHAR> data(runBytes);
+
+            // The runs before the changed one must still hold the batch.
+            FillUndoCheckRun(&other[0], runBytes, 0, 0);
+
+            if (!NtfsVol.Read((ULONGLONG)runs[0], UNDO_CHECK_RUN_SECTORS, &data[0]) ||
+                memcmp(&data[0], &other[0], runBytes) != 0)
+            {
+                Message.Out("Restore wrote to a volume that had changed.");
+                failed = 1;
+            }
+        }
+    }
+
+    // Whatever happened, the volume is left as it was found.
+
+    for (i = 0; i < UNDO_CHECK_RUNS; i++)
+    {
+        if (!NtfsVol.Write((ULONGLONG)runs[i], UNDO_CHECK_RUN_SECTORS, &saved[i * runBytes]))
+        {
+            Message.Out("Cannot put back the sectors of ", drive, ".  Create the image again.");
+            failed = 1;
+            break;
+        }
+    }
+
+    DeleteFileA(BENCH_UNDO_FILE);
+
+    return failed;
+}
+
+int RunUndoCheck(MESSAGE& Message, const std::string& imageFile, const std::string& drive)
+{
+    int failed;
+
+    if (AttachBenchImage(Message, imageFile, drive))
+    {
+        return 1;
+    }
+
+    if (!IsBenchVolume(drive))
+    {
+        DetachBenchImage(Message, imageFile);
+        Message.Out("The image does not hold a benchmark volume.");
+        return 1;
+    }
+
+    failed = CheckUndoOnVolume(Message, drive);
+
+    if (DetachBenchImage(Message, imageFile))
+    {
+        return 1;
+    }
+
+    if (!failed)
+    {
+        Message.Out("The undo journal check passed.");
+    }
+
+    return failed;
+}
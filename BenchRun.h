@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+
+// Runs the benchmark suite against the VHD at imageFile, mounted as
+// drive for the duration.  Each entry of rangeCounts is one case, run in
+// a child process of its own so that its peak memory use is its own.
+// Returns 0 if every case succeeded.
+int RunBenchSuite(MESSAGE& Message, const std::string& imageFile, const std::string& drive,
+                  const std::vector<unsigned __int64>& rangeCounts);
+
+// Runs one case: marks rangeCount single-sector ranges spread evenly
+// over the mounted volume drive, given in a scattered order, through the
+// whole marking pipeline, undo journal included, and prints the wall
+// time, the peak working set and the device reads and writes as one row.
+// The volume is then restored from the undo journal, so every case sees
+// the same volume.  Returns 0 on success.
+int RunBenchCase(MESSAGE& Message, const std::string& drive, unsigned __int64 rangeCount);
+
+// Checks /UNDO against commits cut short, on the VHD at imageFile,
+// mounted as drive for the duration: a journalled batch of runs spread
+// over the volume is written and then cut short after each number of
+// runs, from none to all, by putting the saved contents back on the
+// runs after it, and the journal must roll each one back completely.
+// A run changed since must make the journal refuse to restore anything.
+// Returns 0 if every check passed.
+int RunUndoCheck(MESSAGE& Message, const std::string& imageFile, const std::string& drive);
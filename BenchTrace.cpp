@@ -0,0 +1,487 @@
+// BenchTrace.cpp : Reading and replaying the I/O traces written by
+// /TRACE, so that the requests of a run on a disk we cannot reach can be
+// studied, and timed again against a file or a simulated device.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include <vector>
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "iostats.hxx"
+#include "iotrace.hxx"
+
+#include "BenchTrace.h"
+
+#define TRACE_OPERATIONS 5
+
+#define DUMP_HEADER  "operation     requests          bytes     failed   latency_ms  avg_latency_us"
+#define DUMP_ROW     "%-10s %11I64u %14I64u %10I64u %12.1f %15.1f"
+
+#define REPLAY_HEADER "operation     requests          bytes     failed  recorded_ms  replayed_ms"
+#define REPLAY_ROW    "%-10s %11I64u %14I64u %10I64u %12.1f %12.1f"
+
+static const char* const OperationNames[TRACE_OPERATIONS] =
+{
+    "unknown", "read", "write", "read_back", "verify"
+};
+
+static const char* const StreamNames[IO_STATS_STREAMS] =
+{
+    "other", "mft", "bitmap", "badclus", "upcase", "mirror", "journal"
+};
+
+struct TRACE_TOTALS
+{
+    unsigned __int64 requests;
+    unsigned __int64 bytes;
+    unsigned __int64 failed;
+    unsigned __int64 recordedMicroseconds;
+    LONGLONG replayedTicks;
+};
+
+static ULONG QueryOperation(const IO_TRACE_RECORD& record)
+{
+    return record.Operation < TRACE_OPERATIONS ? record.Operation : 0;
+}
+
+static LONGLONG QueryTicks()
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+static LONGLONG MicrosecondsToTicks(unsigned __int64 microseconds, LONGLONG frequency)
+{
+    return (LONGLONG)(microseconds / 1000000) * frequency +
+           (LONGLONG)(microseconds % 1000000) * frequency / 1000000;
+}
+
+// Waits until the performance counter reaches deadline.  Sleep is far
+// too coarse for device latencies, so the last stretch is spun.
+static void WaitUntil(LONGLONG deadline, LONGLONG frequency)
+{
+    LONGLONG now;
+
+    while ((now = QueryTicks()) < deadline)
+    {
+        if (deadline - now > frequency / 50)
+        {
+            Sleep(1);
+        }
+    }
+}
+
+// Opens a trace and reads its header.  Returns NULL if it cannot be
+// read or is not a trace.
+static FILE* OpenTrace(MESSAGE& Message, const std::string& traceFile, IO_TRACE_HEADER* header)
+{
+    FILE* file = fopen(traceFile.c_str(), "rb");
+
+    if (file == NULL)
+    {
+        Message.Out("Cannot open the trace file: ", traceFile);
+        return NULL;
+    }
+
+    if (fread(header, sizeof(*header), 1, file) != 1 ||
+        memcmp(header->Signature, IO_TRACE_SIGNATURE, sizeof(header->Signature)) != 0 ||
+        header->Version != IO_TRACE_VERSION ||
+        header->SectorSize == 0)
+    {
+        fclose(file);
+        Message.Out("Not a trace file: ", traceFile);
+        return NULL;
+    }
+
+    return file;
+}
+
+// Reads the next records of a trace into records.  A record cut short
+// at the end of the trace of a run that was killed is left out.
+static size_t ReadTraceRecords(FILE* file, std::vector<IO_TRACE_RECORD>& records)
+{
+    return fread(&records[0], sizeof(IO_TRACE_RECORD), records.size(), file);
+}
+
+int DumpTrace(MESSAGE& Message, const std::string& traceFile, const std::string& csvFile)
+{
+    IO_TRACE_HEADER header;
+    std::vector<IO_TRACE_RECORD> records(IO_TRACE_BUFFER_RECORDS);
+    TRACE_TOTALS totals[TRACE_OPERATIONS];
+    unsigned __int64 transfers = 0, sequential = 0, duration = 0;
+    LONGLONG nextSector = -1;
+    FILE* file;
+    FILE* csv = NULL;
+    char row[256];
+    size_t count, i;
+    ULONG operation;
+
+    if ((file = OpenTrace(Message, traceFile, &header)) == NULL)
+    {
+        return 1;
+    }
+
+    if (!csvFile.empty())
+    {
+        if ((csv = fopen(csvFile.c_str(), "wt")) == NULL)
+        {
+            fclose(file);
+            Message.Out("Cannot write the file: ", csvFile);
+            return 1;
+        }
+
+        fprintf(csv, "time_us,operation,stream,sector,bytes,status,latency_us\n");
+    }
+
+    memset(totals, 0, sizeof(totals));
+
+    while ((count = ReadTraceRecords(file, records)) > 0)
+    {
+        for (i = 0; i < count; i++)
+        {
+            const IO_TRACE_RECORD& record = records[i];
+
+            operation = QueryOperation(record);
+
+            totals[operation].requests++;
+            totals[operation].bytes += record.Length;
+            totals[operation].recordedMicroseconds += record.Latency;
+
+            if (NT_ERROR(record.Status))
+            {
+                totals[operation].failed++;
+            }
+
+            // The read back of a write and a verify do not move the
+            // head on their own account, so only reads and writes are
+            // looked at for sequential access.
+            if (operation == IO_TRACE_OP_READ || operation == IO_TRACE_OP_WRITE)
+            {
+                if (record.StartingSector == nextSector)
+                {
+                    sequential++;
+                }
+
+                transfers++;
+                nextSector = record.StartingSector + record.Length / header.SectorSize;
+            }
+
+            duration = max(duration, record.Time + record.Latency);
+
+            if (csv != NULL)
+            {
+                fprintf(csv, "%I64u,%s,%s,%I64d,%lu,0x%08lX,%lu\n", record.Time, OperationNames[operation],
+                        record.Stream < IO_STATS_STREAMS ? StreamNames[record.Stream] : "unknown",
+                        record.StartingSector, record.Length, (ULONG)record.Status, record.Latency);
+            }
+        }
+    }
+
+    fclose(file);
+
+    if (csv != NULL)
+    {
+        bool failed = ferror(csv) != 0;
+
+        if (fclose(csv) != 0 || failed)
+        {
+            Message.Out("Cannot write the file: ", csvFile);
+            return 1;
+        }
+    }
+
+    Message.Out("Volume: ", header.VolumeSectors, " sectors of ", (LONGLONG)header.SectorSize, " bytes");
+    Message.Out("Duration: ", (LONGLONG)(duration / 1000), " ms");
+    Message.Out(DUMP_HEADER);
+
+    for (operation = 1; operation < TRACE_OPERATIONS; operation++)
+    {
+        if (totals[operation].requests == 0)
+        {
+            continue;
+        }
+
+        _snprintf(row, sizeof(row) - 1, DUMP_ROW, OperationNames[operation], totals[operation].requests,
+                  totals[operation].bytes, totals[operation].failed,
+                  totals[operation].recordedMicroseconds / 1000.0,
+                  (double)totals[operation].recordedMicroseconds / totals[operation].requests);
+        row[sizeof(row) - 1] = '\0';
+
+        Message.Out(row);
+    }
+
+    Message.Out("Sequential reads and writes: ", (LONGLONG)sequential, " of ", (LONGLONG)transfers, "");
+
+    if (!csvFile.empty())
+    {
+        Message.Out("Requests written to ", csvFile, ".");
+    }
+
+    return 0;
+}
+
+// Returns the sector size of the volume that holds fileName, or 0 if it
+// cannot be found.
+static DWORD QueryFileSectorSize(const std::string& fileName)
+{
+    char path[MAX_PATH];
+    char root[MAX_PATH];
+    DWORD sectorsPerCluster, bytesPerSector, freeClusters, totalClusters;
+
+    if (!GetFullPathNameA(fileName.c_str(), MAX_PATH, path, NULL) ||
+        !GetVolumePathNameA(path, root, MAX_PATH) ||
+        !GetDiskFreeSpaceA(root, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters))
+    {
+        return 0;
+    }
+
+    return bytesPerSector;
+}
+
+// Opens the file a trace is replayed against, and makes it as large as
+// the traced volume.  A file created here is sparse, so its reads cost
+// nothing until it is written; a file filled beforehand gives them their
+// real cost.  It is opened unbuffered when the sectors of the trace
+// allow it, so the requests reach the disk as they did on the traced one.
+static HANDLE OpenReplayTarget(MESSAGE& Message, const std::string& targetFile, const IO_TRACE_HEADER& header)
+{
+    BY_HANDLE_FILE_INFORMATION information;
+    LARGE_INTEGER size, volumeSize;
+    DWORD sectorSize, flags, bytesReturned;
+    HANDLE target;
+
+    // Only a file; a trace replayed onto a disk or a volume would write
+    // over it.
+    if (targetFile.compare(0, 4, "\\\\.\\") == 0 || targetFile.compare(0, 4, "\\\\?\\") == 0 ||
+        (targetFile.size() == 2 && targetFile[1] == ':'))
+    {
+        Message.Out("A trace is only replayed against a file: ", targetFile);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    sectorSize = QueryFileSectorSize(targetFile);
+    flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH;
+
+    if (sectorSize != 0 && header.SectorSize % sectorSize == 0)
+    {
+        flags |= FILE_FLAG_NO_BUFFERING;
+    }
+    else
+    {
+        Message.Out("The sectors of the trace do not fit those of ", targetFile, "; it is replayed through the cache.");
+    }
+
+    target = CreateFileA(targetFile.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, flags, NULL);
+
+    if (target == INVALID_HANDLE_VALUE)
+    {
+        Message.Out("Cannot open ", targetFile, ".");
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (!GetFileInformationByHandle(target, &information) ||
+        (information.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+        !GetFileSizeEx(target, &size))
+    {
+        CloseHandle(target);
+        Message.Out("A trace is only replayed against a file: ", targetFile);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    volumeSize.QuadPart = header.VolumeSectors * header.SectorSize;
+
+    if (size.QuadPart < volumeSize.QuadPart)
+    {
+        if (size.QuadPart == 0)
+        {
+            DeviceIoControl(target, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL);
+        }
+
+        if (!SetFilePointerEx(target, volumeSize, NULL, FILE_BEGIN) || !SetEndOfFile(target))
+        {
+            CloseHandle(target);
+            Message.Out("Cannot extend ", targetFile, " to the size of the traced volume.");
+            return INVALID_HANDLE_VALUE;
+        }
+    }
+
+    return target;
+}
+
+// Makes one request of the trace to the target.  Buffers for unbuffered
+// I/O must be aligned; VirtualAlloc's are.
+static bool ReplayRequest(HANDLE target, const IO_TRACE_HEADER& header, const IO_TRACE_RECORD& record,
+                          PVOID* buffer, ULONG* bufferSize)
+{
+    OVERLAPPED overlapped;
+    ULONGLONG offset = (ULONGLONG)record.StartingSector * header.SectorSize;
+    DWORD transferred = 0;
+    BOOL result;
+
+    if (record.Length > *bufferSize)
+    {
+        if (*buffer != NULL)
+        {
+            VirtualFree(*buffer, 0, MEM_RELEASE);
+        }
+
+        *bufferSize = 0;
+
+        if ((*buffer = VirtualAlloc(NULL, record.Length, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        {
+            return false;
+        }
+
+        *bufferSize = record.Length;
+    }
+
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+    if (record.Operation == IO_TRACE_OP_WRITE)
+    {
+        result = WriteFile(target, *buffer, record.Length, &transferred, &overlapped);
+    }
+    else
+    {
+        result = ReadFile(target, *buffer, record.Length, &transferred, &overlapped);
+    }
+
+    return result && transferred == record.Length;
+}
+
+int ReplayTrace(MESSAGE& Message, const std::string& traceFile, const std::string& targetFile,
+                bool recordedTiming)
+{
+    IO_TRACE_HEADER header;
+    std::vector<IO_TRACE_RECORD> records(IO_TRACE_BUFFER_RECORDS);
+    TRACE_TOTALS totals[TRACE_OPERATIONS];
+    unsigned __int64 duration = 0;
+    LARGE_INTEGER frequency;
+    LONGLONG begin, start;
+    HANDLE target = INVALID_HANDLE_VALUE;
+    PVOID buffer = NULL;
+    ULONG bufferSize = 0;
+    bool failed = false;
+    FILE* file;
+    char row[256];
+    size_t count, i;
+    ULONG operation;
+
+    if (!QueryPerformanceFrequency(&frequency) || frequency.QuadPart == 0)
+    {
+        Message.Out("Cannot read the performance counter.");
+        return 1;
+    }
+
+    if ((file = OpenTrace(Message, traceFile, &header)) == NULL)
+    {
+        return 1;
+    }
+
+    if (!targetFile.empty() &&
+        (target = OpenReplayTarget(Message, targetFile, header)) == INVALID_HANDLE_VALUE)
+    {
+        fclose(file);
+        return 1;
+    }
+
+    Message.Out(targetFile.empty() ? "Replaying against the recorded latencies..." : "Replaying...");
+
+    memset(totals, 0, sizeof(totals));
+
+    begin = QueryTicks();
+
+    while ((count = ReadTraceRecords(file, records)) > 0)
+    {
+        for (i = 0; i < count; i++)
+        {
+            const IO_TRACE_RECORD& record = records[i];
+
+            operation = QueryOperation(record);
+
+            if (recordedTiming)
+            {
+                WaitUntil(begin + MicrosecondsToTicks(record.Time, frequency.QuadPart), frequency.QuadPart);
+            }
+
+            start = QueryTicks();
+
+            if (target != INVALID_HANDLE_VALUE)
+            {
+                if (!ReplayRequest(target, header, record, &buffer, &bufferSize))
+                {
+                    totals[operation].failed++;
+                    failed = true;
+                }
+            }
+            else
+            {
+                // The simulated device takes as long as the real one
+                // did, and fails where it failed.
+                WaitUntil(start + MicrosecondsToTicks(record.Latency, frequency.QuadPart), frequency.QuadPart);
+
+                if (NT_ERROR(record.Status))
+                {
+                    totals[operation].failed++;
+                }
+            }
+
+            totals[operation].replayedTicks += QueryTicks() - start;
+            totals[operation].requests++;
+            totals[operation].bytes += record.Length;
+            totals[operation].recordedMicroseconds += record.Latency;
+
+            duration = max(duration, record.Time + record.Latency);
+        }
+    }
+
+    start = QueryTicks();
+
+    fclose(file);
+
+    if (buffer != NULL)
+    {
+        VirtualFree(buffer, 0, MEM_RELEASE);
+    }
+
+    if (target != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(target);
+    }
+
+    Message.Out("Recorded duration: ", (LONGLONG)(duration / 1000), " ms");
+    Message.Out("Replayed duration: ", (start - begin) * 1000 / frequency.QuadPart, " ms");
+    Message.Out(REPLAY_HEADER);
+
+    for (operation = 1; operation < TRACE_OPERATIONS; operation++)
+    {
+        if (totals[operation].requests == 0)
+        {
+            continue;
+        }
+
+        _snprintf(row, sizeof(row) - 1, REPLAY_ROW, OperationNames[operation], totals[operation].requests,
+                  totals[operation].bytes, totals[operation].failed,
+                  totals[operation].recordedMicroseconds / 1000.0,
+                  totals[operation].replayedTicks * 1000.0 / frequency.QuadPart);
+        row[sizeof(row) - 1] = '\0';
+
+        Message.Out(row);
+    }
+
+    if (failed)
+    {
+        Message.Out("Some requests failed against ", targetFile, ".");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+
+// Prints a summary of the I/O trace in traceFile, written by /TRACE:
+// the requests of each kind, their bytes and latency, and how many were
+// sequential.  If csvFile is not empty, every request is also written
+// to it, one line each.  Returns 0 on success.
+int DumpTrace(MESSAGE& Message, const std::string& traceFile, const std::string& csvFile);
+
+// Plays the requests in traceFile again.  With a targetFile, each one is
+// made to that file, which is created or extended as needed; without
+// one, each takes the latency it was recorded with.  If recordedTiming
+// is set, each request waits for its recorded time; otherwise they are
+// made back to back.  Prints the recorded and the replayed cost of each
+// kind of request.  Returns 0 on success.
+int ReplayTrace(MESSAGE& Message, const std::string& traceFile, const std::string& targetFile,
+                bool recordedTiming);
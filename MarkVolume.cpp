@@ -0,0 +1,129 @@
+// MarkVolume.cpp : Marking a sectors list as bad on one NTFS volume.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "ifssys.hxx"
+#include "ntfsvol.hxx"
+#include "undojrnl.hxx"
+
+#include "MarkVolume.h"
+
+int OpenNtfsVolume(MESSAGE& Message, PCWSTRING NtDriveName, const std::string& driveName, NTFS_VOL& NtfsVol)
+{
+    NTSTATUS            Status;
+    BOOL                FsNameIsNtfs;
+
+    if (!IFS_SYSTEM::QueryFileSystemNameIsNtfs(NtDriveName,
+        &FsNameIsNtfs,
+        &Status))
+    {
+        if (Status == STATUS_ACCESS_DENIED)
+        {
+            Message.Out("Access denied. Run the program as administrator.");
+        }
+        else if (Status != STATUS_SUCCESS)
+        {
+            Message.Out("Cannot open volume for direct access.");
+        }
+        else
+        {
+            Message.Out("Cannot determine file system of drive: ", driveName);
+        }
+
+        return 1;
+    }
+
+    if (!FsNameIsNtfs) //NOT NTFS
+    {
+        Message.Out("Only NTFS file system supported.");
+        return 1;
+    }
+
+    if (!NtfsVol.Initialize(NtDriveName, &Message))
+    {
+        Message.Out("Failed to initialize.");
+        return 1;
+    }
+
+    return 0;
+}
+
+std::string QueryFullPath(const std::string& fileName)
+{
+    char buffer[MAX_PATH];
+    DWORD length = GetFullPathNameA(fileName.c_str(), MAX_PATH, buffer, NULL);
+
+    if (length == 0 || length >= MAX_PATH)
+    {
+        return fileName;
+    }
+
+    return buffer;
+}
+
+int MarkBadOnVolume(MESSAGE& Message, NTFS_VOL& NtfsVol, const std::string& undoJournalFile,
+                    const std::string& snapshotFile, sectors_range_source& runTargets,
+                    unsigned int listSectorSize)
+{
+    UNDO_JOURNAL UndoJournal;
+    DSTRING UndoJournalName;
+    NTFS_SNAPSHOT Snapshot;
+    DSTRING SnapshotName;
+
+    if (listSectorSize != 0 && listSectorSize != NtfsVol.QuerySectorSize())
+    {
+        Message.Out("The sectors list was made for a drive with ", (LONGLONG)listSectorSize, "-byte sectors.");
+        return 1;
+    }
+
+    // Before the metadata is updated, the sectors it occupies are
+    // saved to a journal in the current directory, which is never on
+    // the target drive.  A run interrupted part way through can be
+    // rolled back with /UNDO.
+
+    if (!UndoJournalName.Initialize(undoJournalFile.c_str()) ||
+        !UndoJournal.Initialize(&UndoJournalName, NtfsVol.GetNtfsSa()->QuerySerialNumber()))
+    {
+        Message.Out("Out of memory.");
+        return 1;
+    }
+
+    Message.Out("Undo journal: ", QueryFullPath(undoJournalFile));
+
+    if (!snapshotFile.empty())
+    {
+        if (!SnapshotName.Initialize(snapshotFile.c_str()) ||
+            !Snapshot.Initialize(&SnapshotName))
+        {
+            Message.Out("Out of memory.");
+            return 1;
+        }
+
+        NtfsVol.SetSnapshot(&Snapshot);
+    }
+
+    NtfsVol.SetUndoJournal(&UndoJournal);
+
+    if (!NtfsVol.MarkBad(runTargets, &Message))
+    {
+        NtfsVol.SetUndoJournal(NULL);
+        NtfsVol.SetSnapshot(NULL);
+        Message.Out("An error has occurred.");
+        return 1;
+    }
+
+    NtfsVol.SetUndoJournal(NULL);
+    NtfsVol.SetSnapshot(NULL);
+
+    if (!UndoJournal.MarkComplete())
+    {
+        Message.Out("Cannot mark the undo journal complete (error ", (LONGLONG)UndoJournal.QueryWriteError(), ").");
+    }
+
+    Message.Out("Completed.");
+    return 0;
+}
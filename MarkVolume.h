@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+DECLARE_CLASS(WSTRING);
+DECLARE_CLASS(NTFS_VOL);
+
+// Checks that NtDriveName holds an NTFS volume and opens it.  driveName
+// names the volume in messages.  Returns 0 on success.
+int OpenNtfsVolume(MESSAGE& Message, PCWSTRING NtDriveName, const std::string& driveName, NTFS_VOL& NtfsVol);
+
+// Returns the full path of fileName, or fileName itself if it cannot be
+// resolved.
+std::string QueryFullPath(const std::string& fileName);
+
+// Marks the ranges read from runTargets as bad on an open volume.  The
+// metadata is saved to undoJournalFile before it is changed, and the
+// journal is marked complete when the run succeeds.  If
+// snapshotFile is not empty, the volume bitmap is taken from it when it
+// is still valid, and saved to it afterwards.  If listSectorSize is not
+// 0, it must match the sector size of the volume.  Returns 0 on success.
+int MarkBadOnVolume(MESSAGE& Message, NTFS_VOL& NtfsVol, const std::string& undoJournalFile,
+                    const std::string& snapshotFile, sectors_range_source& runTargets,
+                    unsigned int listSectorSize);
@@ -0,0 +1,271 @@
+// MultiTarget.cpp : Multi-target mode.  A list names several volumes,
+// each with its own sectors file, and the volumes are marked
+// concurrently on a pool of threads.  Everything a volume needs, from
+// its sectors list to its NTFS_VOL, belongs to the thread working on it.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "system.hxx"
+#include "ntfsvol.hxx"
+
+#include "TextUtils.h"
+#include "SectorsFile.h"
+#include "SectorsSorter.h"
+#include "MarkVolume.h"
+#include "ThreadPool.h"
+#include "MultiTarget.h"
+
+// The longest line of the targets list.
+#define TARGET_LINE_LENGTH (2 * MAX_PATH)
+
+struct TARGET_WORK
+{
+    std::string drive;          // "X:"
+    std::string sectorsFile;
+    int result;
+};
+
+struct TARGETS
+{
+    std::vector<TARGET_WORK*> work;
+    size_t memoryBudget;        // for each sectors list
+    std::string snapshotFile;
+};
+
+static void FreeTargets(std::vector<TARGET_WORK*>& work)
+{
+    for (size_t i = 0; i < work.size(); i++)
+    {
+        delete work[i];
+    }
+    work.clear();
+}
+
+// Reads the targets list.  Every drive may appear only once, since two
+// threads cannot both lock it.
+static int ReadTargetsList(MESSAGE& Message, const std::string& listFile, std::vector<TARGET_WORK*>& work)
+{
+    FILE* file;
+    char text[TARGET_LINE_LENGTH + 2];
+    LONGLONG line = 0;
+    bool used['Z' - 'A' + 1] = { false };
+
+    file = fopen(listFile.c_str(), "rt");
+
+    if (file == NULL)
+    {
+        Message.Out("Cannot open the targets list: ", listFile);
+        return 1;
+    }
+
+    while (fgets(text, sizeof(text), file) != NULL)
+    {
+        std::string entry = text;
+        std::string drive;
+        size_t separator;
+
+        line++;
+
+        if (entry.length() > TARGET_LINE_LENGTH)
+        {
+            fclose(file);
+            Message.Out("Line too long in the targets list, line #", line);
+            return 1;
+        }
+
+        trim(entry);
+
+        if (entry.empty())
+        {
+            continue;
+        }
+
+        separator = entry.find_first_of(" \t");
+        drive = str_toupper(entry.substr(0, separator));
+
+        if (separator == std::string::npos
+            || drive.length() != 2
+            || drive[0] < 'A' || drive[0] > 'Z'
+            || drive[1] != ':')
+        {
+            fclose(file);
+            Message.Out("Wrong line in the targets list, line #", line);
+            return 1;
+        }
+
+        if (used[drive[0] - 'A'])
+        {
+            fclose(file);
+            Message.Out("Drive listed twice in the targets list, line #", line);
+            return 1;
+        }
+
+        used[drive[0] - 'A'] = true;
+
+        TARGET_WORK* target = new TARGET_WORK;
+
+        target->drive = drive;
+        target->sectorsFile = entry.substr(separator + 1);
+        trim(target->sectorsFile);
+        target->result = 1;
+        work.push_back(target);
+    }
+
+    fclose(file);
+
+    if (work.empty())
+    {
+        Message.Out("The targets list is empty.");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Tells a binary sectors list from a text one by its signature.
+static bool IsBinarySectorsFile(const std::string& filename)
+{
+    char signature[sizeof(SECTORS_BINARY_SIGNATURE) - 1];
+    FILE* file = fopen(filename.c_str(), "rb");
+    bool binary;
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    binary = fread(signature, 1, sizeof(signature), file) == sizeof(signature)
+             && memcmp(signature, SECTORS_BINARY_SIGNATURE, sizeof(signature)) == 0;
+
+    fclose(file);
+    return binary;
+}
+
+static void MarkTarget(void* context, size_t item)
+{
+    TARGETS* targets = (TARGETS*)context;
+    TARGET_WORK* work = targets->work[item];
+    MESSAGE Message;
+    NTFS_VOL NtfsVol;
+    DSTRING NtDriveName;
+    SectorsRangeSorter runTargets;
+    unsigned int listSectorSize = 0;
+    std::string snapshotFile;
+    int result;
+
+    Message.Initialize();
+    Message.SetPrefix("[" + work->drive + "] ");
+
+    runTargets.SetMemoryBudget(targets->memoryBudget);
+
+    if (IsBinarySectorsFile(work->sectorsFile))
+    {
+        result = ParseSectorsBinaryFile(Message, work->sectorsFile, runTargets, &listSectorSize);
+    }
+    else
+    {
+        result = ParseSectorsFile(Message, work->sectorsFile, runTargets);
+    }
+
+    if (result)
+    {
+        return;
+    }
+
+    if (!runTargets.Finish())
+    {
+        Message.Out("Cannot write a temporary file while sorting the sectors list.");
+        return;
+    }
+
+    if (!NtDriveName.Initialize(("\\??\\" + work->drive).c_str()))
+    {
+        Message.Out("Out of memory.");
+        return;
+    }
+
+    if (OpenNtfsVolume(Message, &NtDriveName, work->drive, NtfsVol))
+    {
+        return;
+    }
+
+    if (!targets->snapshotFile.empty())
+    {
+        snapshotFile = targets->snapshotFile + "." + work->drive.substr(0, 1);
+    }
+
+    work->result = MarkBadOnVolume(Message, NtfsVol, "NTFSMARKBAD_" + work->drive.substr(0, 1) + ".UNDO",
+                                   snapshotFile, runTargets, listSectorSize);
+}
+
+int MarkBadOnTargets(MESSAGE& Message, const std::string& listFile, unsigned int threadCount,
+                     size_t memoryBudget, const std::string& snapshotFile)
+{
+    TARGETS targets;
+    DSTRING CurrentDrive;
+    DSTRING TargetDrive;
+    size_t i;
+    int result = 0;
+
+    if (ReadTargetsList(Message, listFile, targets.work))
+    {
+        FreeTargets(targets.work);
+        return 1;
+    }
+
+    if (!SYSTEM::QueryCurrentDosDriveName(&CurrentDrive))
+    {
+        Message.Out("Error.");
+        FreeTargets(targets.work);
+        return 1;
+    }
+
+    for (i = 0; i < targets.work.size(); i++)
+    {
+        if (TargetDrive.Initialize(targets.work[i]->drive.c_str()) && CurrentDrive == TargetDrive)
+        {
+            Message.Out("Cannot lock current drive. Change current drive and rerun the program.");
+            FreeTargets(targets.work);
+            return 1;
+        }
+    }
+
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+
+    if (threadCount > targets.work.size())
+    {
+        threadCount = (unsigned int)targets.work.size();
+    }
+
+    targets.memoryBudget = memoryBudget / threadCount;
+    targets.snapshotFile = snapshotFile;
+
+    Message.Out("Marking ", (LONGLONG)targets.work.size(), " volumes on ", (LONGLONG)threadCount, " threads.");
+
+    RunWorkItems(threadCount, targets.work.size(), MarkTarget, &targets);
+
+    Message.Out("");
+
+    for (i = 0; i < targets.work.size(); i++)
+    {
+        if (targets.work[i]->result == 0)
+        {
+            Message.Out("Drive ", targets.work[i]->drive, " completed.");
+        }
+        else
+        {
+            Message.Out("Drive ", targets.work[i]->drive, " failed.");
+            result = 1;
+        }
+    }
+
+    FreeTargets(targets.work);
+    return result;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+
+// Marks several volumes from one process.  listFile holds one target per
+// line, "<drive>: <sectors_file>"; the sectors file may be text or
+// binary.  The targets are processed on a pool of threadCount threads,
+// each with its own NTFS_VOL and sectors list, so as many volumes are
+// marked at once as there are threads.  Each sectors list may use
+// memoryBudget / threadCount bytes for sorting.  The undo journal of
+// drive <X> is written to NTFSMARKBAD_<X>.UNDO, and, if snapshotFile is
+// not empty, its metadata snapshot to <snapshotFile>.<X>.  Returns 0 if
+// every target was processed successfully.
+int MarkBadOnTargets(MESSAGE& Message, const std::string& listFile, unsigned int threadCount,
+                     size_t memoryBudget, const std::string& snapshotFile);
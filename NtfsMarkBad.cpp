@@ -3,8 +3,6 @@
 
 #include "stdafx.h"
 
-#include <fstream>
-
 #include "common.h"
 
 #include "ulib.hxx"
@@ -12,8 +10,20 @@
 #include "system.hxx"
 #include "ifssys.hxx"
 #include "ntfsvol.hxx"
+#include "undojrnl.hxx"
+#include "iostats.hxx"
+#include "iotrace.hxx"
 
 #include "TextUtils.h"
+#include "SectorsFile.h"
+#include "SectorsSorter.h"
+#include "MarkVolume.h"
+#include "PlanMode.h"
+#include "StatsFile.h"
+#include "WholeDisk.h"
+#include "ServiceMode.h"
+#include "MultiTarget.h"
+#include "ThreadPool.h"
 
 #define VERSION_TEXT "0.0.2"
 
@@ -43,112 +53,228 @@ void OutputAboutBanner(MESSAGE& Message)
 		"NTFSMARKBAD <drive>: <first_sector_number> <last_sector_number>\n"
 		"Batch mode:\n"
 		"NTFSMARKBAD <drive>: /B <sector_numbers_file>\n"
+		"NTFSMARKBAD <drive>: /B:BIN <binary_sectors_file>\n"
+		"Whole-disk mode (sector numbers on the physical disk, every NTFS partition):\n"
+		"NTFSMARKBAD /DISK:<disk_number> <first_sector_number> <last_sector_number>\n"
+		"NTFSMARKBAD /DISK:<disk_number> /B <sector_numbers_file>\n"
+		"NTFSMARKBAD /DISK:<disk_number> /B:BIN <binary_sectors_file>\n"
+		"Multi-target mode (one \"<drive>: <sectors_file>\" per line of the list):\n"
+		"NTFSMARKBAD /MULTI <targets_list_file>\n"
+		"Convert a sector numbers file to the binary format:\n"
+		"NTFSMARKBAD /CONVERT <sector_numbers_file> <binary_sectors_file> [<bytes_per_sector>]\n"
 		"Info mode:\n"
-		"NTFSMARKBAD <drive>:\n");
+		"NTFSMARKBAD <drive>:\n"
+		"Undo mode (restore the metadata saved by the last run):\n"
+		"NTFSMARKBAD <drive>: /UNDO <undo_journal_file>\n"
+		"Service mode (mark sectors sent by clients of \\\\.\\pipe\\<pipe_name>):\n"
+		"NTFSMARKBAD <drive>: /SERVICE <pipe_name>\n"
+		"\n"
+		"Any mode that reads a sectors list also accepts /MEM:<megabytes> as the\n"
+		"last argument, the memory to use for sorting it.  Larger lists are\n"
+		"sorted through temporary files in the TEMP directory.\n"
+		"\n"
+		"/SNAPSHOT:<file> as the last argument keeps a copy of the volume bitmap\n"
+		"in <file> between runs, so that repeated runs against an unchanged\n"
+		"volume need not read the whole bitmap again.  In whole-disk mode each\n"
+		"partition <p> uses <file>.<p>, in multi-target mode each drive <X>\n"
+		"uses <file>.<X>.\n"
+		"\n"
+		"In service mode, /WINDOW:<milliseconds> as the last argument sets how\n"
+		"long a batch may keep gathering requests that arrive close together\n"
+		"before it is committed (default 100).  If one request of a batch\n"
+		"cannot be marked, none of the batch is.\n"
+		"\n"
+		"In multi-target mode, /THREADS:<n> as the last argument sets how many\n"
+		"volumes are marked at once (default: the number of processors).  In\n"
+		"whole-disk mode it sets how many partitions are marked at once\n"
+		"(default 1: they share one disk, so they are marked one after another).\n"
+		"\n"
+		"In basic and batch mode, /PLAN as the last argument only reports what\n"
+		"a run would do: the clusters to mark, the runs and file records the\n"
+		"Bad Clusters File would gain, the sectors that would be written, and\n"
+		"an estimate of the time it would take.  The volume is neither locked\n"
+		"nor written.\n"
+		"\n"
+		"In basic and batch mode, /STATS[:<file>] as the last argument writes\n"
+		"the time spent in each phase of the run, the reads and writes made\n"
+		"for each metadata file, their latency, and the parent index updates\n"
+		"skipped because the file names had not changed, to <file> as JSON\n"
+		"(default NTFSMARKBAD_<drive>.JSON).\n"
+		"\n"
+		"In basic and batch mode, /TRACE[:<file>] as the last argument records\n"
+		"every request made to the disk, with its time, sectors, status and\n"
+		"latency, in <file> (default NTFSMARKBAD_<drive>.TRACE).  The trace can\n"
+		"be read and replayed with NTFSMARKBADBENCH.\n");
 }
 
-int ParseSectorsFile(MESSAGE& Message, const std::string& filename, std::vector<sectors_range>& runTargets)
+// The default memory budget for sorting the sectors list: a quarter of
+// the available physical memory, within limits.
+size_t QueryDefaultMemoryBudget()
+{
+    MEMORYSTATUSEX status;
+    unsigned __int64 budget = (unsigned __int64)256 * 1024 * 1024;
+
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+    {
+        budget = status.ullAvailPhys / 4;
+    }
+
+    budget = max(budget, (unsigned __int64)16 * 1024 * 1024);
+    budget = min(budget, (unsigned __int64)1024 * 1024 * 1024);
+
+    return (size_t)budget;
+}
+
+int __cdecl
+main(
+    ULONG nArgCount,
+    PSTR arrArguments[]
+)
 {
-    Message.Out("Reading ", filename, "...");
-	std::ifstream input_file(filename.c_str());
-    if (input_file.is_open())
+    MESSAGE    Message;
+    Message.Initialize();
+
+    OutputVersion(Message);
+
+    // The class descriptors are shared by every volume, so they are
+    // defined once, before any volume is processed on another thread.
+    DefineClassDescriptors();
+
+    SectorsRangeSorter runTargets;
+    std::string runDrive;
+    bool wholeDisk = false;
+    unsigned int diskNumber = 0;
+    std::string undoJournalFile;
+    std::string snapshotFile;
+    unsigned int binarySectorSize = 0;
+    std::string servicePipeName;
+    unsigned int serviceWindow = 100;
+    unsigned int threadCount = 0;
+    bool plan = false;
+    bool stats = false;
+    std::string statsFile;
+    bool trace = false;
+    std::string traceFile;
+
+    runTargets.SetMemoryBudget(QueryDefaultMemoryBudget());
+
+    // Options come last, in any order.
+
+    while (nArgCount > 2)
     {
-        std::string line;
-        int lineCounter = 0;
-        while (std::getline(input_file, line))
+        std::string option = str_toupper(arrArguments[nArgCount - 1]);
+
+        if (option.compare(0, 5, "/MEM:") == 0)
         {
-            lineCounter++;
-            trim(line);
-            if (line.empty()) continue;
-            std::vector<std::string> parts = split(line, " \t,;");
-            if (parts.empty())
+            __int64 megabytes = parse_int64(std::string(arrArguments[nArgCount - 1] + 5));
+            if (megabytes <= 0 || (unsigned __int64)megabytes > (size_t)-1 / (1024 * 1024))
             {
-                continue;
+                Message.Out("Invalid memory size.");
+                return 1;
             }
-            else if (parts.size() == 1)
+
+            runTargets.SetMemoryBudget((size_t)megabytes * 1024 * 1024);
+        }
+        else if (option.compare(0, 10, "/SNAPSHOT:") == 0)
+        {
+            snapshotFile = arrArguments[nArgCount - 1] + 10;
+            if (snapshotFile.empty())
             {
-                std::string firstSectorStr = trim(parts[0]);
-                __int64 firstSector = parse_int64(firstSectorStr);
-                if (firstSector < 0)
-                {
-                    Message.Out("Invalid sector number in file, line ", lineCounter, " value ", firstSectorStr);
-                    return 1;
-                }
-                if (!runTargets.empty() && runTargets.back().lastSector == firstSector - 1)
-                {
-                    runTargets.back().lastSector = firstSector;
-                }
-                else
-                {
-                    runTargets.push_back(sectors_range(firstSector, firstSector));
-                }
+                Message.Out("Invalid snapshot file name.");
+                return 1;
             }
-            else if (parts.size() == 2)
+        }
+        else if (option.compare(0, 8, "/WINDOW:") == 0)
+        {
+            __int64 milliseconds = parse_int64(std::string(arrArguments[nArgCount - 1] + 8));
+            if (milliseconds < 0 || milliseconds > 60000)
             {
-                std::string firstSectorStr = trim(parts[0]);
-                __int64 firstSector = parse_int64(firstSectorStr);
-                if (firstSector < 0)
-                {
-                    Message.Out("Invalid first sector number in file, line ", lineCounter, " value ", firstSectorStr);
-                    return 1;
-                }
-                std::string lastSectorStr = trim(parts[1]);
-                __int64 lastSector = parse_int64(lastSectorStr);
-                if (lastSector < 0)
-                {
-                    Message.Out("Invalid last sector number in file with sectors list, line ", lineCounter, " value ", lastSectorStr);
-                    return 1;
-                }
-                if (lastSector < firstSector)
-                {
-                    Message.Out("Last sector number is less than first number in file, line ", lineCounter);
-                    return 1;
-                }
-                if (!runTargets.empty() && runTargets.back().lastSector == firstSector - 1)
-                {
-                    runTargets.back().lastSector = lastSector;
-                }
-                else
-                {
-                    runTargets.push_back(sectors_range(firstSector, lastSector));
-                }
+                Message.Out("Invalid batch window.");
+                return 1;
             }
-            else
+
+            serviceWindow = (unsigned int)milliseconds;
+        }
+        else if (option.compare(0, 9, "/THREADS:") == 0)
+        {
+            __int64 threads = parse_int64(std::string(arrArguments[nArgCount - 1] + 9));
+            if (threads <= 0 || threads > 1024)
             {
-                Message.Out("Wrong line in file, line #", lineCounter, " value ", line);
+                Message.Out("Invalid number of threads.");
                 return 1;
             }
+
+            threadCount = (unsigned int)threads;
         }
-        input_file.close();
+        else if (option == "/PLAN")
+        {
+            plan = true;
+        }
+        else if (option == "/STATS" || option.compare(0, 7, "/STATS:") == 0)
+        {
+            stats = true;
+            statsFile = option.size() > 7 ? arrArguments[nArgCount - 1] + 7 : "";
+        }
+        else if (option == "/TRACE" || option.compare(0, 7, "/TRACE:") == 0)
+        {
+            trace = true;
+            traceFile = option.size() > 7 ? arrArguments[nArgCount - 1] + 7 : "";
+        }
+        else
+        {
+            break;
+        }
+
+        nArgCount--;
     }
-    else
+
+    if (!plan && !stats && !trace && nArgCount == 3 && str_toupper(arrArguments[1]) == "/MULTI") //multi-target mode
     {
-        Message.Out("Failed to open file with sectors list.");
-        return 1;
+        return MarkBadOnTargets(Message, arrArguments[2], threadCount != 0 ? threadCount : QueryProcessorCount(),
+                                runTargets.QueryMemoryBudget(), snapshotFile);
     }
-    if (runTargets.empty())
+
+    // /CONVERT touches no volume, so options that watch a run on one
+    // have nothing to do there.
+    if (trace && nArgCount > 1 && str_toupper(arrArguments[1]) == "/CONVERT")
     {
-        Message.Out("Empty file with sectors list.");
+        Message.Out("/TRACE needs a drive and the sectors to mark.");
         return 1;
     }
-    return 0;
-}
 
-int __cdecl
-main(
-    ULONG nArgCount,
-    PSTR arrArguments[]
-)
-{
-    MESSAGE    Message;
-    Message.Initialize();
+    if (!plan && !stats && !trace && (nArgCount == 4 || nArgCount == 5) && str_toupper(arrArguments[1]) == "/CONVERT") //convert mode
+    {
+        if (nArgCount == 5)
+        {
+            __int64 sectorSize = parse_int64(arrArguments[4]);
+            if (sectorSize <= 0 || sectorSize > 65536)
+            {
+                Message.Out("Invalid number of bytes per sector.");
+                return 1;
+            }
+            binarySectorSize = (unsigned int)sectorSize;
+        }
 
-    OutputVersion(Message);
+        if (ParseSectorsFile(Message, arrArguments[2], runTargets))
+        {
+            return 1;
+        }
 
-    DefineClassDescriptors();
+        if (!runTargets.Finish())
+        {
+            Message.Out("Cannot write a temporary file while sorting the sectors list.");
+            return 1;
+        }
 
-    std::vector<sectors_range> runTargets;
-    std::string runDrive;
+        if (WriteSectorsBinaryFile(Message, arrArguments[3], runTargets, binarySectorSize))
+        {
+            return 1;
+        }
+
+        Message.Out("Completed, ", (LONGLONG)runTargets.count(), " ranges written.");
+        return 0;
+    }
 
     if (nArgCount != 2 && nArgCount != 4)
     {
@@ -158,7 +284,19 @@ main(
 
     runDrive = str_toupper(arrArguments[1]);
 
-    if (runDrive.length() != 2
+    if (runDrive.compare(0, 6, "/DISK:") == 0) //whole-disk mode
+    {
+        __int64 number = parse_int64(runDrive.substr(6));
+        if (number < 0 || number > 0xFFFF)
+        {
+            Message.Out("Invalid disk number.");
+            return 1;
+        }
+
+        diskNumber = (unsigned int)number;
+        wholeDisk = true;
+    }
+    else if (runDrive.length() != 2
         || runDrive[0] < 'A' || runDrive[0] > 'Z'
         || runDrive[1] != ':')
     {
@@ -176,6 +314,36 @@ main(
             if (ParseSectorsFile(Message, argumentStr3, runTargets))
                 return 1;
         }
+        else if (str_toupper(argumentStr2) == "/B:BIN") //batch mode, binary sectors list
+        {
+            if (ParseSectorsBinaryFile(Message, argumentStr3, runTargets, &binarySectorSize))
+                return 1;
+        }
+        else if (str_toupper(argumentStr2) == "/UNDO") //undo mode
+        {
+            if (wholeDisk)
+            {
+                Message.Out("Undo mode needs the drive letter of the partition.");
+                return 1;
+            }
+
+            undoJournalFile = argumentStr3;
+        }
+        else if (str_toupper(argumentStr2) == "/SERVICE") //service mode
+        {
+            if (wholeDisk)
+            {
+                Message.Out("Service mode needs the drive letter of the partition.");
+                return 1;
+            }
+
+            servicePipeName = argumentStr3;
+            if (servicePipeName.empty() || servicePipeName.find('\\') != std::string::npos)
+            {
+                Message.Out("Invalid pipe name.");
+                return 1;
+            }
+        }
         else //basic mode
         {
             std::string firstSectorStr = arrArguments[2];
@@ -194,33 +362,47 @@ main(
                 return 1;
             }
 
-            runTargets.push_back(sectors_range(firstSector, lastSector));
+            runTargets.Add(sectors_range(firstSector, lastSector));
         }
     }
 
-    //sort and join sectors ranges
-    std::sort(runTargets.begin(), runTargets.end());
+    if (plan && (wholeDisk || nArgCount != 4 || !undoJournalFile.empty() || !servicePipeName.empty()))
+    {
+        Message.Out("/PLAN needs a drive and the sectors to mark.");
+        return 1;
+    }
+
+    if (stats && (plan || wholeDisk || nArgCount != 4 || !undoJournalFile.empty() || !servicePipeName.empty()))
+    {
+        Message.Out("/STATS needs a drive and the sectors to mark.");
+        return 1;
+    }
 
-    std::vector<sectors_range> sortedRunTargets;
+    if (trace && (plan || wholeDisk || nArgCount != 4 || !undoJournalFile.empty() || !servicePipeName.empty()))
+    {
+        Message.Out("/TRACE needs a drive and the sectors to mark.");
+        return 1;
+    }
 
-    for (std::vector<sectors_range>::iterator current = runTargets.begin(); current != runTargets.end(); ++current)
+    // Sort and join the sectors ranges.  They are read back from the
+    // sorter one at a time as the clusters are marked.
+
+    if (!runTargets.Finish())
     {
-        if (!sortedRunTargets.empty())
-        {
-            sectors_range& last = sortedRunTargets.back();
-            if (last.contains(current->firstSector) || last.lastSector + 1 == current->firstSector)
-            {
-                if (!last.contains(current->lastSector))
-                {
-                    last.lastSector = current->lastSector;
-                }
-                continue;
-            }
-        }
-        sortedRunTargets.push_back(*current);
+        Message.Out("Cannot write a temporary file while sorting the sectors list.");
+        return 1;
+    }
+
+    if (runTargets.QuerySpilledRuns() != 0)
+    {
+        Message.Out("Sorted the sectors list in ", (LONGLONG)runTargets.QuerySpilledRuns(), " runs.");
     }
 
-    runTargets = sortedRunTargets;
+    if (wholeDisk)
+    {
+        return MarkBadOnDisk(Message, diskNumber, runTargets, binarySectorSize, snapshotFile,
+                             threadCount != 0 ? threadCount : 1);
+    }
 
     DSTRING         CurrentDrive;
     if (!SYSTEM::QueryCurrentDosDriveName(&CurrentDrive))
@@ -238,7 +420,7 @@ main(
     NtDriveName.Strcat(&InputParamDrive);
 
 
-    if (CurrentDrive == InputParamDrive)
+    if (!plan && CurrentDrive == InputParamDrive)
     {
         Message.Out("Cannot lock current drive. Change current drive and rerun the program.");
         return 1;
@@ -253,58 +435,117 @@ main(
     }
 
 
-    NTSTATUS            Status;
-    DSTRING             drivename;
+    NTFS_VOL    NtfsVol;
 
-    BOOL FsNameIsNtfs;
+    if (OpenNtfsVolume(Message, &NtDriveName, runDrive, NtfsVol))
+    {
+        return 1;
+    }
 
-    if (!IFS_SYSTEM::QueryFileSystemNameIsNtfs(&NtDriveName,
-        &FsNameIsNtfs,
-        &Status))
+    if (plan)
     {
-        if (Status == STATUS_ACCESS_DENIED)
+        return PlanMarkBadOnVolume(Message, NtfsVol, snapshotFile, runTargets, binarySectorSize);
+    }
+
+    UNDO_JOURNAL UndoJournal;
+    DSTRING UndoJournalName;
+
+    if (!undoJournalFile.empty())
+    {
+        if (!UndoJournalName.Initialize(undoJournalFile.c_str()) ||
+            !UndoJournal.Initialize(&UndoJournalName, NtfsVol.GetNtfsSa()->QuerySerialNumber()))
         {
-            Message.Out("Access denied. Run the program as administrator.");
+            Message.Out("Out of memory.");
+            return 1;
         }
-        else if (Status != STATUS_SUCCESS)
+
+        if (!NtfsVol.Lock())
         {
-            Message.Out("Cannot open volume for direct access.");
+            Message.Out("Cannot lock the drive. The volume is still in use.");
+            return 1;
         }
-        else
+
+        Message.Out("Restoring from ", undoJournalFile, "...");
+
+        if (!UndoJournal.Restore(&NtfsVol, &Message))
         {
-            Message.Out("Cannot determine file system of drive: ", runDrive);
+            Message.Out("An error has occurred.");
+            return 1;
         }
 
-        return 1;
+        Message.Out("Completed.");
+        return 0;
     }
 
-    if (!FsNameIsNtfs) //NOT NTFS
+    undoJournalFile = "NTFSMARKBAD_" + runDrive.substr(0, 1) + ".UNDO";
+
+    if (!servicePipeName.empty())
     {
-        Message.Out("Only NTFS file system supported.");
-        return 1;
+        return RunMarkService(Message, NtfsVol, servicePipeName, undoJournalFile, snapshotFile, serviceWindow);
     }
 
+    if (!stats && !trace)
+    {
+        return MarkBadOnVolume(Message, NtfsVol, undoJournalFile, snapshotFile, runTargets, binarySectorSize);
+    }
 
-    NTFS_VOL    NtfsVol;
-    BOOLEAN     Result;
+    IO_STATS Stats;
+    IO_TRACE Trace;
 
-    Result = NtfsVol.Initialize(&NtDriveName, &Message);
-    if (!Result)
+    if (stats)
     {
-        Message.Out("Failed to initialize.");
-        return 1;
+        if (!Stats.Initialize())
+        {
+            Message.Out("Cannot read the performance counter.");
+            return 1;
+        }
+
+        if (statsFile.empty())
+        {
+            statsFile = "NTFSMARKBAD_" + runDrive.substr(0, 1) + ".JSON";
+        }
+
+        NtfsVol.SetIoStats(&Stats);
     }
 
-    Result = NtfsVol.MarkBad(runTargets, &Message);
-    if (!Result)
+    if (trace)
     {
-        Message.Out("An error has occurred.");
-        return 1;
+        DSTRING TraceFileName;
+
+        if (traceFile.empty())
+        {
+            traceFile = "NTFSMARKBAD_" + runDrive.substr(0, 1) + ".TRACE";
+        }
+
+        if (!TraceFileName.Initialize(traceFile.c_str()) ||
+            !Trace.Initialize(&TraceFileName, NtfsVol.QuerySectorSize(), NtfsVol.QuerySectors().GetQuadPart()))
+        {
+            NtfsVol.SetIoStats(NULL);
+            Message.Out("Cannot create the trace file: ", traceFile);
+            return 1;
+        }
+
+        NtfsVol.SetIoTrace(&Trace);
     }
 
-    Message.Out("Completed.");
-    return 0;
-}
+    int result = MarkBadOnVolume(Message, NtfsVol, undoJournalFile, snapshotFile, runTargets, binarySectorSize);
+
+    NtfsVol.SetIoPhase(IO_STATS_PHASE_NONE);
+    NtfsVol.SetIoStats(NULL);
+    NtfsVol.SetIoTrace(NULL);
 
+    // The statistics and the trace of a failed run are written too;
+    // they show where it stopped.
+    if (stats && WriteStatsFile(Message, Stats, statsFile, runDrive))
+    {
+        return 1;
+    }
 
+    if (trace && !Trace.Close())
+    {
+        Message.Out("Cannot write the trace file: ", traceFile);
+        return 1;
+    }
 
+    return result;
+}
@@ -0,0 +1,304 @@
+// NtfsMarkBadApi.cpp : The C interface declared in NtfsMarkBadApi.h.
+// Each NMB_VOLUME wraps an NTFS_VOL; the engine's messages go to the
+// caller's log callback instead of the console.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "ifssys.hxx"
+#include "ntfsvol.hxx"
+#include "undojrnl.hxx"
+
+#include "NtfsMarkBadApi.h"
+
+// Without a range callback, the ranges are marked this many at a time,
+// with a progress callback between the steps.
+#define NMB_PROGRESS_STEP 65536
+
+struct NMB_VOLUME
+{
+    NTFS_VOL Volume;
+    MESSAGE Message;
+    NMB_CALLBACKS Callbacks;
+};
+
+// Hands out the caller's ranges in place.
+class RangeSpanSource : public sectors_range_source
+{
+public:
+    RangeSpanSource(const NMB_RANGE* ranges, size_t count)
+        : _ranges(ranges), _count(count), _next(0)
+    {
+    }
+
+protected:
+    bool read(sectors_range& range)
+    {
+        if (_next == _count)
+        {
+            return false;
+        }
+
+        range.firstSector = _ranges[_next].first_sector;
+        range.lastSector = _ranges[_next].last_sector;
+        _next++;
+        return true;
+    }
+
+private:
+    const NMB_RANGE* _ranges;
+    size_t _count;
+    size_t _next;
+};
+
+// 0 while undefined, 1 while being defined, 2 once defined, 3 if that failed.
+static volatile LONG DescriptorsState = 0;
+
+// The class descriptors are shared by every volume, so the first call
+// to open a volume defines them, and any others wait for it.
+static bool DefineClassDescriptorsOnce()
+{
+    if (InterlockedCompareExchange(&DescriptorsState, 1, 0) == 0)
+    {
+        bool defined = UlibDefineClassDescriptors() && IfsutilDefineClassDescriptors() && UntfsDefineClassDescriptors();
+
+        InterlockedExchange(&DescriptorsState, defined ? 2 : 3);
+    }
+
+    while (DescriptorsState == 1)
+    {
+        Sleep(0);
+    }
+
+    return DescriptorsState == 2;
+}
+
+static VOID MessageToLog(PVOID context, const std::string& line)
+{
+    NMB_VOLUME* volume = (NMB_VOLUME*)context;
+
+    if (volume->Callbacks.log != NULL)
+    {
+        volume->Callbacks.log(volume->Callbacks.context, line.c_str());
+    }
+}
+
+NMB_STATUS NMB_CALL NmbOpenVolume(const char* path, const NMB_CALLBACKS* callbacks, NMB_VOLUME** volume)
+{
+    std::string ntName;
+    DSTRING NtDriveName;
+    NTSTATUS Status;
+    BOOL FsNameIsNtfs;
+    NMB_VOLUME* result;
+
+    if (path == NULL || volume == NULL)
+    {
+        return NMB_ERROR_INVALID_ARGUMENT;
+    }
+
+    *volume = NULL;
+
+    if (path[0] != '\0' && path[1] == ':' && path[2] == '\0')
+    {
+        ntName = std::string("\\??\\") + path;
+    }
+    else if (path[0] == '\\')
+    {
+        ntName = path;
+    }
+    else
+    {
+        return NMB_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (!DefineClassDescriptorsOnce())
+    {
+        return NMB_ERROR_OUT_OF_MEMORY;
+    }
+
+    if (!NtDriveName.Initialize(ntName.c_str()))
+    {
+        return NMB_ERROR_OUT_OF_MEMORY;
+    }
+
+    if (!IFS_SYSTEM::QueryFileSystemNameIsNtfs(&NtDriveName, &FsNameIsNtfs, &Status))
+    {
+        return Status == STATUS_ACCESS_DENIED ? NMB_ERROR_ACCESS_DENIED : NMB_ERROR_OPEN;
+    }
+
+    if (!FsNameIsNtfs)
+    {
+        return NMB_ERROR_NOT_NTFS;
+    }
+
+    result = new NMB_VOLUME;
+
+    if (callbacks != NULL)
+    {
+        result->Callbacks = *callbacks;
+    }
+    else
+    {
+        memset(&result->Callbacks, 0, sizeof(result->Callbacks));
+    }
+
+    result->Message.Initialize();
+    result->Message.SetSink(MessageToLog, result);
+
+    if (result->Volume.Initialize(&NtDriveName, &result->Message) != NoError)
+    {
+        delete result;
+        return NMB_ERROR_OPEN;
+    }
+
+    *volume = result;
+    return NMB_OK;
+}
+
+void NMB_CALL NmbCloseVolume(NMB_VOLUME* volume)
+{
+    delete volume;
+}
+
+NMB_STATUS NMB_CALL NmbQueryVolumeInfo(NMB_VOLUME* volume, NMB_VOLUME_INFO* info)
+{
+    if (volume == NULL || info == NULL)
+    {
+        return NMB_ERROR_INVALID_ARGUMENT;
+    }
+
+    info->first_sector = volume->Volume.QueryHiddenSectors().GetQuadPart();
+    info->sector_count = volume->Volume.QuerySectors().GetQuadPart();
+    info->sector_size = volume->Volume.QuerySectorSize();
+    info->sectors_per_cluster = volume->Volume.GetNtfsSa()->QueryClusterFactor();
+
+    return NMB_OK;
+}
+
+NMB_STATUS NMB_CALL NmbMarkRanges(NMB_VOLUME* volume, const NMB_RANGE* ranges, size_t count,
+                                  const char* undo_journal_file, NMB_COUNTERS* counters)
+{
+    UNDO_JOURNAL UndoJournal;
+    DSTRING UndoJournalName;
+    PNTFS_SA NtfsSa;
+    NMB_COUNTERS total;
+    NMB_STATUS status = NMB_OK;
+    ULONG skipped;
+    size_t step;
+    size_t done;
+
+    if (volume == NULL || (ranges == NULL && count != 0) || counters == NULL)
+    {
+        return NMB_ERROR_INVALID_ARGUMENT;
+    }
+
+    const NMB_CALLBACKS& callbacks = volume->Callbacks;
+
+    step = callbacks.range_result != NULL ? 1 : NMB_PROGRESS_STEP;
+
+    // The engine numbers sectors with signed 64-bit integers.
+
+    for (done = 0; done < count; done++)
+    {
+        if (ranges[done].last_sector < ranges[done].first_sector ||
+            ranges[done].last_sector > (unsigned long long)MAXLONGLONG)
+        {
+            return NMB_ERROR_INVALID_ARGUMENT;
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+
+    if (undo_journal_file != NULL)
+    {
+        if (!UndoJournalName.Initialize(undo_journal_file) ||
+            !UndoJournal.Initialize(&UndoJournalName, volume->Volume.GetNtfsSa()->QuerySerialNumber()))
+        {
+            return NMB_ERROR_OUT_OF_MEMORY;
+        }
+
+        volume->Volume.SetUndoJournal(&UndoJournal);
+    }
+
+    NtfsSa = volume->Volume.GetNtfsSa();
+
+    if (!NtfsSa->BeginMarking(&volume->Message))
+    {
+        volume->Volume.SetUndoJournal(NULL);
+        return NMB_ERROR_LOAD;
+    }
+
+    for (done = 0; done < count; done += step)
+    {
+        size_t stepCount = min(step, count - done);
+        RangeSpanSource source(ranges + done, stepCount);
+        NTFS_MARK_COUNTS Counts;
+
+        if (callbacks.progress != NULL && callbacks.progress(callbacks.context, done, count))
+        {
+            status = NMB_ERROR_CANCELLED;
+            break;
+        }
+
+        if (!NtfsSa->MarkSectors(source, &Counts, &volume->Message))
+        {
+            status = NMB_ERROR_MARK;
+            break;
+        }
+
+        total.ranges += stepCount;
+        total.marked += Counts.Marked;
+        total.already_bad += Counts.AlreadyBad;
+        total.in_use += Counts.InUse;
+
+        if (callbacks.range_result != NULL)
+        {
+            NMB_COUNTERS result;
+
+            result.ranges = 1;
+            result.marked = Counts.Marked;
+            result.already_bad = Counts.AlreadyBad;
+            result.in_use = Counts.InUse;
+            result.skipped_index_updates = 0;
+
+            callbacks.range_result(callbacks.context, &ranges[done], &result);
+        }
+    }
+
+    if (status == NMB_OK && callbacks.progress != NULL && callbacks.progress(callbacks.context, count, count))
+    {
+        status = NMB_ERROR_CANCELLED;
+    }
+
+    skipped = NtfsSa->QuerySkippedFileNameUpdates();
+
+    if (status == NMB_OK && !NtfsSa->CommitMarking(&volume->Message))
+    {
+        status = NMB_ERROR_WRITE;
+    }
+
+    total.skipped_index_updates = NtfsSa->QuerySkippedFileNameUpdates() - skipped;
+
+    // Anything marked but not committed is dropped here.
+
+    NtfsSa->EndMarking(&volume->Message);
+    volume->Volume.SetUndoJournal(NULL);
+
+    // The marks are on the volume either way; a journal that cannot
+    // be marked complete still rolls them back.
+
+    if (status == NMB_OK && undo_journal_file != NULL)
+    {
+        UndoJournal.MarkComplete();
+    }
+
+    if (status == NMB_OK)
+    {
+        *counters = total;
+    }
+
+    return status;
+}
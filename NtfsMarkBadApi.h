@@ -0,0 +1,119 @@
+/*
+ * NtfsMarkBadApi.h : C interface to the marking engine, built as
+ * NtfsMarkBadLib.dll (NtfsMarkBadLib32.dll for x86).
+ *
+ * A volume is opened once and may then be marked any number of times.
+ * Each call to NmbMarkRanges loads the volume metadata, marks the free
+ * clusters holding the given sectors, and writes them to the bad
+ * cluster file in one commit.  The volume stays locked from the first
+ * NmbMarkRanges until NmbCloseVolume.
+ *
+ * Different volumes may be used from different threads at once; one
+ * volume must not be used by two threads at the same time.
+ *
+ * Disk images must be attached as volumes first (for example with
+ * Mount-DiskImage); the engine works on volumes, not on files.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef NTFSMARKBAD_EXPORTS
+#define NMB_API __declspec(dllexport)
+#else
+#define NMB_API __declspec(dllimport)
+#endif
+
+#define NMB_CALL __cdecl
+
+typedef struct NMB_VOLUME NMB_VOLUME;
+
+typedef enum NMB_STATUS
+{
+    NMB_OK = 0,
+    NMB_ERROR_INVALID_ARGUMENT,
+    NMB_ERROR_OUT_OF_MEMORY,
+    NMB_ERROR_ACCESS_DENIED,    /* the caller is not an administrator */
+    NMB_ERROR_OPEN,             /* the volume cannot be opened */
+    NMB_ERROR_NOT_NTFS,
+    NMB_ERROR_LOAD,             /* the volume cannot be locked or its metadata read */
+    NMB_ERROR_MARK,             /* the clusters cannot be marked */
+    NMB_ERROR_WRITE,            /* the metadata cannot be written */
+    NMB_ERROR_CANCELLED         /* the progress callback asked to stop */
+} NMB_STATUS;
+
+/* A range of sectors, numbered on the physical drive and inclusive. */
+typedef struct NMB_RANGE
+{
+    unsigned long long first_sector;
+    unsigned long long last_sector;
+} NMB_RANGE;
+
+/* What was done with the clusters holding a set of sectors. */
+typedef struct NMB_COUNTERS
+{
+    unsigned long long ranges;      /* ranges processed */
+    unsigned long long marked;      /* free clusters added to the bad cluster file */
+    unsigned long long already_bad; /* clusters already in the bad cluster file */
+    unsigned long long in_use;      /* clusters in use, left alone */
+    unsigned long long skipped_index_updates;   /* parent index updates the commit skipped
+                                                 * because the file names had not changed;
+                                                 * 0 in the counts of a single range */
+} NMB_COUNTERS;
+
+typedef struct NMB_VOLUME_INFO
+{
+    unsigned long long first_sector;        /* on the physical drive */
+    unsigned long long sector_count;
+    unsigned long sector_size;              /* in bytes */
+    unsigned long sectors_per_cluster;
+} NMB_VOLUME_INFO;
+
+/* Receives each line the engine would have printed, without the newline. */
+typedef void (NMB_CALL *NMB_LOG_CALLBACK)(void* context, const char* line);
+
+/* Called before each step of NmbMarkRanges with the number of ranges
+ * done so far, and once more at the end.  Returning nonzero stops the
+ * call before anything is written. */
+typedef int (NMB_CALL *NMB_PROGRESS_CALLBACK)(void* context, size_t done, size_t total);
+
+/* Called for each range once it has been marked, with its own counts.
+ * Setting it makes NmbMarkRanges mark the ranges one at a time. */
+typedef void (NMB_CALL *NMB_RANGE_CALLBACK)(void* context, const NMB_RANGE* range, const NMB_COUNTERS* result);
+
+/* Any callback may be NULL. */
+typedef struct NMB_CALLBACKS
+{
+    NMB_LOG_CALLBACK log;
+    NMB_PROGRESS_CALLBACK progress;
+    NMB_RANGE_CALLBACK range_result;
+    void* context;
+} NMB_CALLBACKS;
+
+/* Opens an NTFS volume.  path is a drive ("E:") or an NT device name
+ * ("\Device\HarddiskVolume7").  callbacks is copied and may be NULL. */
+NMB_API NMB_STATUS NMB_CALL NmbOpenVolume(const char* path, const NMB_CALLBACKS* callbacks, NMB_VOLUME** volume);
+
+/* Unlocks and closes a volume.  volume may be NULL. */
+NMB_API void NMB_CALL NmbCloseVolume(NMB_VOLUME* volume);
+
+NMB_API NMB_STATUS NMB_CALL NmbQueryVolumeInfo(NMB_VOLUME* volume, NMB_VOLUME_INFO* info);
+
+/* Marks the free clusters holding the given ranges as bad.  The ranges
+ * are read in place and need not be sorted.  Sectors outside the volume
+ * are ignored.  If undo_journal_file is not NULL, the metadata is saved
+ * there before it is changed, for NTFSMARKBAD /UNDO, and marked complete
+ * once the changes are written.  counters receives
+ * the totals if the call succeeds.  Unless it fails with NMB_ERROR_WRITE,
+ * a failed call leaves the volume unchanged. */
+NMB_API NMB_STATUS NMB_CALL NmbMarkRanges(NMB_VOLUME* volume, const NMB_RANGE* ranges, size_t count,
+                                          const char* undo_journal_file, NMB_COUNTERS* counters);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,375 @@
+// NtfsMarkBadBench.cpp : The benchmark program.  It builds synthetic NTFS
+// volumes in VHD files and times the marking engine against them, so
+// that changes to the hot paths can be measured the same way each time.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "ifssys.hxx"
+#include "ntfsvol.hxx"
+
+#include "TextUtils.h"
+#include "BenchImage.h"
+#include "BenchRun.h"
+#include "BenchMicro.h"
+#include "BenchCheck.h"
+#include "BenchTrace.h"
+
+BOOLEAN DefineClassDescriptors()
+{
+    return UlibDefineClassDescriptors() && IfsutilDefineClassDescriptors() && UntfsDefineClassDescriptors();
+}
+
+void OutputAboutBanner(MESSAGE& Message)
+{
+    Message.Out("Benchmark for NTFSMARKBAD on synthetic volumes\n"
+        "\n"
+        "Create a benchmark volume in a VHD file:\n"
+        "NTFSMARKBADBENCH /IMAGE <vhd_file> <drive>: <megabytes> [/CLUSTER:<bytes>]\n"
+        "                 [/FILL:<percent>] [/FRAG:<percent>] [/BAD:<runs>]\n"
+        "Run the benchmark against it:\n"
+        "NTFSMARKBADBENCH /RUN <vhd_file> <drive>: [/RANGES:<n>[,<n>...]]\n"
+        "Check that an interrupted commit can be rolled back:\n"
+        "NTFSMARKBADBENCH /UNDOCHECK <vhd_file> <drive>:\n"
+        "Time the core containers on their own:\n"
+        "NTFSMARKBADBENCH /MICRO [<json_file>] [/SCALE:<n>]\n"
+        "Check the rewritten routines against the ones they replaced:\n"
+        "NTFSMARKBADBENCH /CHECK [/SCALE:<n>]\n"
+        "Summarize an I/O trace written by NTFSMARKBAD /TRACE:\n"
+        "NTFSMARKBADBENCH /DUMP <trace_file> [<csv_file>]\n"
+        "Replay it:\n"
+        "NTFSMARKBADBENCH /REPLAY <trace_file> [<target_file>] [/ASAP]\n"
+        "\n"
+        "<drive> must be a free drive letter; the volume is mounted there while\n"
+        "the tool works on it.  /FILL is the part of the volume taken by files\n"
+        "(default 50), /FRAG the part freed in holes between them (default 10),\n"
+        "and /BAD the number of runs already in the Bad Clusters File (default\n"
+        "100).  Each number of ranges in /RANGES (default 10,1000,100000,\n"
+        "10000000) is one case; it reports the wall time, the peak working set\n"
+        "and the bytes read and written.  The volume is restored after each\n"
+        "case.  /UNDOCHECK cuts a journalled commit short after each number of\n"
+        "its runs and rolls it back.  All three need administrator rights.\n"
+        "\n"
+        "/MICRO writes its results to <json_file> (default NTFSMARKBAD_MICRO.JSON);\n"
+        "/SCALE multiplies the work of every benchmark, or the number of cases\n"
+        "of every check (default 1).\n"
+        "\n"
+        "/DUMP prints the requests of each kind in the trace, and writes every\n"
+        "request to <csv_file> if given.  /REPLAY makes the requests again to\n"
+        "<target_file>, which is created or extended to the size of the traced\n"
+        "volume, or, without one, takes the latency each was recorded with.\n"
+        "Each request waits for its recorded time unless /ASAP is given.\n");
+}
+
+// Parses "<X>:" for a drive letter that is not in use.
+static bool ParseFreeDrive(MESSAGE& Message, const std::string& text, std::string& drive)
+{
+    drive = str_toupper(text);
+
+    if (drive.size() != 2 || drive[0] < 'A' || drive[0] > 'Z' || drive[1] != ':')
+    {
+        Message.Out("Invalid drive: ", text);
+        return false;
+    }
+
+    if (GetLogicalDrives() & (1 << (drive[0] - 'A')))
+    {
+        Message.Out("Drive ", drive, " is in use.");
+        return false;
+    }
+
+    return true;
+}
+
+// Parses the value of an option like "/FILL:<n>", within [low, high].
+static bool ParseOption(const std::string& option, size_t nameLength, __int64 low, __int64 high,
+                        unsigned __int64* value)
+{
+    __int64 n = parse_int64(option.substr(nameLength));
+
+    if (n < low || n > high)
+    {
+        return false;
+    }
+
+    *value = (unsigned __int64)n;
+    return true;
+}
+
+static int CreateImageMode(MESSAGE& Message, ULONG nArgCount, PSTR arrArguments[])
+{
+    BENCH_IMAGE_OPTIONS Options;
+    std::string drive;
+    unsigned __int64 value;
+    ULONG i;
+
+    if (nArgCount < 5 || !ParseFreeDrive(Message, arrArguments[3], drive))
+    {
+        OutputAboutBanner(Message);
+        return 1;
+    }
+
+    if (!ParseOption(arrArguments[4], 0, 16, 2 * 1024 * 1024, &Options.sizeMegabytes))
+    {
+        Message.Out("Invalid image size.");
+        return 1;
+    }
+
+    Options.clusterSize = 0;
+    Options.fillPercent = 50;
+    Options.fragmentPercent = 10;
+    Options.badRuns = 100;
+
+    for (i = 5; i < nArgCount; i++)
+    {
+        std::string option = str_toupper(arrArguments[i]);
+
+        if (option.compare(0, 9, "/CLUSTER:") == 0 && ParseOption(option, 9, 512, 64 * 1024, &value) &&
+            (value & (value - 1)) == 0)
+        {
+            Options.clusterSize = (unsigned int)value;
+        }
+        else if (option.compare(0, 6, "/FILL:") == 0 && ParseOption(option, 6, 0, 95, &value))
+        {
+            Options.fillPercent = (unsigned int)value;
+        }
+        else if (option.compare(0, 6, "/FRAG:") == 0 && ParseOption(option, 6, 0, 95, &value))
+        {
+            Options.fragmentPercent = (unsigned int)value;
+        }
+        else if (option.compare(0, 5, "/BAD:") == 0 && ParseOption(option, 5, 0, 1000000, &value))
+        {
+            Options.badRuns = (unsigned int)value;
+        }
+        else
+        {
+            Message.Out("Invalid option: ", std::string(arrArguments[i]));
+            return 1;
+        }
+    }
+
+    if (Options.fillPercent + Options.fragmentPercent > 95)
+    {
+        Message.Out("/FILL and /FRAG together may not exceed 95 percent.");
+        return 1;
+    }
+
+    return CreateBenchImage(Message, arrArguments[2], drive, Options);
+}
+
+static int RunSuiteMode(MESSAGE& Message, ULONG nArgCount, PSTR arrArguments[])
+{
+    std::vector<unsigned __int64> rangeCounts;
+    std::string drive;
+    unsigned __int64 value;
+    size_t i;
+
+    if ((nArgCount != 4 && nArgCount != 5) || !ParseFreeDrive(Message, arrArguments[3], drive))
+    {
+        OutputAboutBanner(Message);
+        return 1;
+    }
+
+    if (nArgCount == 5)
+    {
+        std::string option = str_toupper(arrArguments[4]);
+        std::vector<std::string> counts;
+
+        if (option.compare(0, 8, "/RANGES:") == 0)
+        {
+            counts = split(option.substr(8), ",");
+        }
+
+        if (counts.empty())
+        {
+            Message.Out("Invalid option: ", std::string(arrArguments[4]));
+            return 1;
+        }
+
+        for (i = 0; i < counts.size(); i++)
+        {
+            if (!ParseOption(counts[i], 0, 1, MAXLONGLONG, &value))
+            {
+                Message.Out("Invalid number of ranges: ", counts[i]);
+                return 1;
+            }
+
+            rangeCounts.push_back(value);
+        }
+    }
+    else
+    {
+        rangeCounts.push_back(10);
+        rangeCounts.push_back(1000);
+        rangeCounts.push_back(100000);
+        rangeCounts.push_back(10000000);
+    }
+
+    return RunBenchSuite(Message, arrArguments[2], drive, rangeCounts);
+}
+
+static int UndoCheckMode(MESSAGE& Message, ULONG nArgCount, PSTR arrArguments[])
+{
+    std::string drive;
+
+    if (nArgCount != 4 || !ParseFreeDrive(Message, arrArguments[3], drive))
+    {
+        OutputAboutBanner(Message);
+        return 1;
+    }
+
+    return RunUndoCheck(Message, arrArguments[2], drive);
+}
+
+static int MicroMode(MESSAGE& Message, ULONG nArgCount, PSTR arrArguments[])
+{
+    std::string outputFile = "NTFSMARKBAD_MICRO.JSON";
+    unsigned __int64 scale = 1;
+    ULONG i;
+
+    for (i = 2; i < nArgCount; i++)
+    {
+        std::string option = str_toupper(arrArguments[i]);
+
+        if (option.compare(0, 7, "/SCALE:") == 0)
+        {
+            if (!ParseOption(option, 7, 1, 1000, &scale))
+            {
+                Message.Out("Invalid scale.");
+                return 1;
+            }
+        }
+        else if (i == 2 && option[0] != '/')
+        {
+            outputFile = arrArguments[i];
+        }
+        else
+        {
+            OutputAboutBanner(Message);
+            return 1;
+        }
+    }
+
+    return RunMicroBenchmarks(Message, outputFile, (unsigned int)scale);
+}
+
+static int CheckMode(MESSAGE& Message, ULONG nArgCount, PSTR arrArguments[])
+{
+    unsigned __int64 scale = 1;
+    ULONG i;
+
+    for (i = 2; i < nArgCount; i++)
+    {
+        std::string option = str_toupper(arrArguments[i]);
+
+        if (option.compare(0, 7, "/SCALE:") == 0)
+        {
+            if (!ParseOption(option, 7, 1, 1000, &scale))
+            {
+                Message.Out("Invalid scale.");
+                return 1;
+            }
+        }
+        else
+        {
+            OutputAboutBanner(Message);
+            return 1;
+        }
+    }
+
+    return RunSelfChecks(Message, (unsigned int)scale);
+}
+
+static int ReplayMode(MESSAGE& Message, ULONG nArgCount, PSTR arrArguments[])
+{
+    std::string targetFile;
+    bool recordedTiming = true;
+
+    if (nArgCount > 3 && str_toupper(arrArguments[nArgCount - 1]) == "/ASAP")
+    {
+        recordedTiming = false;
+        nArgCount--;
+    }
+
+    if (nArgCount != 3 && nArgCount != 4)
+    {
+        OutputAboutBanner(Message);
+        return 1;
+    }
+
+    if (nArgCount == 4)
+    {
+        targetFile = arrArguments[3];
+    }
+
+    return ReplayTrace(Message, arrArguments[2], targetFile, recordedTiming);
+}
+
+int __cdecl
+main(
+    ULONG nArgCount,
+    PSTR arrArguments[]
+)
+{
+    MESSAGE    Message;
+    Message.Initialize();
+
+    DefineClassDescriptors();
+
+    std::string mode = nArgCount > 1 ? str_toupper(arrArguments[1]) : "";
+
+    if (mode == "/IMAGE")
+    {
+        return CreateImageMode(Message, nArgCount, arrArguments);
+    }
+
+    if (mode == "/RUN")
+    {
+        return RunSuiteMode(Message, nArgCount, arrArguments);
+    }
+
+    if (mode == "/UNDOCHECK")
+    {
+        return UndoCheckMode(Message, nArgCount, arrArguments);
+    }
+
+    if (mode == "/MICRO")
+    {
+        return MicroMode(Message, nArgCount, arrArguments);
+    }
+
+    if (mode == "/CHECK")
+    {
+        return CheckMode(Message, nArgCount, arrArguments);
+    }
+
+    if (mode == "/DUMP" && (nArgCount == 3 || nArgCount == 4))
+    {
+        return DumpTrace(Message, arrArguments[2], nArgCount == 4 ? arrArguments[3] : "");
+    }
+
+    if (mode == "/REPLAY")
+    {
+        return ReplayMode(Message, nArgCount, arrArguments);
+    }
+
+    // One case of the suite, in a process of its own.
+    if (mode == "/CASE" && nArgCount == 4)
+    {
+        __int64 rangeCount = parse_int64(arrArguments[3]);
+
+        if (rangeCount <= 0)
+        {
+            Message.Out("Invalid number of ranges.");
+            return 1;
+        }
+
+        return RunBenchCase(Message, str_toupper(arrArguments[2]), (unsigned __int64)rangeCount);
+    }
+
+    OutputAboutBanner(Message);
+    return 1;
+}
@@ -0,0 +1,198 @@
+// PlanMode.cpp : Dry run.  The metadata is loaded without locking the
+// volume, the clusters are marked in memory, and the commit is staged
+// in the write batch and then dropped, so the volume is only read.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "numset.hxx"
+#include "ntfsvol.hxx"
+
+#include "PlanMode.h"
+
+// How much of the volume is read to measure its throughput.
+#define PLAN_THROUGHPUT_BYTES (16 * 1024 * 1024)
+#define PLAN_THROUGHPUT_CHUNK (1024 * 1024)
+
+// At most this many of the planned writes are used to measure the
+// access time.
+#define PLAN_ACCESS_SAMPLES 32
+
+static double QuerySeconds()
+{
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+// Measures the sequential read throughput of the volume from its start,
+// and the time to reach the first sector of the planned writes.  Reads
+// stand in for writes, which cannot be timed without writing.
+static bool MeasureVolume(NTFS_VOL& NtfsVol, const NUMBER_SET& Sectors,
+                          double* bytesPerSecond, double* secondsPerAccess)
+{
+    ULONG sectorSize = NtfsVol.QuerySectorSize();
+    ULONG chunkSectors = PLAN_THROUGHPUT_CHUNK / sectorSize;
+    LONGLONG totalSectors = min((LONGLONG)(PLAN_THROUGHPUT_BYTES / sectorSize), NtfsVol.QuerySectors().GetQuadPart());
+    ULONG samples = min(Sectors.QueryNumDisjointRanges(), (ULONG)PLAN_ACCESS_SAMPLES);
+    PVOID buffer;
+    LONGLONG sector;
+    BIG_INT start, length;
+    double begin;
+    ULONG i;
+
+    // VirtualAlloc returns page-aligned memory, which meets the
+    // alignment the volume needs for direct reads.
+    buffer = VirtualAlloc(NULL, PLAN_THROUGHPUT_CHUNK, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+    if (buffer == NULL)
+    {
+        return false;
+    }
+
+    begin = QuerySeconds();
+
+    for (sector = 0; sector < totalSectors; sector += chunkSectors)
+    {
+        if (!NtfsVol.Read((ULONGLONG)sector, (SECTORCOUNT)min((LONGLONG)chunkSectors, totalSectors - sector), buffer))
+        {
+            VirtualFree(buffer, 0, MEM_RELEASE);
+            return false;
+        }
+    }
+
+    *bytesPerSecond = (double)totalSectors * sectorSize / max(QuerySeconds() - begin, 1e-6);
+
+    begin = QuerySeconds();
+
+    for (i = 0; i < samples; i++)
+    {
+        Sectors.QueryDisjointRange(i * Sectors.QueryNumDisjointRanges() / samples, &start, &length);
+
+        if (!NtfsVol.Read(start, 1, buffer))
+        {
+            VirtualFree(buffer, 0, MEM_RELEASE);
+            return false;
+        }
+    }
+
+    *secondsPerAccess = samples != 0 ? (QuerySeconds() - begin) / samples : 0;
+
+    VirtualFree(buffer, 0, MEM_RELEASE);
+    return true;
+}
+
+int PlanMarkBadOnVolume(MESSAGE& Message, NTFS_VOL& NtfsVol, const std::string& snapshotFile,
+                        sectors_range_source& runTargets, unsigned int listSectorSize)
+{
+    PNTFS_SA NtfsSa = NtfsVol.GetNtfsSa();
+    NTFS_SNAPSHOT Snapshot;
+    DSTRING SnapshotName;
+    NTFS_MARK_COUNTS Counts;
+    NTFS_MARK_PLAN Plan;
+    NUMBER_SET Sectors;
+    BIG_INT hiddenSectors = NtfsVol.QueryHiddenSectors();
+    BIG_INT start, length;
+    LONGLONG writeBytes;
+    double loadSeconds, writeSeconds;
+    double bytesPerSecond, secondsPerAccess;
+    ULONG i;
+
+    if (listSectorSize != 0 && listSectorSize != NtfsVol.QuerySectorSize())
+    {
+        Message.Out("The sectors list was made for a drive with ", (LONGLONG)listSectorSize, "-byte sectors.");
+        return 1;
+    }
+
+    if (!Sectors.Initialize())
+    {
+        Message.Out("Out of memory.");
+        return 1;
+    }
+
+    if (!snapshotFile.empty())
+    {
+        if (!SnapshotName.Initialize(snapshotFile.c_str()) ||
+            !Snapshot.Initialize(&SnapshotName))
+        {
+            Message.Out("Out of memory.");
+            return 1;
+        }
+
+        NtfsVol.SetSnapshot(&Snapshot);
+    }
+
+    Message.Out("Planning without locking the volume; nothing will be written.");
+
+    loadSeconds = QuerySeconds();
+
+    if (!NtfsSa->BeginMarking(&Message, FALSE))
+    {
+        NtfsVol.SetSnapshot(NULL);
+        Message.Out("An error has occurred.");
+        return 1;
+    }
+
+    loadSeconds = QuerySeconds() - loadSeconds;
+
+    if (!NtfsSa->MarkSectors(runTargets, &Counts, &Message) ||
+        !NtfsSa->PlanMarking(&Plan, &Sectors, &Message))
+    {
+        NtfsVol.SetSnapshot(NULL);
+        NtfsSa->EndMarking(&Message);
+        Message.Out("An error has occurred.");
+        return 1;
+    }
+
+    // The metadata was read while the volume was in use, so it must not
+    // be kept as a snapshot.
+    NtfsVol.SetSnapshot(NULL);
+    NtfsSa->EndMarking(&Message);
+
+    Message.Out("Clusters to mark: ", Counts.Marked);
+    Message.Out("Clusters already marked bad: ", Counts.AlreadyBad);
+    Message.Out("Clusters in use, left alone: ", Counts.InUse);
+    Message.Out("Runs to add to $BadClus: ", (LONGLONG)Plan.AddedRuns);
+    Message.Out("File records to add for $BadClus: ", Plan.AddedFileRecords);
+
+    if (Sectors.QueryCardinality() == 0)
+    {
+        Message.Out("Nothing would be written.");
+        return 0;
+    }
+
+    Message.Out("Sectors to write (on the physical drive), in ", (LONGLONG)Plan.WriteCount, " writes:");
+
+    for (i = 0; i < Sectors.QueryNumDisjointRanges(); i++)
+    {
+        Sectors.QueryDisjointRange(i, &start, &length);
+        Message.Out("  ", (hiddenSectors + start).GetQuadPart(), " - ",
+                    (hiddenSectors + start + length - 1).GetQuadPart(), "");
+    }
+
+    if (!MeasureVolume(NtfsVol, Sectors, &bytesPerSecond, &secondsPerAccess))
+    {
+        Message.Out("Cannot read the volume to measure its throughput.");
+        return 1;
+    }
+
+    // A real run reads every sector it writes into the undo journal
+    // first, so each write costs about twice.
+    writeBytes = Sectors.QueryCardinality().GetQuadPart() * NtfsVol.QuerySectorSize();
+    writeSeconds = 2 * (Plan.WriteCount * secondsPerAccess + writeBytes / bytesPerSecond);
+
+    Message.Out("Measured throughput: ", (LONGLONG)(bytesPerSecond / 1024), " KB/s, access time: ",
+                (LONGLONG)(secondsPerAccess * 1000000), " us");
+    Message.Out("Estimated time of a real run: ", (LONGLONG)((loadSeconds + writeSeconds) * 1000),
+                " ms (metadata load ", (LONGLONG)(loadSeconds * 1000), " ms, writes ",
+                (LONGLONG)(writeSeconds * 1000), " ms)");
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+DECLARE_CLASS(NTFS_VOL);
+
+// Works out what marking the ranges read from runTargets would do to an
+// open volume, without locking or writing it: the clusters to mark, the
+// runs and file records $BadClus would gain, and the exact sectors the
+// commit would write.  The time a real run would take is estimated from
+// the metadata load and from the throughput and access time measured on
+// the volume.  If snapshotFile is not empty, the volume bitmap is taken
+// from it when it is still valid; it is never saved.  If listSectorSize
+// is not 0, it must match the sector size of the volume.  Returns 0 on
+// success.
+int PlanMarkBadOnVolume(MESSAGE& Message, NTFS_VOL& NtfsVol, const std::string& snapshotFile,
+                        sectors_range_source& runTargets, unsigned int listSectorSize);
@@ -0,0 +1,850 @@
+// SectorsFile.cpp : Readers and writer for the sector list files used in
+// batch mode.
+//
+// Scanner output can run to tens of millions of lines, so the file is
+// memory-mapped and tokenized in place, without copying lines or
+// tokens.  Large files are split into chunks at line boundaries; each
+// chunk is parsed on its own thread into a sorted run of ranges.  The
+// file is mapped one window at a time, sized from the sorter's memory
+// budget, and the ranges of each window are handed to the sorter before
+// the next one is read.
+//
+// The binary format (see SectorsFile.h) is decoded into the sorter as it
+// is read, and written straight from a range source.
+
+#include "stdafx.h"
+
+#include <algorithm>
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "undojrnl.hxx"
+
+#include "SectorsFile.h"
+#include "SectorsSorter.h"
+
+#if defined(_M_AMD64)
+#define SECTORS_FILE_WINDOW_SIZE    ((unsigned __int64)-1)
+#else
+#define SECTORS_FILE_WINDOW_SIZE    ((unsigned __int64)256 * 1024 * 1024)
+#endif
+
+// Binary files are read through a buffer of this size.
+#define SECTORS_BINARY_BUFFER_SIZE  (1024 * 1024)
+
+#define SECTORS_FILE_MIN_WINDOW_SIZE ((unsigned __int64)1024 * 1024)
+
+// Windows smaller than this are parsed on the calling thread.
+#define SECTORS_FILE_MIN_CHUNK_SIZE (4 * 1024 * 1024)
+
+#define SECTORS_FILE_MAX_THREADS    16
+
+enum SECTORS_FILE_ERROR
+{
+    SectorsFileNoError,
+    SectorsFileInvalidSector,
+    SectorsFileInvalidFirstSector,
+    SectorsFileInvalidLastSector,
+    SectorsFileLastBeforeFirst,
+    SectorsFileWrongLine
+};
+
+struct SECTORS_FILE_CHUNK
+{
+    const char* begin;
+    const char* end;
+
+    // Filled in by ParseChunk.
+    std::vector<sectors_range> ranges;
+    unsigned __int64 lineCount;
+    SECTORS_FILE_ERROR error;
+    unsigned __int64 errorLine;     // within the chunk, starting at 1
+    std::string errorValue;
+};
+
+static inline bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool IsSeparator(char c)
+{
+    return IsBlank(c) || c == ',' || c == ';';
+}
+
+// Parses a sector number the way parse_int64 does: an optional sign
+// followed by decimal digits, with anything after the digits ignored.
+// Negative and out-of-range numbers are rejected.
+static bool ParseSectorNumber(const char* p, const char* end, unsigned __int64* value)
+{
+    bool negative = false;
+    unsigned __int64 result = 0;
+
+    if (p < end && (*p == '+' || *p == '-'))
+    {
+        negative = (*p == '-');
+        p++;
+    }
+
+    if (p == end || *p < '0' || *p > '9')
+    {
+        return false;
+    }
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        unsigned digit = *p - '0';
+
+        if (result > (_I64_MAX - digit) / 10)
+        {
+            return false;
+        }
+
+        result = result * 10 + digit;
+    }
+
+    if (negative && result != 0)
+    {
+        return false;
+    }
+
+    *value = result;
+    return true;
+}
+
+static void AddRange(std::vector<sectors_range>& ranges, unsigned __int64 firstSector, unsigned __int64 lastSector)
+{
+    if (!ranges.empty() && ranges.back().lastSector + 1 == firstSector)
+    {
+        ranges.back().lastSector = lastSector;
+    }
+    else
+    {
+        ranges.push_back(sectors_range(firstSector, lastSector));
+    }
+}
+
+static void SetChunkError(SECTORS_FILE_CHUNK* chunk, SECTORS_FILE_ERROR error, const char* valueBegin, const char* valueEnd)
+{
+    chunk->error = error;
+    chunk->errorLine = chunk->lineCount;
+    chunk->errorValue.assign(valueBegin, valueEnd);
+}
+
+// Parses the lines of one chunk.  Parsing stops at the first bad line.
+static void ParseChunk(SECTORS_FILE_CHUNK* chunk)
+{
+    const char* p = chunk->begin;
+    const char* end = chunk->end;
+
+    chunk->lineCount = 0;
+    chunk->error = SectorsFileNoError;
+    chunk->errorLine = 0;
+
+    while (p < end)
+    {
+        const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+        const char* next;
+        const char* tokenBegin[2];
+        const char* tokenEnd[2];
+        int tokens = 0;
+        unsigned __int64 firstSector, lastSector;
+
+        if (lineEnd == NULL)
+        {
+            lineEnd = end;
+        }
+
+        next = lineEnd + 1;
+        chunk->lineCount++;
+
+        // Trim the line.
+        while (p < lineEnd && IsBlank(*p)) p++;
+        while (lineEnd > p && IsBlank(lineEnd[-1])) lineEnd--;
+
+        const char* lineBegin = p;
+
+        while (p < lineEnd)
+        {
+            while (p < lineEnd && IsSeparator(*p)) p++;
+
+            if (p == lineEnd)
+            {
+                break;
+            }
+
+            if (tokens == 2)
+            {
+                SetChunkError(chunk, SectorsFileWrongLine, lineBegin, lineEnd);
+                return;
+            }
+
+            tokenBegin[tokens] = p;
+            while (p < lineEnd && !IsSeparator(*p)) p++;
+            tokenEnd[tokens] = p;
+            tokens++;
+        }
+
+        if (tokens == 1)
+        {
+            if (!ParseSectorNumber(tokenBegin[0], tokenEnd[0], &firstSector))
+            {
+                SetChunkError(chunk, SectorsFileInvalidSector, tokenBegin[0], tokenEnd[0]);
+                return;
+            }
+
+            AddRange(chunk->ranges, firstSector, firstSector);
+        }
+        else if (tokens == 2)
+        {
+            if (!ParseSectorNumber(tokenBegin[0], tokenEnd[0], &firstSector))
+            {
+                SetChunkError(chunk, SectorsFileInvalidFirstSector, tokenBegin[0], tokenEnd[0]);
+                return;
+            }
+
+            if (!ParseSectorNumber(tokenBegin[1], tokenEnd[1], &lastSector))
+            {
+                SetChunkError(chunk, SectorsFileInvalidLastSector, tokenBegin[1], tokenEnd[1]);
+                return;
+            }
+
+            if (lastSector < firstSector)
+            {
+                SetChunkError(chunk, SectorsFileLastBeforeFirst, lineBegin, lineBegin);
+                return;
+            }
+
+            AddRange(chunk->ranges, firstSector, lastSector);
+        }
+
+        p = next;
+    }
+
+    // Chunks are already parsed in parallel.
+    SortAndJoinRanges(chunk->ranges, 1);
+}
+
+static DWORD WINAPI ParseChunkThread(LPVOID parameter)
+{
+    ParseChunk((SECTORS_FILE_CHUNK*)parameter);
+    return 0;
+}
+
+static void ReportChunkError(MESSAGE& Message, const SECTORS_FILE_CHUNK& chunk, unsigned __int64 firstLine)
+{
+    LONGLONG line = (LONGLONG)(firstLine + chunk.errorLine);
+
+    switch (chunk.error)
+    {
+    case SectorsFileInvalidSector:
+        Message.Out("Invalid sector number in file, line ", line, " value ", chunk.errorValue);
+        break;
+
+    case SectorsFileInvalidFirstSector:
+        Message.Out("Invalid first sector number in file, line ", line, " value ", chunk.errorValue);
+        break;
+
+    case SectorsFileInvalidLastSector:
+        Message.Out("Invalid last sector number in file with sectors list, line ", line, " value ", chunk.errorValue);
+        break;
+
+    case SectorsFileLastBeforeFirst:
+        Message.Out("Last sector number is less than first number in file, line ", line);
+        break;
+
+    default:
+        Message.Out("Wrong line in file, line #", line, " value ", chunk.errorValue);
+        break;
+    }
+}
+
+static unsigned GetParserThreadCount()
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+
+    return max((DWORD)1, min(info.dwNumberOfProcessors, (DWORD)SECTORS_FILE_MAX_THREADS));
+}
+
+// Splits [begin, end) into up to threadCount chunks of whole lines and
+// parses them, in parallel if the window is large enough.  The parsed
+// chunks are appended to chunks.
+static void ParseWindow(const char* begin, const char* end, unsigned threadCount, std::vector<SECTORS_FILE_CHUNK*>& chunks)
+{
+    size_t firstChunk = chunks.size();
+    size_t chunkCount, i;
+    size_t length = end - begin;
+    HANDLE threads[SECTORS_FILE_MAX_THREADS];
+
+    chunkCount = min((size_t)threadCount, length / SECTORS_FILE_MIN_CHUNK_SIZE);
+    if (chunkCount == 0)
+    {
+        chunkCount = 1;
+    }
+
+    const char* chunkBegin = begin;
+
+    for (i = 0; i < chunkCount && chunkBegin < end; i++)
+    {
+        const char* chunkEnd;
+
+        if (i + 1 == chunkCount)
+        {
+            chunkEnd = end;
+        }
+        else
+        {
+            chunkEnd = begin + length / chunkCount * (i + 1);
+            if (chunkEnd < chunkBegin)
+            {
+                chunkEnd = chunkBegin;
+            }
+            chunkEnd = (const char*)memchr(chunkEnd, '\n', end - chunkEnd);
+            chunkEnd = chunkEnd ? chunkEnd + 1 : end;
+        }
+
+        SECTORS_FILE_CHUNK* chunk = new SECTORS_FILE_CHUNK;
+        chunk->begin = chunkBegin;
+        chunk->end = chunkEnd;
+        chunks.push_back(chunk);
+
+        chunkBegin = chunkEnd;
+    }
+
+    chunkCount = chunks.size() - firstChunk;
+
+    if (chunkCount == 1)
+    {
+        ParseChunk(chunks[firstChunk]);
+        return;
+    }
+
+    for (i = 0; i < chunkCount; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, ParseChunkThread, chunks[firstChunk + i], 0, NULL);
+
+        if (threads[i] == NULL)
+        {
+            // Parse it here instead.
+            ParseChunk(chunks[firstChunk + i]);
+        }
+    }
+
+    for (i = 0; i < chunkCount; i++)
+    {
+        if (threads[i] != NULL)
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+    }
+}
+
+static void FreeChunks(std::vector<SECTORS_FILE_CHUNK*>& chunks)
+{
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        delete chunks[i];
+    }
+    chunks.clear();
+}
+
+// Adds the ranges of parsed chunks to the sorter and frees the chunks.
+static bool AddChunks(std::vector<SECTORS_FILE_CHUNK*>& chunks, SectorsRangeSorter& sorter)
+{
+    bool result = true;
+
+    for (size_t i = 0; i < chunks.size() && result; i++)
+    {
+        const std::vector<sectors_range>& ranges = chunks[i]->ranges;
+
+        for (size_t j = 0; j < ranges.size() && result; j++)
+        {
+            result = sorter.Add(ranges[j]);
+        }
+    }
+
+    FreeChunks(chunks);
+    return result;
+}
+
+int ParseSectorsFile(MESSAGE& Message, const std::string& filename, SectorsRangeSorter& runTargets)
+{
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+    SYSTEM_INFO info;
+    unsigned __int64 fileSize, offset, firstLine, windowSize, added;
+    unsigned threadCount;
+    std::vector<SECTORS_FILE_CHUNK*> chunks;
+    int result = 0;
+
+    Message.Out("Reading ", filename, "...");
+
+    file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+    {
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+        Message.Out("Failed to open file with sectors list.");
+        return 1;
+    }
+
+    fileSize = size.QuadPart;
+
+    if (fileSize == 0)
+    {
+        CloseHandle(file);
+        Message.Out("Empty file with sectors list.");
+        return 1;
+    }
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (mapping == NULL)
+    {
+        CloseHandle(file);
+        Message.Out("Failed to open file with sectors list.");
+        return 1;
+    }
+
+    GetSystemInfo(&info);
+    threadCount = GetParserThreadCount();
+
+    // A line of text yields at most one range, and takes at least two
+    // bytes, so this keeps the ranges parsed from a window well within
+    // the sorter's memory budget.
+    windowSize = max((unsigned __int64)runTargets.QueryMemoryBudget() / 32, (unsigned __int64)SECTORS_FILE_MIN_WINDOW_SIZE);
+    windowSize = min(windowSize - windowSize % info.dwAllocationGranularity, SECTORS_FILE_WINDOW_SIZE);
+
+    offset = 0;
+    firstLine = 0;
+    added = runTargets.QueryAdded();
+
+    while (offset < fileSize && result == 0)
+    {
+        // Views must start on an allocation granularity boundary.
+        unsigned __int64 viewStart = offset - offset % info.dwAllocationGranularity;
+        unsigned __int64 viewLength = min(windowSize, fileSize - viewStart);
+        const char* view;
+        const char* begin;
+        const char* end;
+
+        view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ,
+                                          (DWORD)(viewStart >> 32), (DWORD)viewStart,
+                                          (SIZE_T)viewLength);
+
+        if (view == NULL)
+        {
+            Message.Out("Failed to read file with sectors list.");
+            result = 1;
+            break;
+        }
+
+        begin = view + (offset - viewStart);
+        end = view + viewLength;
+
+        if (viewStart + viewLength < fileSize)
+        {
+            // Stop at the last whole line in the view; the rest is
+            // parsed with the next one.
+            while (end > begin && end[-1] != '\n') end--;
+
+            if (end == begin)
+            {
+                Message.Out("Wrong line in file, line #", (LONGLONG)(firstLine + 1));
+                UnmapViewOfFile(view);
+                result = 1;
+                break;
+            }
+        }
+
+        ParseWindow(begin, end, threadCount, chunks);
+
+        // Report the first bad line, if any.
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            if (chunks[i]->error != SectorsFileNoError)
+            {
+                ReportChunkError(Message, *chunks[i], firstLine);
+                result = 1;
+                break;
+            }
+            firstLine += chunks[i]->lineCount;
+        }
+
+        UnmapViewOfFile(view);
+
+        if (result == 0 && !AddChunks(chunks, runTargets))
+        {
+            Message.Out("Cannot write a temporary file while sorting the sectors list.");
+            result = 1;
+        }
+
+        offset += end - begin;
+    }
+
+    FreeChunks(chunks);
+
+    CloseHandle(mapping);
+    CloseHandle(file);
+
+    if (result == 0 && runTargets.QueryAdded() == added)
+    {
+        Message.Out("Empty file with sectors list.");
+        return 1;
+    }
+
+    return result;
+}
+
+// CRC-32 (IEEE 802.3), continued from crc, which is 0 for a new buffer.
+// The buffers passed here are never near 4 GB.
+static unsigned int UpdateCrc32(unsigned int crc, const unsigned char* p, size_t length)
+{
+    return UNDO_JOURNAL::ComputeChecksum(p, (ULONG)length, crc);
+}
+
+static unsigned int ComputeHeaderChecksum(const SECTORS_BINARY_HEADER& header)
+{
+    SECTORS_BINARY_HEADER copy = header;
+
+    copy.HeaderChecksum = 0;
+    return UpdateCrc32(0, (const unsigned char*)&copy, sizeof(copy));
+}
+
+static void AppendVarint(std::vector<unsigned char>& data, unsigned __int64 value)
+{
+    while (value >= 0x80)
+    {
+        data.push_back((unsigned char)(value | 0x80));
+        value >>= 7;
+    }
+
+    data.push_back((unsigned char)value);
+}
+
+// Reads a file sequentially through a fixed buffer, keeping a CRC-32 of
+// everything returned by ReadByte.
+class SectorsBinaryReader
+{
+public:
+    SectorsBinaryReader(HANDLE file) : _file(file), _buffer(SECTORS_BINARY_BUFFER_SIZE), _next(0), _end(0), _checked(0), _crc(0), _consumed(0)
+    {
+    }
+
+    bool Read(void* buffer, DWORD length)
+    {
+        DWORD bytesRead;
+
+        return ReadFile(_file, buffer, length, &bytesRead, NULL) && bytesRead == length;
+    }
+
+    bool ReadByte(unsigned char* value)
+    {
+        if (_next == _end && !Fill())
+        {
+            return false;
+        }
+
+        *value = _buffer[_next++];
+        _consumed++;
+        return true;
+    }
+
+    // Unsigned LEB128, at most 64 bits, in the fewest bytes that hold
+    // the value: an encoding padded with zero high groups is refused.
+    bool ReadVarint(unsigned __int64* value)
+    {
+        unsigned __int64 result = 0;
+        unsigned char byte;
+
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (!ReadByte(&byte))
+            {
+                return false;
+            }
+
+            if (shift == 63 && byte > 1)
+            {
+                return false;
+            }
+
+            result |= (unsigned __int64)(byte & 0x7F) << shift;
+
+            if (!(byte & 0x80))
+            {
+                if (byte == 0 && shift != 0)
+                {
+                    return false;
+                }
+
+                *value = result;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Whether the file ends exactly where the data consumed so far does.
+    bool AtEnd()
+    {
+        return _next == _end && !Fill();
+    }
+
+    unsigned int QueryCrc()
+    {
+        Flush();
+        return _crc;
+    }
+
+    unsigned __int64 QueryConsumed() const
+    {
+        return _consumed;
+    }
+
+private:
+    bool Fill()
+    {
+        DWORD bytesRead;
+
+        Flush();
+
+        if (!ReadFile(_file, &_buffer[0], (DWORD)_buffer.size(), &bytesRead, NULL) || bytesRead == 0)
+        {
+            return false;
+        }
+
+        _next = 0;
+        _end = bytesRead;
+        _checked = 0;
+        return true;
+    }
+
+    void Flush()
+    {
+        if (_next > _checked)
+        {
+            _crc = UpdateCrc32(_crc, &_buffer[_checked], _next - _checked);
+            _checked = _next;
+        }
+    }
+
+    HANDLE _file;
+    std::vector<unsigned char> _buffer;
+    size_t _next;
+    size_t _end;
+    size_t _checked;
+    unsigned int _crc;
+    unsigned __int64 _consumed;
+};
+
+int ParseSectorsBinaryFile(MESSAGE& Message, const std::string& filename, SectorsRangeSorter& runTargets, unsigned int* sectorSize)
+{
+    HANDLE file;
+    LARGE_INTEGER size;
+    SECTORS_BINARY_HEADER header;
+    unsigned __int64 nextSector, gap, length, i;
+    sectors_range range(0, 0);
+    int result = 1;
+
+    Message.Out("Reading ", filename, "...");
+
+    file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+    {
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+        Message.Out("Failed to open file with sectors list.");
+        return 1;
+    }
+
+    SectorsBinaryReader reader(file);
+
+    if (!reader.Read(&header, sizeof(header))
+        || memcmp(header.Signature, SECTORS_BINARY_SIGNATURE, sizeof(header.Signature)) != 0
+        || header.HeaderChecksum != ComputeHeaderChecksum(header))
+    {
+        Message.Out("Invalid binary file with sectors list.");
+        goto Done;
+    }
+
+    if (header.Version != SECTORS_BINARY_VERSION)
+    {
+        Message.Out("Unsupported version of binary file with sectors list: ", (LONGLONG)header.Version);
+        goto Done;
+    }
+
+    // Every run takes at least two bytes, which bounds what a damaged
+    // header can make us allocate.
+    if (header.DataLength != (unsigned __int64)size.QuadPart - sizeof(header)
+        || header.RunCount > header.DataLength / 2)
+    {
+        Message.Out("Invalid binary file with sectors list.");
+        goto Done;
+    }
+
+    if (header.RunCount == 0)
+    {
+        Message.Out("Empty file with sectors list.");
+        goto Done;
+    }
+
+    nextSector = 0;
+
+    for (i = 0; i < header.RunCount; i++)
+    {
+        // Runs after the first must leave a gap, or they would have
+        // been joined.
+        if (!reader.ReadVarint(&gap)
+            || !reader.ReadVarint(&length)
+            || length == 0
+            || (i != 0 && gap == 0)
+            || nextSector > (unsigned __int64)_I64_MAX
+            || gap > (unsigned __int64)_I64_MAX - nextSector
+            || length - 1 > (unsigned __int64)_I64_MAX - nextSector - gap)
+        {
+            Message.Out("Invalid run in binary file with sectors list, run #", (LONGLONG)(i + 1));
+            goto Done;
+        }
+
+        range = sectors_range(nextSector + gap, nextSector + gap + length - 1);
+        nextSector = range.lastSector + 1;
+
+        if (!runTargets.Add(range))
+        {
+            Message.Out("Cannot write a temporary file while sorting the sectors list.");
+            goto Done;
+        }
+    }
+
+    if (!reader.AtEnd() || reader.QueryConsumed() != header.DataLength)
+    {
+        Message.Out("Invalid binary file with sectors list.");
+        goto Done;
+    }
+
+    if (reader.QueryCrc() != header.DataChecksum)
+    {
+        Message.Out("Checksum mismatch in binary file with sectors list.");
+        goto Done;
+    }
+
+    *sectorSize = header.SectorSize;
+    result = 0;
+
+Done:
+    CloseHandle(file);
+    return result;
+}
+
+// Appends a varint to buffer, flushing the buffer to file first if it
+// may not have room.  Keeps track of the length and checksum written.
+static bool WriteVarint(HANDLE file, std::vector<unsigned char>& buffer, unsigned __int64 value,
+                        unsigned __int64* dataLength, unsigned int* checksum)
+{
+    DWORD bytesWritten;
+
+    if (buffer.size() + 10 > SECTORS_BINARY_BUFFER_SIZE)
+    {
+        if (!WriteFile(file, &buffer[0], (DWORD)buffer.size(), &bytesWritten, NULL) || bytesWritten != buffer.size())
+        {
+            return false;
+        }
+
+        *checksum = UpdateCrc32(*checksum, &buffer[0], buffer.size());
+        *dataLength += buffer.size();
+        buffer.clear();
+    }
+
+    AppendVarint(buffer, value);
+    return true;
+}
+
+int WriteSectorsBinaryFile(MESSAGE& Message, const std::string& filename, sectors_range_source& runTargets, unsigned int sectorSize)
+{
+    SECTORS_BINARY_HEADER header;
+    std::vector<unsigned char> buffer;
+    unsigned __int64 nextSector = 0;
+    sectors_range range(0, 0);
+    LARGE_INTEGER zero;
+    HANDLE file;
+    DWORD bytesWritten;
+    bool ok;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Signature, SECTORS_BINARY_SIGNATURE, sizeof(header.Signature));
+    header.Version = SECTORS_BINARY_VERSION;
+    header.SectorSize = sectorSize;
+
+    Message.Out("Writing ", filename, "...");
+
+    file = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, NULL,
+                       CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        Message.Out("Failed to create binary file with sectors list.");
+        return 1;
+    }
+
+    // The header is written again once the runs are known.
+    ok = WriteFile(file, &header, sizeof(header), &bytesWritten, NULL) && bytesWritten == sizeof(header);
+
+    buffer.reserve(SECTORS_BINARY_BUFFER_SIZE);
+
+    while (ok && runTargets.next(range))
+    {
+        ok = WriteVarint(file, buffer, range.firstSector - nextSector, &header.DataLength, &header.DataChecksum)
+             && WriteVarint(file, buffer, range.lastSector - range.firstSector + 1, &header.DataLength, &header.DataChecksum);
+
+        nextSector = range.lastSector + 1;
+        header.RunCount++;
+    }
+
+    if (ok && runTargets.failed())
+    {
+        CloseHandle(file);
+        DeleteFileA(filename.c_str());
+        Message.Out("Cannot read a temporary file while sorting the sectors list.");
+        return 1;
+    }
+
+    if (ok && !buffer.empty())
+    {
+        ok = WriteFile(file, &buffer[0], (DWORD)buffer.size(), &bytesWritten, NULL) && bytesWritten == buffer.size();
+        header.DataChecksum = UpdateCrc32(header.DataChecksum, &buffer[0], buffer.size());
+        header.DataLength += buffer.size();
+    }
+
+    header.HeaderChecksum = ComputeHeaderChecksum(header);
+    zero.QuadPart = 0;
+
+    ok = ok
+         && SetFilePointerEx(file, zero, NULL, FILE_BEGIN)
+         && WriteFile(file, &header, sizeof(header), &bytesWritten, NULL) && bytesWritten == sizeof(header);
+
+    CloseHandle(file);
+
+    if (!ok)
+    {
+        DeleteFileA(filename.c_str());
+        Message.Out("Failed to write binary file with sectors list.");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+
+class SectorsRangeSorter;
+
+// Reads a file with one sector number, or a first and last sector
+// number, per line, and adds the ranges to runTargets.  Returns 0 on
+// success; on failure the reason, including the offending line, has
+// been reported through Message.
+int ParseSectorsFile(MESSAGE& Message, const std::string& filename, SectorsRangeSorter& runTargets);
+
+// Binary sector list, as read by /B:BIN.
+//
+// The header is followed by DataLength bytes of runs, sorted and with no
+// two runs touching or overlapping.  Each run is a pair of unsigned
+// LEB128 varints: the number of sectors between the end of the previous
+// run (or sector 0) and the first sector of the run, then the number of
+// sectors in the run.  Each varint takes as few bytes as its value
+// needs; a longer encoding is rejected.  All fields are little-endian.
+
+#define SECTORS_BINARY_SIGNATURE    "NMBSECTS"
+#define SECTORS_BINARY_VERSION      1
+
+struct SECTORS_BINARY_HEADER
+{
+    char                Signature[8];       // SECTORS_BINARY_SIGNATURE
+    unsigned int        Version;            // SECTORS_BINARY_VERSION
+    unsigned int        SectorSize;         // bytes per sector, 0 if unknown
+    unsigned __int64    RunCount;
+    unsigned __int64    DataLength;         // bytes of runs after the header
+    unsigned int        DataChecksum;       // CRC-32 of the runs
+    unsigned int        HeaderChecksum;     // CRC-32 of the header, with this field zero
+};
+
+// Reads a binary sector list and adds the ranges to runTargets.  On
+// success *sectorSize receives the sector size recorded in the file.
+// Returns 0 on success.
+int ParseSectorsBinaryFile(MESSAGE& Message, const std::string& filename, SectorsRangeSorter& runTargets, unsigned int* sectorSize);
+
+// Writes the ranges read from runTargets as a binary sector list.
+// Returns 0 on success.
+int WriteSectorsBinaryFile(MESSAGE& Message, const std::string& filename, sectors_range_source& runTargets, unsigned int sectorSize);
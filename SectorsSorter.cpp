@@ -0,0 +1,760 @@
+// SectorsSorter.cpp : Sorting and joining of sector ranges within a
+// memory budget, spilling sorted runs to temporary files.
+
+#include "stdafx.h"
+
+#include <queue>
+#include <algorithm>
+
+#include "common.h"
+
+#include "SectorsSorter.h"
+
+#define SECTORS_SORTER_DEFAULT_BUDGET   ((size_t)256 * 1024 * 1024)
+#define SECTORS_SORTER_MIN_BUDGET       ((size_t)1024 * 1024)
+
+// Each run being merged gets a read buffer of at least this size, which
+// bounds how many runs are merged at once.
+#define SECTORS_SORTER_MIN_READ_BUFFER  ((size_t)64 * 1024)
+#define SECTORS_SORTER_MAX_FAN_IN       256
+
+// Runs are written through a buffer of this size.
+#define SECTORS_SORTER_WRITE_BUFFER     ((size_t)1024 * 1024)
+
+// Arrays shorter than this are sorted with std::sort.
+#define SECTORS_RADIX_MIN_SIZE          4096
+
+// Each sorting thread gets at least this many ranges.
+#define SECTORS_RADIX_MIN_PER_THREAD    (256 * 1024)
+#define SECTORS_RADIX_MAX_THREADS       16
+
+// Joins range into the last range of a sorted sequence if they touch or
+// overlap.  Returns false if range starts a new one.
+static inline bool JoinRange(sectors_range& last, const sectors_range& range)
+{
+    if (last.contains(range.firstSector) || last.lastSector + 1 == range.firstSector)
+    {
+        if (!last.contains(range.lastSector))
+        {
+            last.lastSector = range.lastSector;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Joins the sorted ranges [source, source + count) into destination,
+// which may be the same array.  Returns the number of ranges written.
+static size_t JoinSortedRanges(const sectors_range* source, size_t count, sectors_range* destination)
+{
+    size_t last = 0;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    destination[0] = source[0];
+
+    for (size_t i = 1; i < count; i++)
+    {
+        if (!JoinRange(destination[last], source[i]))
+        {
+            destination[++last] = source[i];
+        }
+    }
+
+    return last + 1;
+}
+
+enum RADIX_TASK_KIND
+{
+    RadixTaskKeyBits,
+    RadixTaskHistogram,
+    RadixTaskScatter,
+    RadixTaskScatterJoin
+};
+
+// One thread's share of a radix sort pass: the slice [begin, end) of
+// the source array.
+struct RADIX_TASK
+{
+    RADIX_TASK_KIND kind;
+    const sectors_range* source;
+    sectors_range* destination;
+    size_t begin;
+    size_t end;
+    unsigned shift;
+
+    // Histogram of the digit in the slice, then where the scatter
+    // puts the next range with each digit.
+    size_t counts[256];
+
+    // In the last pass, where the ranges of the slice with each digit
+    // begin in the destination.
+    size_t starts[256];
+
+    // AND and OR of every key in the slice.
+    unsigned __int64 keyAnd;
+    unsigned __int64 keyOr;
+};
+
+static void RunRadixTask(RADIX_TASK* task)
+{
+    const sectors_range* source = task->source;
+    size_t i;
+
+    switch (task->kind)
+    {
+    case RadixTaskKeyBits:
+        task->keyAnd = (unsigned __int64)-1;
+        task->keyOr = 0;
+
+        for (i = task->begin; i < task->end; i++)
+        {
+            task->keyAnd &= source[i].firstSector;
+            task->keyOr |= source[i].firstSector;
+        }
+        break;
+
+    case RadixTaskHistogram:
+        memset(task->counts, 0, sizeof(task->counts));
+
+        for (i = task->begin; i < task->end; i++)
+        {
+            task->counts[(source[i].firstSector >> task->shift) & 0xFF]++;
+        }
+        break;
+
+    case RadixTaskScatter:
+        for (i = task->begin; i < task->end; i++)
+        {
+            task->destination[task->counts[(source[i].firstSector >> task->shift) & 0xFF]++] = source[i];
+        }
+        break;
+
+    case RadixTaskScatterJoin:
+        // The ranges of the slice with one digit come out in their final
+        // order, into a block of their own, so each is joined with the
+        // one before it in the block as it is scattered.
+        for (i = task->begin; i < task->end; i++)
+        {
+            size_t digit = (source[i].firstSector >> task->shift) & 0xFF;
+            size_t& next = task->counts[digit];
+
+            if (next == task->starts[digit] || !JoinRange(task->destination[next - 1], source[i]))
+            {
+                task->destination[next++] = source[i];
+            }
+        }
+        break;
+    }
+}
+
+static DWORD WINAPI RadixTaskThread(LPVOID parameter)
+{
+    RunRadixTask((RADIX_TASK*)parameter);
+    return 0;
+}
+
+// Runs the tasks, one per thread, and waits for all of them.
+static void RunRadixTasks(RADIX_TASK* tasks, unsigned taskCount)
+{
+    HANDLE threads[SECTORS_RADIX_MAX_THREADS];
+    unsigned i;
+
+    for (i = 1; i < taskCount; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, RadixTaskThread, &tasks[i], 0, NULL);
+
+        if (threads[i] == NULL)
+        {
+            RunRadixTask(&tasks[i]);
+        }
+    }
+
+    RunRadixTask(&tasks[0]);
+
+    for (i = 1; i < taskCount; i++)
+    {
+        if (threads[i] != NULL)
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+    }
+}
+
+void SortAndJoinRanges(std::vector<sectors_range>& ranges, unsigned threadCount)
+{
+    RADIX_TASK tasks[SECTORS_RADIX_MAX_THREADS];
+    std::vector<sectors_range> scratch;
+    sectors_range* source;
+    sectors_range* destination;
+    unsigned __int64 keyAnd, keyOr, varying;
+    size_t count = ranges.size();
+    size_t digit, offset, joined, blockCount, j;
+    const sectors_range* block;
+    unsigned i, shift, lastShift;
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    if (count < SECTORS_RADIX_MIN_SIZE)
+    {
+        std::sort(ranges.begin(), ranges.end());
+        ranges.resize(JoinSortedRanges(&ranges[0], count, &ranges[0]), sectors_range(0, 0));
+        return;
+    }
+
+    // An LSD radix sort on firstSector, one byte per pass.  Ranges with
+    // the same firstSector may end up in any order; joining them gives
+    // the same result either way.  The last pass joins the ranges as it
+    // scatters them.
+
+    if (threadCount == 0)
+    {
+        SYSTEM_INFO info;
+
+        GetSystemInfo(&info);
+        threadCount = info.dwNumberOfProcessors;
+    }
+
+    threadCount = (unsigned)min((size_t)min(threadCount, (unsigned)SECTORS_RADIX_MAX_THREADS), count / SECTORS_RADIX_MIN_PER_THREAD);
+    threadCount = max(threadCount, 1u);
+
+    scratch.resize(count, sectors_range(0, 0));
+
+    source = &ranges[0];
+    destination = &scratch[0];
+
+    for (i = 0; i < threadCount; i++)
+    {
+        tasks[i].begin = count / threadCount * i;
+        tasks[i].end = (i + 1 == threadCount) ? count : count / threadCount * (i + 1);
+        tasks[i].kind = RadixTaskKeyBits;
+        tasks[i].source = source;
+    }
+
+    RunRadixTasks(tasks, threadCount);
+
+    keyAnd = (unsigned __int64)-1;
+    keyOr = 0;
+
+    for (i = 0; i < threadCount; i++)
+    {
+        keyAnd &= tasks[i].keyAnd;
+        keyOr |= tasks[i].keyOr;
+    }
+
+    // Skip bytes that are the same in every key, such as the high
+    // bytes, which are zero on all but the largest disks.
+    varying = keyAnd ^ keyOr;
+
+    if (varying == 0)
+    {
+        // Every range starts at the same sector.
+        ranges.resize(JoinSortedRanges(&ranges[0], count, &ranges[0]), sectors_range(0, 0));
+        return;
+    }
+
+    lastShift = 0;
+
+    for (shift = 0; shift < 64; shift += 8)
+    {
+        if ((varying >> shift) & 0xFF)
+        {
+            lastShift = shift;
+        }
+    }
+
+    for (shift = 0; shift <= lastShift; shift += 8)
+    {
+        if (((varying >> shift) & 0xFF) == 0)
+        {
+            continue;
+        }
+
+        for (i = 0; i < threadCount; i++)
+        {
+            tasks[i].kind = RadixTaskHistogram;
+            tasks[i].source = source;
+            tasks[i].destination = destination;
+            tasks[i].shift = shift;
+        }
+
+        RunRadixTasks(tasks, threadCount);
+
+        // Thread i scatters the ranges with each digit after those
+        // with the same digit from threads before it, which keeps
+        // the sort stable.
+        offset = 0;
+
+        for (digit = 0; digit < 256; digit++)
+        {
+            for (i = 0; i < threadCount; i++)
+            {
+                size_t digitCount = tasks[i].counts[digit];
+
+                tasks[i].counts[digit] = offset;
+                offset += digitCount;
+            }
+        }
+
+        for (i = 0; i < threadCount; i++)
+        {
+            tasks[i].kind = RadixTaskScatter;
+
+            if (shift == lastShift)
+            {
+                tasks[i].kind = RadixTaskScatterJoin;
+                memcpy(tasks[i].starts, tasks[i].counts, sizeof(tasks[i].starts));
+            }
+        }
+
+        RunRadixTasks(tasks, threadCount);
+
+        std::swap(source, destination);
+    }
+
+    // The last pass left a joined block for each digit and thread, in
+    // order, with gaps between them.  Close the gaps, moving the blocks
+    // into the caller's vector if they are in the scratch array, and
+    // join the ranges at the start of each block to the one before it.
+    // A block's ranges do not touch one another, so once one of them
+    // stays separate, the rest of the block does too.
+    joined = 0;
+
+    for (digit = 0; digit < 256; digit++)
+    {
+        for (i = 0; i < threadCount; i++)
+        {
+            block = source + tasks[i].starts[digit];
+            blockCount = tasks[i].counts[digit] - tasks[i].starts[digit];
+            j = 0;
+
+            while (joined != 0 && j < blockCount && JoinRange(ranges[joined - 1], block[j]))
+            {
+                j++;
+            }
+
+            if (j < blockCount)
+            {
+                memmove(&ranges[joined], block + j, (blockCount - j) * sizeof(sectors_range));
+                joined += blockCount - j;
+            }
+        }
+    }
+
+    ranges.resize(joined, sectors_range(0, 0));
+}
+
+static HANDLE CreateRunFile()
+{
+    char path[MAX_PATH];
+    char name[MAX_PATH];
+    DWORD length;
+
+    length = GetTempPathA(MAX_PATH, path);
+
+    if (length == 0 || length >= MAX_PATH || GetTempFileNameA(path, "NMB", 0, name) == 0)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+}
+
+static bool WriteRanges(HANDLE file, const sectors_range* ranges, size_t count)
+{
+    DWORD bytesWritten;
+
+    while (count != 0)
+    {
+        size_t chunk = min(count, SECTORS_SORTER_WRITE_BUFFER / sizeof(sectors_range));
+        DWORD length = (DWORD)(chunk * sizeof(sectors_range));
+
+        if (!WriteFile(file, ranges, length, &bytesWritten, NULL) || bytesWritten != length)
+        {
+            return false;
+        }
+
+        ranges += chunk;
+        count -= chunk;
+    }
+
+    return true;
+}
+
+static bool RewindRunFile(HANDLE file)
+{
+    LARGE_INTEGER zero;
+
+    zero.QuadPart = 0;
+    return SetFilePointerEx(file, zero, NULL, FILE_BEGIN) != 0;
+}
+
+// Reads one sorted run back through a buffer.
+class SectorsRunReader
+{
+public:
+    SectorsRunReader(const SectorsRunFile& run, size_t bufferEntries)
+        : _file(run.file), _remaining(run.count),
+          _buffer(max(bufferEntries, (size_t)1), sectors_range(0, 0)),
+          _next(0), _end(0), _failed(false)
+    {
+    }
+
+    bool Read(sectors_range& range)
+    {
+        if (_next == _end)
+        {
+            DWORD bytesRead;
+            size_t chunk = (size_t)min((unsigned __int64)_buffer.size(), _remaining);
+            DWORD length = (DWORD)(chunk * sizeof(sectors_range));
+
+            if (chunk == 0)
+            {
+                return false;
+            }
+
+            if (!ReadFile(_file, &_buffer[0], length, &bytesRead, NULL) || bytesRead != length)
+            {
+                _failed = true;
+                return false;
+            }
+
+            _next = 0;
+            _end = chunk;
+            _remaining -= chunk;
+        }
+
+        range = _buffer[_next++];
+        return true;
+    }
+
+    bool Failed() const
+    {
+        return _failed;
+    }
+
+private:
+    HANDLE _file;
+    unsigned __int64 _remaining;
+    std::vector<sectors_range> _buffer;
+    size_t _next;
+    size_t _end;
+    bool _failed;
+};
+
+// Merges sorted runs into one sorted, joined sequence.
+class SectorsRunMerger
+{
+public:
+    SectorsRunMerger(const SectorsRunFile* runs, size_t runCount, size_t bufferEntries)
+        : _pending(0, 0), _havePending(false), _failed(false)
+    {
+        for (size_t i = 0; i < runCount; i++)
+        {
+            _readers.push_back(new SectorsRunReader(runs[i], bufferEntries));
+            Fetch(i);
+        }
+    }
+
+    ~SectorsRunMerger()
+    {
+        for (size_t i = 0; i < _readers.size(); i++)
+        {
+            delete _readers[i];
+        }
+    }
+
+    bool Next(sectors_range& range)
+    {
+        while (!_heap.empty() && !_failed)
+        {
+            Entry top = _heap.top();
+
+            _heap.pop();
+            Fetch(top.reader);
+
+            if (!_havePending)
+            {
+                _pending = top.range;
+                _havePending = true;
+            }
+            else if (!JoinRange(_pending, top.range))
+            {
+                range = _pending;
+                _pending = top.range;
+                return true;
+            }
+        }
+
+        if (_havePending && !_failed)
+        {
+            range = _pending;
+            _havePending = false;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool Failed() const
+    {
+        return _failed;
+    }
+
+private:
+    void Fetch(size_t reader)
+    {
+        Entry entry(reader);
+
+        if (_readers[reader]->Read(entry.range))
+        {
+            _heap.push(entry);
+        }
+        else if (_readers[reader]->Failed())
+        {
+            _failed = true;
+        }
+    }
+
+    struct Entry
+    {
+        Entry(size_t reader) : range(0, 0), reader(reader) {}
+
+        sectors_range range;
+        size_t reader;
+
+        bool operator<(const Entry& another) const
+        {
+            // std::priority_queue pops the greatest element first.
+            return another.range < range;
+        }
+    };
+
+    std::vector<SectorsRunReader*> _readers;
+    std::priority_queue<Entry> _heap;
+    sectors_range _pending;
+    bool _havePending;
+    bool _failed;
+};
+
+SectorsRangeSorter::SectorsRangeSorter()
+    : _bufferNext(0), _added(0), _spilledRuns(0), _merger(NULL), _failed(false)
+{
+    SetMemoryBudget(SECTORS_SORTER_DEFAULT_BUDGET);
+}
+
+SectorsRangeSorter::~SectorsRangeSorter()
+{
+    CloseRuns();
+}
+
+void SectorsRangeSorter::SetMemoryBudget(size_t bytes)
+{
+    _memoryBudget = max(bytes, SECTORS_SORTER_MIN_BUDGET);
+    // Half the budget is kept for the scratch array of the sort.
+    _bufferLimit = _memoryBudget / 2 / sizeof(sectors_range);
+}
+
+bool SectorsRangeSorter::Add(const sectors_range& range)
+{
+    _added++;
+
+    // Ranges often arrive in order; join them on the way in.
+    if (!_buffer.empty() && _buffer.back() < range && JoinRange(_buffer.back(), range))
+    {
+        return true;
+    }
+
+    if (_buffer.size() == _bufferLimit)
+    {
+        // Sorting and joining may be enough to make room.  Otherwise
+        // write the buffer out as a run.
+        SortAndJoinRanges(_buffer, 0);
+
+        if (_buffer.size() > _bufferLimit / 2 && !Spill())
+        {
+            return false;
+        }
+    }
+
+    // The buffer grows by hand, so that its capacity never goes past
+    // the limit as push_back's doubling would take it.
+    if (_buffer.size() == _buffer.capacity())
+    {
+        _buffer.reserve(_buffer.capacity() == 0 ? min(_bufferLimit, (size_t)64 * 1024)
+                                                : min(_bufferLimit, _buffer.capacity() * 2));
+    }
+
+    _buffer.push_back(range);
+    return true;
+}
+
+bool SectorsRangeSorter::Spill()
+{
+    SectorsRunFile run;
+
+    run.file = CreateRunFile();
+    run.count = _buffer.size();
+
+    if (run.file == INVALID_HANDLE_VALUE)
+    {
+        _failed = true;
+        return false;
+    }
+
+    _runs.push_back(run);
+
+    if (!WriteRanges(run.file, &_buffer[0], _buffer.size()) || !RewindRunFile(run.file))
+    {
+        _failed = true;
+        return false;
+    }
+
+    _spilledRuns++;
+    _buffer.clear();
+    return true;
+}
+
+bool SectorsRangeSorter::Finish()
+{
+    size_t fanIn;
+
+    SortAndJoinRanges(_buffer, 0);
+
+    if (_runs.empty())
+    {
+        // Everything fitted in memory.
+        return true;
+    }
+
+    if (!_buffer.empty() && !Spill())
+    {
+        return false;
+    }
+
+    std::vector<sectors_range>().swap(_buffer);
+
+    // Merge groups of runs into longer runs until every run can be
+    // given a read buffer of reasonable size.
+    fanIn = min(max(_memoryBudget / SECTORS_SORTER_MIN_READ_BUFFER, (size_t)2), (size_t)SECTORS_SORTER_MAX_FAN_IN);
+
+    while (_runs.size() > fanIn)
+    {
+        SectorsRunFile run;
+        std::vector<sectors_range> output;
+        sectors_range range(0, 0);
+        size_t outputLimit = _memoryBudget / 2 / sizeof(sectors_range);
+        size_t i;
+        bool ok;
+
+        run.file = CreateRunFile();
+        run.count = 0;
+
+        if (run.file == INVALID_HANDLE_VALUE)
+        {
+            _failed = true;
+            return false;
+        }
+
+        {
+            SectorsRunMerger merger(&_runs[0], fanIn, _memoryBudget / 2 / fanIn / sizeof(sectors_range));
+
+            output.reserve(outputLimit);
+            ok = true;
+
+            while (ok && merger.Next(range))
+            {
+                output.push_back(range);
+                run.count++;
+
+                if (output.size() == outputLimit)
+                {
+                    ok = WriteRanges(run.file, &output[0], output.size());
+                    output.clear();
+                }
+            }
+
+            ok = ok && !merger.Failed()
+                 && (output.empty() || WriteRanges(run.file, &output[0], output.size()))
+                 && RewindRunFile(run.file);
+        }
+
+        for (i = 0; i < fanIn; i++)
+        {
+            CloseHandle(_runs[i].file);
+        }
+
+        _runs.erase(_runs.begin(), _runs.begin() + fanIn);
+        _runs.push_back(run);
+
+        if (!ok)
+        {
+            _failed = true;
+            return false;
+        }
+    }
+
+    _merger = new SectorsRunMerger(&_runs[0], _runs.size(), _memoryBudget / _runs.size() / sizeof(sectors_range));
+
+    if (_merger->Failed())
+    {
+        _failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+bool SectorsRangeSorter::read(sectors_range& range)
+{
+    if (_failed)
+    {
+        return false;
+    }
+
+    if (_merger == NULL)
+    {
+        if (_bufferNext == _buffer.size())
+        {
+            return false;
+        }
+
+        range = _buffer[_bufferNext++];
+        return true;
+    }
+
+    if (!_merger->Next(range))
+    {
+        _failed = _merger->Failed();
+        return false;
+    }
+
+    return true;
+}
+
+bool SectorsRangeSorter::failed() const
+{
+    return _failed;
+}
+
+void SectorsRangeSorter::CloseRuns()
+{
+    delete _merger;
+    _merger = NULL;
+
+    for (size_t i = 0; i < _runs.size(); i++)
+    {
+        CloseHandle(_runs[i].file);
+    }
+
+    _runs.clear();
+}
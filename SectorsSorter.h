@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+
+#include "common.h"
+
+// Sorts ranges and joins the ones that touch or overlap, in place.
+// Large arrays are radix sorted on up to threadCount threads, or one per
+// processor if threadCount is 0, and need a scratch array of the same
+// size.
+void SortAndJoinRanges(std::vector<sectors_range>& ranges, unsigned threadCount);
+
+class SectorsRunMerger;
+
+// A sorted run of ranges in a temporary file.
+struct SectorsRunFile
+{
+    HANDLE file;
+    unsigned __int64 count;
+};
+
+// Collects sector ranges in any order and hands them out sorted and
+// joined, using no more than a fixed amount of memory.
+//
+// Ranges are gathered in a buffer.  Each time it fills up it is sorted
+// and joined; if that does not free enough room, it is written out as a
+// sorted run to a temporary file.  Finish merges the runs, and the
+// merged ranges are then read back from all of them at once, so the
+// whole list is never held in memory.
+class SectorsRangeSorter : public sectors_range_source
+{
+public:
+    SectorsRangeSorter();
+    ~SectorsRangeSorter();
+
+    // Must be called before the first Add.
+    void SetMemoryBudget(size_t bytes);
+
+    size_t QueryMemoryBudget() const
+    {
+        return _memoryBudget;
+    }
+
+    // Returns false if a temporary file cannot be written.
+    bool Add(const sectors_range& range);
+
+    // Called after the last Add, before the ranges are read.  Returns
+    // false if a temporary file cannot be written or read.
+    bool Finish();
+
+    // The number of ranges passed to Add.
+    unsigned __int64 QueryAdded() const
+    {
+        return _added;
+    }
+
+    // The number of sorted runs written to temporary files.
+    size_t QuerySpilledRuns() const
+    {
+        return _spilledRuns;
+    }
+
+    bool failed() const;
+
+protected:
+    bool read(sectors_range& range);
+
+private:
+    bool Spill();
+    void CloseRuns();
+
+    size_t _memoryBudget;
+    size_t _bufferLimit;
+    std::vector<sectors_range> _buffer;
+    size_t _bufferNext;
+    unsigned __int64 _added;
+    size_t _spilledRuns;
+
+    std::vector<SectorsRunFile> _runs;
+    SectorsRunMerger* _merger;
+    bool _failed;
+
+    // Not copyable.
+    SectorsRangeSorter(const SectorsRangeSorter&);
+    SectorsRangeSorter& operator=(const SectorsRangeSorter&);
+};
@@ -0,0 +1,523 @@
+// ServiceMode.cpp : Service mode.  The volume is opened and its metadata
+// loaded once; clients send batches of sectors over a named pipe, and
+// the requests that arrive close together are committed as one.
+
+#include "stdafx.h"
+
+#include <sstream>
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "ntfsvol.hxx"
+#include "undojrnl.hxx"
+
+#include "TextUtils.h"
+#include "SectorsSorter.h"
+#include "ServiceMode.h"
+#include "MarkVolume.h"
+
+// The largest request a client may send.
+#define SERVICE_MAX_REQUEST (16 * 1024 * 1024)
+
+#define SERVICE_PIPE_BUFFER_SIZE 4096
+
+// A batch is closed once no request has arrived for this long, or once
+// the window has passed since its first request.
+#define SERVICE_QUIET_MILLISECONDS 10
+
+// Hands out the ranges of a sorted and joined vector.
+class SectorsVectorSource : public sectors_range_source
+{
+public:
+    explicit SectorsVectorSource(const std::vector<sectors_range>& ranges)
+        : _ranges(ranges), _next(0)
+    {
+    }
+
+protected:
+    bool read(sectors_range& range)
+    {
+        if (_next == _ranges.size())
+        {
+            return false;
+        }
+
+        range = _ranges[_next++];
+        return true;
+    }
+
+private:
+    const std::vector<sectors_range>& _ranges;
+    size_t _next;
+};
+
+struct SERVICE_REQUEST
+{
+    std::vector<sectors_range> ranges;
+    bool stop;
+    NTFS_MARK_COUNTS counts;
+    const char* error;      // set if the request failed
+    HANDLE done;            // set when the request has been processed
+};
+
+struct SERVICE_CONTEXT
+{
+    std::string pipePath;
+    HANDLE firstPipe;       // created before the listener starts
+    CRITICAL_SECTION lock;
+    HANDLE queued;          // set when a request is queued
+    std::vector<SERVICE_REQUEST*> queue;
+    bool stopping;
+    volatile LONG clients;  // client threads still running
+};
+
+struct SERVICE_CLIENT
+{
+    SERVICE_CONTEXT* context;
+    HANDLE pipe;
+};
+
+static HANDLE CreateServicePipe(const std::string& pipePath)
+{
+    DWORD mode = PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT;
+
+#ifdef PIPE_REJECT_REMOTE_CLIENTS
+    mode |= PIPE_REJECT_REMOTE_CLIENTS;
+#endif
+
+    return CreateNamedPipeA(pipePath.c_str(), PIPE_ACCESS_DUPLEX, mode, PIPE_UNLIMITED_INSTANCES,
+                            SERVICE_PIPE_BUFFER_SIZE, SERVICE_PIPE_BUFFER_SIZE, 0, NULL);
+}
+
+// Reads one message from a client.
+static bool ReadRequest(HANDLE pipe, std::string& text)
+{
+    char buffer[SERVICE_PIPE_BUFFER_SIZE];
+    DWORD bytesRead;
+
+    for (;;)
+    {
+        if (ReadFile(pipe, buffer, sizeof(buffer), &bytesRead, NULL))
+        {
+            text.append(buffer, bytesRead);
+            return true;
+        }
+
+        if (GetLastError() != ERROR_MORE_DATA)
+        {
+            return false;
+        }
+
+        text.append(buffer, bytesRead);
+
+        if (text.size() > SERVICE_MAX_REQUEST)
+        {
+            return false;
+        }
+    }
+}
+
+// Returns NULL if the request is valid, or why it is not.
+static const char* ParseRequest(const std::string& text, SERVICE_REQUEST& request)
+{
+    std::vector<std::string> lines = split(text, "\r\n");
+    size_t i;
+
+    if (lines.size() == 1)
+    {
+        std::string line = lines[0];
+
+        if (str_toupper(trim(line)) == "STOP")
+        {
+            request.stop = true;
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < lines.size(); i++)
+    {
+        std::vector<std::string> parts = split(lines[i], " \t");
+        __int64 firstSector, lastSector;
+
+        if (parts.empty())
+        {
+            continue;
+        }
+
+        if (parts.size() > 2)
+        {
+            return "invalid line";
+        }
+
+        firstSector = parse_int64(parts[0]);
+        lastSector = parts.size() == 2 ? parse_int64(parts[1]) : firstSector;
+
+        if (firstSector < 0 || lastSector < firstSector)
+        {
+            return "invalid sector number";
+        }
+
+        request.ranges.push_back(sectors_range(firstSector, lastSector));
+    }
+
+    if (request.ranges.empty())
+    {
+        return "no sectors";
+    }
+
+    SortAndJoinRanges(request.ranges, 1);
+    return NULL;
+}
+
+// Reads a client's request, queues it for the service thread, and
+// writes the reply once it has been processed.
+static DWORD WINAPI ServiceClientThread(LPVOID parameter)
+{
+    SERVICE_CLIENT* client = (SERVICE_CLIENT*)parameter;
+    SERVICE_CONTEXT* context = client->context;
+    SERVICE_REQUEST request;
+    std::string text;
+    std::ostringstream reply;
+    std::string replyText;
+    DWORD bytesWritten;
+    bool queued = false;
+
+    request.stop = false;
+    request.error = NULL;
+    request.done = NULL;
+
+    if (!ReadRequest(client->pipe, text))
+    {
+        request.error = "cannot read the request";
+    }
+    else
+    {
+        request.error = ParseRequest(text, request);
+    }
+
+    if (request.error == NULL && (request.done = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+    {
+        request.error = "out of resources";
+    }
+
+    if (request.error == NULL)
+    {
+        EnterCriticalSection(&context->lock);
+
+        if (context->stopping)
+        {
+            request.error = "the service is stopping";
+        }
+        else
+        {
+            context->queue.push_back(&request);
+            SetEvent(context->queued);
+            queued = true;
+        }
+
+        LeaveCriticalSection(&context->lock);
+    }
+
+    if (queued)
+    {
+        WaitForSingleObject(request.done, INFINITE);
+    }
+
+    if (request.error != NULL)
+    {
+        reply << "ERROR " << request.error;
+    }
+    else if (request.stop)
+    {
+        reply << "OK";
+    }
+    else
+    {
+        reply << "OK " << request.counts.Marked << " " << request.counts.AlreadyBad << " " << request.counts.InUse;
+    }
+
+    replyText = reply.str();
+
+    WriteFile(client->pipe, replyText.c_str(), (DWORD)replyText.size(), &bytesWritten, NULL);
+    FlushFileBuffers(client->pipe);
+    DisconnectNamedPipe(client->pipe);
+    CloseHandle(client->pipe);
+
+    if (request.done != NULL)
+    {
+        CloseHandle(request.done);
+    }
+
+    delete client;
+
+    InterlockedDecrement(&context->clients);
+    return 0;
+}
+
+// Accepts clients, one thread each, until the service stops.
+static DWORD WINAPI ServiceListenerThread(LPVOID parameter)
+{
+    SERVICE_CONTEXT* context = (SERVICE_CONTEXT*)parameter;
+    HANDLE pipe = context->firstPipe;
+    bool stopping;
+
+    for (;;)
+    {
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            pipe = CreateServicePipe(context->pipePath);
+
+            if (pipe == INVALID_HANDLE_VALUE)
+            {
+                Sleep(100);
+                continue;
+            }
+        }
+
+        if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+        {
+            CloseHandle(pipe);
+            pipe = INVALID_HANDLE_VALUE;
+            continue;
+        }
+
+        EnterCriticalSection(&context->lock);
+        stopping = context->stopping;
+        LeaveCriticalSection(&context->lock);
+
+        if (stopping)
+        {
+            CloseHandle(pipe);
+            return 0;
+        }
+
+        SERVICE_CLIENT* client = new SERVICE_CLIENT;
+        HANDLE thread;
+
+        client->context = context;
+        client->pipe = pipe;
+        pipe = INVALID_HANDLE_VALUE;
+
+        InterlockedIncrement(&context->clients);
+
+        thread = CreateThread(NULL, 0, ServiceClientThread, client, 0, NULL);
+
+        if (thread == NULL)
+        {
+            ServiceClientThread(client);
+        }
+        else
+        {
+            CloseHandle(thread);
+        }
+    }
+}
+
+int RunMarkService(MESSAGE& Message, NTFS_VOL& NtfsVol, const std::string& pipeName,
+                   const std::string& undoJournalFile, const std::string& snapshotFile,
+                   unsigned int windowMilliseconds)
+{
+    PNTFS_SA NtfsSa = NtfsVol.GetNtfsSa();
+    UNDO_JOURNAL UndoJournal;
+    DSTRING UndoJournalName;
+    NTFS_SNAPSHOT Snapshot;
+    DSTRING SnapshotName;
+    SERVICE_CONTEXT context;
+    std::vector<SERVICE_REQUEST*> batch;
+    HANDLE listener;
+    bool stop = false;
+    int result = 0;
+    size_t i;
+
+    if (!UndoJournalName.Initialize(undoJournalFile.c_str()) ||
+        !UndoJournal.Initialize(&UndoJournalName, NtfsSa->QuerySerialNumber()) ||
+        (!snapshotFile.empty() &&
+         (!SnapshotName.Initialize(snapshotFile.c_str()) || !Snapshot.Initialize(&SnapshotName))))
+    {
+        Message.Out("Out of memory.");
+        return 1;
+    }
+
+    context.pipePath = "\\\\.\\pipe\\" + pipeName;
+    context.stopping = false;
+    context.clients = 0;
+
+    context.firstPipe = CreateServicePipe(context.pipePath);
+
+    if (context.firstPipe == INVALID_HANDLE_VALUE)
+    {
+        Message.Out("Cannot create the pipe ", context.pipePath, ".");
+        return 1;
+    }
+
+    context.queued = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if (context.queued == NULL)
+    {
+        CloseHandle(context.firstPipe);
+        Message.Out("Out of memory.");
+        return 1;
+    }
+
+    InitializeCriticalSection(&context.lock);
+
+    // Load the metadata once, for the whole session.
+
+    NtfsVol.SetUndoJournal(&UndoJournal);
+
+    if (!snapshotFile.empty())
+    {
+        NtfsVol.SetSnapshot(&Snapshot);
+    }
+
+    if (!NtfsSa->BeginMarking(&Message) ||
+        (listener = CreateThread(NULL, 0, ServiceListenerThread, &context, 0, NULL)) == NULL)
+    {
+        NtfsSa->EndMarking(&Message);
+        NtfsVol.SetUndoJournal(NULL);
+        NtfsVol.SetSnapshot(NULL);
+        CloseHandle(context.firstPipe);
+        CloseHandle(context.queued);
+        DeleteCriticalSection(&context.lock);
+        Message.Out("An error has occurred.");
+        return 1;
+    }
+
+    Message.Out("Undo journal: ", QueryFullPath(undoJournalFile));
+    Message.Out("Listening on ", context.pipePath, "...");
+
+    while (!stop)
+    {
+        WaitForSingleObject(context.queued, INFINITE);
+
+        // Let the requests that arrive close together join this batch,
+        // so that they share one commit: keep waiting as long as new
+        // ones keep coming, up to the window from the first one.
+
+        DWORD start = GetTickCount();
+        DWORD elapsed = 0;
+        bool failed = false;
+
+        while (elapsed < windowMilliseconds &&
+               WaitForSingleObject(context.queued,
+                                   min((DWORD)SERVICE_QUIET_MILLISECONDS, windowMilliseconds - elapsed)) == WAIT_OBJECT_0)
+        {
+            elapsed = GetTickCount() - start;
+        }
+
+        EnterCriticalSection(&context.lock);
+        batch.swap(context.queue);
+        LeaveCriticalSection(&context.lock);
+
+        for (i = 0; i < batch.size(); i++)
+        {
+            SERVICE_REQUEST* request = batch[i];
+
+            if (request->stop)
+            {
+                stop = true;
+                continue;
+            }
+
+            SectorsVectorSource source(request->ranges);
+
+            if (!NtfsSa->MarkSectors(source, &request->counts, &Message))
+            {
+                // The failed request has taken the whole batch with it:
+                // every mark since the last commit was undone.
+
+                request->error = "cannot mark the sectors";
+                failed = true;
+                break;
+            }
+        }
+
+        if (failed)
+        {
+            for (i = 0; i < batch.size(); i++)
+            {
+                if (batch[i]->stop)
+                {
+                    stop = true;
+                }
+                else if (batch[i]->error == NULL)
+                {
+                    batch[i]->error = "another request of the batch could not be marked";
+                }
+            }
+        }
+
+        // If the commit fails, the loaded metadata no longer matches
+        // the volume, so the service stops.
+
+        if (!NtfsSa->CommitMarking(&Message))
+        {
+            for (i = 0; i < batch.size(); i++)
+            {
+                if (batch[i]->error == NULL && !batch[i]->stop)
+                {
+                    batch[i]->error = "cannot write the volume metadata";
+                }
+            }
+
+            result = 1;
+            stop = true;
+        }
+
+        for (i = 0; i < batch.size(); i++)
+        {
+            SetEvent(batch[i]->done);
+        }
+
+        batch.clear();
+    }
+
+    // Turn away new requests and the ones that came in after the last
+    // batch, then wake the listener with a connection of our own so
+    // that it sees the service is stopping.
+
+    EnterCriticalSection(&context.lock);
+    context.stopping = true;
+    batch.swap(context.queue);
+    LeaveCriticalSection(&context.lock);
+
+    for (i = 0; i < batch.size(); i++)
+    {
+        batch[i]->error = "the service is stopping";
+        SetEvent(batch[i]->done);
+    }
+
+    while (WaitForSingleObject(listener, 100) == WAIT_TIMEOUT)
+    {
+        HANDLE wake = CreateFileA(context.pipePath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+
+        if (wake != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(wake);
+        }
+    }
+
+    CloseHandle(listener);
+
+    while (context.clients != 0)
+    {
+        Sleep(10);
+    }
+
+    NtfsSa->EndMarking(&Message);
+    NtfsVol.SetUndoJournal(NULL);
+    NtfsVol.SetSnapshot(NULL);
+
+    if (result == 0 && !UndoJournal.MarkComplete())
+    {
+        Message.Out("Cannot mark the undo journal complete (error ", (LONGLONG)UndoJournal.QueryWriteError(), ").");
+    }
+
+    CloseHandle(context.queued);
+    DeleteCriticalSection(&context.lock);
+
+    Message.Out(result == 0 ? "Service stopped." : "Service stopped after an error.");
+    return result;
+}
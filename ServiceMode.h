@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+DECLARE_CLASS(NTFS_VOL);
+
+// Service mode.  The volume is locked and its metadata loaded once, then
+// sectors are marked on request from clients of the named pipe
+// \\.\pipe\<pipeName> until a client asks the service to stop.
+//
+// A client connects, writes one message and reads one reply.  The
+// message holds one range per line, "<first_sector> <last_sector>" or
+// "<sector>", numbered on the physical drive as in a sectors file, or
+// just "STOP".  The reply is "OK <marked> <already_bad> <in_use>", the
+// cluster counts for that request, or "ERROR <reason>".
+//
+// Requests that arrive within windowMilliseconds of each other are
+// committed together, in one write batch.  All batches go to the same
+// undo journal, so /UNDO rolls back the whole session.  Returns 0 if
+// every commit succeeded.
+int RunMarkService(MESSAGE& Message, NTFS_VOL& NtfsVol, const std::string& pipeName,
+                   const std::string& undoJournalFile, const std::string& snapshotFile,
+                   unsigned int windowMilliseconds);
@@ -0,0 +1,107 @@
+// StatsFile.cpp : Writing the per-phase timing and I/O accounting of a
+// run as JSON, so that runs can be compared.
+
+#include "stdafx.h"
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "iostats.hxx"
+
+#include "StatsFile.h"
+
+#define STATS_FILE_VERSION 2
+
+static const char* const PhaseNames[IO_STATS_PHASES] =
+{
+    NULL, "load", "scan", "insert", "flush", "commit", "snapshot"
+};
+
+static const char* const StreamNames[IO_STATS_STREAMS] =
+{
+    "other", "mft", "bitmap", "badclus", "upcase", "mirror", "journal"
+};
+
+static void WriteCounters(FILE* file, const IO_STATS& Stats, const char* prefix,
+                          const IO_STATS_COUNTERS& counters)
+{
+    fprintf(file, "\"%ss\": %I64u, \"%s_bytes\": %I64u, \"%s_seconds\": %.6f",
+            prefix, counters.Operations, prefix, counters.Bytes, prefix, Stats.QuerySeconds(counters.Ticks));
+}
+
+int WriteStatsFile(MESSAGE& Message, const IO_STATS& Stats, const std::string& fileName,
+                   const std::string& drive)
+{
+    IO_STATS_COUNTERS reads, writes, verify;
+    FILE* file;
+    ULONG i;
+
+    file = fopen(fileName.c_str(), "wt");
+
+    if (file == NULL)
+    {
+        Message.Out("Cannot write the statistics file: ", fileName);
+        return 1;
+    }
+
+    fprintf(file, "{\n  \"version\": %d,\n  \"drive\": \"%s\",\n", STATS_FILE_VERSION, drive.c_str());
+
+    fprintf(file, "  \"phases\": {");
+    for (i = 1; i < IO_STATS_PHASES; i++)
+    {
+        fprintf(file, "%s\n    \"%s\": %.6f", i == 1 ? "" : ",", PhaseNames[i], Stats.QueryPhaseSeconds(i));
+    }
+    fprintf(file, "\n  },\n");
+
+    fprintf(file, "  \"streams\": {");
+    for (i = 0; i < IO_STATS_STREAMS; i++)
+    {
+        Stats.QueryReads(i, &reads);
+        Stats.QueryWrites(i, &writes);
+
+        fprintf(file, "%s\n    \"%s\": { ", i == 0 ? "" : ",", StreamNames[i]);
+        WriteCounters(file, Stats, "read", reads);
+        fprintf(file, ", ");
+        WriteCounters(file, Stats, "write", writes);
+        fprintf(file, " }");
+    }
+    fprintf(file, "\n  },\n");
+
+    Stats.QueryVerify(&verify);
+    fprintf(file, "  \"verify\": { \"operations\": %I64u, \"bytes\": %I64u, \"seconds\": %.6f },\n",
+            verify.Operations, verify.Bytes, Stats.QuerySeconds(verify.Ticks));
+
+    fprintf(file, "  \"skipped_file_name_updates\": %I64u,\n", Stats.QuerySkippedFileNameUpdates());
+
+    // Bucket i holds the requests that took up to 2^i microseconds; the
+    // last one has no upper bound.
+    fprintf(file, "  \"latency_us\": {\n    \"upper_bounds\": [");
+    for (i = 0; i < IO_STATS_LATENCY_BUCKETS - 1; i++)
+    {
+        fprintf(file, "%s%lu", i == 0 ? "" : ", ", 1UL << i);
+    }
+    fprintf(file, ", null],\n    \"reads\": [");
+    for (i = 0; i < IO_STATS_LATENCY_BUCKETS; i++)
+    {
+        fprintf(file, "%s%I64u", i == 0 ? "" : ", ", Stats.QueryReadLatency(i));
+    }
+    fprintf(file, "],\n    \"writes\": [");
+    for (i = 0; i < IO_STATS_LATENCY_BUCKETS; i++)
+    {
+        fprintf(file, "%s%I64u", i == 0 ? "" : ", ", Stats.QueryWriteLatency(i));
+    }
+    fprintf(file, "]\n  }\n}\n");
+
+    if (ferror(file))
+    {
+        fclose(file);
+        Message.Out("Cannot write the statistics file: ", fileName);
+        return 1;
+    }
+
+    fclose(file);
+
+    Message.Out("Statistics written to ", fileName, ".");
+    return 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+DECLARE_CLASS(IO_STATS);
+
+// Writes the timing and I/O accounting collected in Stats for a run
+// against drive to fileName, as JSON: the seconds spent in each phase,
+// the reads and writes made for each metadata stream, the cost of the
+// read-back verification, the parent index updates skipped because the
+// file names had not changed, and the latency histograms of reads and
+// writes.  Returns 0 on success.
+int WriteStatsFile(MESSAGE& Message, const IO_STATS& Stats, const std::string& fileName,
+                   const std::string& drive);
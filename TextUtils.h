@@ -76,6 +76,17 @@ inline __int64 parse_int64(const std::string& str)
     return rez;
 }
 
+// convert unsigned 64-bit integer to string
+inline std::string uint64_to_string(unsigned __int64 value)
+{
+    char text[32];
+
+    _snprintf(text, sizeof(text) - 1, "%I64u", value);
+    text[sizeof(text) - 1] = '\0';
+
+    return text;
+}
+
 inline std::vector<std::string> split(const std::string& source, const std::string& delimiters = " ")
 {
     std::size_t prev = 0;
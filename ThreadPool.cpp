@@ -0,0 +1,87 @@
+// ThreadPool.cpp : A fixed pool of threads that share a list of work items.
+
+#include "stdafx.h"
+
+#include <vector>
+
+#include "ThreadPool.h"
+
+struct WORK_POOL
+{
+    WORK_ITEM_ROUTINE routine;
+    void* context;
+    size_t itemCount;
+    volatile LONG next;
+};
+
+static void RunPoolItems(WORK_POOL* pool)
+{
+    for (;;)
+    {
+        size_t item = (size_t)(InterlockedIncrement(&pool->next) - 1);
+
+        if (item >= pool->itemCount)
+        {
+            return;
+        }
+
+        pool->routine(pool->context, item);
+    }
+}
+
+static DWORD WINAPI PoolThread(LPVOID parameter)
+{
+    RunPoolItems((WORK_POOL*)parameter);
+    return 0;
+}
+
+void RunWorkItems(unsigned int threadCount, size_t itemCount, WORK_ITEM_ROUTINE routine, void* context)
+{
+    WORK_POOL pool;
+    std::vector<HANDLE> threads;
+    size_t i;
+
+    pool.routine = routine;
+    pool.context = context;
+    pool.itemCount = itemCount;
+    pool.next = 0;
+
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+
+    if (threadCount > itemCount)
+    {
+        threadCount = (unsigned int)itemCount;
+    }
+
+    // If a thread cannot be created, the others take its share.
+
+    for (i = 1; i < threadCount; i++)
+    {
+        HANDLE thread = CreateThread(NULL, 0, PoolThread, &pool, 0, NULL);
+
+        if (thread != NULL)
+        {
+            threads.push_back(thread);
+        }
+    }
+
+    RunPoolItems(&pool);
+
+    for (i = 0; i < threads.size(); i++)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+}
+
+unsigned int QueryProcessorCount()
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+
+    return max((DWORD)1, info.dwNumberOfProcessors);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "common.h"
+
+// A work item: routine(context, item) is called once for each item.
+typedef void (*WORK_ITEM_ROUTINE)(void* context, size_t item);
+
+// Runs routine on every item in [0, itemCount) using up to threadCount
+// threads, the calling thread included.  Each thread takes the next item
+// as soon as it is done with the previous one.  Returns when every item
+// is done.
+void RunWorkItems(unsigned int threadCount, size_t itemCount, WORK_ITEM_ROUTINE routine, void* context);
+
+// The number of processors, at least 1.
+unsigned int QueryProcessorCount();
@@ -0,0 +1,337 @@
+// WholeDisk.cpp : Whole-disk mode.  Scanners report bad sectors by their
+// number on the physical disk, so one list covers every partition.  The
+// partition table is read once, the sorted list is split between the
+// NTFS partitions in a single pass, and the partitions are then marked,
+// each with its own NTFS_VOL.  They share one disk, so by default they
+// are marked one after another; more threads are only worth it on
+// storage without seeks.
+
+#include "stdafx.h"
+
+#include <algorithm>
+
+#include "common.h"
+
+#include "ulib.hxx"
+#include "message.hxx"
+#include "ifssys.hxx"
+#include "ntfsvol.hxx"
+
+#include "WholeDisk.h"
+#include "SectorsSorter.h"
+#include "MarkVolume.h"
+#include "ThreadPool.h"
+
+struct DISK_PARTITION
+{
+    ULONG number;
+    unsigned __int64 firstSector;
+    unsigned __int64 lastSector;
+
+    bool operator<(const DISK_PARTITION& another) const
+    {
+        return firstSector < another.firstSector;
+    }
+};
+
+// One NTFS partition and the part of the sectors list that falls in it.
+struct PARTITION_WORK
+{
+    DISK_PARTITION partition;
+    unsigned int diskNumber;
+    unsigned int listSectorSize;
+    std::string snapshotFile;
+    SectorsRangeSorter runTargets;
+    int result;
+};
+
+// Reads the partition table of a disk.  The partitions are returned in
+// the order they appear on the disk; containers and unused entries are
+// left out.
+static int QueryDiskLayout(MESSAGE& Message, unsigned int diskNumber, std::vector<DISK_PARTITION>& partitions, ULONG* sectorSize)
+{
+    char name[64];
+    HANDLE disk;
+    DISK_GEOMETRY geometry;
+    std::vector<BYTE> buffer(sizeof(DRIVE_LAYOUT_INFORMATION_EX) + 16 * sizeof(PARTITION_INFORMATION_EX));
+    DRIVE_LAYOUT_INFORMATION_EX* layout;
+    DWORD bytesReturned;
+    DWORD i;
+
+    sprintf(name, "\\\\.\\PhysicalDrive%u", diskNumber);
+
+    disk = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+
+    if (disk == INVALID_HANDLE_VALUE)
+    {
+        if (GetLastError() == ERROR_ACCESS_DENIED)
+        {
+            Message.Out("Access denied. Run the program as administrator.");
+        }
+        else
+        {
+            Message.Out("Cannot open disk ", (LONGLONG)diskNumber, ".");
+        }
+        return 1;
+    }
+
+    if (!DeviceIoControl(disk, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+                         &geometry, sizeof(geometry), &bytesReturned, NULL)
+        || geometry.BytesPerSector == 0)
+    {
+        CloseHandle(disk);
+        Message.Out("Cannot read the partition table of the disk.");
+        return 1;
+    }
+
+    while (!DeviceIoControl(disk, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, NULL, 0,
+                            &buffer[0], (DWORD)buffer.size(), &bytesReturned, NULL))
+    {
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+        {
+            CloseHandle(disk);
+            Message.Out("Cannot read the partition table of the disk.");
+            return 1;
+        }
+
+        buffer.resize(buffer.size() * 2);
+    }
+
+    CloseHandle(disk);
+
+    layout = (DRIVE_LAYOUT_INFORMATION_EX*)&buffer[0];
+
+    for (i = 0; i < layout->PartitionCount; i++)
+    {
+        const PARTITION_INFORMATION_EX& entry = layout->PartitionEntry[i];
+        DISK_PARTITION partition;
+
+        if (entry.PartitionNumber == 0 || entry.PartitionLength.QuadPart < geometry.BytesPerSector)
+        {
+            continue;
+        }
+
+        if (layout->PartitionStyle == PARTITION_STYLE_MBR
+            && (entry.Mbr.PartitionType == PARTITION_ENTRY_UNUSED || IsContainerPartition(entry.Mbr.PartitionType)))
+        {
+            continue;
+        }
+
+        partition.number = entry.PartitionNumber;
+        partition.firstSector = entry.StartingOffset.QuadPart / geometry.BytesPerSector;
+        partition.lastSector = partition.firstSector + entry.PartitionLength.QuadPart / geometry.BytesPerSector - 1;
+
+        partitions.push_back(partition);
+    }
+
+    std::sort(partitions.begin(), partitions.end());
+
+    *sectorSize = geometry.BytesPerSector;
+    return 0;
+}
+
+// Hands each range of the sorted list to the partitions it overlaps,
+// clipped to each of them.  Partitions do not overlap, so one pass over
+// the list and the partitions is enough.  Counts the ranges that fall
+// in no NTFS partition.
+static bool SplitTargets(sectors_range_source& runTargets, std::vector<PARTITION_WORK*>& work, unsigned __int64* outside)
+{
+    sectors_range range(0, 0);
+    size_t first = 0;
+    size_t i;
+
+    *outside = 0;
+
+    while (runTargets.next(range))
+    {
+        bool inside = false;
+
+        while (first < work.size() && work[first]->partition.lastSector < range.firstSector)
+        {
+            first++;
+        }
+
+        for (i = first; i < work.size() && work[i]->partition.firstSector <= range.lastSector; i++)
+        {
+            const DISK_PARTITION& partition = work[i]->partition;
+
+            if (!work[i]->runTargets.Add(sectors_range(max(range.firstSector, partition.firstSector),
+                                                       min(range.lastSector, partition.lastSector))))
+            {
+                return false;
+            }
+
+            inside = true;
+        }
+
+        if (!inside)
+        {
+            (*outside)++;
+        }
+    }
+
+    return !runTargets.failed();
+}
+
+static void MarkPartition(void* context, size_t item)
+{
+    PARTITION_WORK* work = (*(std::vector<PARTITION_WORK*>*)context)[item];
+    MESSAGE Message;
+    NTFS_VOL NtfsVol;
+    DSTRING NtDriveName;
+    std::string snapshotFile;
+    char text[64];
+
+    Message.Initialize();
+
+    sprintf(text, "[Partition %lu] ", work->partition.number);
+    Message.SetPrefix(text);
+
+    sprintf(text, "\\Device\\Harddisk%u\\Partition%lu", work->diskNumber, work->partition.number);
+
+    if (!NtDriveName.Initialize(text))
+    {
+        Message.Out("Out of memory.");
+        work->result = 1;
+        return;
+    }
+
+    work->result = OpenNtfsVolume(Message, &NtDriveName, text, NtfsVol);
+
+    if (work->result == 0)
+    {
+        if (!work->snapshotFile.empty())
+        {
+            sprintf(text, ".%lu", work->partition.number);
+            snapshotFile = work->snapshotFile + text;
+        }
+
+        sprintf(text, "NTFSMARKBAD_DISK%u_%lu.UNDO", work->diskNumber, work->partition.number);
+
+        work->result = MarkBadOnVolume(Message, NtfsVol, text, snapshotFile,
+                                       work->runTargets, work->listSectorSize);
+    }
+}
+
+static void FreeWork(std::vector<PARTITION_WORK*>& work)
+{
+    for (size_t i = 0; i < work.size(); i++)
+    {
+        delete work[i];
+    }
+    work.clear();
+}
+
+int MarkBadOnDisk(MESSAGE& Message, unsigned int diskNumber, SectorsRangeSorter& runTargets,
+                  unsigned int listSectorSize, const std::string& snapshotFile,
+                  unsigned int threadCount)
+{
+    std::vector<DISK_PARTITION> partitions;
+    std::vector<PARTITION_WORK*> work;
+    unsigned __int64 outside;
+    ULONG sectorSize;
+    DSTRING NtDriveName;
+    char text[64];
+    size_t i;
+    int result = 0;
+
+    if (QueryDiskLayout(Message, diskNumber, partitions, &sectorSize))
+    {
+        return 1;
+    }
+
+    if (listSectorSize != 0 && listSectorSize != sectorSize)
+    {
+        Message.Out("The sectors list was made for a drive with ", (LONGLONG)listSectorSize, "-byte sectors.");
+        return 1;
+    }
+
+    // Find the NTFS partitions.
+
+    for (i = 0; i < partitions.size(); i++)
+    {
+        BOOL FsNameIsNtfs;
+
+        sprintf(text, "\\Device\\Harddisk%u\\Partition%lu", diskNumber, partitions[i].number);
+
+        if (!NtDriveName.Initialize(text))
+        {
+            Message.Out("Out of memory.");
+            FreeWork(work);
+            return 1;
+        }
+
+        if (!IFS_SYSTEM::QueryFileSystemNameIsNtfs(&NtDriveName, &FsNameIsNtfs) || !FsNameIsNtfs)
+        {
+            Message.Out("Partition ", (LONGLONG)partitions[i].number, ": not NTFS, skipped.");
+            continue;
+        }
+
+        Message.Out("Partition ", (LONGLONG)partitions[i].number, ": sectors ",
+                    (LONGLONG)partitions[i].firstSector, " - ", (LONGLONG)partitions[i].lastSector, ", NTFS.");
+
+        PARTITION_WORK* partitionWork = new PARTITION_WORK;
+
+        partitionWork->partition = partitions[i];
+        partitionWork->diskNumber = diskNumber;
+        partitionWork->listSectorSize = listSectorSize;
+        partitionWork->snapshotFile = snapshotFile;
+        partitionWork->result = 1;
+        work.push_back(partitionWork);
+    }
+
+    if (work.empty())
+    {
+        Message.Out("No NTFS partitions found on the disk.");
+        return 1;
+    }
+
+    for (i = 0; i < work.size(); i++)
+    {
+        work[i]->runTargets.SetMemoryBudget(runTargets.QueryMemoryBudget() / work.size());
+    }
+
+    if (!SplitTargets(runTargets, work, &outside))
+    {
+        Message.Out("Cannot sort the sectors list: temporary file error.");
+        FreeWork(work);
+        return 1;
+    }
+
+    for (i = 0; i < work.size(); i++)
+    {
+        if (!work[i]->runTargets.Finish())
+        {
+            Message.Out("Cannot sort the sectors list: temporary file error.");
+            FreeWork(work);
+            return 1;
+        }
+    }
+
+    if (outside != 0)
+    {
+        Message.Out("Ranges outside NTFS partitions, skipped: ", (LONGLONG)outside);
+    }
+
+    // Mark the partitions.
+
+    RunWorkItems(threadCount, work.size(), MarkPartition, &work);
+
+    Message.Out("");
+
+    for (i = 0; i < work.size(); i++)
+    {
+        if (work[i]->result == 0)
+        {
+            Message.Out("Partition ", (LONGLONG)work[i]->partition.number, ": completed.");
+        }
+        else
+        {
+            Message.Out("Partition ", (LONGLONG)work[i]->partition.number, ": failed.");
+            result = 1;
+        }
+    }
+
+    FreeWork(work);
+    return result;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+
+DECLARE_CLASS(MESSAGE);
+
+class SectorsRangeSorter;
+
+// Marks a sectors list given for a whole physical disk.  The partition
+// table is read once, the list is split between the partitions in one
+// pass, and the NTFS partitions are processed on up to threadCount
+// threads, each with its own NTFS_VOL.  The undo journal of partition <p> is written to
+// NTFSMARKBAD_DISK<diskNumber>_<p>.UNDO, and, if snapshotFile is not
+// empty, its metadata snapshot to <snapshotFile>.<p>.  Returns 0 if
+// every NTFS partition was processed successfully.
+int MarkBadOnDisk(MESSAGE& Message, unsigned int diskNumber, SectorsRangeSorter& runTargets,
+                  unsigned int listSectorSize, const std::string& snapshotFile,
+                  unsigned int threadCount);
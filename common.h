@@ -100,3 +100,42 @@ struct sectors_range
 };
 
 
+// A sorted sequence of sector ranges, no two of which touch or overlap,
+// handed out one range at a time.
+class sectors_range_source
+{
+public:
+    sectors_range_source() : _count(0) {}
+    virtual ~sectors_range_source() {}
+
+    // Returns false at the end of the sequence or if it cannot be read;
+    // failed() tells the two apart.
+    bool next(sectors_range& range)
+    {
+        if (!read(range))
+        {
+            return false;
+        }
+        _count++;
+        return true;
+    }
+
+    // The number of ranges handed out so far.
+    unsigned __int64 count() const
+    {
+        return _count;
+    }
+
+    virtual bool failed() const
+    {
+        return false;
+    }
+
+protected:
+    virtual bool read(sectors_range& range) = 0;
+
+private:
+    unsigned __int64 _count;
+};
+
+
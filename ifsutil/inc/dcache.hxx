@@ -8,7 +8,25 @@ Abstract:
 
     This class models a general cache for reading and writing.
     The actual implementation of this base class is to not have
-    any cache at all.
+    any cache at all, except that writes may be collected into a
+    batch and committed together.
+
+    While a batch is open, writes are copied and held back, and
+    reads see the held-back data.  When the batch is committed the
+    writes are sorted by phase and then by starting sector, runs of
+    adjacent sectors are merged, and each phase is written in one
+    ascending sweep before the next phase begins.  Phases let the
+    caller keep the ordering that the file system needs between
+    groups of writes, and nothing more.  If an undo journal is
+    attached, the sectors about to be overwritten are saved to it
+    before the batch is written.  Each write keeps the IO_STATS
+    stream that was current when it was made, and a merged run is
+    recorded against the stream of its first write.
+
+    The held-back writes are also indexed by starting sector, in one
+    sorted array for each power of two of their length, so that the
+    writes overlapping a run of sectors are found with a binary search
+    of each array rather than a scan of the whole batch.
 
 --*/
 
@@ -18,6 +36,38 @@ Abstract:
 #include "drive.hxx"
 
 DECLARE_CLASS(DRIVE_CACHE);
+DECLARE_CLASS(UNDO_JOURNAL);
+DECLARE_CLASS(NUMBER_SET);
+
+struct DRIVE_CACHE_WRITE {
+    LONGLONG    StartingSector;
+    SECTORCOUNT NumberOfSectors;
+    ULONG       Phase;
+    ULONG       Sequence;
+    ULONG       Stream;         // for IO_STATS
+    PVOID       Buffer;
+    PVOID       Allocation;
+};
+
+DEFINE_POINTER_TYPES(DRIVE_CACHE_WRITE);
+
+struct DRIVE_CACHE_RUN {
+    LONGLONG    StartingSector;
+    LONGLONG    NextSector;
+};
+
+DEFINE_POINTER_TYPES(DRIVE_CACHE_RUN);
+
+// The writes of length 2^i to 2^(i+1) - 1 sectors are in index i.
+#define DRIVE_CACHE_INDEXES     32
+
+struct DRIVE_CACHE_INDEX {
+    PDRIVE_CACHE_WRITE* Writes;         // sorted by starting sector
+    ULONG               NumberOfWrites;
+    ULONG               MaxWrites;
+};
+
+DEFINE_POINTER_TYPES(DRIVE_CACHE_INDEX);
 
 class DRIVE_CACHE : public OBJECT {
 
@@ -50,6 +100,42 @@ class DRIVE_CACHE : public OBJECT {
 			IN  PVOID       Buffer
             );
 
+        BOOLEAN
+        BeginWriteBatch(
+            );
+
+        VOID
+        SetWriteBatchPhase(
+            IN  ULONG   Phase
+            );
+
+        BOOLEAN
+        CommitWriteBatch(
+            );
+
+        VOID
+        AbortWriteBatch(
+            );
+
+        BOOLEAN
+        QueryWriteBatch(
+            OUT PNUMBER_SET Sectors,
+            OUT PULONG      NumberOfRuns
+            );
+
+        VOID
+        SetUndoJournal(
+            IN OUT  PUNDO_JOURNAL   Journal
+            );
+
+        PUNDO_JOURNAL
+        QueryUndoJournal(
+            );
+
+        BOOLEAN
+        IsWriteBatchOpen(
+            ) CONST;
+
     private:
          
 		VOID
@@ -61,6 +147,119 @@ class DRIVE_CACHE : public OBJECT {
         Destroy(
             );
 
-        PIO_DP_DRIVE    _drive;
+        PDRIVE_CACHE_WRITE
+        AllocateWrite(
+            IN  SECTORCOUNT NumberOfSectors
+            );
+
+        VOID
+        FreeWrites(
+            );
+
+        ULONG
+        FindRunEnd(
+            IN  ULONG       First,
+            OUT PLONGLONG   RunEnd
+            );
+
+        BOOLEAN
+        WriteJournal(
+            );
+
+        VOID
+        OverlayWrites(
+            IN      LONGLONG    StartingSector,
+            IN      SECTORCOUNT NumberOfSectors,
+            IN OUT  PVOID       Buffer
+            );
+
+        STATIC
+        ULONG
+        QueryIndex(
+            IN  SECTORCOUNT NumberOfSectors
+            );
+
+        BOOLEAN
+        ReserveIndex(
+            IN  SECTORCOUNT NumberOfSectors
+            );
+
+        VOID
+        AddToIndex(
+            IN  PDRIVE_CACHE_WRITE  Write
+            );
+
+        VOID
+        CopyOverlaps(
+            IN      LONGLONG    StartingSector,
+            IN      SECTORCOUNT NumberOfSectors,
+            IN OUT  PVOID       Buffer,
+            IN      BOOLEAN     ToWrites
+            );
+
+        BOOLEAN
+        IssueRun(
+            IN  ULONG   First,
+            IN  ULONG   Count
+            );
+
+        PIO_DP_DRIVE        _drive;
+
+        BOOLEAN             _batch_open;
+        ULONG               _batch_phase;
+        PDRIVE_CACHE_WRITE* _writes;
+        ULONG               _num_writes;
+        ULONG               _max_writes;
+        DRIVE_CACHE_INDEX   _index[DRIVE_CACHE_INDEXES];
+        PUNDO_JOURNAL       _journal;
 };
 
+
+INLINE
+BOOLEAN
+DRIVE_CACHE::IsWriteBatchOpen(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine tells whether writes are currently being batched.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Writes go straight to the disk.
+    TRUE    - Writes are being held until the batch is committed.
+
+--*/
+{
+    return _batch_open;
+}
+
+
+INLINE
+PUNDO_JOURNAL
+DRIVE_CACHE::QueryUndoJournal(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the journal supplied by SetUndoJournal.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The undo journal, or NULL if there is none.
+
+--*/
+{
+    return _journal;
+}
+
@@ -77,6 +77,9 @@ DECLARE_CLASS( LOG_IO_DP_DRIVE );
 DECLARE_CLASS( NUMBER_SET );
 DECLARE_CLASS( MESSAGE );
 DECLARE_CLASS( DRIVE_CACHE );
+DECLARE_CLASS( UNDO_JOURNAL );
+DECLARE_CLASS( IO_STATS );
+DECLARE_CLASS( IO_TRACE );
 
 #include "ifsentry.hxx"
 
@@ -358,6 +361,66 @@ public:
          IN  SECTORCOUNT NumberOfSectors,
          IN  PVOID       Buffer
          );
+
+    BOOLEAN
+    BeginWriteBatch(
+        );
+
+    VOID
+    SetWriteBatchPhase(
+        IN  ULONG   Phase
+        );
+
+    BOOLEAN
+    CommitWriteBatch(
+        );
+
+    VOID
+    AbortWriteBatch(
+        );
+
+    BOOLEAN
+    QueryWriteBatch(
+        OUT PNUMBER_SET Sectors,
+        OUT PULONG      NumberOfRuns
+        );
+
+    VOID
+    SetUndoJournal(
+        IN OUT  PUNDO_JOURNAL   Journal
+        );
+
+    PUNDO_JOURNAL
+    QueryUndoJournal(
+        );
+
+    VOID
+    SetIoStats(
+        IN OUT  PIO_STATS   Stats
+        );
+
+    PIO_STATS
+    QueryIoStats(
+        );
+
+    VOID
+    SetIoPhase(
+        IN  ULONG   Phase
+        );
+
+    ULONG
+    SetIoStream(
+        IN  ULONG   Stream
+        );
+
+    ULONG
+    QueryIoStream(
+        ) CONST;
+
+    VOID
+    SetIoTrace(
+        IN OUT  PIO_TRACE   Trace
+        );
      
      
     BOOLEAN
@@ -410,6 +473,8 @@ private:
     PDRIVE_CACHE    _cache;
     ULONG           _ValidBlockLengthForVerify;
     PMESSAGE        _message;
+    PIO_STATS       _stats;
+    PIO_TRACE       _trace;
 
      
     VOID
@@ -0,0 +1,206 @@
+/*++
+
+Module Name:
+
+    iostats.hxx
+
+Abstract:
+
+    This class collects timing and I/O accounting for a run: the time
+    spent in each phase, the reads and writes made for each metadata
+    stream, the cost of reading writes back to verify them, and a
+    histogram of the latency of each request to the device.  It also
+    counts the parent index updates that flushing the MFT skipped
+    because the file names they carry had not changed.
+
+    The drive records every request it makes (see IO_DP_DRIVE::
+    SetIoStats) against the current stream.  The code that knows what
+    is being read or written sets the stream and the phase as it goes;
+    writes held back in a batch keep the stream they were made for.
+
+--*/
+
+#pragma once
+
+DECLARE_CLASS( IO_STATS );
+
+#define IO_STATS_PHASE_NONE         (0)
+#define IO_STATS_PHASE_LOAD         (1)     // locking and reading the metadata
+#define IO_STATS_PHASE_SCAN         (2)     // marking the clusters in the bitmap
+#define IO_STATS_PHASE_INSERT       (3)     // adding them to $BadClus
+#define IO_STATS_PHASE_FLUSH        (4)     // staging the metadata writes
+#define IO_STATS_PHASE_COMMIT       (5)     // journal and writes
+#define IO_STATS_PHASE_SNAPSHOT     (6)     // saving the metadata snapshot
+#define IO_STATS_PHASES             (7)
+
+#define IO_STATS_STREAM_OTHER       (0)
+#define IO_STATS_STREAM_MFT         (1)
+#define IO_STATS_STREAM_BITMAP      (2)
+#define IO_STATS_STREAM_BADCLUS     (3)
+#define IO_STATS_STREAM_UPCASE      (4)
+#define IO_STATS_STREAM_MIRROR      (5)
+#define IO_STATS_STREAM_JOURNAL     (6)     // pre-images read for the undo journal
+#define IO_STATS_STREAMS            (7)
+
+// Bucket 0 counts requests under 1 microsecond, bucket i those from
+// 2^(i-1) up to 2^i microseconds, and the last bucket everything longer.
+#define IO_STATS_LATENCY_BUCKETS    (24)
+
+struct IO_STATS_COUNTERS {
+    ULONGLONG   Operations;
+    ULONGLONG   Bytes;
+    LONGLONG    Ticks;
+};
+
+DEFINE_POINTER_TYPES(IO_STATS_COUNTERS);
+
+class IO_STATS : public OBJECT {
+
+    public:
+
+        DECLARE_CONSTRUCTOR( IO_STATS );
+
+        VIRTUAL
+        ~IO_STATS(
+            );
+
+        BOOLEAN
+        Initialize(
+            );
+
+        VOID
+        SetPhase(
+            IN  ULONG   Phase
+            );
+
+        ULONG
+        SetStream(
+            IN  ULONG   Stream
+            );
+
+        ULONG
+        QueryStream(
+            ) CONST;
+
+        STATIC
+        LONGLONG
+        QueryTicks(
+            );
+
+        VOID
+        RecordRead(
+            IN  ULONG       Stream,
+            IN  ULONG       Bytes,
+            IN  LONGLONG    Ticks
+            );
+
+        VOID
+        RecordWrite(
+            IN  ULONG       Stream,
+            IN  ULONG       Bytes,
+            IN  LONGLONG    Ticks
+            );
+
+        VOID
+        RecordVerify(
+            IN  ULONG       Bytes,
+            IN  LONGLONG    Ticks
+            );
+
+        VOID
+        RecordSkippedFileNameUpdates(
+            IN  ULONG   Count
+            );
+
+        double
+        QueryPhaseSeconds(
+            IN  ULONG   Phase
+            ) CONST;
+
+        VOID
+        QueryReads(
+            IN  ULONG               Stream,
+            OUT PIO_STATS_COUNTERS  Counters
+            ) CONST;
+
+        VOID
+        QueryWrites(
+            IN  ULONG               Stream,
+            OUT PIO_STATS_COUNTERS  Counters
+            ) CONST;
+
+        VOID
+        QueryVerify(
+            OUT PIO_STATS_COUNTERS  Counters
+            ) CONST;
+
+        ULONGLONG
+        QuerySkippedFileNameUpdates(
+            ) CONST;
+
+        ULONGLONG
+        QueryReadLatency(
+            IN  ULONG   Bucket
+            ) CONST;
+
+        ULONGLONG
+        QueryWriteLatency(
+            IN  ULONG   Bucket
+            ) CONST;
+
+        double
+        QuerySeconds(
+            IN  LONGLONG    Ticks
+            ) CONST;
+
+    private:
+
+        VOID
+        Construct(
+            );
+
+        VOID
+        Destroy(
+            );
+
+        ULONG
+        QueryBucket(
+            IN  LONGLONG    Ticks
+            ) CONST;
+
+        LONGLONG            _frequency;
+        ULONG               _phase;
+        LONGLONG            _phase_start;
+        LONGLONG            _phase_ticks[IO_STATS_PHASES];
+        ULONG               _stream;
+        IO_STATS_COUNTERS   _reads[IO_STATS_STREAMS];
+        IO_STATS_COUNTERS   _writes[IO_STATS_STREAMS];
+        IO_STATS_COUNTERS   _verify;
+        ULONGLONG           _skipped_file_name_updates;
+        ULONGLONG           _read_latency[IO_STATS_LATENCY_BUCKETS];
+        ULONGLONG           _write_latency[IO_STATS_LATENCY_BUCKETS];
+};
+
+
+INLINE
+ULONG
+IO_STATS::QueryStream(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the stream that requests are recorded against.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The current stream.
+
+--*/
+{
+    return _stream;
+}
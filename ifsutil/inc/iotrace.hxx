@@ -0,0 +1,155 @@
+/*++
+
+Module Name:
+
+    iotrace.hxx
+
+Abstract:
+
+    This class records a trace of the requests a drive makes to the
+    device: when each one was made, what it was, where, how long it
+    took and how it ended.  The trace lets the I/O of a run on a
+    machine we cannot reach be studied, and replayed, elsewhere.
+
+    The drive records every request it makes (see IO_DP_DRIVE::
+    SetIoTrace), including the ones that fail.  The records are kept
+    in a buffer and written to the file as it fills, so tracing costs
+    one sequential write every IO_TRACE_BUFFER_RECORDS requests.
+
+    The file consists of an IO_TRACE_HEADER followed by
+    IO_TRACE_RECORD records up to the end of the file.  The header
+    does not hold a count, so the records of a run that is killed
+    before the trace is closed are still readable.
+
+--*/
+
+#pragma once
+
+#include "wstring.hxx"
+
+DECLARE_CLASS( IO_TRACE );
+
+#define IO_TRACE_SIGNATURE          "NTFSIOTR"
+#define IO_TRACE_VERSION            1
+
+#define IO_TRACE_OP_READ            (1)
+#define IO_TRACE_OP_WRITE           (2)
+#define IO_TRACE_OP_READ_BACK       (3)     // of a write, to check it
+#define IO_TRACE_OP_VERIFY          (4)     // IOCTL_DISK_VERIFY
+
+#define IO_TRACE_BUFFER_RECORDS     (2048)
+
+struct IO_TRACE_HEADER {
+    CHAR        Signature[8];
+    ULONG       Version;
+    ULONG       SectorSize;
+    LONGLONG    VolumeSectors;
+    LONGLONG    StartTime;      // FILETIME, UTC
+};
+
+DEFINE_POINTER_TYPES(IO_TRACE_HEADER);
+
+struct IO_TRACE_RECORD {
+    ULONGLONG   Time;           // microseconds since the trace began
+    LONGLONG    StartingSector;
+    ULONG       Length;         // bytes
+    LONG        Status;         // NTSTATUS
+    ULONG       Latency;        // microseconds
+    UCHAR       Operation;      // IO_TRACE_OP_*
+    UCHAR       Stream;         // IO_STATS_STREAM_*
+    USHORT      Reserved;
+};
+
+DEFINE_POINTER_TYPES(IO_TRACE_RECORD);
+
+class IO_TRACE : public OBJECT {
+
+    public:
+
+        DECLARE_CONSTRUCTOR( IO_TRACE );
+
+        VIRTUAL
+        ~IO_TRACE(
+            );
+
+        BOOLEAN
+        Initialize(
+            IN  PCWSTRING   FileName,
+            IN  ULONG       SectorSize,
+            IN  LONGLONG    VolumeSectors
+            );
+
+        ULONG
+        SetStream(
+            IN  ULONG   Stream
+            );
+
+        ULONG
+        QueryStream(
+            ) CONST;
+
+        VOID
+        Record(
+            IN  ULONG       Operation,
+            IN  LONGLONG    StartingSector,
+            IN  ULONG       Length,
+            IN  NTSTATUS    Status,
+            IN  LONGLONG    StartTicks,
+            IN  LONGLONG    EndTicks
+            );
+
+        BOOLEAN
+        Close(
+            );
+
+    private:
+
+        VOID
+        Construct(
+            );
+
+        VOID
+        Destroy(
+            );
+
+        BOOLEAN
+        Flush(
+            );
+
+        ULONGLONG
+        QueryMicroseconds(
+            IN  LONGLONG    Ticks
+            ) CONST;
+
+        HANDLE              _handle;
+        BOOLEAN             _failed;
+        LONGLONG            _frequency;
+        LONGLONG            _start;
+        ULONG               _stream;
+        PIO_TRACE_RECORD    _records;
+        ULONG               _num_records;
+};
+
+
+INLINE
+ULONG
+IO_TRACE::QueryStream(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the stream that requests are recorded against.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The current stream.
+
+--*/
+{
+    return _stream;
+}
@@ -32,7 +32,7 @@ public:
 	VIRTUAL
 	BOOLEAN
 	MarkBad(
-		IN const std::vector<sectors_range>& physicalDriveSectorsTargets,
+		IN OUT sectors_range_source& physicalDriveSectorsTargets,
 		IN OUT PMESSAGE Message
 	) PURE;
 
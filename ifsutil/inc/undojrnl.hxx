@@ -0,0 +1,187 @@
+/*++
+
+Module Name:
+
+    undojrnl.hxx
+
+Abstract:
+
+    This class models an undo journal: a file holding the contents
+    that a batch of writes is about to overwrite, so that the writes
+    can be rolled back if the update is interrupted.
+
+    The records of a write batch are built in memory while the batch
+    is committed (see DRIVE_CACHE::CommitWriteBatch) and are appended
+    to the file in a single sequential write, followed by a rewrite of
+    the header to count them and a single flush, before any of the
+    batch reaches the disk.  Only the records of the current batch are
+    held in memory.
+
+    The header names the records of the last batch and carries their
+    CRC-32, so it does not have to reach the disk after them.  If the
+    header is there but the records of its last batch are not, that
+    batch never reached the volume, and Restore leaves it out.
+
+    The file consists of an UNDO_JOURNAL_HEADER followed by
+    NumberOfRecords records.  Each record is an UNDO_JOURNAL_RECORD
+    followed by NumberOfSectors sectors of data.  Each record and the
+    header carry a CRC-32 so that a partly-written journal is never
+    applied.
+
+    The header names the volume by its serial number, and each record
+    carries the CRC-32 of the sectors as its batch left them.  Restore
+    puts nothing back unless every run still holds either what the
+    journal says it was left holding or, if the commit of its batch
+    was cut short before the run was written, the sectors saved for
+    it, so a journal is never applied to another volume, or to one
+    that has changed since.  When the run that wrote
+    the journal completes, MarkComplete sets a flag in the header.
+
+--*/
+
+#pragma once
+
+#include "wstring.hxx"
+#include "drive.hxx"
+
+DECLARE_CLASS( MESSAGE );
+DECLARE_CLASS( UNDO_JOURNAL );
+
+#define UNDO_JOURNAL_SIGNATURE  "NTFSUNDO"
+#define UNDO_JOURNAL_VERSION    3
+
+#define UNDO_JOURNAL_FLAG_COMPLETE  (0x00000001)    // the run completed
+
+struct UNDO_JOURNAL_HEADER {
+    CHAR        Signature[8];
+    ULONG       Version;
+    ULONG       SectorSize;
+    LONGLONG    VolumeSectors;
+    LONGLONG    VolumeSerialNumber;
+    ULONG       NumberOfRecords;
+    ULONG       Flags;          // UNDO_JOURNAL_FLAG_*
+    ULONG       Checksum;       // of the header, with this field zero
+    ULONG       LastBatchRecords;   // the last NumberOfRecords, appended together
+    ULONG       LastBatchChecksum;  // of those records, end to end
+    ULONG       Reserved;
+};
+
+DEFINE_POINTER_TYPES(UNDO_JOURNAL_HEADER);
+
+struct UNDO_JOURNAL_RECORD {
+    LONGLONG    StartingSector;
+    ULONG       NumberOfSectors;
+    ULONG       Checksum;       // of the record and its data, with this field zero
+    ULONG       PostImageChecksum;  // of the sectors as the batch left them
+    ULONG       Reserved;
+};
+
+DEFINE_POINTER_TYPES(UNDO_JOURNAL_RECORD);
+
+class UNDO_JOURNAL : public OBJECT {
+
+    public:
+
+        DECLARE_CONSTRUCTOR( UNDO_JOURNAL );
+
+        VIRTUAL
+        ~UNDO_JOURNAL(
+            );
+
+        BOOLEAN
+        Initialize(
+            IN  PCWSTRING   FileName,
+            IN  LONGLONG    VolumeSerialNumber
+            );
+
+        PVOID
+        AddPreImage(
+            IN  LONGLONG    StartingSector,
+            IN  SECTORCOUNT NumberOfSectors,
+            IN  ULONG       SectorSize,
+            IN  ULONG       PostImageChecksum
+            );
+
+        BOOLEAN
+        Write(
+            IN  ULONG       SectorSize,
+            IN  LONGLONG    VolumeSectors
+            );
+
+        VOID
+        DiscardPreImages(
+            );
+
+        BOOLEAN
+        MarkComplete(
+            );
+
+        BOOLEAN
+        Restore(
+            IN OUT  PIO_DP_DRIVE    Drive,
+            IN OUT  PMESSAGE        Message
+            );
+
+        ULONG
+        QueryWriteError(
+            ) CONST;
+
+        STATIC
+        ULONG
+        ComputeChecksum(
+            IN  PCVOID  Buffer,
+            IN  ULONG   Length,
+            IN  ULONG   Checksum    DEFAULT 0
+            );
+
+    private:
+
+        VOID
+        Construct(
+            );
+
+        VOID
+        Destroy(
+            );
+
+        BOOLEAN
+        Reserve(
+            IN  ULONG   Length
+            );
+
+        DSTRING     _file_name;
+        LONGLONG    _serial_number;
+        PCHAR       _buffer;
+        ULONG       _length;
+        ULONG       _max_length;
+        ULONG       _num_records;
+        ULONG       _total_records;
+        LONGLONG    _file_length;
+        BOOLEAN     _written;
+        ULONG       _write_error;
+};
+
+
+INLINE
+ULONG
+UNDO_JOURNAL::QueryWriteError(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine tells why the journal could not be written.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The Win32 error of the last Write or MarkComplete that failed, or
+    ERROR_SUCCESS if none has.
+
+--*/
+{
+    return _write_error;
+}
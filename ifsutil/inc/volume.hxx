@@ -57,7 +57,7 @@ class VOL_LIODPDRV : public LOG_IO_DP_DRIVE {
 
         BOOLEAN
             MarkBad(
-                IN     const std::vector<sectors_range>& physicalDriveSectorsTargets,
+                IN OUT sectors_range_source& physicalDriveSectorsTargets,
                 IN OUT  PMESSAGE    Message
             );
 	
@@ -6,6 +6,11 @@
 
 #include "ulib.hxx"
 #include "dcache.hxx"
+#include "undojrnl.hxx"
+#include "numset.hxx"
+#include "iostats.hxx"
+
+#include <stdlib.h>
 
 
 DEFINE_CONSTRUCTOR( DRIVE_CACHE, OBJECT );
@@ -52,7 +57,21 @@ Return Value:
 
 --*/
 {
+    ULONG   i;
+
     _drive = NULL;
+    _batch_open = FALSE;
+    _batch_phase = 0;
+    _writes = NULL;
+    _num_writes = 0;
+    _max_writes = 0;
+    _journal = NULL;
+
+    for (i = 0; i < DRIVE_CACHE_INDEXES; i++) {
+        _index[i].Writes = NULL;
+        _index[i].NumberOfWrites = 0;
+        _index[i].MaxWrites = 0;
+    }
 }
 
 
@@ -75,6 +94,20 @@ Return Value:
 
 --*/
 {
+    ULONG   i;
+
+    FreeWrites();
+    DELETE_ARRAY(_writes);
+    _max_writes = 0;
+
+    for (i = 0; i < DRIVE_CACHE_INDEXES; i++) {
+        DELETE_ARRAY(_index[i].Writes);
+        _index[i].MaxWrites = 0;
+    }
+
+    _batch_open = FALSE;
+    _batch_phase = 0;
+    _journal = NULL;
     _drive = NULL;
 }
 
@@ -134,7 +167,17 @@ Return Value:
 --*/
 {
     DebugAssert(_drive);
-    return _drive->HardRead(StartingSector, NumberOfSectors, Buffer);
+
+    if (!_drive->HardRead(StartingSector, NumberOfSectors, Buffer)) {
+        return FALSE;
+    }
+
+    // Lay any held-back writes over what was read, so that the
+    // caller sees the disk as it will be once the batch is committed.
+
+    OverlayWrites(StartingSector.GetQuadPart(), NumberOfSectors, Buffer);
+
+    return TRUE;
 }
 
 
@@ -163,7 +206,956 @@ Return Value:
 
 --*/
 {
+    PDRIVE_CACHE_WRITE  new_write;
+    PDRIVE_CACHE_WRITE* new_writes;
+    ULONG               sector_size;
+
     DebugAssert(_drive);
-    return _drive->HardWrite(StartingSector, NumberOfSectors, Buffer);
+
+    if (!_batch_open) {
+        return _drive->HardWrite(StartingSector, NumberOfSectors, Buffer);
+    }
+
+    if (NumberOfSectors == 0) {
+        return TRUE;
+    }
+
+    if (_num_writes == _max_writes) {
+
+        if (!(new_writes = NEW PDRIVE_CACHE_WRITE[2*_max_writes + 32])) {
+            return FALSE;
+        }
+
+        if (_num_writes) {
+            memcpy(new_writes, _writes, _num_writes*sizeof(PDRIVE_CACHE_WRITE));
+        }
+
+        DELETE_ARRAY(_writes);
+        _writes = new_writes;
+        _max_writes = 2*_max_writes + 32;
+    }
+
+    if (!ReserveIndex(NumberOfSectors) ||
+        !(new_write = AllocateWrite(NumberOfSectors))) {
+        return FALSE;
+    }
+
+    sector_size = _drive->QuerySectorSize();
+
+    new_write->StartingSector = StartingSector.GetQuadPart();
+    new_write->NumberOfSectors = NumberOfSectors;
+    new_write->Phase = _batch_phase;
+    new_write->Sequence = _num_writes;
+    new_write->Stream = _drive->QueryIoStream();
+
+    memcpy(new_write->Buffer, Buffer, NumberOfSectors*sector_size);
+
+    // Bring any earlier writes to the same sectors up to date, so that
+    // every held-back copy of a sector agrees with the latest one.
+
+    CopyOverlaps(new_write->StartingSector, NumberOfSectors, Buffer, TRUE);
+
+    AddToIndex(new_write);
+    _writes[_num_writes++] = new_write;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DRIVE_CACHE::BeginWriteBatch(
+    )
+/*++
+
+Routine Description:
+
+    This routine starts holding back writes.  Writes made from now
+    until the batch is committed or aborted are in phase 0 unless
+    SetWriteBatchPhase says otherwise.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - A batch is already open.
+    TRUE    - Success.
+
+--*/
+{
+    if (_batch_open) {
+        return FALSE;
+    }
+
+    _batch_open = TRUE;
+    _batch_phase = 0;
+
+    return TRUE;
+}
+
+
+VOID
+DRIVE_CACHE::SetWriteBatchPhase(
+    IN  ULONG   Phase
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the phase of the writes which follow.  When
+    the batch is committed, all the writes of a phase reach the disk
+    before any write of a later phase.
+
+Arguments:
+
+    Phase   - Supplies the phase for subsequent writes.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _batch_phase = Phase;
+}
+
+
+STATIC
+int __cdecl
+CompareWrites(
+    IN  const void* Left,
+    IN  const void* Right
+    )
+/*++
+
+Routine Description:
+
+    This routine orders held-back writes by phase, then by starting
+    sector, then by the order in which they were made.
+
+Arguments:
+
+    Left    - Supplies a pointer to the first write.
+    Right   - Supplies a pointer to the second write.
+
+Return Value:
+
+    <0, 0 or >0 as Left sorts before, with, or after Right.
+
+--*/
+{
+    PCDRIVE_CACHE_WRITE left = *(PDRIVE_CACHE_WRITE*) Left;
+    PCDRIVE_CACHE_WRITE right = *(PDRIVE_CACHE_WRITE*) Right;
+
+    if (left->Phase != right->Phase) {
+        return left->Phase < right->Phase ? -1 : 1;
+    }
+
+    if (left->StartingSector != right->StartingSector) {
+        return left->StartingSector < right->StartingSector ? -1 : 1;
+    }
+
+    if (left->Sequence != right->Sequence) {
+        return left->Sequence < right->Sequence ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+BOOLEAN
+DRIVE_CACHE::CommitWriteBatch(
+    )
+/*++
+
+Routine Description:
+
+    This routine writes out the held-back writes and closes the
+    batch.  The writes are sorted by phase and starting sector, and
+    writes within a phase which touch or overlap are merged into a
+    single write.
+
+    If an undo journal has been supplied, the current contents of
+    every sector the batch will overwrite are saved to it, and the
+    journal is made stable, before anything is written.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Failure.  The batch is closed and whatever was not
+              written is discarded.
+    TRUE    - Success.
+
+--*/
+{
+    LONGLONG    run_end;
+    ULONG       first, next;
+    ULONG       stream;
+    BOOLEAN     r;
+
+    DebugAssert(_drive);
+
+    if (!_batch_open) {
+        return TRUE;
+    }
+
+    _batch_open = FALSE;
+    _batch_phase = 0;
+
+    if (_num_writes > 1) {
+        qsort(_writes, _num_writes, sizeof(PDRIVE_CACHE_WRITE), CompareWrites);
+    }
+
+    if (_journal && _num_writes && !WriteJournal()) {
+        FreeWrites();
+        return FALSE;
+    }
+
+    r = TRUE;
+    stream = _drive->SetIoStream(IO_STATS_STREAM_OTHER);
+
+    for (first = 0; r && first < _num_writes; first = next) {
+
+        next = FindRunEnd(first, &run_end);
+        _drive->SetIoStream(_writes[first]->Stream);
+        r = IssueRun(first, next - first);
+    }
+
+    _drive->SetIoStream(stream);
+    FreeWrites();
+
+    return r;
+}
+
+
+BOOLEAN
+DRIVE_CACHE::QueryWriteBatch(
+    OUT PNUMBER_SET Sectors,
+    OUT PULONG      NumberOfRuns
+    )
+/*++
+
+Routine Description:
+
+    This routine reports what committing the batch would write,
+    without writing anything.  The batch stays open.
+
+Arguments:
+
+    Sectors         - Supplies an initialized set, to which every
+                      sector the batch would write is added.
+    NumberOfRuns    - Receives the number of writes the commit would
+                      issue after merging.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    LONGLONG    run_start, run_end;
+    ULONG       first, next;
+
+    *NumberOfRuns = 0;
+
+    // The order of the held-back writes only matters to the commit,
+    // which sorts them the same way again.
+
+    if (_num_writes > 1) {
+        qsort(_writes, _num_writes, sizeof(PDRIVE_CACHE_WRITE), CompareWrites);
+    }
+
+    for (first = 0; first < _num_writes; first = next) {
+
+        next = FindRunEnd(first, &run_end);
+        run_start = _writes[first]->StartingSector;
+
+        if (!Sectors->Add(run_start, run_end - run_start)) {
+            return FALSE;
+        }
+
+        (*NumberOfRuns)++;
+    }
+
+    return TRUE;
+}
+
+
+VOID
+DRIVE_CACHE::SetUndoJournal(
+    IN OUT  PUNDO_JOURNAL   Journal
+    )
+/*++
+
+Routine Description:
+
+    This routine supplies an undo journal to be written before each
+    batch is committed.
+
+Arguments:
+
+    Journal - Supplies the journal, or NULL for none.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _journal = Journal;
+}
+
+
+ULONG
+DRIVE_CACHE::FindRunEnd(
+    IN  ULONG       First,
+    OUT PLONGLONG   RunEnd
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the sorted, held-back writes which can be
+    merged with the write at First: those of the same phase which
+    touch or overlap it, or each other.
+
+Arguments:
+
+    First   - Supplies the index of the first write in the run.
+    RunEnd  - Receives the sector following the run.
+
+Return Value:
+
+    The index of the first write after the run.
+
+--*/
+{
+    PDRIVE_CACHE_WRITE  write;
+    ULONG               next;
+
+    write = _writes[First];
+    *RunEnd = write->StartingSector + write->NumberOfSectors;
+
+    for (next = First + 1; next < _num_writes; next++) {
+
+        write = _writes[next];
+
+        if (write->Phase != _writes[First]->Phase ||
+            write->StartingSector > *RunEnd) {
+            break;
+        }
+
+        *RunEnd = max(*RunEnd, write->StartingSector + write->NumberOfSectors);
+    }
+
+    return next;
+}
+
+
+STATIC
+int __cdecl
+CompareRuns(
+    IN  const void* Left,
+    IN  const void* Right
+    )
+/*++
+
+Routine Description:
+
+    This routine orders runs of sectors by their first sector.
+
+Arguments:
+
+    Left    - Supplies a pointer to the first run.
+    Right   - Supplies a pointer to the second run.
+
+Return Value:
+
+    <0, 0 or >0 as Left sorts before, with, or after Right.
+
+--*/
+{
+    PCDRIVE_CACHE_RUN   left = (PCDRIVE_CACHE_RUN) Left;
+    PCDRIVE_CACHE_RUN   right = (PCDRIVE_CACHE_RUN) Right;
+
+    if (left->StartingSector != right->StartingSector) {
+        return left->StartingSector < right->StartingSector ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+BOOLEAN
+DRIVE_CACHE::WriteJournal(
+    )
+/*++
+
+Routine Description:
+
+    This routine saves the current contents of every sector the batch
+    will write to the undo journal, with the checksum of what the
+    batch will leave there, and writes the journal.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Failure.  Nothing should be written.
+    TRUE    - Success.
+
+--*/
+{
+    PDRIVE_CACHE_RUN    runs;
+    PVOID               pre_image, post_image;
+    LONGLONG            run_end, max_length;
+    SECTORCOUNT         length;
+    ULONG               num_runs, first, next, i, j;
+    ULONG               sector_size;
+    ULONG               stream;
+    BOOLEAN             r;
+
+    DebugAssert(_num_writes);
+
+    // The runs of different phases may overlap.  The journal takes
+    // their union, so that each sector is saved once and no two
+    // records overlap, which lets Restore check every record against
+    // the volume.
+
+    if (!(runs = NEW DRIVE_CACHE_RUN[_num_writes])) {
+        return FALSE;
+    }
+
+    num_runs = 0;
+
+    for (first = 0; first < _num_writes; first = next) {
+
+        next = FindRunEnd(first, &run_end);
+        runs[num_runs].StartingSector = _writes[first]->StartingSector;
+        runs[num_runs].NextSector = run_end;
+        num_runs++;
+    }
+
+    qsort(runs, num_runs, sizeof(DRIVE_CACHE_RUN), CompareRuns);
+
+    max_length = runs[0].NextSector - runs[0].StartingSector;
+
+    for (i = 1, j = 0; i < num_runs; i++) {
+
+        if (runs[i].StartingSector <= runs[j].NextSector) {
+            runs[j].NextSector = max(runs[j].NextSector, runs[i].NextSector);
+        } else {
+            runs[++j] = runs[i];
+        }
+
+        max_length = max(max_length, runs[j].NextSector - runs[j].StartingSector);
+    }
+
+    num_runs = j + 1;
+    sector_size = _drive->QuerySectorSize();
+
+    if (!(post_image = MALLOC((ULONG) max_length*sector_size))) {
+        DELETE_ARRAY(runs);
+        return FALSE;
+    }
+
+    r = TRUE;
+    stream = _drive->SetIoStream(IO_STATS_STREAM_JOURNAL);
+
+    for (i = 0; r && i < num_runs; i++) {
+
+        // Every sector of the run is written by the batch, so the
+        // held-back writes alone give what it will hold.
+
+        length = (SECTORCOUNT) (runs[i].NextSector - runs[i].StartingSector);
+        OverlayWrites(runs[i].StartingSector, length, post_image);
+
+        if (!(pre_image = _journal->AddPreImage(runs[i].StartingSector,
+                                                length,
+                                                sector_size,
+                                                UNDO_JOURNAL::ComputeChecksum(post_image,
+                                                                              length*sector_size))) ||
+            !_drive->HardRead((ULONGLONG) runs[i].StartingSector, length, pre_image)) {
+            r = FALSE;
+        }
+    }
+
+    _drive->SetIoStream(stream);
+
+    FREE(post_image);
+    DELETE_ARRAY(runs);
+
+    if (!r) {
+        _journal->DiscardPreImages();
+        return FALSE;
+    }
+
+    return _journal->Write(sector_size, _drive->QuerySectors().GetQuadPart());
+}
+
+
+VOID
+DRIVE_CACHE::OverlayWrites(
+    IN      LONGLONG    StartingSector,
+    IN      SECTORCOUNT NumberOfSectors,
+    IN OUT  PVOID       Buffer
+    )
+/*++
+
+Routine Description:
+
+    This routine copies the held-back writes to a run of sectors over
+    the contents of the run in Buffer.  Overlapping writes are kept
+    consistent with one another, so the order in which they are
+    applied does not matter.
+
+Arguments:
+
+    StartingSector  - Supplies the first sector of the run.
+    NumberOfSectors - Supplies the number of sectors in the run.
+    Buffer          - Supplies the contents of the run, and receives
+                      them with the held-back writes laid over.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CopyOverlaps(StartingSector, NumberOfSectors, Buffer, FALSE);
+}
+
+
+ULONG
+DRIVE_CACHE::QueryIndex(
+    IN  SECTORCOUNT NumberOfSectors
+    )
+/*++
+
+Routine Description:
+
+    This routine computes which index holds writes of the given
+    length: the position of the highest bit set in the length.
+
+Arguments:
+
+    NumberOfSectors - Supplies the length of the write.  It is not 0.
+
+Return Value:
+
+    The index for the write.
+
+--*/
+{
+    ULONG   i;
+
+    DebugAssert(NumberOfSectors);
+
+    for (i = 0; NumberOfSectors >>= 1; i++) {
+    }
+
+    return i;
+}
+
+
+BOOLEAN
+DRIVE_CACHE::ReserveIndex(
+    IN  SECTORCOUNT NumberOfSectors
+    )
+/*++
+
+Routine Description:
+
+    This routine makes sure the index for writes of the given length
+    has room for one more, so that AddToIndex cannot fail.
+
+Arguments:
+
+    NumberOfSectors - Supplies the length of the write.
+
+Return Value:
+
+    FALSE   - There is not enough memory.
+    TRUE    - Success.
+
+--*/
+{
+    PDRIVE_CACHE_INDEX  index;
+    PDRIVE_CACHE_WRITE* new_writes;
+
+    index = &_index[QueryIndex(NumberOfSectors)];
+
+    if (index->NumberOfWrites < index->MaxWrites) {
+        return TRUE;
+    }
+
+    if (!(new_writes = NEW PDRIVE_CACHE_WRITE[2*index->MaxWrites + 32])) {
+        return FALSE;
+    }
+
+    if (index->NumberOfWrites) {
+        memcpy(new_writes, index->Writes,
+               index->NumberOfWrites*sizeof(PDRIVE_CACHE_WRITE));
+    }
+
+    DELETE_ARRAY(index->Writes);
+    index->Writes = new_writes;
+    index->MaxWrites = 2*index->MaxWrites + 32;
+
+    return TRUE;
+}
+
+
+VOID
+DRIVE_CACHE::AddToIndex(
+    IN  PDRIVE_CACHE_WRITE  Write
+    )
+/*++
+
+Routine Description:
+
+    This routine inserts a held-back write into the index for its
+    length, after any write with the same starting sector.  Room must
+    have been made by ReserveIndex.
+
+Arguments:
+
+    Write   - Supplies the write.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PDRIVE_CACHE_INDEX  index;
+    ULONG               low, high, middle;
+
+    index = &_index[QueryIndex(Write->NumberOfSectors)];
+
+    DebugAssert(index->NumberOfWrites < index->MaxWrites);
+
+    // Writes mostly come in ascending order, so look at the end first.
+
+    low = index->NumberOfWrites;
+
+    if (low && index->Writes[low - 1]->StartingSector > Write->StartingSector) {
+
+        low = 0;
+        high = index->NumberOfWrites;
+
+        while (low < high) {
+
+            middle = low + (high - low)/2;
+
+            if (index->Writes[middle]->StartingSector <= Write->StartingSector) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        memmove(&index->Writes[low + 1], &index->Writes[low],
+                (index->NumberOfWrites - low)*sizeof(PDRIVE_CACHE_WRITE));
+    }
+
+    index->Writes[low] = Write;
+    index->NumberOfWrites++;
+}
+
+
+VOID
+DRIVE_CACHE::CopyOverlaps(
+    IN      LONGLONG    StartingSector,
+    IN      SECTORCOUNT NumberOfSectors,
+    IN OUT  PVOID       Buffer,
+    IN      BOOLEAN     ToWrites
+    )
+/*++
+
+Routine Description:
+
+    This routine copies the sectors that a run shares with the
+    held-back writes, either from the run to the writes or from the
+    writes to the run.
+
+    In each index a binary search finds the first write that can
+    reach the run: the writes there are shorter than twice the
+    shortest, so none that starts further back can overlap it.  From
+    there the writes are taken in order until one starts past the run.
+
+Arguments:
+
+    StartingSector  - Supplies the first sector of the run.
+    NumberOfSectors - Supplies the number of sectors in the run.
+    Buffer          - Supplies the contents of the run.
+    ToWrites        - Supplies TRUE to copy Buffer over the writes,
+                      FALSE to copy the writes over Buffer.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PDRIVE_CACHE_INDEX  index;
+    PDRIVE_CACHE_WRITE  write;
+    LONGLONG            end, reach, overlap_start, overlap_end;
+    PCHAR               run_data, write_data;
+    ULONG               length;
+    ULONG               sector_size;
+    ULONG               low, high, middle;
+    ULONG               i;
+
+    sector_size = _drive->QuerySectorSize();
+    end = StartingSector + NumberOfSectors;
+
+    for (i = 0; i < DRIVE_CACHE_INDEXES; i++) {
+
+        index = &_index[i];
+
+        if (index->NumberOfWrites == 0) {
+            continue;
+        }
+
+        // The writes here are at most 2^(i+1) - 1 sectors long, so
+        // only those which start after reach can end inside the run.
+
+        reach = StartingSector - (((LONGLONG) 2 << i) - 1);
+
+        low = 0;
+        high = index->NumberOfWrites;
+
+        while (low < high) {
+
+            middle = low + (high - low)/2;
+
+            if (index->Writes[middle]->StartingSector <= reach) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        for (; low < index->NumberOfWrites; low++) {
+
+            write = index->Writes[low];
+
+            if (write->StartingSector >= end) {
+                break;
+            }
+
+            overlap_start = max(StartingSector, write->StartingSector);
+            overlap_end = min(end, write->StartingSector + write->NumberOfSectors);
+
+            if (overlap_start >= overlap_end) {
+                continue;
+            }
+
+            run_data = (PCHAR) Buffer + (overlap_start - StartingSector)*sector_size;
+            write_data = (PCHAR) write->Buffer +
+                         (overlap_start - write->StartingSector)*sector_size;
+            length = (ULONG) (overlap_end - overlap_start)*sector_size;
+
+            if (ToWrites) {
+                memcpy(write_data, run_data, length);
+            } else {
+                memcpy(run_data, write_data, length);
+            }
+        }
+    }
+}
+
+
+VOID
+DRIVE_CACHE::AbortWriteBatch(
+    )
+/*++
+
+Routine Description:
+
+    This routine discards the held-back writes and closes the batch.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    FreeWrites();
+    _batch_open = FALSE;
+    _batch_phase = 0;
+}
+
+
+PDRIVE_CACHE_WRITE
+DRIVE_CACHE::AllocateWrite(
+    IN  SECTORCOUNT NumberOfSectors
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates a held-back write with room for the given
+    number of sectors.  The data buffer meets the drive's alignment
+    requirement.
+
+Arguments:
+
+    NumberOfSectors - Supplies the number of sectors in the write.
+
+Return Value:
+
+    The new write, or NULL if there is not enough memory.
+
+--*/
+{
+    PDRIVE_CACHE_WRITE  write;
+    ULONG               alignment_mask;
+
+    alignment_mask = _drive->QueryAlignmentMask();
+
+    if (!(write = (PDRIVE_CACHE_WRITE) MALLOC(sizeof(DRIVE_CACHE_WRITE)))) {
+        return NULL;
+    }
+
+    if (!(write->Allocation =
+            MALLOC(NumberOfSectors*_drive->QuerySectorSize() + alignment_mask))) {
+        FREE(write);
+        return NULL;
+    }
+
+    write->Buffer = (PVOID) (((ULONG_PTR) write->Allocation + alignment_mask) &
+                             ~(ULONG_PTR) alignment_mask);
+
+    return write;
+}
+
+
+VOID
+DRIVE_CACHE::FreeWrites(
+    )
+/*++
+
+Routine Description:
+
+    This routine frees all the held-back writes.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG   i;
+
+    for (i = 0; i < _num_writes; i++) {
+        FREE(_writes[i]->Allocation);
+        FREE(_writes[i]);
+    }
+
+    _num_writes = 0;
+
+    for (i = 0; i < DRIVE_CACHE_INDEXES; i++) {
+        _index[i].NumberOfWrites = 0;
+    }
+}
+
+
+BOOLEAN
+DRIVE_CACHE::IssueRun(
+    IN  ULONG   First,
+    IN  ULONG   Count
+    )
+/*++
+
+Routine Description:
+
+    This routine writes a run of sorted, held-back writes which
+    together cover a contiguous range of sectors.  A run of one write
+    is written from its own buffer; a longer run is gathered into a
+    single buffer first.
+
+Arguments:
+
+    First   - Supplies the index of the first write in the run.
+    Count   - Supplies the number of writes in the run.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    PDRIVE_CACHE_WRITE  write, run;
+    LONGLONG            run_start, run_end;
+    ULONG               sector_size;
+    ULONG               i;
+    BOOLEAN             r;
+
+    write = _writes[First];
+
+    if (Count == 1) {
+        return _drive->HardWrite((ULONGLONG) write->StartingSector,
+                                 write->NumberOfSectors,
+                                 write->Buffer);
+    }
+
+    sector_size = _drive->QuerySectorSize();
+    run_start = write->StartingSector;
+    run_end = run_start;
+
+    for (i = First; i < First + Count; i++) {
+        run_end = max(run_end, _writes[i]->StartingSector +
+                               _writes[i]->NumberOfSectors);
+    }
+
+    if (!(run = AllocateWrite((SECTORCOUNT) (run_end - run_start)))) {
+
+        // Fall back to writing the pieces one at a time.
+
+        for (i = First; i < First + Count; i++) {
+            write = _writes[i];
+            if (!_drive->HardWrite((ULONGLONG) write->StartingSector,
+                                   write->NumberOfSectors,
+                                   write->Buffer)) {
+                return FALSE;
+            }
+        }
+
+        return TRUE;
+    }
+
+    for (i = First; i < First + Count; i++) {
+        write = _writes[i];
+        memcpy((PCHAR) run->Buffer + (write->StartingSector - run_start)*sector_size,
+               write->Buffer,
+               write->NumberOfSectors*sector_size);
+    }
+
+    r = _drive->HardWrite((ULONGLONG) run_start,
+                          (SECTORCOUNT) (run_end - run_start),
+                          run->Buffer);
+
+    FREE(run->Allocation);
+    FREE(run);
+
+    return r;
 }
 
@@ -22,6 +22,8 @@ Abstract:
 #include "message.hxx"
 #include "numset.hxx"
 #include "dcache.hxx"
+#include "iostats.hxx"
+#include "iotrace.hxx"
 #include "hmem.hxx"
 #include "ifssys.hxx"
 
@@ -891,6 +893,8 @@ Return Value:
     _cache = NULL;
     _ValidBlockLengthForVerify = 0;
     _message = NULL;
+    _stats = NULL;
+    _trace = NULL;
 }
 
 
@@ -929,6 +933,8 @@ Return Value:
 
     _ValidBlockLengthForVerify = 0;
     _message = NULL;
+    _stats = NULL;
+    _trace = NULL;
 }
 
 
@@ -1067,6 +1073,359 @@ Return Value:
 }
 
 
+BOOLEAN
+IO_DP_DRIVE::BeginWriteBatch(
+    )
+/*++
+
+Routine Description:
+
+    This routine starts collecting writes into a batch instead of
+    writing them immediately.  Reads made while the batch is open see
+    the collected writes.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    DebugAssert(_cache);
+    return _cache->BeginWriteBatch();
+}
+
+
+VOID
+IO_DP_DRIVE::SetWriteBatchPhase(
+    IN  ULONG   Phase
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the phase of the writes which follow.  All the
+    writes of a phase reach the disk before any write of a later phase.
+
+Arguments:
+
+    Phase   - Supplies the phase for subsequent writes.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DebugAssert(_cache);
+    _cache->SetWriteBatchPhase(Phase);
+}
+
+
+BOOLEAN
+IO_DP_DRIVE::CommitWriteBatch(
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the collected writes to disk, phase by phase,
+    each phase in ascending sector order with adjacent writes merged.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    DebugAssert(_cache);
+    return _cache->CommitWriteBatch();
+}
+
+
+VOID
+IO_DP_DRIVE::AbortWriteBatch(
+    )
+/*++
+
+Routine Description:
+
+    This routine discards the collected writes.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DebugAssert(_cache);
+    _cache->AbortWriteBatch();
+}
+
+
+BOOLEAN
+IO_DP_DRIVE::QueryWriteBatch(
+    OUT PNUMBER_SET Sectors,
+    OUT PULONG      NumberOfRuns
+    )
+/*++
+
+Routine Description:
+
+    This routine reports the sectors that committing the open batch
+    would write, and in how many writes, without writing them.
+
+Arguments:
+
+    Sectors         - Supplies an initialized set to receive the sectors.
+    NumberOfRuns    - Receives the number of writes.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    DebugAssert(_cache);
+    return _cache->QueryWriteBatch(Sectors, NumberOfRuns);
+}
+
+
+VOID
+IO_DP_DRIVE::SetUndoJournal(
+    IN OUT  PUNDO_JOURNAL   Journal
+    )
+/*++
+
+Routine Description:
+
+    This routine supplies an undo journal which receives the current
+    contents of the sectors each write batch overwrites, before the
+    batch is written.
+
+Arguments:
+
+    Journal - Supplies the journal, or NULL for none.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DebugAssert(_cache);
+    _cache->SetUndoJournal(Journal);
+}
+
+
+PUNDO_JOURNAL
+IO_DP_DRIVE::QueryUndoJournal(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the journal supplied by SetUndoJournal.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The undo journal, or NULL if there is none.
+
+--*/
+{
+    DebugAssert(_cache);
+    return _cache->QueryUndoJournal();
+}
+
+
+VOID
+IO_DP_DRIVE::SetIoStats(
+    IN OUT  PIO_STATS   Stats
+    )
+/*++
+
+Routine Description:
+
+    This routine supplies an object which records every read and
+    write made to the device, and the time each took.
+
+Arguments:
+
+    Stats   - Supplies the statistics, or NULL for none.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _stats = Stats;
+}
+
+
+PIO_STATS
+IO_DP_DRIVE::QueryIoStats(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the statistics supplied by SetIoStats.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The statistics, or NULL if there are none.
+
+--*/
+{
+    return _stats;
+}
+
+
+VOID
+IO_DP_DRIVE::SetIoPhase(
+    IN  ULONG   Phase
+    )
+/*++
+
+Routine Description:
+
+    This routine starts a new phase in the statistics, if there are
+    any.
+
+Arguments:
+
+    Phase   - Supplies the phase.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (_stats) {
+        _stats->SetPhase(Phase);
+    }
+}
+
+
+ULONG
+IO_DP_DRIVE::SetIoStream(
+    IN  ULONG   Stream
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the metadata stream that subsequent reads and
+    writes are recorded against, if there are statistics or a trace.
+
+Arguments:
+
+    Stream  - Supplies the stream.
+
+Return Value:
+
+    The stream that was current before.
+
+--*/
+{
+    ULONG previous = IO_STATS_STREAM_OTHER;
+
+    if (_trace) {
+        previous = _trace->SetStream(Stream);
+    }
+
+    if (_stats) {
+        previous = _stats->SetStream(Stream);
+    }
+
+    return previous;
+}
+
+
+ULONG
+IO_DP_DRIVE::QueryIoStream(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the metadata stream that reads and writes are
+    recorded against.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The current stream, or IO_STATS_STREAM_OTHER if nothing is
+    recorded.
+
+--*/
+{
+    if (_stats) {
+        return _stats->QueryStream();
+    }
+
+    return _trace ? _trace->QueryStream() : IO_STATS_STREAM_OTHER;
+}
+
+
+VOID
+IO_DP_DRIVE::SetIoTrace(
+    IN OUT  PIO_TRACE   Trace
+    )
+/*++
+
+Routine Description:
+
+    This routine supplies an object which records a trace of every
+    request made to the device, including the ones that fail.  The
+    trace starts out on the stream of the statistics, if there are
+    any.
+
+Arguments:
+
+    Trace   - Supplies the trace, or NULL for none.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Trace) {
+        Trace->SetStream(QueryIoStream());
+    }
+
+    _trace = Trace;
+}
+
+
 BOOLEAN
 IO_DP_DRIVE::HardRead(
     IN  BIG_INT     StartingSector,
@@ -1103,6 +1462,7 @@ Return Value:
     BIG_INT         byte_offset;
     BIG_INT         tmp;
     LARGE_INTEGER   l;
+    LONGLONG        start;
 
     DebugAssert(!(((ULONG_PTR) Buffer) & QueryAlignmentMask()));
 
@@ -1127,9 +1487,16 @@ Return Value:
 
         l = byte_offset.GetLargeInteger();
 
+        start = (_stats || _trace) ? IO_STATS::QueryTicks() : 0;
+
         _last_status = NtReadFile(_handle, 0, NULL, NULL, &status_block,
                                   bufptr, buffer_size, &l, NULL);
 
+        if (_trace) {
+            _trace->Record(IO_TRACE_OP_READ, secptr.GetQuadPart(), buffer_size,
+                           _last_status, start, IO_STATS::QueryTicks());
+        }
+
         if (_last_status == STATUS_NO_MEMORY) {
             increment /= 2;
             secptr -= increment;
@@ -1160,6 +1527,11 @@ Return Value:
             return FALSE;
         }
 
+        if (_stats) {
+            _stats->RecordRead(_stats->QueryStream(), buffer_size,
+                               IO_STATS::QueryTicks() - start);
+        }
+
         bufptr += buffer_size;
     }
 
@@ -1207,6 +1579,7 @@ Return Value:
     BIG_INT         byte_offset;
     BIG_INT         tmp;
     LARGE_INTEGER   l;
+    LONGLONG        start;
     CHAR            ScratchIoBuf[MaxIoSize + 511];
 
     DebugAssert(!(((ULONG_PTR) Buffer) & QueryAlignmentMask()));
@@ -1239,9 +1612,16 @@ Return Value:
 
         l = byte_offset.GetLargeInteger();
 
+        start = (_stats || _trace) ? IO_STATS::QueryTicks() : 0;
+
         _last_status = NtWriteFile(_handle, 0, NULL, NULL, &status_block,
                                    bufptr, buffer_size, &l, NULL);
 
+        if (_trace) {
+            _trace->Record(IO_TRACE_OP_WRITE, secptr.GetQuadPart(), buffer_size,
+                           _last_status, start, IO_STATS::QueryTicks());
+        }
+
         if (_last_status == STATUS_NO_MEMORY) {
             increment /= 2;
             secptr -= increment;
@@ -1261,11 +1641,25 @@ Return Value:
             return FALSE;
         }
 
+        if (_stats) {
+            _stats->RecordWrite(_stats->QueryStream(), buffer_size,
+                                IO_STATS::QueryTicks() - start);
+        }
+
+        if (_stats || _trace) {
+            start = IO_STATS::QueryTicks();
+        }
+
         DebugAssert(buffer_size <= MaxIoSize);
 
         _last_status = NtReadFile(_handle, 0, NULL, NULL, &status_block,
                                   scratch_ptr, buffer_size, &l, NULL);
 
+        if (_trace) {
+            _trace->Record(IO_TRACE_OP_READ_BACK, secptr.GetQuadPart(), buffer_size,
+                           _last_status, start, IO_STATS::QueryTicks());
+        }
+
         if (NT_ERROR(_last_status) || status_block.Information != buffer_size) {
 
             if (NT_ERROR(_last_status)) {
@@ -1302,6 +1696,10 @@ Return Value:
             return FALSE;
         }
 
+        if (_stats) {
+            _stats->RecordVerify(buffer_size, IO_STATS::QueryTicks() - start);
+        }
+
         bufptr += buffer_size;
     }
 
@@ -1421,6 +1819,7 @@ Return Value:
     IO_STATUS_BLOCK     status_block;
     BIG_INT             starting_offset;
     BIG_INT             verify_size;
+    LONGLONG            start;
 
     DebugAssert(QuerySectorSize());
 
@@ -1440,12 +1839,20 @@ Return Value:
     DebugAssert(verify_size.GetHighPart() == 0);
     verify_info.Length = verify_size.GetLowPart();
 
+    start = _trace ? IO_STATS::QueryTicks() : 0;
+
     _last_status = NtDeviceIoControlFile(_handle, 0, NULL, NULL,
                                          &status_block, IOCTL_DISK_VERIFY,
                                          &verify_info,
                                          sizeof(VERIFY_INFORMATION),
                                          NULL, 0);
 
+    if (_trace) {
+        _trace->Record(IO_TRACE_OP_VERIFY, StartingSector.GetQuadPart(),
+                       verify_info.Length, _last_status, start,
+                       IO_STATS::QueryTicks());
+    }
+
     return (BOOLEAN) NT_SUCCESS(_last_status);
 }
 
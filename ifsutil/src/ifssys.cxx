@@ -290,11 +290,13 @@ DECLARE_CLASS(DRIVE);
 DECLARE_CLASS(DRIVE_CACHE);
 DECLARE_CLASS(INTSTACK);
 DECLARE_CLASS(IO_DP_DRIVE);
+DECLARE_CLASS(IO_STATS);
 DECLARE_CLASS(LOG_IO_DP_DRIVE);
 DECLARE_CLASS(NUMBER_EXTENT);
 DECLARE_CLASS(NUMBER_SET);
 DECLARE_CLASS(SECRUN);
 DECLARE_CLASS(SUPERAREA);
+DECLARE_CLASS(UNDO_JOURNAL);
 DECLARE_CLASS(VOL_LIODPDRV);
 
 
@@ -307,11 +309,13 @@ IfsutilDefineClassDescriptors(
         DEFINE_CLASS_DESCRIPTOR(DRIVE_CACHE) &&
         DEFINE_CLASS_DESCRIPTOR(INTSTACK) &&
         DEFINE_CLASS_DESCRIPTOR(IO_DP_DRIVE) &&
+        DEFINE_CLASS_DESCRIPTOR(IO_STATS) &&
         DEFINE_CLASS_DESCRIPTOR(LOG_IO_DP_DRIVE) &&
         DEFINE_CLASS_DESCRIPTOR(NUMBER_EXTENT) &&
         DEFINE_CLASS_DESCRIPTOR(NUMBER_SET) &&
         DEFINE_CLASS_DESCRIPTOR(SECRUN) &&
         DEFINE_CLASS_DESCRIPTOR(SUPERAREA) &&
+        DEFINE_CLASS_DESCRIPTOR(UNDO_JOURNAL) &&
         DEFINE_CLASS_DESCRIPTOR(VOL_LIODPDRV)) {
 
         return TRUE;
@@ -333,11 +337,13 @@ IfsutilUndefineClassDescriptors(
     UNDEFINE_CLASS_DESCRIPTOR(DRIVE_CACHE);
     UNDEFINE_CLASS_DESCRIPTOR(INTSTACK);
     UNDEFINE_CLASS_DESCRIPTOR(IO_DP_DRIVE);
+    UNDEFINE_CLASS_DESCRIPTOR(IO_STATS);
     UNDEFINE_CLASS_DESCRIPTOR(LOG_IO_DP_DRIVE);
     UNDEFINE_CLASS_DESCRIPTOR(NUMBER_EXTENT);
     UNDEFINE_CLASS_DESCRIPTOR(NUMBER_SET);
     UNDEFINE_CLASS_DESCRIPTOR(SECRUN);
     UNDEFINE_CLASS_DESCRIPTOR(SUPERAREA);
+    UNDEFINE_CLASS_DESCRIPTOR(UNDO_JOURNAL);
     UNDEFINE_CLASS_DESCRIPTOR(VOL_LIODPDRV);
     return TRUE;
 }
@@ -0,0 +1,579 @@
+#include "stdafx.h"
+
+/*++
+
+Module Name:
+
+    iostats.cxx
+
+Abstract:
+
+    This module contains the member function definitions for
+    IO_STATS, which collects timing and I/O accounting for a run.
+
+--*/
+
+
+#include "ulib.hxx"
+
+#include "iostats.hxx"
+
+
+DEFINE_CONSTRUCTOR( IO_STATS, OBJECT );
+
+
+IO_STATS::~IO_STATS(
+    )
+/*++
+
+Routine Description:
+
+    Destructor for IO_STATS.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Destroy();
+}
+
+
+VOID
+IO_STATS::Construct(
+    )
+/*++
+
+Routine Description:
+
+    Constructor for IO_STATS.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _frequency = 1;
+    _phase = IO_STATS_PHASE_NONE;
+    _phase_start = 0;
+    _stream = IO_STATS_STREAM_OTHER;
+    memset(_phase_ticks, 0, sizeof(_phase_ticks));
+    memset(_reads, 0, sizeof(_reads));
+    memset(_writes, 0, sizeof(_writes));
+    memset(&_verify, 0, sizeof(_verify));
+    _skipped_file_name_updates = 0;
+    memset(_read_latency, 0, sizeof(_read_latency));
+    memset(_write_latency, 0, sizeof(_write_latency));
+}
+
+
+VOID
+IO_STATS::Destroy(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns an IO_STATS object to its initial state.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Construct();
+}
+
+
+BOOLEAN
+IO_STATS::Initialize(
+    )
+/*++
+
+Routine Description:
+
+    This routine initializes an IO_STATS object with everything at
+    zero.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    LARGE_INTEGER frequency;
+
+    Destroy();
+
+    if (!QueryPerformanceFrequency(&frequency) || frequency.QuadPart == 0) {
+        return FALSE;
+    }
+
+    _frequency = frequency.QuadPart;
+
+    return TRUE;
+}
+
+
+VOID
+IO_STATS::SetPhase(
+    IN  ULONG   Phase
+    )
+/*++
+
+Routine Description:
+
+    This routine ends the current phase, adding its time to the total
+    for that phase, and starts the given one.  The time spent in
+    IO_STATS_PHASE_NONE is not counted.
+
+Arguments:
+
+    Phase   - Supplies the phase that starts now.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LONGLONG now = QueryTicks();
+
+    DebugAssert(Phase < IO_STATS_PHASES);
+
+    if (_phase != IO_STATS_PHASE_NONE) {
+        _phase_ticks[_phase] += now - _phase_start;
+    }
+
+    _phase = Phase;
+    _phase_start = now;
+}
+
+
+ULONG
+IO_STATS::SetStream(
+    IN  ULONG   Stream
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the stream that subsequent requests are recorded
+    against.
+
+Arguments:
+
+    Stream  - Supplies the stream.
+
+Return Value:
+
+    The stream that was current before.
+
+--*/
+{
+    ULONG previous = _stream;
+
+    DebugAssert(Stream < IO_STATS_STREAMS);
+
+    _stream = Stream;
+
+    return previous;
+}
+
+
+LONGLONG
+IO_STATS::QueryTicks(
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the monotonic high-resolution counter.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The current count, in units of the performance counter frequency.
+
+--*/
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+
+VOID
+IO_STATS::RecordRead(
+    IN  ULONG       Stream,
+    IN  ULONG       Bytes,
+    IN  LONGLONG    Ticks
+    )
+/*++
+
+Routine Description:
+
+    This routine records a read request made to the device.
+
+Arguments:
+
+    Stream  - Supplies the stream that was read.
+    Bytes   - Supplies the number of bytes read.
+    Ticks   - Supplies how long the request took.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _reads[Stream].Operations++;
+    _reads[Stream].Bytes += Bytes;
+    _reads[Stream].Ticks += Ticks;
+    _read_latency[QueryBucket(Ticks)]++;
+}
+
+
+VOID
+IO_STATS::RecordWrite(
+    IN  ULONG       Stream,
+    IN  ULONG       Bytes,
+    IN  LONGLONG    Ticks
+    )
+/*++
+
+Routine Description:
+
+    This routine records a write request made to the device.
+
+Arguments:
+
+    Stream  - Supplies the stream that was written.
+    Bytes   - Supplies the number of bytes written.
+    Ticks   - Supplies how long the request took.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _writes[Stream].Operations++;
+    _writes[Stream].Bytes += Bytes;
+    _writes[Stream].Ticks += Ticks;
+    _write_latency[QueryBucket(Ticks)]++;
+}
+
+
+VOID
+IO_STATS::RecordVerify(
+    IN  ULONG       Bytes,
+    IN  LONGLONG    Ticks
+    )
+/*++
+
+Routine Description:
+
+    This routine records the read-back of a write, and its comparison
+    with what was written.
+
+Arguments:
+
+    Bytes   - Supplies the number of bytes read back.
+    Ticks   - Supplies how long the read and the comparison took.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _verify.Operations++;
+    _verify.Bytes += Bytes;
+    _verify.Ticks += Ticks;
+}
+
+
+VOID
+IO_STATS::RecordSkippedFileNameUpdates(
+    IN  ULONG   Count
+    )
+/*++
+
+Routine Description:
+
+    This routine records parent index updates that a flush skipped
+    because the file names of the records had not changed.
+
+Arguments:
+
+    Count   - Supplies the number of updates skipped.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _skipped_file_name_updates += Count;
+}
+
+
+double
+IO_STATS::QueryPhaseSeconds(
+    IN  ULONG   Phase
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the time spent in a phase so far, including
+    the current one.
+
+Arguments:
+
+    Phase   - Supplies the phase.
+
+Return Value:
+
+    The time in seconds.
+
+--*/
+{
+    LONGLONG ticks = _phase_ticks[Phase];
+
+    if (Phase == _phase && Phase != IO_STATS_PHASE_NONE) {
+        ticks += QueryTicks() - _phase_start;
+    }
+
+    return QuerySeconds(ticks);
+}
+
+
+VOID
+IO_STATS::QueryReads(
+    IN  ULONG               Stream,
+    OUT PIO_STATS_COUNTERS  Counters
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the reads made for a stream.
+
+Arguments:
+
+    Stream      - Supplies the stream.
+    Counters    - Receives the counters.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    *Counters = _reads[Stream];
+}
+
+
+VOID
+IO_STATS::QueryWrites(
+    IN  ULONG               Stream,
+    OUT PIO_STATS_COUNTERS  Counters
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the writes made for a stream.
+
+Arguments:
+
+    Stream      - Supplies the stream.
+    Counters    - Receives the counters.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    *Counters = _writes[Stream];
+}
+
+
+VOID
+IO_STATS::QueryVerify(
+    OUT PIO_STATS_COUNTERS  Counters
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the read-backs made to verify writes.
+
+Arguments:
+
+    Counters    - Receives the counters.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    *Counters = _verify;
+}
+
+
+ULONGLONG
+IO_STATS::QuerySkippedFileNameUpdates(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the number of parent index updates skipped
+    because the file names had not changed.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of updates skipped.
+
+--*/
+{
+    return _skipped_file_name_updates;
+}
+
+
+ULONGLONG
+IO_STATS::QueryReadLatency(
+    IN  ULONG   Bucket
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the number of reads in a latency bucket.
+
+Arguments:
+
+    Bucket  - Supplies the bucket.
+
+Return Value:
+
+    The number of reads.
+
+--*/
+{
+    return _read_latency[Bucket];
+}
+
+
+ULONGLONG
+IO_STATS::QueryWriteLatency(
+    IN  ULONG   Bucket
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the number of writes in a latency bucket.
+
+Arguments:
+
+    Bucket  - Supplies the bucket.
+
+Return Value:
+
+    The number of writes.
+
+--*/
+{
+    return _write_latency[Bucket];
+}
+
+
+double
+IO_STATS::QuerySeconds(
+    IN  LONGLONG    Ticks
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine converts a duration from counter ticks to seconds.
+
+Arguments:
+
+    Ticks   - Supplies the duration.
+
+Return Value:
+
+    The duration in seconds.
+
+--*/
+{
+    return (double) Ticks / (double) _frequency;
+}
+
+
+ULONG
+IO_STATS::QueryBucket(
+    IN  LONGLONG    Ticks
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine finds the latency bucket of a request.
+
+Arguments:
+
+    Ticks   - Supplies how long the request took.
+
+Return Value:
+
+    The bucket.
+
+--*/
+{
+    LONGLONG    microseconds = Ticks * 1000000 / _frequency;
+    ULONG       bucket = 0;
+
+    while (microseconds > 0 && bucket < IO_STATS_LATENCY_BUCKETS - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
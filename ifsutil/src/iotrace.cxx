@@ -0,0 +1,373 @@
+#include "stdafx.h"
+
+/*++
+
+Module Name:
+
+    iotrace.cxx
+
+Abstract:
+
+    This module contains the member function definitions for
+    IO_TRACE, which records a trace of the requests made to a device.
+
+--*/
+
+
+#include "ulib.hxx"
+
+#include "iotrace.hxx"
+#include "iostats.hxx"
+
+
+DEFINE_CONSTRUCTOR( IO_TRACE, OBJECT );
+
+
+IO_TRACE::~IO_TRACE(
+    )
+/*++
+
+Routine Description:
+
+    Destructor for IO_TRACE.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Destroy();
+}
+
+
+VOID
+IO_TRACE::Construct(
+    )
+/*++
+
+Routine Description:
+
+    Constructor for IO_TRACE.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _handle = INVALID_HANDLE_VALUE;
+    _failed = FALSE;
+    _frequency = 1;
+    _start = 0;
+    _stream = IO_STATS_STREAM_OTHER;
+    _records = NULL;
+    _num_records = 0;
+}
+
+
+VOID
+IO_TRACE::Destroy(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns an IO_TRACE object to its initial state.  The
+    records still in the buffer are written out first.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Close();
+    FREE(_records);
+    Construct();
+}
+
+
+BOOLEAN
+IO_TRACE::Initialize(
+    IN  PCWSTRING   FileName,
+    IN  ULONG       SectorSize,
+    IN  LONGLONG    VolumeSectors
+    )
+/*++
+
+Routine Description:
+
+    This routine creates the trace file and writes its header.
+
+Arguments:
+
+    FileName        - Supplies the name of the trace file.
+    SectorSize      - Supplies the sector size of the drive.
+    VolumeSectors   - Supplies the number of sectors of the drive.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    IO_TRACE_HEADER header;
+    LARGE_INTEGER   frequency;
+    FILETIME        now;
+    DWORD           bytes_written;
+
+    Destroy();
+
+    if (!QueryPerformanceFrequency(&frequency) || frequency.QuadPart == 0) {
+        return FALSE;
+    }
+
+    _frequency = frequency.QuadPart;
+
+    if (!(_records = (PIO_TRACE_RECORD)
+          MALLOC(IO_TRACE_BUFFER_RECORDS*sizeof(IO_TRACE_RECORD)))) {
+        return FALSE;
+    }
+
+    _handle = CreateFileW((LPCWSTR) FileName->GetWSTR(),
+                          GENERIC_WRITE,
+                          FILE_SHARE_READ,
+                          NULL,
+                          CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                          NULL);
+
+    if (_handle == INVALID_HANDLE_VALUE) {
+        Destroy();
+        return FALSE;
+    }
+
+    GetSystemTimeAsFileTime(&now);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Signature, IO_TRACE_SIGNATURE, sizeof(header.Signature));
+    header.Version = IO_TRACE_VERSION;
+    header.SectorSize = SectorSize;
+    header.VolumeSectors = VolumeSectors;
+    header.StartTime = ((LONGLONG) now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+    if (!WriteFile(_handle, &header, sizeof(header), &bytes_written, NULL) ||
+        bytes_written != sizeof(header)) {
+        Destroy();
+        return FALSE;
+    }
+
+    _start = IO_STATS::QueryTicks();
+
+    return TRUE;
+}
+
+
+ULONG
+IO_TRACE::SetStream(
+    IN  ULONG   Stream
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the stream that subsequent requests are recorded
+    against.
+
+Arguments:
+
+    Stream  - Supplies the stream.
+
+Return Value:
+
+    The stream that was current before.
+
+--*/
+{
+    ULONG previous = _stream;
+
+    DebugAssert(Stream < IO_STATS_STREAMS);
+
+    _stream = Stream;
+
+    return previous;
+}
+
+
+VOID
+IO_TRACE::Record(
+    IN  ULONG       Operation,
+    IN  LONGLONG    StartingSector,
+    IN  ULONG       Length,
+    IN  NTSTATUS    Status,
+    IN  LONGLONG    StartTicks,
+    IN  LONGLONG    EndTicks
+    )
+/*++
+
+Routine Description:
+
+    This routine records a request made to the device.  A failure to
+    write the trace does not fail the request; it is reported by
+    Close.
+
+Arguments:
+
+    Operation       - Supplies the kind of request, IO_TRACE_OP_*.
+    StartingSector  - Supplies the first sector of the request.
+    Length          - Supplies the number of bytes of the request.
+    Status          - Supplies how the request ended.
+    StartTicks      - Supplies the performance counter when it was made.
+    EndTicks        - Supplies the performance counter when it ended.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PIO_TRACE_RECORD    record;
+    ULONGLONG           latency;
+
+    if (_handle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    latency = QueryMicroseconds(EndTicks - StartTicks);
+
+    record = &_records[_num_records++];
+    record->Time = QueryMicroseconds(StartTicks - _start);
+    record->StartingSector = StartingSector;
+    record->Length = Length;
+    record->Status = Status;
+    record->Latency = latency > MAXULONG ? MAXULONG : (ULONG) latency;
+    record->Operation = (UCHAR) Operation;
+    record->Stream = (UCHAR) _stream;
+    record->Reserved = 0;
+
+    if (_num_records == IO_TRACE_BUFFER_RECORDS) {
+        Flush();
+    }
+}
+
+
+BOOLEAN
+IO_TRACE::Close(
+    )
+/*++
+
+Routine Description:
+
+    This routine writes out the records still in the buffer and closes
+    the trace file.  Nothing more is recorded after it.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Some of the trace could not be written.
+    TRUE    - Success.
+
+--*/
+{
+    BOOLEAN r;
+
+    if (_handle == INVALID_HANDLE_VALUE) {
+        return !_failed;
+    }
+
+    Flush();
+
+    CloseHandle(_handle);
+    _handle = INVALID_HANDLE_VALUE;
+
+    r = !_failed;
+    _failed = FALSE;
+
+    return r;
+}
+
+
+BOOLEAN
+IO_TRACE::Flush(
+    )
+/*++
+
+Routine Description:
+
+    This routine appends the records in the buffer to the trace file.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    DWORD   length = _num_records*sizeof(IO_TRACE_RECORD);
+    DWORD   bytes_written;
+
+    _num_records = 0;
+
+    if (length == 0) {
+        return TRUE;
+    }
+
+    if (!WriteFile(_handle, _records, length, &bytes_written, NULL) ||
+        bytes_written != length) {
+        _failed = TRUE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+ULONGLONG
+IO_TRACE::QueryMicroseconds(
+    IN  LONGLONG    Ticks
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine converts a count of the performance counter to
+    microseconds.
+
+Arguments:
+
+    Ticks   - Supplies the count.
+
+Return Value:
+
+    The number of microseconds.
+
+--*/
+{
+    if (Ticks <= 0) {
+        return 0;
+    }
+
+    return (ULONGLONG) (Ticks/_frequency)*1000000 +
+           (ULONGLONG) (Ticks%_frequency)*1000000/_frequency;
+}
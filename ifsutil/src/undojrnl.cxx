@@ -0,0 +1,1000 @@
+#include "stdafx.h"
+
+/*++
+
+Module Name:
+
+    undojrnl.cxx
+
+Abstract:
+
+    This module contains the member function definitions for
+    UNDO_JOURNAL, which saves the contents of the sectors a write
+    batch overwrites and can put them back.
+
+--*/
+
+
+#include "ulib.hxx"
+
+#include "undojrnl.hxx"
+#include "message.hxx"
+
+
+DEFINE_CONSTRUCTOR( UNDO_JOURNAL, OBJECT );
+
+
+UNDO_JOURNAL::~UNDO_JOURNAL(
+    )
+/*++
+
+Routine Description:
+
+    Destructor for UNDO_JOURNAL.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Destroy();
+}
+
+
+VOID
+UNDO_JOURNAL::Construct(
+    )
+/*++
+
+Routine Description:
+
+    Constructor for UNDO_JOURNAL.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _serial_number = 0;
+    _buffer = NULL;
+    _length = 0;
+    _max_length = 0;
+    _num_records = 0;
+    _total_records = 0;
+    _file_length = 0;
+    _written = FALSE;
+    _write_error = ERROR_SUCCESS;
+}
+
+
+VOID
+UNDO_JOURNAL::Destroy(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns an UNDO_JOURNAL object to its initial state.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    FREE(_buffer);
+    _serial_number = 0;
+    _length = 0;
+    _max_length = 0;
+    _num_records = 0;
+    _total_records = 0;
+    _file_length = 0;
+    _written = FALSE;
+    _write_error = ERROR_SUCCESS;
+}
+
+
+BOOLEAN
+UNDO_JOURNAL::Initialize(
+    IN  PCWSTRING   FileName,
+    IN  LONGLONG    VolumeSerialNumber
+    )
+/*++
+
+Routine Description:
+
+    This routine initializes an UNDO_JOURNAL object.  Nothing is
+    written to the file until Write is called, and Restore only reads
+    from it.
+
+Arguments:
+
+    FileName            - Supplies the name of the journal file.
+    VolumeSerialNumber  - Supplies the serial number of the volume,
+                          which Write records and Restore checks.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    Destroy();
+
+    DebugAssert(FileName);
+
+    if (!_file_name.Initialize(FileName)) {
+        return FALSE;
+    }
+
+    _serial_number = VolumeSerialNumber;
+
+    // Leave room for the header, which is filled in by Write.
+
+    if (!Reserve(sizeof(UNDO_JOURNAL_HEADER))) {
+        Destroy();
+        return FALSE;
+    }
+
+    _length = sizeof(UNDO_JOURNAL_HEADER);
+
+    return TRUE;
+}
+
+
+PVOID
+UNDO_JOURNAL::AddPreImage(
+    IN  LONGLONG    StartingSector,
+    IN  SECTORCOUNT NumberOfSectors,
+    IN  ULONG       SectorSize,
+    IN  ULONG       PostImageChecksum
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a record for a run of sectors to the journal.
+    The caller reads the current contents of the run into the returned
+    buffer before calling AddPreImage or Write again.  The records are
+    held in memory until the next Write or DiscardPreImages.
+
+Arguments:
+
+    StartingSector      - Supplies the first sector of the run.
+    NumberOfSectors     - Supplies the number of sectors in the run.
+    SectorSize          - Supplies the number of bytes per sector.
+    PostImageChecksum   - Supplies the CRC-32 of the run as the batch
+                          will leave it.
+
+Return Value:
+
+    A buffer of NumberOfSectors*SectorSize bytes for the contents of
+    the run, or NULL if there is not enough memory.
+
+--*/
+{
+    PUNDO_JOURNAL_RECORD    record;
+    ULONG                   data_length;
+
+    data_length = NumberOfSectors*SectorSize;
+
+    if (!Reserve(sizeof(UNDO_JOURNAL_RECORD) + data_length)) {
+        return NULL;
+    }
+
+    record = (PUNDO_JOURNAL_RECORD) (_buffer + _length);
+    record->StartingSector = StartingSector;
+    record->NumberOfSectors = NumberOfSectors;
+    record->Checksum = 0;
+    record->PostImageChecksum = PostImageChecksum;
+    record->Reserved = 0;
+
+    _length += sizeof(UNDO_JOURNAL_RECORD) + data_length;
+    _num_records++;
+
+    return record + 1;
+}
+
+
+BOOLEAN
+UNDO_JOURNAL::Write(
+    IN  ULONG       SectorSize,
+    IN  LONGLONG    VolumeSectors
+    )
+/*++
+
+Routine Description:
+
+    This routine seals the records added since the last Write and
+    writes them to the journal file, then flushes the file.  The first
+    Write replaces any earlier journal of the same name; later ones
+    append their records with one write and then rewrite the header
+    to count them.  One flush covers both: the header carries the
+    checksum of the records it adds, so Restore can tell if they did
+    not reach the disk.  The records are dropped from memory either
+    way.
+
+Arguments:
+
+    SectorSize      - Supplies the number of bytes per sector.
+    VolumeSectors   - Supplies the number of sectors on the volume.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.  The journal is on stable storage.
+
+--*/
+{
+    PUNDO_JOURNAL_HEADER    header;
+    PUNDO_JOURNAL_RECORD    record;
+    ULONG                   offset, record_length;
+    ULONG                   i;
+    HANDLE                  handle;
+    LARGE_INTEGER           end;
+    PCHAR                   data;
+    ULONG                   data_length;
+    ULONG                   batch_records, batch_checksum;
+    DWORD                   bytes_written;
+    BOOL                    r;
+
+    DebugAssert(_buffer);
+
+    _write_error = ERROR_SUCCESS;
+
+    if (_total_records + _num_records < _total_records) {
+        _write_error = ERROR_ARITHMETIC_OVERFLOW;
+        DiscardPreImages();
+        return FALSE;
+    }
+
+    offset = sizeof(UNDO_JOURNAL_HEADER);
+
+    for (i = 0; i < _num_records; i++) {
+
+        record = (PUNDO_JOURNAL_RECORD) (_buffer + offset);
+        record_length = sizeof(UNDO_JOURNAL_RECORD) +
+                        record->NumberOfSectors*SectorSize;
+
+        record->Checksum = 0;
+        record->Checksum = ComputeChecksum(record, record_length);
+
+        offset += record_length;
+    }
+
+    DebugAssert(offset == _length);
+
+    header = (PUNDO_JOURNAL_HEADER) _buffer;
+
+    if (!_written) {
+        memcpy(header->Signature, UNDO_JOURNAL_SIGNATURE, sizeof(header->Signature));
+        header->Version = UNDO_JOURNAL_VERSION;
+        header->SectorSize = SectorSize;
+        header->VolumeSectors = VolumeSectors;
+        header->VolumeSerialNumber = _serial_number;
+        header->Flags = 0;
+        header->LastBatchRecords = 0;
+        header->LastBatchChecksum = 0;
+        header->Reserved = 0;
+    }
+
+    DebugAssert(header->SectorSize == SectorSize);
+
+    batch_records = header->LastBatchRecords;
+    batch_checksum = header->LastBatchChecksum;
+
+    header->NumberOfRecords = _total_records + _num_records;
+    header->LastBatchRecords = _num_records;
+    header->LastBatchChecksum = ComputeChecksum(_buffer + sizeof(UNDO_JOURNAL_HEADER),
+                                                _length - sizeof(UNDO_JOURNAL_HEADER));
+    header->Checksum = 0;
+    header->Checksum = ComputeChecksum(header, sizeof(UNDO_JOURNAL_HEADER));
+
+    handle = CreateFileW((LPCWSTR) _file_name.GetWSTR(),
+                         GENERIC_WRITE,
+                         0,
+                         NULL,
+                         _written ? OPEN_EXISTING : CREATE_ALWAYS,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                         NULL);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        _write_error = GetLastError();
+        DiscardPreImages();
+        return FALSE;
+    }
+
+    if (!_written) {
+
+        // A new journal: the header and the records in one write.
+
+        data = _buffer;
+        data_length = _length;
+        end.QuadPart = 0;
+
+    } else {
+
+        // Append the records after the ones already counted.  Until the
+        // header is rewritten, Restore ignores them, and until the flush
+        // below, it ignores them unless all of them match the checksum
+        // in the header; their batch has not touched the volume yet.
+        // Records left past the end by a failed Write are overwritten.
+
+        data = _buffer + sizeof(UNDO_JOURNAL_HEADER);
+        data_length = _length - sizeof(UNDO_JOURNAL_HEADER);
+        end.QuadPart = _file_length;
+    }
+
+    r = SetFilePointerEx(handle, end, NULL, FILE_BEGIN) &&
+        WriteFile(handle, data, data_length, &bytes_written, NULL) &&
+        bytes_written == data_length;
+
+    if (r && _written) {
+
+        end.QuadPart = 0;
+
+        r = SetFilePointerEx(handle, end, NULL, FILE_BEGIN) &&
+            WriteFile(handle, header, sizeof(UNDO_JOURNAL_HEADER), &bytes_written, NULL) &&
+            bytes_written == sizeof(UNDO_JOURNAL_HEADER);
+    }
+
+    r = r && FlushFileBuffers(handle);
+
+    if (!r && (_write_error = GetLastError()) == ERROR_SUCCESS) {
+
+        // A short write with no error means the disk is full.
+
+        _write_error = ERROR_DISK_FULL;
+    }
+
+    CloseHandle(handle);
+
+    if (!r) {
+
+        // The header in memory must keep matching the file.
+
+        header->NumberOfRecords = _total_records;
+        header->LastBatchRecords = batch_records;
+        header->LastBatchChecksum = batch_checksum;
+        header->Checksum = 0;
+        header->Checksum = ComputeChecksum(header, sizeof(UNDO_JOURNAL_HEADER));
+
+        DiscardPreImages();
+        return FALSE;
+    }
+
+    _file_length += data_length;
+    _total_records += _num_records;
+    _written = TRUE;
+
+    DiscardPreImages();
+
+    return TRUE;
+}
+
+
+VOID
+UNDO_JOURNAL::DiscardPreImages(
+    )
+/*++
+
+Routine Description:
+
+    This routine drops the records added since the last Write.  It is
+    called when their batch will not be written.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _length = sizeof(UNDO_JOURNAL_HEADER);
+    _num_records = 0;
+}
+
+
+BOOLEAN
+UNDO_JOURNAL::MarkComplete(
+    )
+/*++
+
+Routine Description:
+
+    This routine records in the journal file that the run which wrote
+    it completed.  The journal can still roll the run back.  The flag
+    only tells Restore to say so, and nothing is ordered after it, so
+    the file is not flushed.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success, or nothing was ever written to the journal.
+
+--*/
+{
+    PUNDO_JOURNAL_HEADER    header;
+    HANDLE                  handle;
+    DWORD                   bytes_written;
+    BOOL                    r;
+
+    if (!_written) {
+        return TRUE;
+    }
+
+    header = (PUNDO_JOURNAL_HEADER) _buffer;
+    header->Flags |= UNDO_JOURNAL_FLAG_COMPLETE;
+    header->Checksum = 0;
+    header->Checksum = ComputeChecksum(header, sizeof(UNDO_JOURNAL_HEADER));
+
+    handle = CreateFileW((LPCWSTR) _file_name.GetWSTR(),
+                         GENERIC_WRITE,
+                         0,
+                         NULL,
+                         OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL,
+                         NULL);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        _write_error = GetLastError();
+        return FALSE;
+    }
+
+    r = WriteFile(handle, header, sizeof(UNDO_JOURNAL_HEADER), &bytes_written, NULL) &&
+        bytes_written == sizeof(UNDO_JOURNAL_HEADER);
+
+    if (!r && (_write_error = GetLastError()) == ERROR_SUCCESS) {
+
+        // A short write with no error means the disk is full.
+
+        _write_error = ERROR_DISK_FULL;
+    }
+
+    CloseHandle(handle);
+
+    return r ? TRUE : FALSE;
+}
+
+
+STATIC
+BOOLEAN
+ReadJournalAt(
+    IN  HANDLE      Handle,
+    IN  LONGLONG    Offset,
+    OUT PVOID       Buffer,
+    IN  ULONG       Length
+    )
+/*++
+
+Routine Description:
+
+    This routine reads part of the journal file.
+
+Arguments:
+
+    Handle  - Supplies the journal file.
+    Offset  - Supplies the offset in the file of the first byte.
+    Buffer  - Returns the bytes read.
+    Length  - Supplies the number of bytes to read.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    LARGE_INTEGER   position;
+    DWORD           bytes_read;
+
+    position.QuadPart = Offset;
+
+    return SetFilePointerEx(Handle, position, NULL, FILE_BEGIN) &&
+           ReadFile(Handle, Buffer, Length, &bytes_read, NULL) &&
+           bytes_read == Length;
+}
+
+
+BOOLEAN
+UNDO_JOURNAL::Restore(
+    IN OUT  PIO_DP_DRIVE    Drive,
+    IN OUT  PMESSAGE        Message
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the journal file and writes the saved sectors
+    back to the drive.  The whole journal is checked before anything
+    is written, so a damaged journal leaves the drive untouched.  So
+    does a journal of another volume, or of one which has changed
+    since the journal was written.  A run which still holds the
+    sectors saved for it, because the commit of its batch was cut
+    short before reaching it, needs nothing put back and is skipped.
+
+    The records are read from the file one at a time, so the journal
+    may be of any size.  Bytes past the records the header counts are
+    ignored: they were appended by a Write that did not finish, and
+    their batch never reached the volume.  So are the records of the
+    last batch if they do not all match the checksum in the header:
+    the header reached the disk, but the flush that would have let
+    their batch be written did not finish.
+
+Arguments:
+
+    Drive   - Supplies the drive to restore.  It must be locked.
+    Message - Supplies an outlet for messages.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    UNDO_JOURNAL_HEADER     header;
+    PUNDO_JOURNAL_RECORD    record;
+    LONGLONG                offset;
+    PLONGLONG               record_offsets;
+    ULONG                   record_length, max_record_length;
+    ULONG                   checksum;
+    PCHAR                   buffer, new_buffer;
+    ULONG                   buffer_length;
+    PVOID                   current;
+    PCSTR                   error;
+    ULONG                   num_records, first_batch_record;
+    LONGLONG                batch_offset;
+    ULONG                   batch_checksum;
+    BOOLEAN                 valid;
+    ULONG                   unchanged;
+    ULONG                   i;
+    HANDLE                  handle;
+    LARGE_INTEGER           file_size;
+
+    DebugAssert(Drive);
+    DebugAssert(Message);
+
+    handle = CreateFileW((LPCWSTR) _file_name.GetWSTR(),
+                         GENERIC_READ,
+                         FILE_SHARE_READ,
+                         NULL,
+                         OPEN_EXISTING,
+                         FILE_FLAG_RANDOM_ACCESS,
+                         NULL);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        Message->Out("Cannot open the undo journal.");
+        return FALSE;
+    }
+
+    if (!GetFileSizeEx(handle, &file_size) ||
+        file_size.QuadPart < (LONGLONG) sizeof(UNDO_JOURNAL_HEADER)) {
+
+        CloseHandle(handle);
+        Message->Out("The undo journal is damaged.");
+        return FALSE;
+    }
+
+    if (!ReadJournalAt(handle, 0, &header, sizeof(UNDO_JOURNAL_HEADER))) {
+        CloseHandle(handle);
+        Message->Out("Cannot read the undo journal.");
+        return FALSE;
+    }
+
+    // Check the header, then every record, before writing anything.
+
+    checksum = header.Checksum;
+    header.Checksum = 0;
+
+    if (memcmp(header.Signature, UNDO_JOURNAL_SIGNATURE, sizeof(header.Signature)) ||
+        header.Version != UNDO_JOURNAL_VERSION ||
+        ComputeChecksum(&header, sizeof(UNDO_JOURNAL_HEADER)) != checksum) {
+
+        CloseHandle(handle);
+        Message->Out("The undo journal is damaged.");
+        return FALSE;
+    }
+
+    if (header.SectorSize != Drive->QuerySectorSize() ||
+        header.VolumeSectors != Drive->QuerySectors().GetQuadPart() ||
+        header.VolumeSerialNumber != _serial_number) {
+
+        CloseHandle(handle);
+        Message->Out("The undo journal was not made for this volume.");
+        return FALSE;
+    }
+
+    if (header.SectorSize == 0 ||
+        header.NumberOfRecords == MAXULONG ||
+        header.LastBatchRecords > header.NumberOfRecords ||
+        header.NumberOfRecords - header.LastBatchRecords >
+            (file_size.QuadPart - sizeof(UNDO_JOURNAL_HEADER))/sizeof(UNDO_JOURNAL_RECORD)) {
+
+        CloseHandle(handle);
+        Message->Out("The undo journal is damaged.");
+        return FALSE;
+    }
+
+    if (!(record_offsets = NEW LONGLONG[header.NumberOfRecords + 1])) {
+        CloseHandle(handle);
+        Message->Out("Out of memory.");
+        return FALSE;
+    }
+
+    if (!(buffer = (PCHAR) MALLOC(sizeof(UNDO_JOURNAL_RECORD)))) {
+        DELETE_ARRAY(record_offsets);
+        CloseHandle(handle);
+        Message->Out("Out of memory.");
+        return FALSE;
+    }
+
+    buffer_length = sizeof(UNDO_JOURNAL_RECORD);
+    max_record_length = sizeof(UNDO_JOURNAL_RECORD);
+    offset = sizeof(UNDO_JOURNAL_HEADER);
+    error = NULL;
+
+    // The records of the last batch were written together with the
+    // header and flushed once with it, so the header may have reached
+    // the disk without them.  Their batch was only written to the
+    // volume after the flush, so if any of them is missing or damaged,
+    // they are all left out.  A damaged record before them still means
+    // the journal is damaged.
+
+    num_records = header.NumberOfRecords;
+    first_batch_record = header.NumberOfRecords - header.LastBatchRecords;
+    batch_offset = offset;
+    batch_checksum = 0;
+
+    for (i = 0; i < num_records; i++) {
+
+        record = (PUNDO_JOURNAL_RECORD) buffer;
+        valid = FALSE;
+
+        if (i == first_batch_record) {
+            batch_offset = offset;
+        }
+
+        if (file_size.QuadPart - offset >= (LONGLONG) sizeof(UNDO_JOURNAL_RECORD)) {
+
+            if (!ReadJournalAt(handle, offset, record, sizeof(UNDO_JOURNAL_RECORD))) {
+                error = "Cannot read the undo journal.";
+                break;
+            }
+
+            valid = record->NumberOfSectors <=
+                        (file_size.QuadPart - offset - sizeof(UNDO_JOURNAL_RECORD))/header.SectorSize &&
+                    record->NumberOfSectors <=
+                        (MAXULONG - sizeof(UNDO_JOURNAL_RECORD))/header.SectorSize &&
+                    record->StartingSector >= 0 &&
+                    record->StartingSector + record->NumberOfSectors <= header.VolumeSectors;
+        }
+
+        if (valid) {
+
+            record_length = sizeof(UNDO_JOURNAL_RECORD) +
+                            record->NumberOfSectors*header.SectorSize;
+
+            if (buffer_length < record_length) {
+
+                if (!(new_buffer = (PCHAR) MALLOC(record_length))) {
+                    error = "Out of memory.";
+                    break;
+                }
+
+                FREE(buffer);
+                buffer = new_buffer;
+                buffer_length = record_length;
+                record = (PUNDO_JOURNAL_RECORD) buffer;
+            }
+
+            if (!ReadJournalAt(handle, offset, record, record_length)) {
+                error = "Cannot read the undo journal.";
+                break;
+            }
+
+            if (i >= first_batch_record) {
+                batch_checksum = ComputeChecksum(record, record_length, batch_checksum);
+            }
+
+            checksum = record->Checksum;
+            record->Checksum = 0;
+
+            valid = ComputeChecksum(record, record_length) == checksum;
+        }
+
+        if (!valid) {
+
+            if (i < first_batch_record) {
+                error = "The undo journal is damaged.";
+            } else {
+                num_records = first_batch_record;
+            }
+
+            break;
+        }
+
+        record_offsets[i] = offset;
+        offset += record_length;
+        max_record_length = max(max_record_length, record_length);
+    }
+
+    if (error) {
+        FREE(buffer);
+        DELETE_ARRAY(record_offsets);
+        CloseHandle(handle);
+        Message->Out(error);
+        return FALSE;
+    }
+
+    if (num_records == header.NumberOfRecords &&
+        num_records != first_batch_record &&
+        batch_checksum != header.LastBatchChecksum) {
+
+        num_records = first_batch_record;
+    }
+
+    if (num_records != header.NumberOfRecords) {
+        offset = batch_offset;
+        Message->Out("The last batch in the undo journal never reached the disk, and is left out.");
+    }
+
+    record_offsets[num_records] = offset;
+
+    if (header.Flags & UNDO_JOURNAL_FLAG_COMPLETE) {
+        Message->Out("The run that wrote the undo journal completed; rolling it back.");
+    }
+
+    // The buffer has grown to hold the longest record; the sectors read
+    // back from the volume need as much room as its data.
+
+    if (!(current = MALLOC(max((ULONG) (max_record_length - sizeof(UNDO_JOURNAL_RECORD)),
+                               header.SectorSize)))) {
+
+        FREE(buffer);
+        DELETE_ARRAY(record_offsets);
+        CloseHandle(handle);
+        Message->Out("Out of memory.");
+        return FALSE;
+    }
+
+    // Put the sectors back.  If several batches overwrote the same
+    // sector, the oldest pre-image is the one that counts, so the
+    // records go into the write batch newest first and the batch
+    // keeps the last write made to each sector.
+    //
+    // Reads made while the batch is open see the writes it holds, so
+    // each run is read as it will be once the newer records are put
+    // back, which is how its own batch left it, or, if the commit of
+    // its batch was cut short before the run was written, its
+    // pre-image.  If any run holds something else, the volume has
+    // changed since, and nothing is written.
+
+    if (!Drive->BeginWriteBatch()) {
+        FREE(current);
+        FREE(buffer);
+        DELETE_ARRAY(record_offsets);
+        CloseHandle(handle);
+        return FALSE;
+    }
+
+    record = (PUNDO_JOURNAL_RECORD) buffer;
+    unchanged = 0;
+
+    for (i = num_records; i > 0; i--) {
+
+        record_length = (ULONG) (record_offsets[i] - record_offsets[i - 1]);
+
+        if (!ReadJournalAt(handle, record_offsets[i - 1], record, record_length)) {
+
+            Drive->AbortWriteBatch();
+            FREE(current);
+            FREE(buffer);
+            DELETE_ARRAY(record_offsets);
+            CloseHandle(handle);
+            Message->Out("Cannot read the undo journal.");
+            return FALSE;
+        }
+
+        if (!Drive->Read((ULONGLONG) record->StartingSector,
+                         record->NumberOfSectors,
+                         current)) {
+
+            Drive->AbortWriteBatch();
+            FREE(current);
+            FREE(buffer);
+            DELETE_ARRAY(record_offsets);
+            CloseHandle(handle);
+            Message->Out("Cannot read from the volume.");
+            return FALSE;
+        }
+
+        // A run that still holds its pre-image was never reached by a
+        // commit that was cut short, and is left as it is.
+
+        if (memcmp(current, record + 1, record->NumberOfSectors*header.SectorSize) == 0) {
+            unchanged++;
+            continue;
+        }
+
+        if (ComputeChecksum(current, record->NumberOfSectors*header.SectorSize) !=
+                record->PostImageChecksum) {
+
+            Drive->AbortWriteBatch();
+            FREE(current);
+            FREE(buffer);
+            DELETE_ARRAY(record_offsets);
+            CloseHandle(handle);
+            Message->Out("The volume has changed since the undo journal was written.  Nothing was restored.");
+            return FALSE;
+        }
+
+        if (!Drive->Write((ULONGLONG) record->StartingSector,
+                          record->NumberOfSectors,
+                          record + 1)) {
+
+            Drive->AbortWriteBatch();
+            FREE(current);
+            FREE(buffer);
+            DELETE_ARRAY(record_offsets);
+            CloseHandle(handle);
+            Message->Out("Cannot write to the volume.  Nothing was restored.");
+            return FALSE;
+        }
+    }
+
+    FREE(current);
+    FREE(buffer);
+    DELETE_ARRAY(record_offsets);
+    CloseHandle(handle);
+
+    if (!Drive->CommitWriteBatch()) {
+        Message->Out("Cannot write to the volume.");
+        return FALSE;
+    }
+
+    if (num_records - unchanged == 1) {
+        Message->Out("Restored 1 run of sectors.");
+    } else {
+        Message->Out("Restored ", (LONGLONG) (num_records - unchanged), " runs of sectors.");
+    }
+
+    if (unchanged) {
+        Message->Out("Runs of sectors that were never written and still held their saved contents: ",
+                     (LONGLONG) unchanged);
+    }
+
+    return TRUE;
+}
+
+
+BOOLEAN
+UNDO_JOURNAL::Reserve(
+    IN  ULONG   Length
+    )
+/*++
+
+Routine Description:
+
+    This routine makes sure the journal buffer has room for Length
+    more bytes.
+
+Arguments:
+
+    Length  - Supplies the number of bytes needed.
+
+Return Value:
+
+    FALSE   - There is not enough memory.
+    TRUE    - Success.
+
+--*/
+{
+    PCHAR   new_buffer;
+    ULONG   new_max_length;
+
+    if (_max_length - _length >= Length) {
+        return TRUE;
+    }
+
+    new_max_length = max(2*_max_length, _length + Length);
+
+    if (!(new_buffer = (PCHAR) MALLOC(new_max_length))) {
+        return FALSE;
+    }
+
+    if (_length) {
+        memcpy(new_buffer, _buffer, _length);
+    }
+
+    FREE(_buffer);
+    _buffer = new_buffer;
+    _max_length = new_max_length;
+
+    return TRUE;
+}
+
+
+ULONG
+UNDO_JOURNAL::ComputeChecksum(
+    IN  PCVOID  Buffer,
+    IN  ULONG   Length,
+    IN  ULONG   Checksum
+    )
+/*++
+
+Routine Description:
+
+    This routine computes the CRC-32 (IEEE 802.3) of a buffer.  Data
+    that comes in pieces is checksummed by passing the result for one
+    piece with the next.
+
+Arguments:
+
+    Buffer      - Supplies the buffer.
+    Length      - Supplies the number of bytes in the buffer.
+    Checksum    - Supplies the CRC-32 of the data that comes before
+                  the buffer, or 0 if there is none.
+
+Return Value:
+
+    The CRC-32 of the data up to the end of the buffer.
+
+--*/
+{
+    STATIC ULONG            table[256];
+    STATIC volatile BOOLEAN table_ready = FALSE;
+    PUCHAR                  p;
+    ULONG                   crc, c;
+    ULONG                   i, j;
+
+    if (!table_ready) {
+
+        for (i = 0; i < 256; i++) {
+
+            c = i;
+
+            for (j = 0; j < 8; j++) {
+                c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            }
+
+            table[i] = c;
+        }
+
+        // Threads that race to build the table write the same values;
+        // make sure none of them sees it as ready before it is.
+        MemoryBarrier();
+        table_ready = TRUE;
+    }
+
+    p = (PUCHAR) Buffer;
+    crc = Checksum ^ 0xFFFFFFFF;
+
+    for (i = 0; i < Length; i++) {
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
@@ -169,7 +169,7 @@ Return Value:
 
 BOOLEAN
 VOL_LIODPDRV::MarkBad(
-    IN const std::vector<sectors_range>& physicalDriveSectorsTargets,
+    IN OUT sectors_range_source& physicalDriveSectorsTargets,
     IN OUT  PMESSAGE    Message
 )
 {
@@ -17,10 +17,14 @@ Abstract:
 
 #include <string>
 #include <iostream>
+#include <sstream>
 #include "wstring.hxx"
 
 DECLARE_CLASS( MESSAGE );
 
+// Receives the lines of a MESSAGE in place of the console.
+typedef VOID (*MESSAGE_SINK)(PVOID Context, const std::string& Line);
+
 class MESSAGE : public OBJECT {
 
     public:
@@ -33,35 +37,72 @@ class MESSAGE : public OBJECT {
 
         void Out(const char* str)
         {
-            std::cout << str << "\n";
+            std::ostringstream line;
+            line << str;
+            Write(line);
         }
         void Out(const char* str1, const std::string& str2)
         {
-            std::cout << str1 << str2 << "\n";
+            std::ostringstream line;
+            line << str1 << str2;
+            Write(line);
         }
         void Out(const char* str1, const std::string& str2, const char* str3)
         {
-            std::cout << str1 << str2 << str3 << "\n";
+            std::ostringstream line;
+            line << str1 << str2 << str3;
+            Write(line);
         }
         void Out(const char* str, LONGLONG number)
         {
-            std::cout << str << number << "\n";
+            std::ostringstream line;
+            line << str << number;
+            Write(line);
         }
         void Out(const char* str1, LONGLONG number, const char* str2)
         {
-            std::cout << str1 << number << str2 << "\n";
+            std::ostringstream line;
+            line << str1 << number << str2;
+            Write(line);
         }
         void Out(const char* str1, LONGLONG number1, const char* str2, LONGLONG number2, const char* str3)
         {
-            std::cout << str1 << number1 << str2 << number2 << str3 << "\n";
+            std::ostringstream line;
+            line << str1 << number1 << str2 << number2 << str3;
+            Write(line);
         }
         void Out(const char* str1, LONGLONG number1, const char* str2, LONGLONG number2, const char* str3, LONGLONG number3, const char* str4)
         {
-            std::cout << str1 << number1 << str2 << number2 << str3 << number3 << str4 << "\n";
+            std::ostringstream line;
+            line << str1 << number1 << str2 << number2 << str3 << number3 << str4;
+            Write(line);
         }
         void Out(const char* str1, int number, const char* str2, const std::string& str3)
         {
-            std::cout << str1 << number << str2 << str3 << "\n";
+            std::ostringstream line;
+            line << str1 << number << str2 << str3;
+            Write(line);
+        }
+        void Out(const char* str1, LONGLONG number, const char* str2, const std::string& str3)
+        {
+            std::ostringstream line;
+            line << str1 << number << str2 << str3;
+            Write(line);
+        }
+
+        // Tags every line written from now on, so that the output for
+        // volumes processed on different threads can be told apart.
+        void SetPrefix(const std::string& prefix)
+        {
+            _prefix = prefix;
+        }
+
+        // Sends every line written from now on to Sink instead of the
+        // console; NULL restores the console.
+        void SetSink(MESSAGE_SINK Sink, PVOID Context)
+        {
+            _sink = Sink;
+            _sink_context = Context;
         }
 
 		inline void OutIncorrectStructure()
@@ -84,6 +125,15 @@ class MESSAGE : public OBJECT {
         Destroy(
             );
 
+        VOID
+        Write(
+            IN  const std::ostringstream& Line
+            );
+
+        std::string     _prefix;
+        MESSAGE_SINK    _sink;
+        PVOID           _sink_context;
+
 };
 
 
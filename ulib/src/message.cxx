@@ -10,6 +10,28 @@
 DEFINE_CONSTRUCTOR(MESSAGE, OBJECT );
 
 
+//
+// Serializes the lines written by all MESSAGE objects.  It is set up
+// during static initialization, before any thread can write.
+//
+
+STATIC class MESSAGE_OUTPUT_LOCK {
+
+    public:
+
+        MESSAGE_OUTPUT_LOCK() { InitializeCriticalSection(&_lock); }
+        ~MESSAGE_OUTPUT_LOCK() { DeleteCriticalSection(&_lock); }
+
+        VOID Acquire() { EnterCriticalSection(&_lock); }
+        VOID Release() { LeaveCriticalSection(&_lock); }
+
+    private:
+
+        CRITICAL_SECTION _lock;
+
+} OutputLock;
+
+
 MESSAGE::~MESSAGE(
     )
 /*++
@@ -51,6 +73,8 @@ Return Value:
 
 --*/
 {
+    _sink = NULL;
+    _sink_context = NULL;
 }
 
 
@@ -98,3 +122,37 @@ Return Value:
 }
 
 
+VOID
+MESSAGE::Write(
+    IN  const std::ostringstream& Line
+    )
+/*++
+
+Routine Description:
+
+    This routine writes one line of output, after the prefix set with
+    SetPrefix.  The line is written whole, even when other threads are
+    writing through other MESSAGE objects.  If a sink is set, the line
+    goes to it instead, without the newline.
+
+Arguments:
+
+    Line    - Supplies the text of the line.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (_sink) {
+        _sink(_sink_context, _prefix + Line.str());
+        return;
+    }
+
+    std::string text = _prefix + Line.str() + "\n";
+
+    OutputLock.Acquire();
+    std::cout << text;
+    OutputLock.Release();
+}
@@ -31,6 +31,10 @@ Abstract:
     same type code and name only if they can be distinguished by
     value.
 
+    Since entries are variable-length, the object keeps a table of
+    entry offsets alongside the packed list so that lookups by
+    (type code, name, LowestVcn) can binary search it.
+
 --*/
 
 #pragma once
@@ -208,11 +212,57 @@ class NTFS_ATTRIBUTE_LIST : public NTFS_ATTRIBUTE {
             OUT PULONG              EntryIndex DEFAULT NULL
             ) CONST;
 
+        BOOLEAN
+        IsEntryBefore(
+            IN  PCATTRIBUTE_LIST_ENTRY  Entry,
+            IN  ATTRIBUTE_TYPE_CODE     Type,
+            IN  PCWSTR                  NameBuffer,
+            IN  ULONG                   NameLength,
+            IN  BOOLEAN                 HasName,
+            IN  VCN                     LowestVcn
+            ) CONST;
+
+        BOOLEAN
+        BuildIndex(
+            );
+
+        BOOLEAN
+        ReserveIndexEntry(
+            );
+
+        VOID
+        InsertIndexEntry(
+            IN  ULONG   EntryIndex,
+            IN  ULONG   EntryOffset,
+            IN  ULONG   EntryLength
+            );
+
+        VOID
+        RemoveIndexEntry(
+            IN  ULONG   EntryIndex,
+            IN  ULONG   EntryLength
+            );
+
+        BOOLEAN
+        QueryIndexFromOffset(
+            IN  ULONG   EntryOffset,
+            OUT PULONG  EntryIndex
+            ) CONST;
+
 
         HMEM                    _Mem;
         ULONG                   _LengthOfList;
         PNTFS_UPCASE_TABLE      _UpcaseTable;
 
+        // Offsets of the entries in _Mem, in list order.  If the
+        // list cannot be parsed, _IndexValid is FALSE and lookups
+        // fall back to walking the list.
+        //
+        PULONG                  _EntryOffsets;
+        ULONG                   _NumberOfEntries;
+        ULONG                   _MaximumEntries;
+        BOOLEAN                 _IndexValid;
+
 };
 
 
@@ -0,0 +1,203 @@
+/*++
+
+Module Name:
+
+        attrtab.hxx
+
+Abstract:
+
+        This module contains the declarations for
+        NTFS_ATTRIBUTE_OFFSET_TABLE, which records where each attribute
+        record in a file record segment lives.
+
+        Attribute records are variable-length, so finding one by type,
+        name or instance tag means walking every record before it and
+        parsing each header on the way.  The table keeps a compact entry
+        (type code, name hash, instance tag, offset and length) for every
+        record, and two hash tables over the entries: one keyed by type
+        code and name hash, one keyed by instance tag.  A lookup hashes
+        its key, follows the chain of entries in that bucket, and checks
+        the record it picks, without looking at any other record.
+
+        The table is owned by the file record segment, which invalidates
+        it whenever it moves records around; the next lookup rebuilds it.
+        It is only built for a record segment whose attribute records
+        are well formed, so that answers taken from it are exactly those
+        a walk of the records would give.  Otherwise the owner falls back
+        to walking the records itself.
+
+--*/
+
+#pragma once
+
+DECLARE_CLASS( WSTRING );
+DECLARE_CLASS( NTFS_ATTRIBUTE_OFFSET_TABLE );
+
+// Ends a chain of entries in a hash bucket.
+#define NTFS_ATTRIBUTE_OFFSET_NONE  ((ULONG)-1)
+
+struct NTFS_ATTRIBUTE_OFFSET {
+    ATTRIBUTE_TYPE_CODE TypeCode;
+    ULONG               NameHash;
+    USHORT              Instance;
+    ULONG               Offset;
+    ULONG               Length;
+    ULONG               NextByKey;      // next entry in the bucket, in record order
+    ULONG               NextByTag;
+};
+
+DEFINE_POINTER_TYPES(NTFS_ATTRIBUTE_OFFSET);
+
+
+class NTFS_ATTRIBUTE_OFFSET_TABLE : public OBJECT {
+
+    public:
+
+        DECLARE_CONSTRUCTOR( NTFS_ATTRIBUTE_OFFSET_TABLE );
+
+        VIRTUAL
+        ~NTFS_ATTRIBUTE_OFFSET_TABLE(
+            );
+
+        BOOLEAN
+        Build(
+            IN  PFILE_RECORD_SEGMENT_HEADER FrsData,
+            IN  ULONG                       FrsSize
+            );
+
+        VOID
+        Invalidate(
+            );
+
+        BOOLEAN
+        IsValid(
+            IN  PFILE_RECORD_SEGMENT_HEADER FrsData
+            ) CONST;
+
+        BOOLEAN
+        FindRecord(
+            IN  PFILE_RECORD_SEGMENT_HEADER FrsData,
+            IN  ATTRIBUTE_TYPE_CODE         Type,
+            IN  PCWSTRING                   Name,
+            OUT PVOID*                      Record
+            );
+
+        BOOLEAN
+        FindRecordByTag(
+            IN  PFILE_RECORD_SEGMENT_HEADER FrsData,
+            IN  ULONG                       Tag,
+            OUT PVOID*                      Record
+            );
+
+    private:
+
+        VOID
+        Construct(
+            );
+
+        VOID
+        Destroy(
+            );
+
+        BOOLEAN
+        IsEntryCurrent(
+            IN  PFILE_RECORD_SEGMENT_HEADER FrsData,
+            IN  PCNTFS_ATTRIBUTE_OFFSET     Entry
+            ) CONST;
+
+        STATIC
+        ULONG
+        HashName(
+            IN  PCWSTR  Name,
+            IN  ULONG   NameLength
+            );
+
+        ULONG
+        QueryKeyBucket(
+            IN  ATTRIBUTE_TYPE_CODE Type,
+            IN  ULONG               NameHash
+            ) CONST;
+
+        ULONG
+        QueryTagBucket(
+            IN  ULONG   Tag
+            ) CONST;
+
+        STATIC
+        ULONG
+        MixHash(
+            IN  ULONG   Value
+            );
+
+        PNTFS_ATTRIBUTE_OFFSET  _Entries;
+        ULONG                   _NumberOfEntries;
+        ULONG                   _MaximumEntries;
+
+        // _Buckets holds _NumberOfBuckets heads of chains by type and
+        // name, then as many by instance tag.  _NumberOfBuckets is a
+        // power of two, at least twice the number of entries.
+        //
+        PULONG                  _Buckets;
+        ULONG                   _NumberOfBuckets;
+        ULONG                   _MaximumBuckets;
+
+        // _FirstFreeByte is the FirstFreeByte of the record segment
+        // when the table was built.  Every insertion or removal of
+        // an attribute record changes it, so a table whose value
+        // no longer matches is treated as stale.
+        //
+        ULONG                   _FirstFreeByte;
+        BOOLEAN                 _IsValid;
+};
+
+
+INLINE
+BOOLEAN
+NTFS_ATTRIBUTE_OFFSET_TABLE::IsValid(
+    IN  PFILE_RECORD_SEGMENT_HEADER FrsData
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method determines whether the table describes the record
+    segment it was last built from.
+
+Arguments:
+
+    FrsData --  supplies the record segment.
+
+Return Value:
+
+    TRUE if the table may be used.
+
+--*/
+{
+    return _IsValid && FrsData->FirstFreeByte == _FirstFreeByte;
+}
+
+
+INLINE
+VOID
+NTFS_ATTRIBUTE_OFFSET_TABLE::Invalidate(
+    )
+/*++
+
+Routine Description:
+
+    This method marks the table as stale.  The owner calls it after
+    changing the layout of its attribute records; the next lookup
+    rebuilds it.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _IsValid = FALSE;
+}
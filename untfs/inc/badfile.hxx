@@ -66,6 +66,11 @@ public:
         IN LCN Lcn
     );
 
+    BOOLEAN
+    QueryRunCount(
+        OUT PULONG  RunCount
+    );
+
  
     BOOLEAN
     Flush(
@@ -231,6 +231,13 @@ class NTFS_EXTENT_LIST : public OBJECT {
         Coalesce(
             );
 
+        STATIC
+        BOOLEAN
+        IsRunAccepted(
+            IN  VCN         Vcn,
+            IN  BIG_INT     RunLength
+            );
+
         STATIC
         BOOLEAN
         QueryMappingPairsLength(
@@ -343,6 +343,21 @@ class NTFS_FILE_RECORD_SEGMENT : public NTFS_FRS_STRUCTURE {
         QueryMaximumAttributeRecordSize (
             ) CONST;
 
+        BOOLEAN
+        ReserveChildFileRecordSegments(
+            IN  ULONG   NumberOfSegments
+            );
+
+        VOID
+        ReleaseChildFileRecordSegments(
+            );
+
+         
+        VIRTUAL
+        BOOLEAN
+        Read(
+            );
+
          
         BOOLEAN
         QueryDuplicatedInformation(
@@ -418,6 +433,15 @@ class NTFS_FILE_RECORD_SEGMENT : public NTFS_FRS_STRUCTURE {
         SetupAttributeList(
             );
 
+        BOOLEAN
+        QueryValueView(
+            IN  ATTRIBUTE_TYPE_CODE Type,
+            IN  ULONG               Length,
+            OUT PVOID               Buffer,
+            OUT PCVOID*             Value,
+            OUT PBOOLEAN            Error
+            );
+
          
         BOOLEAN
         CreateAttributeList(
@@ -466,12 +490,31 @@ class NTFS_FILE_RECORD_SEGMENT : public NTFS_FRS_STRUCTURE {
             VCN FileNumber
             );
 
+        VOID
+        SnapshotFileNames(
+            );
+
         HMEM                        _Mem;
         LIST                        _Children;
         PITERATOR                   _ChildIterator;
                 PNTFS_MASTER_FILE_TABLE         _Mft;
         PNTFS_ATTRIBUTE_LIST        _AttributeList;
 
+        // _FileNameInfo is the duplicated information carried by
+        // this FRS's file names when it was read (or when they were
+        // last propagated to the parent index).  Flush uses it to
+        // skip rewriting the parent index when nothing changed.
+        //
+        DUPLICATED_INFORMATION      _FileNameInfo;
+        BOOLEAN                     _FileNameInfoValid;
+
+        // _ReservedChildCount file record segments, starting at
+        // _ReservedChildFileNumber, have been allocated for child
+        // FRS's that have not been created yet.
+        //
+        VCN                         _ReservedChildFileNumber;
+        ULONG                       _ReservedChildCount;
+
 };
 
  
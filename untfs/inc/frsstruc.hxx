@@ -14,6 +14,7 @@ Abstract:
 
 #include "volume.hxx"
 #include "ntfssa.hxx"
+#include "attrtab.hxx"
 
 DECLARE_CLASS( NTFS_FRS_STRUCTURE );
 DECLARE_CLASS( MEM );
@@ -91,6 +92,10 @@ class NTFS_FRS_STRUCTURE : public OBJECT {
         Write(
             );
 
+        BOOLEAN
+        IsModified(
+            ) CONST;
+
          
         PVOID
         GetNextAttributeRecord(
@@ -123,6 +128,14 @@ class NTFS_FRS_STRUCTURE : public OBJECT {
         GetAttributeList(
             );
 
+        BOOLEAN
+        QueryResidentValue(
+            IN  ATTRIBUTE_TYPE_CODE Type,
+            IN  PCWSTRING           Name,
+            OUT PCVOID*             Value,
+            OUT PULONG              ValueLength
+            );
+
          
         MFT_SEGMENT_REFERENCE
         QuerySegmentReference(
@@ -242,6 +255,23 @@ class NTFS_FRS_STRUCTURE : public OBJECT {
 
     protected:
 
+        BOOLEAN
+        FindAttributeRecord(
+            IN  ATTRIBUTE_TYPE_CODE Type,
+            IN  PCWSTRING           Name,
+            OUT PVOID*              Record
+            );
+
+        BOOLEAN
+        FindAttributeRecordByTag(
+            IN  ULONG   Tag,
+            OUT PVOID*  Record
+            );
+
+        VOID
+        InvalidateAttributeTable(
+            );
+
         PFILE_RECORD_SEGMENT_HEADER _FrsData;
 
     private:
@@ -257,6 +287,10 @@ class NTFS_FRS_STRUCTURE : public OBJECT {
         Destroy(
             );
 
+        VOID
+        SaveCleanCopy(
+            );
+
         PSECRUN             _secrun;
         PNTFS_ATTRIBUTE     _mftdata;
 
@@ -273,9 +307,44 @@ class NTFS_FRS_STRUCTURE : public OBJECT {
         BIG_INT             _volume_sectors;
         UCHAR               _usa_check;
 
+        // _clean_data holds the record as it was when last read from
+        // or written to disk, so that Write can skip records which
+        // have not changed since.
+
+        PVOID               _clean_data;
+        BOOLEAN             _clean_valid;
+
+        NTFS_ATTRIBUTE_OFFSET_TABLE _attribute_table;
+
 };
 
 
+INLINE
+VOID
+NTFS_FRS_STRUCTURE::InvalidateAttributeTable(
+    )
+/*++
+
+Routine Description:
+
+    This routine discards the attribute offset table.  It must be
+    called whenever attribute records are inserted, removed or
+    moved within the FRS.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _attribute_table.Invalidate();
+}
+
+
 INLINE
 MFT_SEGMENT_REFERENCE
 NTFS_FRS_STRUCTURE::QuerySegmentReference(
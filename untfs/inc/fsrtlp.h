@@ -16,7 +16,8 @@ Abstract:
 #define NTKERNELAPI
 
 typedef ULONG ERESOURCE, *PERESOURCE;
-typedef ULONG FAST_MUTEX, *PFAST_MUTEX;
+typedef LONG KSPIN_LOCK, *PKSPIN_LOCK;
+typedef KSPIN_LOCK FAST_MUTEX, *PFAST_MUTEX;
 typedef ULONG KEVENT, *PKEVENT;
 typedef ULONG KMUTEX, *PKMUTEX;
 
@@ -37,15 +38,35 @@ typedef LONGLONG LBN64, *PLBN64;
 
 #define PAGED_CODE()                    /* nothing */
 #define DebugTrace(a, b, c, d)          /* nothing */
-#define ExInitializeFastMutex(a)        /* nothing */
-#define ExAcquireFastMutex(a)           /* nothing */
-#define ExReleaseFastMutex(a)           /* nothing */
-#define ExAcquireSpinLock(a, b)         /* nothing */
-#define ExReleaseSpinLock(a, b)         /* nothing */
-
-#define ExIsFullZone(a)                    FALSE
-#define ExAllocateFromZone(a)              ((PVOID)1)
-#define ExIsObjectInFirstZoneSegment(a, b) TRUE
+
+//
+//  Volumes may be processed on several threads at once, so the spin
+//  lock that guards the package's free lists and the fast mutex of
+//  each MCB are real locks: a LONG taken with an interlocked exchange.
+//  There is no zone; fast mutexes come from the free list or the heap.
+//
+
+extern "C"
+VOID
+FsRtlAcquireSpinLock(
+    IN  PKSPIN_LOCK SpinLock
+    );
+
+extern "C"
+VOID
+FsRtlReleaseSpinLock(
+    IN  PKSPIN_LOCK SpinLock
+    );
+
+#define ExInitializeFastMutex(a)        (*(a) = 0)
+#define ExAcquireFastMutex(a)           FsRtlAcquireSpinLock(a)
+#define ExReleaseFastMutex(a)           FsRtlReleaseSpinLock(a)
+#define ExAcquireSpinLock(a, b)         FsRtlAcquireSpinLock(a)
+#define ExReleaseSpinLock(a, b)         FsRtlReleaseSpinLock(a)
+
+#define ExIsFullZone(a)                    TRUE
+#define ExAllocateFromZone(a)              NULL
+#define ExIsObjectInFirstZoneSegment(a, b) FALSE
 #define ExFreeToZone(a, p)                 /* nothing */
 
 #define try_return(S)       { S; goto try_exit; }
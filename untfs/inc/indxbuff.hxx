@@ -15,6 +15,7 @@ Abstract:
 
 #include "hmem.hxx"
 #include "indxtree.hxx"
+#include "indxtab.hxx"
 
 DECLARE_CLASS( LOG_IO_DP_DRIVE );
 DECLARE_CLASS( NTFS_ATTRIBUTE );
@@ -172,6 +173,10 @@ class NTFS_INDEX_BUFFER : public OBJECT {
         Destroy(
             );
 
+        BOOLEAN
+        BuildEntryTable(
+            );
+
          
         VOID
         InsertClump(
@@ -196,6 +201,8 @@ class NTFS_INDEX_BUFFER : public OBJECT {
 
         HMEM                        _Mem;
         PINDEX_ALLOCATION_BUFFER    _Data;
+
+        NTFS_INDEX_ENTRY_TABLE      _EntryTable;
 };
 
  
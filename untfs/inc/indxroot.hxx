@@ -15,6 +15,7 @@ Abstract:
 
 #include "untfs.hxx"
 #include "untfs2.hxx"
+#include "indxtab.hxx"
 
 DECLARE_CLASS( NTFS_ATTRIBUTE );
 DECLARE_CLASS( NTFS_UPCASE_TABLE );
@@ -128,6 +129,10 @@ class NTFS_INDEX_ROOT : public OBJECT {
         Destroy(
             );
 
+        BOOLEAN
+        BuildEntryTable(
+            );
+
 
 
         ULONG               _MaximumSize;
@@ -137,6 +142,8 @@ class NTFS_INDEX_ROOT : public OBJECT {
 
         BOOLEAN             _IsModified;
 
+        NTFS_INDEX_ENTRY_TABLE  _EntryTable;
+
 };
 
  
@@ -0,0 +1,154 @@
+/*++
+
+Module Name:
+
+        indxtab.hxx
+
+Abstract:
+
+        This module contains the declarations for NTFS_INDEX_ENTRY_TABLE,
+        which records the offsets of the entries in an index root or an
+        index allocation buffer.
+
+        Index entries are variable-length, so the only way to reach the
+        n-th entry of an index block is to walk the entries before it.
+        With a table of offsets, FindEntry can binary search the block
+        and a split point can be picked without walking it.  The table
+        is owned by the index root or buffer, which keeps it in step with
+        its own inserts and removals and invalidates it whenever the
+        block is rewritten wholesale.
+
+--*/
+
+#pragma once
+
+DECLARE_CLASS( NTFS_UPCASE_TABLE );
+DECLARE_CLASS( NTFS_INDEX_ENTRY_TABLE );
+
+
+class NTFS_INDEX_ENTRY_TABLE : public OBJECT {
+
+    public:
+
+        DECLARE_CONSTRUCTOR( NTFS_INDEX_ENTRY_TABLE );
+
+        VIRTUAL
+        ~NTFS_INDEX_ENTRY_TABLE(
+            );
+
+        BOOLEAN
+        Build(
+            IN  PINDEX_HEADER   Header,
+            IN  ULONG           BlockLength
+            );
+
+        VOID
+        Invalidate(
+            );
+
+        BOOLEAN
+        IsValid(
+            ) CONST;
+
+        BOOLEAN
+        FindEntry(
+            IN      PINDEX_HEADER       Header,
+            IN      PCINDEX_ENTRY       SearchEntry,
+            IN      COLLATION_RULE      CollationRule,
+            IN      PNTFS_UPCASE_TABLE  UpcaseTable,
+            IN OUT  PULONG              Ordinal,
+            OUT     PINDEX_ENTRY*       EntryFound
+            ) CONST;
+
+        PINDEX_ENTRY
+        FindSplitPoint(
+            IN  PINDEX_HEADER   Header
+            ) CONST;
+
+        VOID
+        NoteInsert(
+            IN  ULONG   EntryOffset,
+            IN  ULONG   EntryLength
+            );
+
+        VOID
+        NoteRemove(
+            IN  ULONG   EntryOffset,
+            IN  ULONG   EntryLength
+            );
+
+    private:
+
+        VOID
+        Construct(
+            );
+
+        VOID
+        Destroy(
+            );
+
+        BOOLEAN
+        QueryIndexFromOffset(
+            IN  ULONG   EntryOffset,
+            OUT PULONG  EntryIndex
+            ) CONST;
+
+        // _Offsets holds the offset, relative to the index header, of
+        // every entry including the END entry, which is always last.
+        //
+        PULONG  _Offsets;
+        ULONG   _NumberOfEntries;
+        ULONG   _MaximumEntries;
+        BOOLEAN _IsValid;
+};
+
+
+INLINE
+BOOLEAN
+NTFS_INDEX_ENTRY_TABLE::IsValid(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method determines whether the table describes the block
+    it was last built from.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the table may be used.
+
+--*/
+{
+    return _IsValid;
+}
+
+
+INLINE
+VOID
+NTFS_INDEX_ENTRY_TABLE::Invalidate(
+    )
+/*++
+
+Routine Description:
+
+    This method marks the table as stale.  The owner calls it after
+    changing the block in a way the table does not track; the next
+    lookup rebuilds it.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _IsValid = FALSE;
+}
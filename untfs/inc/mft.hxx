@@ -51,6 +51,13 @@ class NTFS_MASTER_FILE_TABLE : public OBJECT {
 			);
 
 		 
+        BOOLEAN
+        AllocateFileRecordSegments(
+            IN  VCN     NearFileNumber,
+            IN  ULONG   NumberOfSegments,
+            OUT PVCN    FirstFileNumber
+            );
+
         BOOLEAN
 		FreeFileRecordSegment(
             IN  VCN SegmentToFree
@@ -124,6 +131,18 @@ class NTFS_MASTER_FILE_TABLE : public OBJECT {
             IN PNTFS_UPCASE_TABLE UpcaseTable
             );
 
+        VOID
+        NoteReflectedSegmentWritten(
+            );
+
+        BOOLEAN
+        AreReflectedSegmentsModified(
+            ) CONST;
+
+        VOID
+        ClearReflectedSegmentsModified(
+            );
+
 
 	private:
 
@@ -147,6 +166,12 @@ class NTFS_MASTER_FILE_TABLE : public OBJECT {
         BOOLEAN             _ReadOnly;
         BIG_INT             _VolumeSectors;
         ULONG               _SectorSize;
+        BOOLEAN             _ReflectedSegmentsModified;
+
+        // _LastAllocatedFileNumber is where the next allocation for
+        // a client other than the MFT itself starts looking.
+        //
+        VCN                 _LastAllocatedFileNumber;
 
 };
 
@@ -468,3 +493,79 @@ NTFS_MASTER_FILE_TABLE::QuerySectorSize(
 }
 
 
+INLINE
+VOID
+NTFS_MASTER_FILE_TABLE::NoteReflectedSegmentWritten(
+    )
+/*++
+
+Routine Description:
+
+    This method records that one of the File Record Segments which
+    are reflected in the MFT Mirror has been written, so the mirror
+    must be brought up to date when the MFT is flushed.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _ReflectedSegmentsModified = TRUE;
+}
+
+
+INLINE
+BOOLEAN
+NTFS_MASTER_FILE_TABLE::AreReflectedSegmentsModified(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method determines whether any of the File Record Segments
+    reflected in the MFT Mirror have been written since the mirror
+    was last written.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the MFT Mirror is out of date.
+
+--*/
+{
+    return _ReflectedSegmentsModified;
+}
+
+
+INLINE
+VOID
+NTFS_MASTER_FILE_TABLE::ClearReflectedSegmentsModified(
+    )
+/*++
+
+Routine Description:
+
+    This method records that the MFT Mirror has been written.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _ReflectedSegmentsModified = FALSE;
+}
+
+
@@ -0,0 +1,322 @@
+/*++
+
+Module Name:
+
+        mpairs.hxx
+
+Abstract:
+
+        This module contains the declarations for the mapping pairs
+        codec helpers and for NTFS_MAPPING_PAIRS_DECODER, which walks a
+        compressed mapping pairs list one run at a time.
+
+        A compressed mapping pair is a count byte (low nibble: number of
+        VCN delta bytes, high nibble: number of LCN delta bytes) followed
+        by the two little-endian, sign-extended deltas.  The helpers here
+        work on plain 64-bit deltas: field widths come from a
+        count-leading-zeros lookup and fields are fetched with a single
+        unaligned 8-byte load that is masked down to the field width.
+
+        The decoder does not build an MCB; clients that only need to
+        look at the runs (or that feed them into some other structure)
+        can use it directly.
+
+--*/
+
+#pragma once
+
+#include <intrin.h>
+
+DECLARE_CLASS( NTFS_MAPPING_PAIRS_DECODER );
+
+//
+// Number of bytes needed to store a signed 64-bit value, indexed by
+// the count of leading zeros of (Value ^ (Value >> 63)).
+//
+extern CONST UCHAR MappingPairsWidthFromLeadingZeros[65];
+
+
+INLINE
+UCHAR
+MappingPairsFieldWidth(
+    IN  LONGLONG    Value
+    )
+/*++
+
+Routine Description:
+
+    This routine computes the number of bytes in the compressed form
+    of a signed delta.  It matches BIG_INT::QueryCompressedInteger,
+    including returning one byte for zero.
+
+Arguments:
+
+    Value   - Supplies the delta to compress.
+
+Return Value:
+
+    The number of bytes (1 to 8) needed to represent Value.
+
+--*/
+{
+    ULONGLONG   magnitude;
+    ULONG       high_bit;
+
+    magnitude = (ULONGLONG)(Value ^ (Value >> 63));
+
+#if defined(_M_AMD64)
+    if (!_BitScanReverse64(&high_bit, magnitude)) {
+        return MappingPairsWidthFromLeadingZeros[64];
+    }
+#else
+    if (_BitScanReverse(&high_bit, (ULONG)(magnitude >> 32))) {
+        high_bit += 32;
+    } else if (!_BitScanReverse(&high_bit, (ULONG)magnitude)) {
+        return MappingPairsWidthFromLeadingZeros[64];
+    }
+#endif
+
+    return MappingPairsWidthFromLeadingZeros[63 - high_bit];
+}
+
+
+INLINE
+LONGLONG
+MappingPairsLoadField(
+    IN  PCUCHAR Data,
+    IN  UCHAR   Width,
+    IN  ULONG   Available
+    )
+/*++
+
+Routine Description:
+
+    This routine fetches a sign-extended delta of the given width.
+    When at least eight bytes of the buffer remain, the field is read
+    with one unaligned load and the excess bytes are shifted out;
+    otherwise only the field bytes are copied.
+
+Arguments:
+
+    Data        - Supplies the first byte of the field.
+    Width       - Supplies the field width, 0 to 8 bytes.
+    Available   - Supplies the number of valid bytes starting at Data.
+
+Return Value:
+
+    The sign-extended value of the field.
+
+--*/
+{
+    ULONGLONG   raw;
+    ULONG       shift;
+
+    DebugAssert(Width <= sizeof(ULONGLONG));
+    DebugAssert(Width <= Available);
+
+    if (Width == 0) {
+        return 0;
+    }
+
+    if (Available >= sizeof(ULONGLONG)) {
+        raw = *(const ULONGLONG UNALIGNED *)Data;
+    } else {
+        raw = 0;
+        memcpy(&raw, Data, Width);
+    }
+
+    shift = (sizeof(ULONGLONG) - Width) * 8;
+
+    return ((LONGLONG)(raw << shift)) >> shift;
+}
+
+
+class NTFS_MAPPING_PAIRS_DECODER : public OBJECT {
+
+    public:
+
+        DECLARE_CONSTRUCTOR( NTFS_MAPPING_PAIRS_DECODER );
+
+        VIRTUAL
+        ~NTFS_MAPPING_PAIRS_DECODER(
+            );
+
+        BOOLEAN
+        Initialize(
+            IN  PCVOID  CompressedPairs,
+            IN  ULONG   BufferSize,
+            IN  VCN     StartingVcn
+            );
+
+        BOOLEAN
+        QueryNextRun(
+            OUT PVCN        Vcn,
+            OUT PLCN        Lcn,
+            OUT PBIG_INT    RunLength
+            );
+
+        BOOLEAN
+        IsCorrupt(
+            ) CONST;
+
+        BOOLEAN
+        IsDone(
+            ) CONST;
+
+        ULONG
+        QueryNumberOfPairs(
+            ) CONST;
+
+        ULONG
+        QueryLength(
+            ) CONST;
+
+        VCN
+        QueryNextVcn(
+            ) CONST;
+
+    private:
+
+        VOID
+        Construct(
+            );
+
+        VOID
+        Destroy(
+            );
+
+        PCUCHAR     _Data;
+        ULONG       _BufferSize;
+        ULONG       _Offset;
+        ULONG       _NumberOfPairs;
+        LONGLONG    _CurrentVcn;
+        LONGLONG    _CurrentLcn;
+        BOOLEAN     _Corrupt;
+        BOOLEAN     _Done;
+};
+
+
+INLINE
+BOOLEAN
+NTFS_MAPPING_PAIRS_DECODER::IsCorrupt(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method tells whether decoding stopped because the compressed
+    list was malformed or overflowed its buffer.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the list is corrupt.
+
+--*/
+{
+    return _Corrupt;
+}
+
+
+INLINE
+BOOLEAN
+NTFS_MAPPING_PAIRS_DECODER::IsDone(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method tells whether the terminating zero count byte has
+    been reached.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if every pair in the list has been returned.
+
+--*/
+{
+    return _Done;
+}
+
+
+INLINE
+ULONG
+NTFS_MAPPING_PAIRS_DECODER::QueryNumberOfPairs(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method returns the number of pairs decoded so far.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of pairs returned by QueryNextRun.
+
+--*/
+{
+    return _NumberOfPairs;
+}
+
+
+INLINE
+ULONG
+NTFS_MAPPING_PAIRS_DECODER::QueryLength(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method returns the number of bytes consumed so far.  Once
+    the decoder is done this includes the terminating zero byte.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of bytes of the compressed list consumed.
+
+--*/
+{
+    return _Offset;
+}
+
+
+INLINE
+VCN
+NTFS_MAPPING_PAIRS_DECODER::QueryNextVcn(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method returns the VCN following the last decoded run.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The next VCN.
+
+--*/
+{
+    VCN next_vcn;
+
+    next_vcn = _CurrentVcn;
+    return next_vcn;
+}
@@ -48,6 +48,15 @@ DECLARE_CLASS( NTFS_ATTRIBUTE );
 DECLARE_CLASS( NTFS_BITMAP );
 DECLARE_CLASS( NTFS_MASTER_FILE_TABLE );
 
+//
+// The bitmap keeps track of which parts of it have changed since it
+// was last read or written, in chunks of this many bytes, so that
+// Write only has to touch the clusters of the attribute that hold
+// changed bits.
+//
+#define NTFS_BITMAP_DIRTY_CHUNK_SIZE    (4096)
+#define NTFS_BITMAP_BITS_PER_CHUNK      (NTFS_BITMAP_DIRTY_CHUNK_SIZE * 8)
+
 class NTFS_BITMAP : public OBJECT {
 
         public:
@@ -137,6 +146,13 @@ class NTFS_BITMAP : public OBJECT {
             );
 
          
+        BOOLEAN
+        Load(
+            IN  PCVOID  Data,
+            IN  ULONG   SizeInBytes
+            );
+
+         
          
         BOOLEAN
         Write(
@@ -182,6 +198,18 @@ class NTFS_BITMAP : public OBJECT {
         Destroy(
                 );
 
+        VOID
+        MarkDirty(
+            IN ULONG    FirstBit,
+            IN ULONG    NumberOfBits
+            );
+
+        BOOLEAN
+        WriteDirtyChunks(
+            IN OUT  PNTFS_ATTRIBUTE BitmapAttribute,
+            IN OUT  PNTFS_BITMAP    VolumeBitmap
+            );
+
         BIG_INT         _NumberOfClusters;
         BOOLEAN         _IsGrowable;
 
@@ -190,6 +218,15 @@ class NTFS_BITMAP : public OBJECT {
         BIG_INT         _NextAlloc;
         BITVECTOR       _Bitmap;
 
+        //
+        // _DirtyChunks has one bit per NTFS_BITMAP_DIRTY_CHUNK_SIZE
+        // bytes of the bitmap; _AllDirty means that the whole bitmap
+        // must be written regardless.
+        //
+
+        BITVECTOR       _DirtyChunks;
+        BOOLEAN         _AllDirty;
+
         //
         // This is to support testing newly-allocated clusters in the
         // volume bitmap to ensure they can support IO.
@@ -262,6 +299,7 @@ Notes:
         !(Lcn + RunLength > _NumberOfClusters) ) {
 
         _Bitmap.ResetBit( Lcn.GetLowPart(), RunLength.GetLowPart() ) ;
+        MarkDirty( Lcn.GetLowPart(), RunLength.GetLowPart() );
     }
 }
 
@@ -303,6 +341,7 @@ Notes:
     {
 
         _Bitmap.SetBit( Lcn.GetLowPart(), RunLength.GetLowPart() );
+        MarkDirty( Lcn.GetLowPart(), RunLength.GetLowPart() );
     }
 }
 
@@ -473,12 +512,65 @@ Return Value:
 
     DebugPtrAssert( _BitmapData );
 
-    return( BitmapAttribute->Read( _BitmapData,
-                                   0,
-                                   _BitmapSize,
-                                   &BytesRead ) &&
+    if( !BitmapAttribute->Read( _BitmapData,
+                                0,
+                                _BitmapSize,
+                                &BytesRead ) ||
+        BytesRead != _BitmapSize ) {
+
+        return FALSE;
+    }
+
+    // The bitmap now matches what is on disk.
+
+    _DirtyChunks.ResetAll();
+    _AllDirty = FALSE;
+
+    return TRUE;
+}
+
+
+ 
+INLINE
+BOOLEAN
+NTFS_BITMAP::Load(
+    IN  PCVOID  Data,
+    IN  ULONG   SizeInBytes
+    )
+/*++
+
+Routine Description:
+
+    This method sets the bitmap from a copy of its on-disk contents
+    kept elsewhere, in place of reading it with Read.
+
+Arguments:
+
+    Data        --  Supplies the contents of the bitmap.
+    SizeInBytes --  Supplies the size of Data, which must be the size
+                    of the bitmap.
+
+Return Value:
+
+    TRUE upon successful completion.
+
+--*/
+{
+    DebugPtrAssert( _BitmapData );
+
+    if( SizeInBytes != _BitmapSize ) {
+
+        return FALSE;
+    }
+
+    memcpy( _BitmapData, Data, _BitmapSize );
+
+    // The bitmap now matches what is on disk.
 
-            BytesRead == _BitmapSize );
+    _DirtyChunks.ResetAll();
+    _AllDirty = FALSE;
+
+    return TRUE;
 }
 
 
@@ -542,6 +634,50 @@ Return Value:
     return _BitmapData;
 }
 
+INLINE
+VOID
+NTFS_BITMAP::MarkDirty(
+    IN ULONG    FirstBit,
+    IN ULONG    NumberOfBits
+    )
+/*++
+
+Routine Description:
+
+    This method notes that a range of bits in the bitmap has been
+    changed, so that the next Write includes it.
+
+Arguments:
+
+    FirstBit        --  Supplies the first bit which was changed.
+    NumberOfBits    --  Supplies the number of bits which were changed.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG FirstChunk, LastChunk;
+
+    if( _AllDirty || NumberOfBits == 0 ) {
+
+        return;
+    }
+
+    FirstChunk = FirstBit / NTFS_BITMAP_BITS_PER_CHUNK;
+    LastChunk = (FirstBit + NumberOfBits - 1) / NTFS_BITMAP_BITS_PER_CHUNK;
+
+    if( LastChunk >= _DirtyChunks.QuerySize() ) {
+
+        _AllDirty = TRUE;
+        return;
+    }
+
+    _DirtyChunks.SetBit( FirstChunk, LastChunk - FirstChunk + 1 );
+}
+
+
 INLINE
 VOID
 NTFS_BITMAP::SetMftPointer(
@@ -18,6 +18,7 @@ Abstract:
 #include "message.hxx"
 #include "ntfsbit.hxx"
 #include "numset.hxx"
+#include "ntfssnap.hxx"
 
 DECLARE_CLASS( NTFS_INDEX_TREE );
 
@@ -61,6 +62,44 @@ CONST ULONG LsnResetThreshholdHighPart = 0x10000;
 CONST UCHAR UpdateSequenceArrayCheckValueMinorError = 2;// should always be non-zero
 CONST UCHAR UpdateSequenceArrayCheckValueOk = 1;        // should always be non-zero
 
+//
+// What marking a list of sectors did with the clusters holding them.
+//
+struct NTFS_MARK_COUNTS {
+    LONGLONG    Marked;         // free clusters added to the bad cluster list
+    LONGLONG    AlreadyBad;     // clusters already in the bad cluster list
+    LONGLONG    InUse;          // clusters in use, left alone
+};
+
+DEFINE_POINTER_TYPES(NTFS_MARK_COUNTS);
+
+//
+// What committing the marked clusters would change on the volume.
+//
+struct NTFS_MARK_PLAN {
+    ULONG       AddedRuns;              // runs added to the mapping pairs of $Bad
+    LONGLONG    AddedFileRecords;       // file records allocated to hold them
+    ULONG       WriteCount;             // writes the commit would issue
+};
+
+DEFINE_POINTER_TYPES(NTFS_MARK_PLAN);
+
+//
+// What code that has no pointer to the super area needs to know about
+// the volume it is working on.  Each NTFS_SA owns one, and makes it the
+// current context of the calling thread while it works, so that several
+// volumes can be processed at once on different threads.
+//
+struct NTFS_VOLUME_CONTEXT {
+    UCHAR       MajorVersion;           // decide the format of the mapping
+    UCHAR       MinorVersion;           //   pairs of sparse files
+    LONG        SkippedFileNameUpdates; // parent index updates Flush skipped
+};
+
+DEFINE_POINTER_TYPES(NTFS_VOLUME_CONTEXT);
+
+struct NTFS_MARK_STATE;
+
 
 class NTFS_SA : public SUPERAREA {
 
@@ -69,16 +108,52 @@ public:
     BOOLEAN
         MarkInFreeSpace(
             IN OUT  PNTFS_MASTER_FILE_TABLE Mft,
-            IN      const std::vector<sectors_range>& physicalDriveSectorsTargets,
+            IN OUT  sectors_range_source&   physicalDriveSectorsTargets,
             IN OUT  PNUMBER_SET             BadClusters,
             IN      PNTFS_BAD_CLUSTER_FILE  BadClusterFile,
+            OUT     PNTFS_MARK_COUNTS       Counts,
             IN OUT  PMESSAGE                Message
         );
 
     VIRTUAL
         BOOLEAN
         MarkBad(
-            IN const std::vector<sectors_range>& physicalDriveSectorsTargets,
+            IN OUT sectors_range_source& physicalDriveSectorsTargets,
+            IN OUT  PMESSAGE    Message
+        );
+
+    VOID
+        SetSnapshot(
+            IN OUT  PNTFS_SNAPSHOT  Snapshot
+        );
+
+    BOOLEAN
+        BeginMarking(
+            IN OUT  PMESSAGE    Message,
+            IN      BOOLEAN     Lock        DEFAULT TRUE
+        );
+
+    BOOLEAN
+        MarkSectors(
+            IN OUT  sectors_range_source&   physicalDriveSectorsTargets,
+            OUT     PNTFS_MARK_COUNTS       Counts,
+            IN OUT  PMESSAGE                Message
+        );
+
+    BOOLEAN
+        CommitMarking(
+            IN OUT  PMESSAGE    Message
+        );
+
+    BOOLEAN
+        PlanMarking(
+            OUT     PNTFS_MARK_PLAN Plan,
+            IN OUT  PNUMBER_SET     Sectors,
+            IN OUT  PMESSAGE        Message
+        );
+
+    VOID
+        EndMarking(
             IN OUT  PMESSAGE    Message
         );
 
@@ -133,6 +208,16 @@ public:
         ) CONST;
 
 
+    LONGLONG
+        QuerySerialNumber(
+        ) CONST;
+
+
+    ULONG
+        QuerySkippedFileNameUpdates(
+        ) CONST;
+
+
 
 
     UCHAR
@@ -185,8 +270,7 @@ public:
 
 
 
-    STATIC
-        VOID
+    VOID
         SetVersionNumber(
             IN  UCHAR   Major,
             IN  UCHAR   Minor
@@ -199,6 +283,11 @@ public:
             OUT PUCHAR  Minor
         );
 
+    STATIC
+        PNTFS_VOLUME_CONTEXT
+        QueryCurrentContext(
+        );
+
 
 private:
 
@@ -220,17 +309,31 @@ private:
         Destroy(
         );
 
+    BOOLEAN
+        QuerySnapshotKey(
+            IN OUT  PNTFS_MASTER_FILE_TABLE Mft,
+            OUT     PNTFS_SNAPSHOT_KEY      Key
+        );
+
+    VOID
+        MakeContextCurrent(
+        );
+
+    BOOLEAN
+        StageMarking(
+            IN OUT  PMESSAGE    Message
+        );
+
+    VOID
+        DiscardMarking(
+        );
+
     BOOLEAN                 _cleanup_that_requires_reboot;
     LCN                     _cvt_zone;      // convert region for mft, logfile, etc.
     BIG_INT                 _cvt_zone_size; // convert region size in terms of clusters
-
-    // This version number is used to determine what format
-    // is used for the compressed mapping pairs of sparse
-    // files.  Ideally, this information should be tracked
-    // on a per-volume basis; however, that would require
-    // extensive changes to the UNTFS class interfaces.
-    //
-    STATIC UCHAR            _MajorVersion, _MinorVersion;
+    PNTFS_SNAPSHOT          _snapshot;      // metadata snapshot, or NULL
+    NTFS_MARK_STATE*        _mark;          // loaded by BeginMarking, or NULL
+    NTFS_VOLUME_CONTEXT     _context;       // current while marking
 };
 
 INLINE
@@ -258,6 +361,32 @@ Return Value:
     return SECRUN::GetBuf();
 }
 
+INLINE
+VOID
+NTFS_SA::SetSnapshot(
+    IN OUT  PNTFS_SNAPSHOT  Snapshot
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the metadata snapshot used by MarkBad.  MarkBad
+    takes the volume bitmap from the snapshot if it still matches the
+    volume, and saves the bitmap to it when done.
+
+Arguments:
+
+    Snapshot    - Supplies the snapshot, or NULL for none.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _snapshot = Snapshot;
+}
+
 INLINE
 BOOLEAN
 NTFS_SA::Write(
@@ -286,6 +415,58 @@ Return Value:
 }
 
 
+INLINE
+LONGLONG
+NTFS_SA::QuerySerialNumber(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the serial number of the volume as recorded in
+    the boot sector.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The volume serial number.
+
+--*/
+{
+    return _boot_sector->SerialNumber.QuadPart;
+}
+
+
+INLINE
+ULONG
+NTFS_SA::QuerySkippedFileNameUpdates(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine returns the number of parent index updates that
+    flushing the MFT has skipped on this volume, because the file
+    names of the records had not changed.  Records flushed without a
+    parent index, such as the bad cluster file, are not counted.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of updates skipped since the volume was initialized.
+
+--*/
+{
+    return (ULONG) _context.SkippedFileNameUpdates;
+}
+
+
 INLINE
 BIG_INT
 NTFS_SA::QueryVolumeSectors(
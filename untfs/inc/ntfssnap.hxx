@@ -0,0 +1,119 @@
+/*++
+
+Module Name:
+
+    ntfssnap.hxx
+
+Abstract:
+
+    This class models a metadata snapshot: a file holding the volume
+    bitmap of an NTFS volume as it was at the end of a run, so that a
+    later run against the same volume can skip reading the whole
+    bitmap if nothing has changed since.
+
+    The snapshot is keyed by an NTFS_SNAPSHOT_KEY, which the super
+    area builds from a few small reads: the volume serial number, a
+    CRC-32 of the file records of $MFT, $Bitmap and $BadClus (which
+    hold their mapping pairs), and the current LSN of the $LogFile
+    restart area.  Any change the file system makes to the bitmap is
+    logged and moves the LSN; the changes this program makes rewrite
+    the $BadClus record.  A snapshot whose key does not match is
+    ignored.
+
+    The file consists of an NTFS_SNAPSHOT_HEADER followed by the
+    bitmap, run-length encoded: runs of zero or all-ones bytes are
+    stored as a length, everything else as literal bytes.
+
+--*/
+
+#pragma once
+
+#include "wstring.hxx"
+
+DECLARE_CLASS( NTFS_BITMAP );
+DECLARE_CLASS( NTFS_SNAPSHOT );
+
+#define NTFS_SNAPSHOT_SIGNATURE "NTFSSNAP"
+#define NTFS_SNAPSHOT_VERSION   1
+
+struct NTFS_SNAPSHOT_KEY {
+    LONGLONG    SerialNumber;
+    LONGLONG    VolumeSectors;
+    LONGLONG    CurrentLsn;     // of the $LogFile restart area
+    ULONG       SectorSize;
+    ULONG       ClusterFactor;
+    ULONG       FrsChecksum;    // of the $MFT, $Bitmap and $BadClus records
+    ULONG       Reserved;       // zero
+};
+
+DEFINE_POINTER_TYPES(NTFS_SNAPSHOT_KEY);
+
+struct NTFS_SNAPSHOT_HEADER {
+    CHAR                Signature[8];
+    ULONG               Version;
+    ULONG               BitmapSize;     // in bytes, before encoding
+    NTFS_SNAPSHOT_KEY   Key;
+    ULONG               DataLength;     // in bytes, after encoding
+    ULONG               DataChecksum;
+    ULONG               Reserved;       // zero
+    ULONG               Checksum;       // of the header, with this field zero
+};
+
+DEFINE_POINTER_TYPES(NTFS_SNAPSHOT_HEADER);
+
+class NTFS_SNAPSHOT : public OBJECT {
+
+    public:
+
+        DECLARE_CONSTRUCTOR( NTFS_SNAPSHOT );
+
+        VIRTUAL
+        ~NTFS_SNAPSHOT(
+            );
+
+        BOOLEAN
+        Initialize(
+            IN  PCWSTRING   FileName
+            );
+
+        BOOLEAN
+        Load(
+            IN      PCNTFS_SNAPSHOT_KEY Key,
+            IN OUT  PNTFS_BITMAP        VolumeBitmap
+            );
+
+        BOOLEAN
+        Save(
+            IN  PCNTFS_SNAPSHOT_KEY Key,
+            IN  PCNTFS_BITMAP       VolumeBitmap
+            );
+
+    private:
+
+        VOID
+        Construct(
+            );
+
+        VOID
+        Destroy(
+            );
+
+        STATIC
+        ULONG
+        Encode(
+            IN  PCUCHAR Data,
+            IN  ULONG   Size,
+            OUT PUCHAR  Output
+            );
+
+        STATIC
+        BOOLEAN
+        Decode(
+            IN  PCUCHAR Data,
+            IN  ULONG   Length,
+            OUT PUCHAR  Output,
+            IN  ULONG   Size
+            );
+
+        DSTRING     _file_name;
+};
@@ -37,6 +37,15 @@ public:
             IN OUT  PMESSAGE    Message         DEFAULT NULL
         );
 
+        VOID
+        SetSnapshot(
+            IN OUT  PNTFS_SNAPSHOT  Snapshot
+        );
+
+        PNTFS_SA
+        GetNtfsSa(
+        );
+
 
 private:
 
@@ -55,3 +64,51 @@ private:
 };
 
 
+INLINE
+VOID
+NTFS_VOL::SetSnapshot(
+    IN OUT  PNTFS_SNAPSHOT  Snapshot
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the metadata snapshot used by MarkBad.
+
+Arguments:
+
+    Snapshot    - Supplies the snapshot, or NULL for none.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _ntfssa.SetSnapshot(Snapshot);
+}
+
+
+INLINE
+PNTFS_SA
+NTFS_VOL::GetNtfsSa(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the NTFS super area of the volume, for
+    callers that mark sectors in several batches.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    A pointer to the NTFS super area.
+
+--*/
+{
+    return &_ntfssa;
+}
@@ -41,6 +41,15 @@ IMPORTANT NOTE:
 #define REFLECTED_MFT_SEGMENTS  (4)
 #define BYTES_IN_BOOT_AREA     (0x2000)
 
+// These values are the phases of a batched metadata update (see
+// IO_DP_DRIVE::BeginWriteBatch).  The volume bitmap must claim
+// clusters before any record refers to them, and the MFT Mirror
+// is a copy of the MFT, so it goes last.
+
+#define NTFS_WRITE_PHASE_BITMAP     (0)
+#define NTFS_WRITE_PHASE_METADATA   (1)
+#define NTFS_WRITE_PHASE_MIRROR     (2)
+
 // This value is used in a mapping-pair to indicate that the run
 // described by the mapping pair doesn't really exist.  This allows
 // NTFS to support sparse files.  Note that the actual values
@@ -11,6 +11,11 @@ Abstract:
     which is used to upcase attribute names and file names resident
     on that volume.
 
+    The table can be initialized in deferred mode, in which case the
+    value of the $UpCase attribute is not read until a character
+    outside the ASCII range actually has to be upcased.  Most names
+    the tool compares ($Bad, $I30, and so on) never need it.
+
 --*/
 
 #pragma once
@@ -50,9 +55,22 @@ class NTFS_UPCASE_TABLE : public OBJECT {
          
         BOOLEAN
         Initialize(
-            IN PNTFS_ATTRIBUTE Attribute
+            IN PNTFS_ATTRIBUTE Attribute,
+            IN BOOLEAN         Deferred DEFAULT FALSE
+            );
+
+        BOOLEAN
+        Materialize(
             );
 
+        BOOLEAN
+        IsAsciiFoldable(
+            ) CONST;
+
+        BOOLEAN
+        QueryReadFailed(
+            ) CONST;
+
          
         WCHAR
         UpperCase(
@@ -79,8 +97,16 @@ class NTFS_UPCASE_TABLE : public OBJECT {
         Destroy(
             );
 
-        PWCHAR  _Data;
-        ULONG   _Length;
+        PWCHAR          _Data;
+        ULONG           _Length;
+
+        // In deferred mode, _Attribute supplies the table's value
+        // until it has been read into _Data; it must outlive this
+        // object.
+        //
+        PNTFS_ATTRIBUTE _Attribute;
+        BOOLEAN         _AsciiFoldable;
+        BOOLEAN         _ReadFailed;
 };
 
  
@@ -105,9 +131,72 @@ Notes:
     If Character is not in the table (ie. is greater or equal
     to _Length), it upcases to itself.
 
+    If the table was initialized in deferred mode, the first call
+    reads it.  Should that read fail, characters upcase to
+    themselves and QueryReadFailed returns TRUE; nothing compared
+    with the table since may be written to the volume.
+
+--*/
+{
+    if( _Data == NULL && _Attribute != NULL ) {
+
+        ((PNTFS_UPCASE_TABLE) this)->Materialize();
+    }
+
+    return( (_Data != NULL && Character < _Length) ? _Data[Character] :
+                                                      Character );
+}
+
+
+INLINE
+BOOLEAN
+NTFS_UPCASE_TABLE::QueryReadFailed(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method determines whether reading a deferred table failed,
+    so that names have been upcased without it.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the deferred read of the table failed.
+
+--*/
+{
+    return _ReadFailed;
+}
+
+
+INLINE
+BOOLEAN
+NTFS_UPCASE_TABLE::IsAsciiFoldable(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method determines whether characters below 0x80 may be
+    upcased without consulting the table.  Every NTFS upcase table
+    maps 'a'-'z' to 'A'-'Z' and the rest of the ASCII range to
+    itself, provided it is long enough to cover that range at all.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if ASCII characters can be upcased arithmetically.
+
 --*/
 {
-    return( (Character < _Length) ? _Data[Character] : Character );
+    return _AsciiFoldable;
 }
 
 
@@ -748,6 +748,79 @@ Return Value:
 
  
  
+STATIC
+ULONG
+QueryAttributeRecordCount(
+    IN  PCNTFS_EXTENT_LIST  ExtentList,
+    IN  ULONG               MaxSize
+    )
+/*++
+
+Routine Description:
+
+    This routine estimates how many attribute records
+    PartitionExtentList will split 'ExtentList' into.
+
+Arguments:
+
+    ExtentList  - Supplies the list of extents.
+    MaxSize     - Supplies the maximum number of bytes for the
+                    compressed mapping pairs of each record.
+
+Return Value:
+
+    The estimated number of records, or zero if it could not be
+    computed.
+
+Notes:
+
+    The first mapping pair of each record may grow when it is
+    compressed on its own, so each record is assumed to hold one
+    mapping pair's worth less than MaxSize.
+
+--*/
+{
+    CONST  int MaxBytesPerMappingPair = sizeof(LCN) + sizeof(VCN) + 1;
+
+    VCN lowest;
+    VCN next;
+    ULONG mapping_length;
+    PUCHAR mapping_space;
+    ULONG buffer_size;
+    ULONG capacity;
+
+    if (ExtentList->IsEmpty()) {
+        return 1;
+    }
+
+    if (MaxSize <= (ULONG) MaxBytesPerMappingPair) {
+        return 0;
+    }
+
+    capacity = MaxSize - MaxBytesPerMappingPair;
+
+    buffer_size = MaxBytesPerMappingPair*
+                  (2*ExtentList->QueryNumberOfExtents() + 1) + 1;
+
+    if ( (mapping_space = (PUCHAR) MALLOC( (UINT) buffer_size )) == NULL ) {
+        return 0;
+    }
+
+    if (!ExtentList->QueryCompressedMappingPairs(&lowest,
+                                                 &next,
+                                                 &mapping_length,
+                                                 buffer_size,
+                                                 mapping_space)) {
+        FREE(mapping_space);
+        return 0;
+    }
+
+    FREE(mapping_space);
+
+    return (mapping_length + capacity - 1)/capacity;
+}
+
+
 BOOLEAN
 NTFS_ATTRIBUTE::InsertIntoFile (
    IN OUT  PNTFS_FILE_RECORD_SEGMENT   BaseFileRecordSegment,
@@ -788,6 +861,7 @@ Notes:
     NTFS_EXTENT_LIST source;
     NTFS_EXTENT_LIST result;
     NTFS_EXTENT_LIST remainder;
+    ULONG RecordCount;
     BOOLEAN FirstChunkInserted = FALSE;
     BOOLEAN Completed = FALSE;
 
@@ -885,6 +959,18 @@ Notes:
         MaxExtentsSize -= sizeof(BIG_INT);
     }
     MaxExtentsSize -= QuadAlign(_Name.QueryChCount());
+
+    // If the mapping pairs will need more than one attribute record,
+    // set aside child FRS's for the extra records now, so that they
+    // are allocated together rather than one at a time.
+    //
+    RecordCount = QueryAttributeRecordCount(_ExtentList, MaxExtentsSize);
+
+    if (RecordCount > 1) {
+
+        BaseFileRecordSegment->ReserveChildFileRecordSegments(RecordCount - 1);
+    }
+
     Result = source.Initialize(_ExtentList);
 
     while (Result && !Completed) {
@@ -941,6 +1027,7 @@ Notes:
     }
 
 
+    BaseFileRecordSegment->ReleaseChildFileRecordSegments();
     ResetStorageModified();
     FREE( AttributeRecordData );
     return Result;
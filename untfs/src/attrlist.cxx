@@ -82,6 +82,10 @@ Return Value:
 {
     _LengthOfList = 0;
     _UpcaseTable = NULL;
+    _EntryOffsets = NULL;
+    _NumberOfEntries = 0;
+    _MaximumEntries = 0;
+    _IndexValid = TRUE;
 }
 
 VOID
@@ -105,6 +109,10 @@ Return Value:
 {
     _LengthOfList = 0;
     _UpcaseTable = NULL;
+    DELETE_ARRAY( _EntryOffsets );
+    _NumberOfEntries = 0;
+    _MaximumEntries = 0;
+    _IndexValid = TRUE;
 }
 
  
@@ -236,7 +244,7 @@ Return Value:
     ULONG LengthOfNewEntry;
     ULONG NewLengthOfList;
     PATTRIBUTE_LIST_ENTRY CurrentEntry;
-    ULONG EntryOffset, NameLength;
+    ULONG EntryOffset, EntryIndex, NameLength;
 
 
     // Compute the size of the new entry and the new length of the
@@ -252,15 +260,16 @@ Return Value:
     // If our existing buffer isn't big enough, stretch it to
     // hold the new entry.
 
-    if( !_Mem.Resize( NewLengthOfList ) ) {
+    if( !_Mem.Resize( NewLengthOfList ) ||
+        !ReserveIndexEntry() ) {
 
         return FALSE;
     }
 
-    // Scan forward to the point at which the new entry should
-    // be inserted.
+    // Find the point at which the new entry should be inserted.
 
-    CurrentEntry = FindEntry( Type, Name, LowestVcn, &EntryOffset );
+    CurrentEntry = FindEntry( Type, Name, LowestVcn,
+                              &EntryOffset, &EntryIndex );
 
     if (CurrentEntry == NULL)
         return FALSE;   // fail as there is no insertion point
@@ -275,6 +284,8 @@ Return Value:
 
     _LengthOfList = NewLengthOfList;
 
+    InsertIndexEntry( EntryIndex, EntryOffset, LengthOfNewEntry );
+
     // Fill in the new entry
 
     CurrentEntry->AttributeTypeCode = Type;
@@ -326,8 +337,6 @@ Return Value:
     ULONG i;
 
 
-    // Scan forward to the requested entry
-
     CurrentOffset = 0;
     CurrentEntry = (PATTRIBUTE_LIST_ENTRY)(_Mem.GetBuf());
 
@@ -338,6 +347,33 @@ Return Value:
         return TRUE;
     }
 
+    if( _IndexValid ) {
+
+        if( EntryIndex >= _NumberOfEntries ) {
+
+            // We ran out of entries.
+
+            return TRUE;
+        }
+
+        CurrentOffset = _EntryOffsets[EntryIndex];
+        CurrentEntry = (PATTRIBUTE_LIST_ENTRY)
+                       ((PBYTE)_Mem.GetBuf() + CurrentOffset);
+
+        BytesToRemove = CurrentEntry->RecordLength;
+
+        memmove( CurrentEntry,
+                 (PBYTE)CurrentEntry + BytesToRemove,
+                 _LengthOfList - (CurrentOffset + BytesToRemove) );
+
+        _LengthOfList -= BytesToRemove;
+
+        RemoveIndexEntry( EntryIndex, BytesToRemove );
+
+        return TRUE;
+    }
+
+    // Scan forward to the requested entry
 
     for( i = 0; i < EntryIndex; i++ ) {
 
@@ -395,6 +431,7 @@ Return Value:
     PATTRIBUTE_LIST_ENTRY CurrentEntry;
     ULONG CurrentOffset;
     ULONG BytesToRemove;
+    ULONG EntryIndex;
 
     if( _LengthOfList == 0 ) {
 
@@ -425,6 +462,15 @@ Return Value:
 
     _LengthOfList -= BytesToRemove;
 
+    if( QueryIndexFromOffset( CurrentOffset, &EntryIndex ) ) {
+
+        RemoveIndexEntry( EntryIndex, BytesToRemove );
+
+    } else {
+
+        _IndexValid = FALSE;
+    }
+
     return TRUE;
 }
 
@@ -456,7 +502,7 @@ Return Value:
 --*/
 {
     PATTRIBUTE_LIST_ENTRY CurrentEntry;
-    ULONG EntryOffset;
+    ULONG EntryOffset, EntryIndex;
     ULONG BytesToRemove;
     ULONG NameLength;
     PWSTR NameBuffer = NULL;
@@ -479,7 +525,7 @@ Return Value:
 
     // find the first matching entry.
 
-    CurrentEntry = FindEntry( Type, Name, 0, &EntryOffset );
+    CurrentEntry = FindEntry( Type, Name, 0, &EntryOffset, &EntryIndex );
 
     if (CurrentEntry) {
         while( EntryOffset < _LengthOfList &&
@@ -503,6 +549,8 @@ Return Value:
                      _LengthOfList - (EntryOffset + BytesToRemove) );
 
             _LengthOfList -= BytesToRemove;
+
+            RemoveIndexEntry( EntryIndex, BytesToRemove );
         }
     }
 
@@ -986,7 +1034,47 @@ Notes:
         return FALSE;
     }
 
-    if( DesiredVcn != NULL ) {
+    if( DesiredVcn != NULL && Name != NULL ) {
+
+        // The caller specified a particular VCN, so we have to find the
+        // entry that contains it.  The first entry for this type and
+        // name whose LowestVcn is beyond the desired VCN follows it
+        // directly, and FindEntry can locate that one without walking
+        // the whole run of entries.  Since we passed the test above,
+        // that entry is not the first one for this type and name.
+
+        CurrentEntry = FindEntry( Type, Name, *DesiredVcn + 1,
+                                  &EntryOffset, &CurrentEntryIndex );
+
+        if( CurrentEntry == NULL ) {
+
+            if( NameBuffer != NULL ) {
+
+                FREE( NameBuffer );
+            }
+
+            return FALSE;
+        }
+
+        CurrentEntryIndex -= 1;
+
+        if( _IndexValid ) {
+
+            CurrentEntry = (PATTRIBUTE_LIST_ENTRY)
+                           ((PBYTE)_Mem.GetBuf() +
+                            _EntryOffsets[CurrentEntryIndex]);
+
+        } else {
+
+            CurrentEntry = (PATTRIBUTE_LIST_ENTRY)_Mem.GetBuf();
+
+            for( ULONG i = 0; i < CurrentEntryIndex; i++ ) {
+
+                CurrentEntry = NextEntry( CurrentEntry );
+            }
+        }
+
+    } else if( DesiredVcn != NULL ) {
 
         // The caller specified a particular VCN, so we have to find the
         // entry that contains it.  We do this by scanning forward until
@@ -1153,10 +1241,11 @@ Return Value:
         return FALSE;
     }
 
-    // Read the attribute's value into our buffer.
+    // Read the attribute's value into our buffer and index it.
 
     return( Read( _Mem.GetBuf(), 0, _LengthOfList, &BytesRead) &&
-            BytesRead == _LengthOfList );
+            BytesRead == _LengthOfList &&
+            BuildIndex() );
 }
 
 
@@ -1204,8 +1293,9 @@ Return Value:
 {
     PATTRIBUTE_LIST_ENTRY CurrentEntry;
     ULONG CurrentOffset, CurrentIndex;
+    ULONG Low, High, Middle;
     ULONG NameLength;
-    PWSTR NameBuffer = NULL;
+    PCWSTR NameBuffer;
 
     // This is slightly ugly but necessary.  NTFS attribute names
     // are collated straight, so we can't use the WSTRING name
@@ -1214,91 +1304,56 @@ Return Value:
     if( Name != NULL ) {
 
         NameLength = Name->QueryChCount();
-        NameBuffer = Name->QueryWSTR();
+        NameBuffer = Name->GetWSTR();
 
-        if( NameBuffer == NULL ) {
+    } else {
 
-            return NULL;
-        }
+        NameLength = 0;
+        NameBuffer = NULL;
     }
 
-    // Start at the beginning of the list.
+    if( _IndexValid ) {
 
-    CurrentEntry = (PATTRIBUTE_LIST_ENTRY)(((PNTFS_ATTRIBUTE_LIST) this)->_Mem.GetBuf());
-    CurrentOffset = 0;
-    CurrentIndex = 0;
+        // The entries are sorted, so the ones that come before the
+        // entry we're seeking form a prefix of the list.  Binary
+        // search the offset table for the end of that prefix.
 
-    // Scan forward to the first entry which has a type code
-    // greater than or equal to the type code we want.
+        Low = 0;
+        High = _NumberOfEntries;
 
-    while( CurrentOffset < _LengthOfList &&
-           Type > CurrentEntry->AttributeTypeCode ) {
+        while( Low < High ) {
 
-        CurrentIndex += 1;
-        CurrentOffset += CurrentEntry->RecordLength;
-        CurrentEntry = NextEntry( CurrentEntry );
-    }
+            Middle = Low + (High - Low)/2;
 
+            CurrentEntry = (PATTRIBUTE_LIST_ENTRY)
+                           ((PBYTE)_Mem.GetBuf() + _EntryOffsets[Middle]);
 
-    // CurrentEntry now points at the first entry with an attribute
-    // type code greater than or equal to the one we're seeking.
-    // Within the group of entries with the same type code, the
-    // entries are sorted first by name and then by LowestVcn.
+            if( IsEntryBefore( CurrentEntry, Type, NameBuffer, NameLength,
+                               (BOOLEAN)(Name != NULL), LowestVcn ) ) {
 
-    if( Name != NULL ) {
+                Low = Middle + 1;
 
-        // The caller specified a name name, so we need to scan
-        // through the entries with this attribute type code for
-        // the first entry with a name greater than or equal to
-        // that name.
+            } else {
 
-        while( CurrentOffset < _LengthOfList &&
-               Type == CurrentEntry->AttributeTypeCode &&
-               NtfsUpcaseCompare( NameBuffer,
-                                  NameLength,
-                                  NameFromEntry( CurrentEntry ),
-                                  CurrentEntry->AttributeNameLength,
-                                  _UpcaseTable,
-                                  TRUE ) > 0 ) {
-
-            CurrentIndex += 1;
-            CurrentOffset += CurrentEntry->RecordLength;
-            CurrentEntry = NextEntry( CurrentEntry );
+                High = Middle;
+            }
         }
 
-        // Now scan forward by LowestVcn through the attributes with
-        // this type code and name.  Note that a search value of -1
-        // for LowestVcn indicates we should skip all matching entries.
-
-        while( CurrentOffset < _LengthOfList &&
-               Type == CurrentEntry->AttributeTypeCode &&
-               ( NameLength == CurrentEntry->AttributeNameLength &&
-                 memcmp( NameBuffer,
-                         NameFromEntry( CurrentEntry ),
-                         NameLength * sizeof(WCHAR) ) == 0 ) &&
-               ( (LowestVcn == -1) ||
-                 (LowestVcn > CurrentEntry->LowestVcn) ) ) {
-
-            CurrentIndex += 1;
-            CurrentOffset += CurrentEntry->RecordLength;
-            CurrentEntry = NextEntry( CurrentEntry );
-        }
+        CurrentIndex = Low;
+        CurrentOffset = ( Low < _NumberOfEntries ) ? _EntryOffsets[Low] :
+                                                     _LengthOfList;
 
     } else {
 
-        // The caller did not specify a name, so we only examine
-        // entries without names.  These come before entries with
-        // that same attribute type code that have names.  Scan
-        // forward by LowestVcn through the entries that have this
-        // attribute type code and no name.  Note that a search value
-        // of -1 for LowestVcn indicates that we should skip all matching
-        // entries.
+        // The list could not be indexed, so walk it from the start.
+
+        CurrentEntry = (PATTRIBUTE_LIST_ENTRY)_Mem.GetBuf();
+        CurrentOffset = 0;
+        CurrentIndex = 0;
 
         while( CurrentOffset < _LengthOfList &&
-               Type == CurrentEntry->AttributeTypeCode &&
-               CurrentEntry->AttributeNameLength == 0 &&
-               ( (LowestVcn == -1) ||
-                 (LowestVcn > CurrentEntry->LowestVcn) ) ) {
+               IsEntryBefore( CurrentEntry, Type, NameBuffer, NameLength,
+                              (BOOLEAN)(Name != NULL), LowestVcn ) ) {
 
             CurrentIndex += 1;
             CurrentOffset += CurrentEntry->RecordLength;
@@ -1306,6 +1361,8 @@ Return Value:
         }
     }
 
+    CurrentEntry = (PATTRIBUTE_LIST_ENTRY)((PBYTE)_Mem.GetBuf() + CurrentOffset);
+
     if( EntryOffset != NULL ) {
 
         *EntryOffset = CurrentOffset;
@@ -1316,10 +1373,350 @@ Return Value:
         *EntryIndex = CurrentIndex;
     }
 
-    if( NameBuffer != NULL ) {
+    return CurrentEntry;
+}
 
-        FREE( NameBuffer );
+
+BOOLEAN
+NTFS_ATTRIBUTE_LIST::IsEntryBefore(
+    IN  PCATTRIBUTE_LIST_ENTRY  Entry,
+    IN  ATTRIBUTE_TYPE_CODE     Type,
+    IN  PCWSTR                  NameBuffer,
+    IN  ULONG                   NameLength,
+    IN  BOOLEAN                 HasName,
+    IN  VCN                     LowestVcn
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method determines whether an entry sorts before the
+    (type code, name, LowestVcn) key that FindEntry is seeking.
+
+Arguments:
+
+    Entry       -- supplies the entry to examine.
+    Type        -- supplies the attribute type code to find.
+    NameBuffer  -- supplies the name to find.
+    NameLength  -- supplies the length of the name, in characters.
+    HasName     -- supplies whether a name was given.  If not, only
+                    entries without names are considered to match.
+    LowestVcn   -- supplies the VCN to find.  A value of -1 indicates
+                    that all entries for this type and name come first.
+
+Return Value:
+
+    TRUE if the entry comes before the key.
+
+Notes:
+
+    Within the group of entries with the same type code, the entries
+    are sorted first by name and then by LowestVcn, so this predicate
+    is TRUE for a prefix of the list and FALSE for the rest.
+
+--*/
+{
+    if( Type != Entry->AttributeTypeCode ) {
+
+        return( Type > Entry->AttributeTypeCode );
     }
 
-    return CurrentEntry;
+    if( HasName ) {
+
+        if( NtfsUpcaseCompare( NameBuffer,
+                               NameLength,
+                               NameFromEntry( Entry ),
+                               Entry->AttributeNameLength,
+                               _UpcaseTable,
+                               TRUE ) > 0 ) {
+
+            return TRUE;
+        }
+
+        if( NameLength != Entry->AttributeNameLength ||
+            memcmp( NameBuffer,
+                    NameFromEntry( Entry ),
+                    NameLength * sizeof(WCHAR) ) != 0 ) {
+
+            return FALSE;
+        }
+
+    } else if( Entry->AttributeNameLength != 0 ) {
+
+        return FALSE;
+    }
+
+    return( (LowestVcn == -1) || (LowestVcn > Entry->LowestVcn) );
+}
+
+
+BOOLEAN
+NTFS_ATTRIBUTE_LIST::BuildIndex(
+    )
+/*++
+
+Routine Description:
+
+    This method makes a pass through the list and records the
+    offset of every entry.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE if memory for the offset table could not be allocated.
+    A list that cannot be parsed is not an error; it just leaves
+    the index invalid, so lookups walk the list instead.
+
+--*/
+{
+    PATTRIBUTE_LIST_ENTRY CurrentEntry;
+    ULONG CurrentOffset;
+    ULONG Count;
+
+    _NumberOfEntries = 0;
+    _IndexValid = FALSE;
+
+    // Count the entries, checking that they fit in the list.
+
+    Count = 0;
+    CurrentOffset = 0;
+
+    while( CurrentOffset < _LengthOfList ) {
+
+        CurrentEntry = (PATTRIBUTE_LIST_ENTRY)
+                       ((PBYTE)_Mem.GetBuf() + CurrentOffset);
+
+        if( _LengthOfList - CurrentOffset < sizeof(ATTRIBUTE_LIST_ENTRY) -
+                                            sizeof(WCHAR) ||
+            CurrentEntry->RecordLength == 0 ||
+            CurrentEntry->RecordLength > _LengthOfList - CurrentOffset ) {
+
+            return TRUE;
+        }
+
+        Count += 1;
+        CurrentOffset += CurrentEntry->RecordLength;
+    }
+
+    if( Count > _MaximumEntries ) {
+
+        DELETE_ARRAY( _EntryOffsets );
+        _MaximumEntries = 0;
+
+        if( (_EntryOffsets = NEW ULONG[Count]) == NULL ) {
+
+            return FALSE;
+        }
+
+        _MaximumEntries = Count;
+    }
+
+    CurrentOffset = 0;
+
+    while( _NumberOfEntries < Count ) {
+
+        CurrentEntry = (PATTRIBUTE_LIST_ENTRY)
+                       ((PBYTE)_Mem.GetBuf() + CurrentOffset);
+
+        _EntryOffsets[_NumberOfEntries++] = CurrentOffset;
+        CurrentOffset += CurrentEntry->RecordLength;
+    }
+
+    _IndexValid = TRUE;
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_ATTRIBUTE_LIST::ReserveIndexEntry(
+    )
+/*++
+
+Routine Description:
+
+    This method makes sure the offset table has room for one more
+    entry, so that AddEntry cannot fail after it has changed the list.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE upon successful completion.
+
+--*/
+{
+    PULONG NewOffsets;
+    ULONG NewMaximum;
+
+    if( !_IndexValid || _NumberOfEntries < _MaximumEntries ) {
+
+        return TRUE;
+    }
+
+    NewMaximum = 2*_MaximumEntries + 16;
+
+    if( (NewOffsets = NEW ULONG[NewMaximum]) == NULL ) {
+
+        return FALSE;
+    }
+
+    if( _NumberOfEntries != 0 ) {
+
+        memcpy( NewOffsets, _EntryOffsets, _NumberOfEntries * sizeof(ULONG) );
+    }
+
+    DELETE_ARRAY( _EntryOffsets );
+
+    _EntryOffsets = NewOffsets;
+    _MaximumEntries = NewMaximum;
+
+    return TRUE;
+}
+
+
+VOID
+NTFS_ATTRIBUTE_LIST::InsertIndexEntry(
+    IN  ULONG   EntryIndex,
+    IN  ULONG   EntryOffset,
+    IN  ULONG   EntryLength
+    )
+/*++
+
+Routine Description:
+
+    This method records a new entry in the offset table.  The entries
+    after it move down the list by the length of the new entry.
+
+Arguments:
+
+    EntryIndex  -- supplies the index of the new entry.
+    EntryOffset -- supplies the offset of the new entry.
+    EntryLength -- supplies the length of the new entry.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    if( !_IndexValid ) {
+
+        return;
+    }
+
+    DebugAssert( _NumberOfEntries < _MaximumEntries );
+    DebugAssert( EntryIndex <= _NumberOfEntries );
+
+    for( i = _NumberOfEntries; i > EntryIndex; i-- ) {
+
+        _EntryOffsets[i] = _EntryOffsets[i - 1] + EntryLength;
+    }
+
+    _EntryOffsets[EntryIndex] = EntryOffset;
+    _NumberOfEntries += 1;
+}
+
+
+VOID
+NTFS_ATTRIBUTE_LIST::RemoveIndexEntry(
+    IN  ULONG   EntryIndex,
+    IN  ULONG   EntryLength
+    )
+/*++
+
+Routine Description:
+
+    This method drops an entry from the offset table.  The entries
+    after it move up the list by the length of the removed entry.
+
+Arguments:
+
+    EntryIndex  -- supplies the index of the removed entry.
+    EntryLength -- supplies the length of the removed entry.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    if( !_IndexValid ) {
+
+        return;
+    }
+
+    DebugAssert( EntryIndex < _NumberOfEntries );
+
+    for( i = EntryIndex; i + 1 < _NumberOfEntries; i++ ) {
+
+        _EntryOffsets[i] = _EntryOffsets[i + 1] - EntryLength;
+    }
+
+    _NumberOfEntries -= 1;
+}
+
+
+BOOLEAN
+NTFS_ATTRIBUTE_LIST::QueryIndexFromOffset(
+    IN  ULONG   EntryOffset,
+    OUT PULONG  EntryIndex
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method finds the index of the entry at a given offset.
+
+Arguments:
+
+    EntryOffset -- supplies the offset of the entry.
+    EntryIndex  -- receives the index of the entry.
+
+Return Value:
+
+    TRUE if the offset table is valid and an entry starts at
+    EntryOffset.
+
+--*/
+{
+    ULONG Low, High, Middle;
+
+    if( !_IndexValid ) {
+
+        return FALSE;
+    }
+
+    Low = 0;
+    High = _NumberOfEntries;
+
+    while( Low < High ) {
+
+        Middle = Low + (High - Low)/2;
+
+        if( _EntryOffsets[Middle] < EntryOffset ) {
+
+            Low = Middle + 1;
+
+        } else {
+
+            High = Middle;
+        }
+    }
+
+    if( Low == _NumberOfEntries || _EntryOffsets[Low] != EntryOffset ) {
+
+        return FALSE;
+    }
+
+    *EntryIndex = Low;
+    return TRUE;
 }
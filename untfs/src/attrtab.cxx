@@ -0,0 +1,581 @@
+#include "stdafx.h"
+
+/*++
+
+Module Name:
+
+    attrtab.cxx
+
+Abstract:
+
+    This module contains the member function definitions for
+    NTFS_ATTRIBUTE_OFFSET_TABLE, which records where each attribute
+    record in a file record segment lives.
+
+--*/
+
+
+#include "ulib.hxx"
+
+#include "untfs.hxx"
+
+#include "wstring.hxx"
+#include "attrtab.hxx"
+
+
+DEFINE_CONSTRUCTOR( NTFS_ATTRIBUTE_OFFSET_TABLE, OBJECT );
+
+
+NTFS_ATTRIBUTE_OFFSET_TABLE::~NTFS_ATTRIBUTE_OFFSET_TABLE(
+    )
+/*++
+
+Routine Description:
+
+    Destructor for NTFS_ATTRIBUTE_OFFSET_TABLE.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Destroy();
+}
+
+
+VOID
+NTFS_ATTRIBUTE_OFFSET_TABLE::Construct(
+    )
+/*++
+
+Routine Description:
+
+    Worker method for NTFS_ATTRIBUTE_OFFSET_TABLE construction.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _Entries = NULL;
+    _NumberOfEntries = 0;
+    _MaximumEntries = 0;
+    _Buckets = NULL;
+    _NumberOfBuckets = 0;
+    _MaximumBuckets = 0;
+    _FirstFreeByte = 0;
+    _IsValid = FALSE;
+}
+
+
+VOID
+NTFS_ATTRIBUTE_OFFSET_TABLE::Destroy(
+    )
+/*++
+
+Routine Description:
+
+    Worker method for NTFS_ATTRIBUTE_OFFSET_TABLE destruction.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DELETE_ARRAY( _Entries );
+    _NumberOfEntries = 0;
+    _MaximumEntries = 0;
+    DELETE_ARRAY( _Buckets );
+    _NumberOfBuckets = 0;
+    _MaximumBuckets = 0;
+    _FirstFreeByte = 0;
+    _IsValid = FALSE;
+}
+
+
+BOOLEAN
+NTFS_ATTRIBUTE_OFFSET_TABLE::Build(
+    IN  PFILE_RECORD_SEGMENT_HEADER FrsData,
+    IN  ULONG                       FrsSize
+    )
+/*++
+
+Routine Description:
+
+    This method walks the attribute records of a file record segment,
+    records where each one lives, and hashes the entries by type and
+    name and by instance tag.
+
+Arguments:
+
+    FrsData --  supplies the file record segment.
+    FrsSize --  supplies the size of the file record segment in bytes.
+
+Return Value:
+
+    TRUE if the table is now valid.  FALSE if any attribute record
+    is malformed, the END record is missing or FirstFreeByte does not
+    agree with it, or memory could not be allocated.  In that case
+    the owner must walk the records itself, which also lets
+    NTFS_FRS_STRUCTURE::GetNextAttributeRecord repair them.
+
+--*/
+{
+    PATTRIBUTE_RECORD_HEADER CurrentRecord;
+    PNTFS_ATTRIBUTE_OFFSET Entry;
+    ULONG CurrentOffset, Count, Buckets, Bucket, i;
+
+    DebugPtrAssert( FrsData );
+
+    _IsValid = FALSE;
+    _NumberOfEntries = 0;
+
+    if( FrsData->FirstAttributeOffset % 4 != 0 ) {
+
+        return FALSE;
+    }
+
+    // Count the records, applying the same checks as
+    // GetNextAttributeRecord.  In addition, each record must be
+    // long enough to hold the fields the table records, and its
+    // name must lie within it.
+
+    Count = 0;
+    CurrentOffset = FrsData->FirstAttributeOffset;
+
+    while( TRUE ) {
+
+        if( CurrentOffset > FrsSize ||
+            FrsSize - CurrentOffset < QuadAlign(sizeof(ATTRIBUTE_TYPE_CODE)) ) {
+
+            return FALSE;
+        }
+
+        CurrentRecord = (PATTRIBUTE_RECORD_HEADER)((PBYTE)FrsData + CurrentOffset);
+
+        if( CurrentRecord->TypeCode == $END ) {
+
+            break;
+        }
+
+        if( CurrentRecord->RecordLength < FIELD_OFFSET(ATTRIBUTE_RECORD_HEADER, Form) ||
+            !IsQuadAligned(CurrentRecord->RecordLength) ||
+            CurrentRecord->RecordLength >
+                FrsSize - CurrentOffset - QuadAlign(sizeof(ATTRIBUTE_TYPE_CODE)) ||
+            (ULONG)CurrentRecord->NameOffset +
+                CurrentRecord->NameLength * sizeof(WCHAR) > CurrentRecord->RecordLength ) {
+
+            return FALSE;
+        }
+
+        Count += 1;
+        CurrentOffset += CurrentRecord->RecordLength;
+    }
+
+    if( FrsData->FirstFreeByte !=
+        CurrentOffset + QuadAlign(sizeof(ATTRIBUTE_TYPE_CODE)) ) {
+
+        return FALSE;
+    }
+
+    if( Count > _MaximumEntries ) {
+
+        DELETE_ARRAY( _Entries );
+        _MaximumEntries = 0;
+
+        // Leave some slack so that a record segment which gains
+        // a few attributes doesn't force a reallocation.
+
+        if( (_Entries = NEW NTFS_ATTRIBUTE_OFFSET[Count + 8]) == NULL ) {
+
+            return FALSE;
+        }
+
+        _MaximumEntries = Count + 8;
+    }
+
+    Buckets = 16;
+
+    while( Buckets < 2 * Count ) {
+
+        Buckets *= 2;
+    }
+
+    if( Buckets > _MaximumBuckets ) {
+
+        DELETE_ARRAY( _Buckets );
+        _MaximumBuckets = 0;
+
+        if( (_Buckets = NEW ULONG[2 * Buckets]) == NULL ) {
+
+            return FALSE;
+        }
+
+        _MaximumBuckets = Buckets;
+    }
+
+    _NumberOfBuckets = Buckets;
+
+    CurrentOffset = FrsData->FirstAttributeOffset;
+
+    while( _NumberOfEntries < Count ) {
+
+        CurrentRecord = (PATTRIBUTE_RECORD_HEADER)((PBYTE)FrsData + CurrentOffset);
+        Entry = &_Entries[_NumberOfEntries++];
+
+        Entry->TypeCode = CurrentRecord->TypeCode;
+        Entry->NameHash = HashName( (PCWSTR)((PBYTE)CurrentRecord +
+                                             CurrentRecord->NameOffset),
+                                    CurrentRecord->NameLength );
+        Entry->Instance = CurrentRecord->Instance;
+        Entry->Offset = CurrentOffset;
+        Entry->Length = CurrentRecord->RecordLength;
+
+        CurrentOffset += CurrentRecord->RecordLength;
+    }
+
+    // Chain the entries into their buckets, last first, so that each
+    // chain is in record order and a lookup finds the first match.
+
+    for( i = 0; i < 2 * _NumberOfBuckets; i++ ) {
+
+        _Buckets[i] = NTFS_ATTRIBUTE_OFFSET_NONE;
+    }
+
+    for( i = Count; i > 0; i-- ) {
+
+        Entry = &_Entries[i - 1];
+
+        Bucket = QueryKeyBucket( Entry->TypeCode, Entry->NameHash );
+        Entry->NextByKey = _Buckets[Bucket];
+        _Buckets[Bucket] = i - 1;
+
+        Bucket = QueryTagBucket( Entry->Instance );
+        Entry->NextByTag = _Buckets[Bucket];
+        _Buckets[Bucket] = i - 1;
+    }
+
+    _FirstFreeByte = FrsData->FirstFreeByte;
+    _IsValid = TRUE;
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_ATTRIBUTE_OFFSET_TABLE::FindRecord(
+    IN  PFILE_RECORD_SEGMENT_HEADER FrsData,
+    IN  ATTRIBUTE_TYPE_CODE         Type,
+    IN  PCWSTRING                   Name,
+    OUT PVOID*                      Record
+    )
+/*++
+
+Routine Description:
+
+    This method locates the first attribute record with the given
+    type and name.  It has the same semantics as a walk of the records
+    using NTFS_ATTRIBUTE_RECORD::IsMatch.
+
+Arguments:
+
+    FrsData --  supplies the file record segment.
+    Type    --  supplies the attribute type code.
+    Name    --  supplies the attribute name.  NULL is the same as
+                the empty name.
+    Record  --  receives a pointer to the matching record, or NULL
+                if there is none.
+
+Return Value:
+
+    TRUE if *Record may be relied upon.  FALSE if the table turned
+    out to be stale, in which case it has been invalidated.
+
+Notes:
+
+    The table must be valid.
+
+--*/
+{
+    PCWSTR NameBuffer;
+    ULONG NameLength, NameHash, i;
+    PATTRIBUTE_RECORD_HEADER CurrentRecord;
+
+    DebugAssert( IsValid( FrsData ) );
+
+    if( Name != NULL ) {
+
+        NameBuffer = Name->GetWSTR();
+        NameLength = Name->QueryChCount();
+
+    } else {
+
+        NameBuffer = NULL;
+        NameLength = 0;
+    }
+
+    NameHash = HashName( NameBuffer, NameLength );
+
+    for( i = _Buckets[QueryKeyBucket( Type, NameHash )];
+         i != NTFS_ATTRIBUTE_OFFSET_NONE;
+         i = _Entries[i].NextByKey ) {
+
+        if( _Entries[i].TypeCode != Type ||
+            _Entries[i].NameHash != NameHash ) {
+
+            continue;
+        }
+
+        if( !IsEntryCurrent( FrsData, &_Entries[i] ) ) {
+
+            _IsValid = FALSE;
+            return FALSE;
+        }
+
+        CurrentRecord = (PATTRIBUTE_RECORD_HEADER)
+                        ((PBYTE)FrsData + _Entries[i].Offset);
+
+        if( CurrentRecord->NameLength == NameLength &&
+            ( NameLength == 0 ||
+              memcmp( (PBYTE)CurrentRecord + CurrentRecord->NameOffset,
+                      NameBuffer,
+                      NameLength * sizeof(WCHAR) ) == 0 ) ) {
+
+            *Record = CurrentRecord;
+            return TRUE;
+        }
+    }
+
+    *Record = NULL;
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_ATTRIBUTE_OFFSET_TABLE::FindRecordByTag(
+    IN  PFILE_RECORD_SEGMENT_HEADER FrsData,
+    IN  ULONG                       Tag,
+    OUT PVOID*                      Record
+    )
+/*++
+
+Routine Description:
+
+    This method locates the first attribute record with the given
+    instance tag.
+
+Arguments:
+
+    FrsData --  supplies the file record segment.
+    Tag     --  supplies the instance tag.
+    Record  --  receives a pointer to the matching record, or NULL
+                if there is none.
+
+Return Value:
+
+    TRUE if *Record may be relied upon.  FALSE if the table turned
+    out to be stale, in which case it has been invalidated.
+
+Notes:
+
+    The table must be valid.
+
+--*/
+{
+    ULONG i;
+
+    DebugAssert( IsValid( FrsData ) );
+
+    for( i = _Buckets[QueryTagBucket( Tag )];
+         i != NTFS_ATTRIBUTE_OFFSET_NONE;
+         i = _Entries[i].NextByTag ) {
+
+        if( _Entries[i].Instance != Tag ) {
+
+            continue;
+        }
+
+        if( !IsEntryCurrent( FrsData, &_Entries[i] ) ) {
+
+            _IsValid = FALSE;
+            return FALSE;
+        }
+
+        *Record = (PBYTE)FrsData + _Entries[i].Offset;
+        return TRUE;
+    }
+
+    *Record = NULL;
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_ATTRIBUTE_OFFSET_TABLE::IsEntryCurrent(
+    IN  PFILE_RECORD_SEGMENT_HEADER FrsData,
+    IN  PCNTFS_ATTRIBUTE_OFFSET     Entry
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method checks that the record an entry points at is still
+    the record the entry describes.
+
+Arguments:
+
+    FrsData --  supplies the file record segment.
+    Entry   --  supplies the entry.
+
+Return Value:
+
+    TRUE if the entry still describes its record.
+
+--*/
+{
+    PATTRIBUTE_RECORD_HEADER CurrentRecord;
+
+    CurrentRecord = (PATTRIBUTE_RECORD_HEADER)((PBYTE)FrsData + Entry->Offset);
+
+    return CurrentRecord->TypeCode == Entry->TypeCode &&
+           CurrentRecord->RecordLength == Entry->Length &&
+           CurrentRecord->Instance == Entry->Instance &&
+           (ULONG)CurrentRecord->NameOffset +
+                CurrentRecord->NameLength * sizeof(WCHAR) <= Entry->Length;
+}
+
+
+ULONG
+NTFS_ATTRIBUTE_OFFSET_TABLE::HashName(
+    IN  PCWSTR  Name,
+    IN  ULONG   NameLength
+    )
+/*++
+
+Routine Description:
+
+    This method hashes an attribute name (FNV-1a over its characters).
+    The hash only narrows the search; matches are always confirmed
+    against the record itself.
+
+Arguments:
+
+    Name        --  supplies the name.
+    NameLength  --  supplies the length of the name in characters.
+
+Return Value:
+
+    The hash of the name.
+
+--*/
+{
+    ULONG Hash, i;
+
+    Hash = 2166136261;
+
+    for( i = 0; i < NameLength; i++ ) {
+
+        Hash ^= Name[i];
+        Hash *= 16777619;
+    }
+
+    return Hash;
+}
+
+
+ULONG
+NTFS_ATTRIBUTE_OFFSET_TABLE::QueryKeyBucket(
+    IN  ATTRIBUTE_TYPE_CODE Type,
+    IN  ULONG               NameHash
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method computes the bucket of the chains by type and name
+    that holds entries with the given type code and name hash.
+
+Arguments:
+
+    Type        --  supplies the attribute type code.
+    NameHash    --  supplies the hash of the attribute name.
+
+Return Value:
+
+    The index of the bucket in _Buckets.
+
+--*/
+{
+    return MixHash( MixHash( Type ) ^ NameHash ) & (_NumberOfBuckets - 1);
+}
+
+
+ULONG
+NTFS_ATTRIBUTE_OFFSET_TABLE::QueryTagBucket(
+    IN  ULONG   Tag
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method computes the bucket of the chains by instance tag
+    that holds entries with the given tag.
+
+Arguments:
+
+    Tag --  supplies the instance tag.
+
+Return Value:
+
+    The index of the bucket in _Buckets.
+
+--*/
+{
+    return _NumberOfBuckets + (MixHash( Tag ) & (_NumberOfBuckets - 1));
+}
+
+
+ULONG
+NTFS_ATTRIBUTE_OFFSET_TABLE::MixHash(
+    IN  ULONG   Value
+    )
+/*++
+
+Routine Description:
+
+    This method scrambles the bits of a value, so that values which
+    differ only in their high bits, such as attribute type codes,
+    still fall into different buckets.
+
+Arguments:
+
+    Value   --  supplies the value.
+
+Return Value:
+
+    The scrambled value.
+
+--*/
+{
+    Value ^= Value >> 16;
+    Value *= 0x7FEB352D;
+    Value ^= Value >> 15;
+    Value *= 0x846CA68B;
+    Value ^= Value >> 16;
+
+    return Value;
+}
@@ -304,6 +304,77 @@ Notes:
 
 
  
+BOOLEAN
+NTFS_BAD_CLUSTER_FILE::QueryRunCount(
+    OUT PULONG  RunCount
+    )
+/*++
+
+Routine Description:
+
+    This method counts the runs of clusters in the bad cluster list,
+    as they would be recorded in the mapping pairs of $Bad.
+
+Arguments:
+
+    RunCount    --  receives the number of runs.
+
+Return Value:
+
+    TRUE upon successful completion.
+
+--*/
+{
+    DSTRING DataAttributeName;
+    PCNTFS_EXTENT_LIST Extents;
+    VCN Vcn;
+    LCN Lcn;
+    BIG_INT RunLength;
+    ULONG NumberOfExtents;
+    ULONG i;
+    BOOLEAN Error;
+
+    *RunCount = 0;
+
+    if( _DataAttribute == NULL &&
+        (!DataAttributeName.Initialize( BadfileDataNameData ) ||
+          (_DataAttribute = NEW NTFS_ATTRIBUTE) == NULL ||
+          !QueryAttribute( _DataAttribute,
+                           &Error,
+                           $DATA,
+                           &DataAttributeName ) ) ) 
+    {
+        DELETE( _DataAttribute );
+        return FALSE;
+    }
+
+    // $Bad is sparse; the holes between the bad clusters are not runs.
+
+    if( (Extents = _DataAttribute->GetExtentList()) == NULL )
+    {
+        return TRUE;
+    }
+
+    NumberOfExtents = Extents->QueryNumberOfExtents();
+
+    for( i = 0; i < NumberOfExtents; i++ )
+    {
+        if( !Extents->QueryExtent( i, &Vcn, &Lcn, &RunLength ) )
+        {
+            return FALSE;
+        }
+
+        if( Lcn != LCN_NOT_PRESENT )
+        {
+            (*RunCount)++;
+        }
+    }
+
+    return TRUE;
+}
+
+
+ 
 BOOLEAN
 NTFS_BAD_CLUSTER_FILE::Flush(
     IN OUT  PNTFS_BITMAP        Bitmap,
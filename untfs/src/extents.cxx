@@ -23,6 +23,9 @@ Abstract:
     The extent list is kept sorted by VCN.  Since extent lists are
     typically quite short, linear search is used.
 
+    Mapping pairs are encoded and decoded on plain 64-bit deltas with
+    the helpers in mpairs.hxx rather than byte by byte through BIG_INT.
+
 
 --*/
 
@@ -36,6 +39,7 @@ Abstract:
 #include "iterator.hxx"
 
 #include "extents.hxx"
+#include "mpairs.hxx"
 #include "ntfssa.hxx"
 
 extern "C" {
@@ -465,24 +469,14 @@ Return Value:
     VCN             TempVcn;
     BOOLEAN         b;
 
-    if (RunLength <= 0) {
-
-        // zero-length runs are not valid.  Neither are negative ones.
-
-        return FALSE;
-    }
-    if (LCN_NOT_PRESENT == Lcn) {
+    if (LCN_NOT_PRESENT == Lcn && RunLength > 0) {
 
         // We ignore attempts to explicitly add holes.
 
         return TRUE;
     }
 
-    //
-    // Currently, Mcb routines cannot handle number beyond 32 bits
-    //
-
-    if (Vcn.GetLargeInteger().HighPart) {
+    if (!IsRunAccepted(Vcn, RunLength)) {
         return FALSE;
     }
 
@@ -527,6 +521,50 @@ Return Value:
 }
 
 
+BOOLEAN
+NTFS_EXTENT_LIST::IsRunAccepted(
+    IN  VCN         Vcn,
+    IN  BIG_INT     RunLength
+    )
+/*++
+
+Routine Description:
+
+    This routine determines whether AddExtent can take a run that is
+    not a hole, before it is handed to the Mcb routines.  AddExtents
+    checks a whole list with it before adding any of the runs, so the
+    two must agree.
+
+Arguments:
+
+    Vcn         --  Supplies the starting VCN of the run.
+    RunLength   --  Supplies the number of clusters in the run.
+
+Return Value:
+
+    FALSE if the run would be refused.
+
+--*/
+{
+    if (RunLength <= 0) {
+
+        // zero-length runs are not valid.  Neither are negative ones.
+
+        return FALSE;
+    }
+
+    //
+    // Currently, Mcb routines cannot handle number beyond 32 bits
+    //
+
+    if (Vcn.GetLargeInteger().HighPart) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
  
 VOID
 NTFS_EXTENT_LIST::Coalesce(
@@ -588,20 +626,28 @@ Notes:
     this list overlaps with another extent in the list.  In either
     of these cases, AddExtents will return FALSE.
 
-    If this method encounters an error after processing part of
-    the list, it will leave the extent list in an undefined (but
-    valid, as an object) state.
+    The whole list is decoded and checked before any extent is
+    added, so a list that cannot be expanded leaves the extent list
+    as it was.  If an extent cannot be added (because it overlaps
+    another one, or memory runs out), the extents already added by
+    this call are removed again, so a failure never leaves the
+    extent list half-updated.
 
     Clients who trust their mapping pairs list may omit the
     BadMappingPairs parameter.
 
 --*/
 {
-    VCN             CurrentVcn;
-    ULONG           LengthOfCompressedPairs;
-    ULONG           NumberOfPairs;
-    PMAPPING_PAIR   MappingPairs;
-    ULONG i;
+    NTFS_MAPPING_PAIRS_DECODER  Decoder;
+    NTFS_EXTENT_LIST            Saved;
+    VCN                         Vcn;
+    LCN                         Lcn;
+    BIG_INT                     RunLength;
+    VCN                         SavedLowestVcn;
+    VCN                         SavedNextVcn;
+    BOOLEAN                     Refused;
+    BOOLEAN                     HadExtents;
+    BOOLEAN                     Added;
 
     // Assume innocent until found guilty
     //
@@ -610,41 +656,34 @@ Notes:
         *BadMappingPairs = FALSE;
     }
 
-    // Determine how many mapping pairs we actually have, so
-    // we can allocate the correct size of an expanded mapping
-    // pairs buffer.
-
-    if( !QueryMappingPairsLength( CompressedMappingPairs,
-                                  MappingPairsMaximumLength,
-                                  &LengthOfCompressedPairs,
-                                  &NumberOfPairs ) ) {
+    // Walk the compressed list directly; there is no need to
+    // expand it into an intermediate array of mapping pairs.
+    // The first pass only checks the list, so that nothing is
+    // added from a list that turns out to be corrupt.
 
-        if( BadMappingPairs != NULL ) {
-
-            *BadMappingPairs = TRUE;
-        }
+    if( !Decoder.Initialize( CompressedMappingPairs,
+                             MappingPairsMaximumLength,
+                             StartingVcn ) ) {
 
-        DebugPrint( "Can't determine length of mapping pairs.\n" );
         return FALSE;
     }
 
-    // Allocate a buffer to hold the expanded mapping pairs.
+    Refused = FALSE;
 
-    MappingPairs = (PMAPPING_PAIR)MALLOC( sizeof(MAPPING_PAIR) *
-                                            (UINT) NumberOfPairs );
+    while( Decoder.QueryNextRun( &Vcn, &Lcn, &RunLength ) ) {
 
-    if( MappingPairs == NULL ) {
+        // These are the runs AddExtent would refuse.  A list that
+        // cannot be expanded is reported as such even if it also
+        // holds one of them, so keep walking.
 
-        return FALSE;
-    }
+        if( Lcn != LCN_NOT_PRESENT &&
+            !IsRunAccepted( Vcn, RunLength ) ) {
 
+            Refused = TRUE;
+        }
+    }
 
-    if( !ExpandMappingPairs( CompressedMappingPairs,
-                             StartingVcn,
-                             MappingPairsMaximumLength,
-                             NumberOfPairs,
-                             MappingPairs,
-                             &NumberOfPairs ) ) {
+    if( !Decoder.IsDone() ) {
 
         DebugPrint( "Cannot expand mapping pairs.\n" );
 
@@ -653,29 +692,57 @@ Notes:
             *BadMappingPairs = TRUE;
         }
 
-        FREE( MappingPairs );
         return FALSE;
     }
 
+    if( Refused ) {
+
+        return FALSE;
+    }
+
+    // The second pass adds the runs.  An empty list is put back by
+    // truncating it; a list that already held extents is copied
+    // first, which only clients merging several lists pay for.
 
-    // Convert the mapping pairs into extents.
+    SavedLowestVcn = _LowestVcn;
+    SavedNextVcn = _NextVcn;
+    HadExtents = ( QueryNumberOfExtents() != 0 );
 
-    CurrentVcn = StartingVcn;
+    if( HadExtents && !Saved.Initialize( this ) ) {
 
-    for( i = 0; i < NumberOfPairs; i++ ) {
+        return FALSE;
+    }
 
-        if( MappingPairs[i].CurrentLcn != LCN_NOT_PRESENT ) {
+    Decoder.Initialize( CompressedMappingPairs,
+                        MappingPairsMaximumLength,
+                        StartingVcn );
 
-            if( !AddExtent( CurrentVcn,
-                            MappingPairs[i].CurrentLcn,
-                            MappingPairs[i].NextVcn - CurrentVcn ) ) {
+    Added = TRUE;
 
-                FREE( MappingPairs );
-                return FALSE;
-            }
+    while( Decoder.QueryNextRun( &Vcn, &Lcn, &RunLength ) ) {
+
+        if( Lcn != LCN_NOT_PRESENT &&
+            !AddExtent( Vcn, Lcn, RunLength ) ) {
+
+            Added = FALSE;
+            break;
+        }
+    }
+
+    if( !Added ) {
+
+        if( HadExtents ) {
+
+            Initialize( &Saved );
+
+        } else {
+
+            FsRtlTruncateLargeMcb( _Mcb, 0 );
+            _LowestVcn = SavedLowestVcn;
+            _NextVcn = SavedNextVcn;
         }
 
-        CurrentVcn = MappingPairs[i].NextVcn;
+        return FALSE;
     }
 
     // Set _LowestVcn to the client-supplied value, if necessary.
@@ -690,12 +757,11 @@ Notes:
 
     // Update _NextVcn if neccessary.
     //
-    if( CurrentVcn > _NextVcn ) {
+    if( Decoder.QueryNextVcn() > _NextVcn ) {
 
-        _NextVcn = CurrentVcn;
+        _NextVcn = Decoder.QueryNextVcn();
     }
 
-    FREE( MappingPairs );
     return TRUE;
 }
 
@@ -1366,28 +1432,30 @@ Return Value:
 
 --*/
 {
-    PBYTE CurrentCountByte;
-    ULONG CurrentLength;
+    PCUCHAR CurrentData;
+    ULONG   CurrentLength;
+    UCHAR   CountByte;
 
-    CurrentCountByte = (PBYTE)CompressedPairs;
+    CurrentData = (PCUCHAR)CompressedPairs;
 
     *NumberOfPairs = 0;
     *Length = 0;
 
-    while( *Length <= MaximumLength &&
-           *CurrentCountByte != 0 ) {
+    // Only the count bytes are looked at; each one tells how far
+    // to skip to reach the next.
+
+    while( *Length < MaximumLength &&
+           (CountByte = CurrentData[*Length]) != 0 ) {
 
         // The length for this pair is the number of LCN bytes, plus
         // the number of VCN bytes, plus one for the count byte.
 
-        CurrentLength = LcnBytesFromCountByte( *CurrentCountByte ) +
-                        VcnBytesFromCountByte( *CurrentCountByte ) +
+        CurrentLength = LcnBytesFromCountByte( CountByte ) +
+                        VcnBytesFromCountByte( CountByte ) +
                         1;
 
         (*NumberOfPairs)++;
         *Length += CurrentLength;
-
-        CurrentCountByte += CurrentLength;
     }
 
     (*Length)++; // For the final 0 byte.
@@ -1430,91 +1498,38 @@ Return Value:
 
 --*/
 {
-    PBYTE CurrentData;
-    VCN CurrentVcn;
-    LCN CurrentLcn;
-    UCHAR v, l;
-    ULONG CurrentLength;
-    VCN DeltaVcn;
-    LCN DeltaLcn;
-    ULONG PairIndex;
+    NTFS_MAPPING_PAIRS_DECODER  Decoder;
+    VCN                         Vcn;
+    LCN                         Lcn;
+    BIG_INT                     RunLength;
+    ULONG                       PairIndex;
 
+    if( !Decoder.Initialize( CompressedPairs, BufferSize, StartingVcn ) ) {
 
-    CurrentData = (PBYTE)CompressedPairs;
-    CurrentVcn = StartingVcn;
-    CurrentLcn = 0;
-    CurrentLength = 0;
-    PairIndex = 0;
-
-    while(  CurrentLength < BufferSize &&
-            *CurrentData != 0 &&
-            PairIndex < MaximumNumberOfPairs
-            ) {
-
-        // Get the count byte.  Note that whenever we advance the
-        // current data pointer, we first increment the length count,
-        // to make sure our access is valid.
-
-        CurrentLength ++;
-
-        if( CurrentLength > BufferSize ) {
-
-            return FALSE;
-        }
-
-        v = VcnBytesFromCountByte( *CurrentData );
-        l = LcnBytesFromCountByte( *CurrentData );
-
-        CurrentData ++;
-
-
-        // Unpack DeltaVcn and compute the current VCN:
-
-        CurrentLength += v;
-
-        if( v > 8 || CurrentLength > BufferSize ) {
-
-            return FALSE;
-        }
-
-        DeltaVcn.Set( v, CurrentData );
-        CurrentData += v;
-
-        CurrentVcn += DeltaVcn;
-        MappingPairs[PairIndex].NextVcn = CurrentVcn;
-
-        // Unpack DeltaLcn and compute the current LCN:
-        //
-        CurrentLength += l;
-
-        if( l > 8 || CurrentLength > BufferSize ) {
-
-            return FALSE;
-        }
-
-        if( l == 0 ) {
+        return FALSE;
+    }
 
-            // a delta-LCN count value of 0 indicates a
-            // non-present run.
-            //
-            MappingPairs[PairIndex].CurrentLcn = LCN_NOT_PRESENT;
+    PairIndex = 0;
 
-        } else {
+    while( PairIndex < MaximumNumberOfPairs &&
+           Decoder.QueryNextRun( &Vcn, &Lcn, &RunLength ) ) {
 
-            DeltaLcn.Set( l, CurrentData );
-            CurrentLcn += DeltaLcn;
-            MappingPairs[PairIndex].CurrentLcn = CurrentLcn;
-        }
-
-        CurrentData += l;
+        MappingPairs[PairIndex].NextVcn = Vcn + RunLength;
+        MappingPairs[PairIndex].CurrentLcn = Lcn;
         PairIndex ++;
     }
 
     *NumberOfPairs = PairIndex;
 
-    return( CurrentLength <= BufferSize &&
-            *CurrentData == 0 &&
-            PairIndex <= MaximumNumberOfPairs );
+    // If the output buffer filled up, the list must end right here.
+    //
+    if( !Decoder.IsDone() &&
+        Decoder.QueryNextRun( &Vcn, &Lcn, &RunLength ) ) {
+
+        return FALSE;
+    }
+
+    return Decoder.IsDone();
 }
 
  
@@ -1536,14 +1551,13 @@ Notes:
 --*/
 {
     PBYTE CurrentData;
-    VCN CurrentVcn;
-    LCN CurrentLcn;
+    LONGLONG CurrentVcn;
+    LONGLONG CurrentLcn;
+    LONGLONG NextLcn;
     ULONG CurrentLength;
-    VCN DeltaVcn;
-    LCN DeltaLcn;
+    LONGLONG DeltaVcn;
+    LONGLONG DeltaLcn;
     ULONG i;
-    UCHAR ComDeltaVcn[sizeof(VCN)];
-    UCHAR ComDeltaLcn[sizeof(LCN)];
     UCHAR VcnLength;
     UCHAR LcnLength;
     UCHAR Major, Minor;
@@ -1556,33 +1570,35 @@ Notes:
     NewSparseFormat = (Major > 1) || (Major == 1 && Minor > 1);
 
     // A mapping pair is (NextVcn, CurrentLcn); however, the compressed
-    // form is a list of deltas.
+    // form is a list of deltas.  The deltas are little-endian, so the
+    // low bytes of a LONGLONG are exactly the compressed integer.
 
     CurrentData = (PBYTE)CompressedPairs;
-    CurrentVcn = StartingVcn;
+    CurrentVcn = StartingVcn.GetQuadPart();
     CurrentLcn = 0;
     CurrentLength = 0;
 
     for( i = 0; i < NumberOfPairs; i++ ) {
 
-        DeltaVcn = MappingPairs[i].NextVcn - CurrentVcn;
-        DeltaLcn = MappingPairs[i].CurrentLcn - CurrentLcn;
+        NextLcn = MappingPairs[i].CurrentLcn.GetQuadPart();
 
-        DeltaVcn.QueryCompressedInteger(&VcnLength, ComDeltaVcn);
+        DeltaVcn = MappingPairs[i].NextVcn.GetQuadPart() - CurrentVcn;
+        VcnLength = MappingPairsFieldWidth( DeltaVcn );
 
-        if( NewSparseFormat && MappingPairs[i].CurrentLcn == LCN_NOT_PRESENT ) {
+        if( NewSparseFormat && NextLcn == LCN_NOT_PRESENT ) {
 
             LcnLength = 0;
             DeltaLcn = 0;
 
         } else {
 
-            DeltaLcn.QueryCompressedInteger(&LcnLength, ComDeltaLcn);
+            DeltaLcn = NextLcn - CurrentLcn;
+            LcnLength = MappingPairsFieldWidth( DeltaLcn );
         }
 
-        // Fill in the count byte and step over it.
+        // Make sure the count byte and both deltas fit.
 
-        CurrentLength ++;
+        CurrentLength += 1 + VcnLength + LcnLength;
 
         if( CurrentLength > MaximumCompressedLength ) {
 
@@ -1592,30 +1608,10 @@ Notes:
         *CurrentData = ComputeMappingPairCountByte( VcnLength, LcnLength );
         CurrentData ++;
 
-
-        // Copy DeltaVcn and advance the pointer
-
-        CurrentLength += VcnLength;
-
-        if( CurrentLength > MaximumCompressedLength ) {
-
-            return FALSE;
-        }
-
-        memcpy( CurrentData, ComDeltaVcn, VcnLength );
+        memcpy( CurrentData, &DeltaVcn, VcnLength );
         CurrentData += VcnLength;
 
-
-        // Copy DeltaLcn and advance the pointer
-
-        CurrentLength += LcnLength;
-
-        if( CurrentLength > MaximumCompressedLength ) {
-
-            return FALSE;
-        }
-
-        memcpy( CurrentData, ComDeltaLcn, LcnLength );
+        memcpy( CurrentData, &DeltaLcn, LcnLength );
         CurrentData += LcnLength;
 
         CurrentVcn += DeltaVcn;
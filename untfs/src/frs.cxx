@@ -37,6 +37,7 @@ Abstract:
 #include "indxroot.hxx"
 #include "upcase.hxx"
 #include "indxbuff.hxx"
+#include "ntfssa.hxx"
 
 
 DEFINE_CONSTRUCTOR(NTFS_FILE_RECORD_SEGMENT, NTFS_FRS_STRUCTURE);
@@ -71,6 +72,9 @@ Return Value:
     _Mft = NULL;
     _AttributeList = NULL;
     _ChildIterator = NULL;
+    _FileNameInfoValid = FALSE;
+    _ReservedChildFileNumber = 0;
+    _ReservedChildCount = 0;
 }
 
 
@@ -105,6 +109,7 @@ Return Value:
 
     DELETE(_AttributeList);
     _AttributeList = NULL;
+    _FileNameInfoValid = FALSE;
 }
 
 VOID
@@ -126,6 +131,8 @@ Return Value:
 
 --*/
 {
+   ReleaseChildFileRecordSegments();
+
    _Mft = NULL;
 
    Destroy2();
@@ -386,6 +393,7 @@ Return value:
     DebugPtrAssert( _FrsData );
 
     memset( _FrsData, 0, (UINT) QuerySize() );
+    InvalidateAttributeTable();
 
     _FrsData->Lsn.LowPart = 0;
     _FrsData->Lsn.HighPart = 0;
@@ -823,6 +831,7 @@ Notes:
    ULONG CurrentRecordOffset;
    NTFS_ATTRIBUTE_RECORD CurrentRecord;
    NTFS_ATTRIBUTE AttributeList;
+   PVOID RecordData;
    BOOLEAN Found = FALSE;
 
     DebugPtrAssert( _FrsData );
@@ -849,7 +858,13 @@ Notes:
         // attributes or there is no ATTRIBUTE_LIST attribute,
         // or we're looking for the attribute list itself,
       // so we'll go through the list of attribute records
-      // in this File Record Segment.
+      // in this File Record Segment.  The attribute offset table
+      // answers this without walking them, if it can be used.
+
+        if( FindAttributeRecord( Type, Name, &RecordData ) ) {
+
+            return( RecordData != NULL );
+        }
 
       CurrentRecordOffset = _FrsData->FirstAttributeOffset;
 
@@ -1636,6 +1651,25 @@ Arguments:
     BOOLEAN Found = FALSE;
 
 
+    // Use the attribute offset table if possible.
+
+    if( FindAttributeRecordByTag( Tag, &CurrentRecordData ) ) {
+
+        if( CurrentRecordData == NULL ) {
+
+            *Error = FALSE;
+            return FALSE;
+        }
+
+        if( !CurrentRecord.Initialize( GetDrive(), CurrentRecordData ) ) {
+
+            *Error = TRUE;
+            return FALSE;
+        }
+
+        Found = TRUE;
+    }
+
     while( !Found ) {
 
         CurrentRecordData = GetNextAttributeRecord( CurrentRecordData );
@@ -1802,6 +1836,8 @@ Return Value:
                    (PBYTE)_FrsData + NextRecordOffset,
                    (UINT) (QuerySize() - NextRecordOffset) );
 
+            InvalidateAttributeTable();
+
 
 
             // Note that, since we've brought the next record to
@@ -2537,11 +2573,28 @@ Return Value:
 --*/
 {
     ULONG CurrentRecordOffset;
+    PVOID RecordData;
     BOOLEAN Found = FALSE;
 
     DebugPtrAssert( _FrsData );
     DebugPtrAssert( AttributeRecord );
 
+    // Use the attribute offset table if possible.
+
+    if( FindAttributeRecord( Type, Name, &RecordData ) ) {
+
+        if( RecordData == NULL ) {
+
+            return FALSE;
+        }
+
+        CurrentRecordOffset = (ULONG)((PBYTE)RecordData - (PBYTE)_FrsData);
+
+        return AttributeRecord->Initialize( GetDrive(),
+                                            RecordData,
+                                            QuerySize() - CurrentRecordOffset );
+    }
+
     // Spin through the records in this File Record Segment
     // looking for a match.  If we find one, set the Found
     // flag and break out.
@@ -2748,6 +2801,7 @@ Notes:
                  _FrsData->FirstFreeByte - CurrentRecordOffset);
 
         _FrsData->FirstFreeByte += NewRecord->QueryRecordLength();
+        InvalidateAttributeTable();
 
       memcpy( (PBYTE)_FrsData + CurrentRecordOffset,
             NewRecord->GetData(),
@@ -2783,6 +2837,7 @@ Notes:
                              NewRecord->QueryRecordLength()) );
 
                 _FrsData->FirstFreeByte -= NewRecord->QueryRecordLength();
+                InvalidateAttributeTable();
 
                 return FALSE;
             }
@@ -3128,6 +3183,15 @@ Notes:
         //
         ChildFileNumber = MFT_OVERFLOW_FRS_NUMBER;
 
+    } else if( !IsMftData && _ReservedChildCount != 0 ) {
+
+        // Use one of the segments set aside by
+        // ReserveChildFileRecordSegments.
+        //
+        ChildFileNumber = _ReservedChildFileNumber;
+        _ReservedChildFileNumber += 1;
+        _ReservedChildCount -= 1;
+
     } else if( !_Mft->AllocateFileRecordSegment( &ChildFileNumber, IsMftData ) ) {
 
         // Can't get a new child File Record Segment.
@@ -3186,6 +3250,90 @@ Notes:
     return TRUE;
 }
 
+
+BOOLEAN
+NTFS_FILE_RECORD_SEGMENT::ReserveChildFileRecordSegments(
+    IN  ULONG   NumberOfSegments
+    )
+/*++
+
+Routine Description:
+
+    This method sets aside a run of contiguous File Record Segments,
+    near this one, for the child FRS's this FRS is about to need.
+    InsertExternalAttributeRecord uses them before it allocates
+    segments one at a time, so that a caller which knows up front
+    how many records it will insert gets its children allocated
+    in one scan of the MFT bitmap, and written out together.
+
+Arguments:
+
+    NumberOfSegments    -- supplies the number of segments to reserve.
+
+Return Value:
+
+    TRUE upon successful completion.  On failure nothing is reserved,
+    and children are allocated one at a time as usual.  That is also
+    what happens when the MFT has enough free segments but no run of
+    them: it is not extended just to make them contiguous.
+
+Notes:
+
+    Any segments still reserved are freed by
+    ReleaseChildFileRecordSegments, which the caller should invoke
+    once it has finished inserting records.
+
+--*/
+{
+    ReleaseChildFileRecordSegments();
+
+    if( _Mft == NULL ||
+        NumberOfSegments == 0 ||
+        !_Mft->AllocateFileRecordSegments( QueryFileNumber(),
+                                           NumberOfSegments,
+                                           &_ReservedChildFileNumber ) ) {
+
+        return FALSE;
+    }
+
+    _ReservedChildCount = NumberOfSegments;
+
+    return TRUE;
+}
+
+
+VOID
+NTFS_FILE_RECORD_SEGMENT::ReleaseChildFileRecordSegments(
+    )
+/*++
+
+Routine Description:
+
+    This method frees any File Record Segments set aside by
+    ReserveChildFileRecordSegments which have not been used.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    while( _ReservedChildCount != 0 ) {
+
+        if( _Mft != NULL ) {
+
+            _Mft->FreeFileRecordSegment( _ReservedChildFileNumber );
+        }
+
+        _ReservedChildFileNumber += 1;
+        _ReservedChildCount -= 1;
+    }
+}
+
  
  
 BOOLEAN
@@ -3196,7 +3344,9 @@ NTFS_FILE_RECORD_SEGMENT::Write(
 Routine Description:
 
     This method writes the File Record Segment.  It does not affect the
-    attribute list or the child record segments.
+    attribute list or the child record segments.  If the segment is
+    one of those reflected in the MFT Mirror, the MFT is told that the
+    mirror needs to be rewritten.
 
 Arguments:
 
@@ -3208,7 +3358,14 @@ Return Value:
 
 --*/
 {
-   return( NTFS_FRS_STRUCTURE::Write() );
+    if( _Mft != NULL &&
+        QueryFileNumber() < REFLECTED_MFT_SEGMENTS &&
+        IsModified() ) {
+
+        _Mft->NoteReflectedSegmentWritten();
+    }
+
+    return( NTFS_FRS_STRUCTURE::Write() );
 }
 
  
@@ -3262,16 +3419,50 @@ Return Value:
         return FALSE;
     }
 
-    // Update the file name attributes:
+    // Update the file name attributes.  If the information they
+    // duplicate is what they already held when this FRS was read,
+    // there is nothing to propagate, and the lookup and rewrite
+    // of the parent index can be skipped.
+
+    if ( !FrsIsEmpty ) {
 
-    if ( !FrsIsEmpty )
-        if( !QueryDuplicatedInformation( &DuplicatedInformation ) ||
-            !UpdateFileNames( &DuplicatedInformation, ParentIndex, FALSE ) ) {
+        if( !QueryDuplicatedInformation( &DuplicatedInformation ) ) {
 
             DebugAbort( "Can't update file names in Flush.\n" );
             return FALSE;
         }
 
+        if( _FileNameInfoValid &&
+            memcmp( &_FileNameInfo,
+                    &DuplicatedInformation,
+                    sizeof( DUPLICATED_INFORMATION ) ) == 0 ) {
+
+            // Without a parent index, as for the bad cluster file,
+            // only the names in this FRS would have been rewritten,
+            // so there is no index work saved to count.
+
+            if( ParentIndex != NULL ) {
+
+                InterlockedIncrement( &NTFS_SA::QueryCurrentContext()->SkippedFileNameUpdates );
+            }
+
+        } else if( !UpdateFileNames( &DuplicatedInformation, ParentIndex, FALSE ) ) {
+
+            DebugAbort( "Can't update file names in Flush.\n" );
+            return FALSE;
+
+        } else {
+
+            // The file names now carry this information, but only
+            // the parent index, if given, has been brought up to date.
+
+            memcpy( &_FileNameInfo,
+                    &DuplicatedInformation,
+                    sizeof( DUPLICATED_INFORMATION ) );
+            _FileNameInfoValid = ( ParentIndex != NULL );
+        }
+    }
+
     // Flush all the children.  If a child is empty, mark it as
     // unused.
     //
@@ -3305,6 +3496,129 @@ Return Value:
 }
 
  
+BOOLEAN
+NTFS_FILE_RECORD_SEGMENT::Read(
+    )
+/*++
+
+Routine Description:
+
+    This method reads the File Record Segment and notes the
+    duplicated information held by its file names.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE upon successful completion.
+
+--*/
+{
+    _FileNameInfoValid = FALSE;
+
+    if( !NTFS_FRS_STRUCTURE::Read() ) {
+
+        return FALSE;
+    }
+
+    SnapshotFileNames();
+
+    return TRUE;
+}
+
+
+VOID
+NTFS_FILE_RECORD_SEGMENT::SnapshotFileNames(
+    )
+/*++
+
+Routine Description:
+
+    This method records the duplicated information held by the
+    file names in this FRS, for Flush to compare against.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+Notes:
+
+    The snapshot is only taken if it is certain to describe every
+    file name of the file: the FRS must be a base FRS without an
+    attribute list, and all its file names must agree.
+
+--*/
+{
+    NTFS_ATTRIBUTE_RECORD CurrentRecord;
+    PVOID CurrentRecordData;
+    PFILE_NAME CurrentName;
+    ULONG ValueLength;
+    BOOLEAN Found;
+
+    _FileNameInfoValid = FALSE;
+
+    if( !IsBase() ) {
+
+        return;
+    }
+
+    Found = FALSE;
+    CurrentRecordData = NULL;
+
+    while( (CurrentRecordData =
+            GetNextAttributeRecord( CurrentRecordData )) != NULL ) {
+
+        if( !CurrentRecord.Initialize( GetDrive(), CurrentRecordData ) ) {
+
+            return;
+        }
+
+        if( CurrentRecord.QueryTypeCode() == $ATTRIBUTE_LIST ) {
+
+            // Some file names may live in child records.
+            //
+            return;
+        }
+
+        if( CurrentRecord.QueryTypeCode() != $FILE_NAME ) {
+
+            continue;
+        }
+
+        CurrentName = (PFILE_NAME)( CurrentRecord.GetResidentValue() );
+        ValueLength = CurrentRecord.QueryResidentValueLength();
+
+        if( CurrentName == NULL ||
+            ValueLength < sizeof( FILE_NAME ) ) {
+
+            return;
+        }
+
+        if( !Found ) {
+
+            memcpy( &_FileNameInfo,
+                    &(CurrentName->Info),
+                    sizeof( DUPLICATED_INFORMATION ) );
+            Found = TRUE;
+
+        } else if( memcmp( &_FileNameInfo,
+                           &(CurrentName->Info),
+                           sizeof( DUPLICATED_INFORMATION ) ) != 0 ) {
+
+            return;
+        }
+    }
+
+    _FileNameInfoValid = Found;
+}
+
+
 BOOLEAN
 NTFS_FILE_RECORD_SEGMENT::QueryDuplicatedInformation(
     OUT PDUPLICATED_INFORMATION DuplicatedInformation
@@ -3327,11 +3641,11 @@ Return Value:
 
 --*/
 {
-    NTFS_ATTRIBUTE          Attribute;
     STANDARD_INFORMATION    StandardInformation;
     EA_INFORMATION          EaInformation;
     REPARSE_DATA_BUFFER     reparse_point;
-    ULONG                   BytesRead;
+    PCVOID                  Value;
+    PCSTANDARD_INFORMATION  pStandardInformation;
     BOOLEAN                 Error;
 
     // Start with a clean slate:
@@ -3341,29 +3655,28 @@ Return Value:
     // Most of the duplicated information comes from the
     // Standard Information attribute.
     //
-    if( !QueryAttribute( &Attribute,
-                         &Error,
-                         $STANDARD_INFORMATION ) ||
-        !Attribute.Read( &StandardInformation,
-                         0,
+    if( !QueryValueView( $STANDARD_INFORMATION,
                          sizeof( STANDARD_INFORMATION ),
-                         &BytesRead ) ||
-        BytesRead != sizeof( STANDARD_INFORMATION ) ) {
+                         &StandardInformation,
+                         &Value,
+                         &Error ) ) {
 
         DebugPrintTrace(( "Can't fetch standard information.\n" ));
         return FALSE;
     }
 
+    pStandardInformation = (PCSTANDARD_INFORMATION) Value;
+
     DuplicatedInformation->CreationTime =
-                        StandardInformation.CreationTime;
+                        pStandardInformation->CreationTime;
     DuplicatedInformation->LastModificationTime =
-                        StandardInformation.LastModificationTime;
+                        pStandardInformation->LastModificationTime;
     DuplicatedInformation->LastChangeTime =
-                        StandardInformation.LastChangeTime;
+                        pStandardInformation->LastChangeTime;
     DuplicatedInformation->LastAccessTime  =
-                        StandardInformation.LastAccessTime;
+                        pStandardInformation->LastAccessTime;
 
-    DuplicatedInformation->FileAttributes = StandardInformation.FileAttributes;
+    DuplicatedInformation->FileAttributes = pStandardInformation->FileAttributes;
 
     if( _FrsData->Flags & FILE_FILE_NAME_INDEX_PRESENT ) {
 
@@ -3378,7 +3691,11 @@ Return Value:
     // We also need one field from the EA_INFORMATION attribute
     // or the REPARSE_POINT attribute.
     //
-    if( !QueryAttribute( &Attribute, &Error, $EA_INFORMATION )) {
+    if( !QueryValueView( $EA_INFORMATION,
+                         sizeof( EA_INFORMATION ),
+                         &EaInformation,
+                         &Value,
+                         &Error ) ) {
 
         if( Error ) {
 
@@ -3388,7 +3705,12 @@ Return Value:
             DebugAbort( "Error fetching Ea Information attribute.\n" );
             return FALSE;
 
-        } else if (!QueryAttribute( &Attribute, &Error, $REPARSE_POINT )) {
+        } else if( !QueryValueView( $REPARSE_POINT,
+                                    FIELD_OFFSET(_REPARSE_DATA_BUFFER,
+                                                 GenericReparseBuffer.DataBuffer),
+                                    &reparse_point,
+                                    &Value,
+                                    &Error ) ) {
 
             if( Error ) {
 
@@ -3404,42 +3726,21 @@ Return Value:
 
                 DuplicatedInformation->PackedEaSize = 0;
             }
-        } else if ( !Attribute.Read( &reparse_point,
-                                     0,
-                                     FIELD_OFFSET(_REPARSE_DATA_BUFFER,
-                                                  GenericReparseBuffer.DataBuffer),
-                                     &BytesRead ) ||
-                    BytesRead != FIELD_OFFSET(_REPARSE_DATA_BUFFER,
-                                              GenericReparseBuffer.DataBuffer)) {
-
-            // Couldn't read the Reparse Point data.
-            //
-            DebugAbort( "Can't read Reparse Point.\n" );
-            return FALSE;
 
         } else {
 
             // We've got the Reparse Point.
             //
-            DuplicatedInformation->ReparsePointTag = reparse_point.ReparseTag;
+            DuplicatedInformation->ReparsePointTag =
+                ((CONST REPARSE_DATA_BUFFER*) Value)->ReparseTag;
         }
 
-    } else if( !Attribute.Read( &EaInformation,
-                                0,
-                                sizeof( EA_INFORMATION ),
-                                &BytesRead ) ||
-                BytesRead != sizeof( EA_INFORMATION ) ) {
-
-        // Couldn't read the Ea Information data.
-        //
-        DebugAbort( "Can't read EA Information.\n" );
-        return FALSE;
-
     } else {
 
         // We've got the Ea Information.
         //
-        DuplicatedInformation->PackedEaSize = EaInformation.PackedEaSize;
+        DuplicatedInformation->PackedEaSize =
+            ((PCEA_INFORMATION) Value)->PackedEaSize;
     }
 
 
@@ -3471,6 +3772,76 @@ Return Value:
     return TRUE;
 }
 
+
+BOOLEAN
+NTFS_FILE_RECORD_SEGMENT::QueryValueView(
+    IN  ATTRIBUTE_TYPE_CODE Type,
+    IN  ULONG               Length,
+    OUT PVOID               Buffer,
+    OUT PCVOID*             Value,
+    OUT PBOOLEAN            Error
+    )
+/*++
+
+Routine Description:
+
+    This method gives read-only access to the first Length bytes of
+    the value of an unnamed attribute.  If the attribute is resident
+    in this FRS, the view points straight into the FRS; otherwise the
+    bytes are read into the caller's buffer.
+
+Arguments:
+
+    Type    --  Supplies the attribute type code.
+    Length  --  Supplies the number of bytes the caller needs.
+    Buffer  --  Supplies a buffer of at least Length bytes, used if
+                the value cannot be viewed in place.
+    Value   --  Receives a pointer to the first Length bytes of the
+                value.
+    Error   --  Receives TRUE if the method fails because of an
+                error.
+
+Return Value:
+
+    TRUE upon successful completion.  As with QueryAttribute, if the
+    method returns FALSE and *Error is FALSE, the attribute is not
+    present.
+
+Notes:
+
+    A view into the FRS remains valid only until the FRS is read
+    again or its attribute records are changed.
+
+--*/
+{
+    NTFS_ATTRIBUTE  Attribute;
+    ULONG           ValueLength;
+    ULONG           BytesRead;
+
+    if( QueryResidentValue( Type, NULL, Value, &ValueLength ) ) {
+
+        // The attribute is present, so a short value is an error.
+        //
+        *Error = ( ValueLength < Length );
+        return !*Error;
+    }
+
+    if( !QueryAttribute( &Attribute, Error, Type ) ) {
+
+        return FALSE;
+    }
+
+    if( !Attribute.Read( Buffer, 0, Length, &BytesRead ) ||
+        BytesRead != Length ) {
+
+        *Error = TRUE;
+        return FALSE;
+    }
+
+    *Value = Buffer;
+    return TRUE;
+}
+
  
 BOOLEAN
 NTFS_FILE_RECORD_SEGMENT::UpdateFileNames(
@@ -80,6 +80,8 @@ Return Value:
     _frs_count = 0;
     _frs_state = _read_status = FALSE;
     _usa_check = UpdateSequenceArrayCheckValueOk;
+    _clean_data = NULL;
+    _clean_valid = FALSE;
 }
 
 
@@ -115,6 +117,9 @@ Return Value:
     _first_file_number = 0;
     _frs_count = 0;
     _frs_state = _read_status = FALSE;
+    FREE(_clean_data);
+    _clean_valid = FALSE;
+    _attribute_table.Invalidate();
 }
 
 
@@ -376,6 +381,8 @@ Return Value:
 
     DebugAssert(_mftdata || _secrun);
 
+    _attribute_table.Invalidate();
+
     if (_mftdata) {
         r = _mftdata->Read(_FrsData,
                            _file_number*QuerySize(),
@@ -396,6 +403,12 @@ Return Value:
                                                       drive,
                                                       _FrsData->FirstFreeByte));
 
+    if (_read_status) {
+        SaveCleanCopy();
+    } else {
+        _clean_valid = FALSE;
+    }
+
     return _read_status;
 }
 
@@ -407,7 +420,8 @@ NTFS_FRS_STRUCTURE::Write(
 
 Routine Description:
 
-    This routine writes the FRS to disk.
+    This routine writes the FRS to disk.  If the FRS has not changed
+    since it was last read or written, nothing is written.
 
 Arguments:
 
@@ -425,6 +439,10 @@ Return Value:
 
     DebugAssert(_mftdata || _secrun);
 
+    if (!IsModified()) {
+        return TRUE;
+    }
+
     NTFS_SA::PreWriteMultiSectorFixup(_FrsData, QuerySize());
 
     if (_mftdata) {
@@ -442,10 +460,73 @@ Return Value:
 
     NTFS_SA::PostReadMultiSectorFixup(_FrsData, QuerySize(), NULL);
 
+    if (r) {
+        SaveCleanCopy();
+    } else {
+        _clean_valid = FALSE;
+    }
+
     return r;
 }
 
 
+BOOLEAN
+NTFS_FRS_STRUCTURE::IsModified(
+    ) CONST
+/*++
+
+Routine Description:
+
+    This routine determines whether the FRS has changed since it
+    was last read from or written to disk.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    FALSE   - The FRS is the same as it is on disk.
+    TRUE    - The FRS has changed, or its state on disk is not known.
+
+--*/
+{
+    return !_clean_valid ||
+           memcmp(_clean_data, _FrsData, QuerySize()) != 0;
+}
+
+
+VOID
+NTFS_FRS_STRUCTURE::SaveCleanCopy(
+    )
+/*++
+
+Routine Description:
+
+    This routine records the current contents of the FRS as the
+    contents on disk.  If memory for the copy cannot be allocated,
+    the FRS is simply treated as modified from then on.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (!_clean_data && !(_clean_data = MALLOC(QuerySize()))) {
+        _clean_valid = FALSE;
+        return;
+    }
+
+    memcpy(_clean_data, _FrsData, QuerySize());
+    _clean_valid = TRUE;
+}
+
+
  
 PVOID
 NTFS_FRS_STRUCTURE::GetNextAttributeRecord(
@@ -536,6 +617,7 @@ Return Value:
             if (error) {
 
                 p->TypeCode = $END;
+                _attribute_table.Invalidate();
 
                 bytes_free = (ULONG)(next_frs - q) -
                                 QuadAlign(sizeof(ATTRIBUTE_TYPE_CODE));
@@ -576,6 +658,7 @@ Return Value:
         if (_FrsData->FirstFreeByte + bytes_free != QuerySize()) 
         {
             _FrsData->FirstFreeByte = QuerySize() - bytes_free;
+            _attribute_table.Invalidate();
 
             if (ErrorsFound) 
             {
@@ -612,6 +695,7 @@ Return Value:
     if (error) {
 
         p->TypeCode = $END;
+        _attribute_table.Invalidate();
 
         bytes_free = (ULONG)(next_frs - q) - QuadAlign(sizeof(ATTRIBUTE_TYPE_CODE));
 
@@ -666,6 +750,7 @@ Return Value:
     DebugAssert(end < frs_end);
 
     memmove(p, end, (unsigned int)(frs_end - end));
+    _attribute_table.Invalidate();
 
     // This loop is here to straighten out the attribute records.
     p = NULL;
@@ -729,6 +814,11 @@ Return Value:
 --*/
 {
     PATTRIBUTE_RECORD_HEADER    prec;
+    PVOID                       record;
+
+    if (FindAttributeRecord(TypeCode, NULL, &record)) {
+        return record;
+    }
 
     prec = NULL;
     while (prec = (PATTRIBUTE_RECORD_HEADER) GetNextAttributeRecord(prec)) {
@@ -767,3 +857,168 @@ Return Value:
     return GetAttribute($ATTRIBUTE_LIST);
 }
 
+
+BOOLEAN
+NTFS_FRS_STRUCTURE::QueryResidentValue(
+    IN  ATTRIBUTE_TYPE_CODE Type,
+    IN  PCWSTRING           Name,
+    OUT PCVOID*             Value,
+    OUT PULONG              ValueLength
+    )
+/*++
+
+Routine Description:
+
+    This routine returns a read-only view of the value of a resident
+    attribute record in this FRS, without copying it.  Only this FRS
+    is searched; external attribute records are not considered.
+
+Arguments:
+
+    Type        - Supplies the attribute type code.
+    Name        - Supplies the attribute name, or NULL for an unnamed
+                    attribute.
+    Value       - Returns a pointer to the value within the FRS.
+    ValueLength - Returns the length of the value in bytes.
+
+Return Value:
+
+    FALSE   - There is no such attribute record in this FRS, it is not
+                resident, or its value does not lie within it.
+    TRUE    - Success.
+
+Notes:
+
+    The view points into the FRS buffer.  It remains valid only until
+    the FRS is read again or its attribute records are changed.
+
+--*/
+{
+    PATTRIBUTE_RECORD_HEADER    prec;
+    PVOID                       record;
+    NTFS_ATTRIBUTE_RECORD       attr_rec;
+
+    if (!FindAttributeRecord(Type, Name, &record)) {
+
+        record = NULL;
+        while (record = GetNextAttributeRecord(record)) {
+
+            if (attr_rec.Initialize(GetDrive(), record) &&
+                attr_rec.IsMatch(Type, Name)) {
+                break;
+            }
+        }
+    }
+
+    if (!(prec = (PATTRIBUTE_RECORD_HEADER) record)) {
+        return FALSE;
+    }
+
+    // The walk has already checked that the record lies within
+    // the FRS; make sure the value lies within the record.
+
+    if (prec->FormCode != RESIDENT_FORM ||
+        prec->RecordLength < SIZE_OF_RESIDENT_HEADER ||
+        prec->Form.Resident.ValueOffset > prec->RecordLength ||
+        prec->Form.Resident.ValueLength >
+            prec->RecordLength - prec->Form.Resident.ValueOffset) {
+        return FALSE;
+    }
+
+    *Value = (PCHAR) prec + prec->Form.Resident.ValueOffset;
+    *ValueLength = prec->Form.Resident.ValueLength;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_FRS_STRUCTURE::FindAttributeRecord(
+    IN  ATTRIBUTE_TYPE_CODE Type,
+    IN  PCWSTRING           Name,
+    OUT PVOID*              Record
+    )
+/*++
+
+Routine Description:
+
+    This routine looks up the first attribute record in this FRS with
+    the given type and name using the attribute offset table, building
+    the table first if need be.
+
+Arguments:
+
+    Type    - Supplies the attribute type code.
+    Name    - Supplies the attribute name, or NULL for an unnamed
+                attribute.
+    Record  - Returns a pointer to the attribute record, or NULL if
+                there is no such record.
+
+Return Value:
+
+    FALSE   - The table could not be used; the caller must walk the
+                attribute records itself.
+    TRUE    - Success.
+
+--*/
+{
+    DebugAssert(_FrsData);
+
+    if (!_attribute_table.IsValid(_FrsData) &&
+        !_attribute_table.Build(_FrsData, QuerySize())) {
+        return FALSE;
+    }
+
+    if (_attribute_table.FindRecord(_FrsData, Type, Name, Record)) {
+        return TRUE;
+    }
+
+    // The table was stale; rebuild it and try once more.
+
+    return _attribute_table.Build(_FrsData, QuerySize()) &&
+           _attribute_table.FindRecord(_FrsData, Type, Name, Record);
+}
+
+
+BOOLEAN
+NTFS_FRS_STRUCTURE::FindAttributeRecordByTag(
+    IN  ULONG   Tag,
+    OUT PVOID*  Record
+    )
+/*++
+
+Routine Description:
+
+    This routine looks up the attribute record in this FRS with the
+    given instance tag using the attribute offset table, building the
+    table first if need be.
+
+Arguments:
+
+    Tag     - Supplies the attribute instance tag.
+    Record  - Returns a pointer to the attribute record, or NULL if
+                there is no such record.
+
+Return Value:
+
+    FALSE   - The table could not be used; the caller must walk the
+                attribute records itself.
+    TRUE    - Success.
+
+--*/
+{
+    DebugAssert(_FrsData);
+
+    if (!_attribute_table.IsValid(_FrsData) &&
+        !_attribute_table.Build(_FrsData, QuerySize())) {
+        return FALSE;
+    }
+
+    if (_attribute_table.FindRecordByTag(_FrsData, Tag, Record)) {
+        return TRUE;
+    }
+
+    return _attribute_table.Build(_FrsData, QuerySize()) &&
+           _attribute_table.FindRecordByTag(_FrsData, Tag, Record);
+}
+
@@ -93,6 +93,7 @@ Return Value:
     _BufferSize = 0;
     _CollationRule = COLLATION_NUMBER_RULES;
     _UpcaseTable = NULL;
+    _EntryTable.Invalidate();
 }
 
  
@@ -151,6 +152,8 @@ Return Value:
     _CollationRule = CollationRule;
     _UpcaseTable = UpcaseTable;
 
+    _EntryTable.Invalidate();
+
     if( !_Mem.Initialize() ||
         (_Data = (PINDEX_ALLOCATION_BUFFER)
                  _Mem.Acquire( BufferSize,
@@ -253,6 +256,7 @@ Return Value:
     _Data->IndexHeader.BytesAvailable =
         QuerySize() - (ULONG)( (PBYTE)&(_Data->IndexHeader) - (PBYTE)_Data );
 
+    _EntryTable.Invalidate();
 }
 
 
@@ -347,6 +351,18 @@ Return Value:
         }
     }
 
+    // Record where the entries are, so that lookups in this
+    // buffer can binary search them.
+    //
+    if( Result ) {
+
+        BuildEntryTable();
+
+    } else {
+
+        _EntryTable.Invalidate();
+    }
+
     return Result;
 }
 
@@ -452,6 +468,20 @@ Notes:
     BOOLEAN Found;
     int CompareResult;
 
+    // If the buffer's entries can be located through the entry
+    // table, binary search them.  Otherwise, fall back to walking
+    // the buffer.
+
+    if( _EntryTable.IsValid() || BuildEntryTable() ) {
+
+        return _EntryTable.FindEntry( &(_Data->IndexHeader),
+                                      SearchEntry,
+                                      _CollationRule,
+                                      _UpcaseTable,
+                                      Ordinal,
+                                      EntryFound );
+    }
+
     CurrentEntry = GetFirstEntry();
     Found = FALSE;
 
@@ -575,6 +605,10 @@ Notes:
 
     memcpy( InsertPoint, NewEntry, NewEntry->Length );
 
+    _EntryTable.NoteInsert(
+        (ULONG)((PBYTE)InsertPoint - (PBYTE)&(_Data->IndexHeader)),
+        NewEntry->Length );
+
     return TRUE;
 }
 
@@ -616,6 +650,10 @@ Notes:
     BytesToCopy = _Data->IndexHeader.FirstFreeByte -
                   (ULONG)(NextEntry - (PBYTE)&(_Data->IndexHeader));
 
+    _EntryTable.NoteRemove(
+        (ULONG)((PBYTE)EntryToRemove - (PBYTE)&(_Data->IndexHeader)),
+        EntryToRemove->Length );
+
     _Data->IndexHeader.FirstFreeByte -= EntryToRemove->Length;
 
     memmove( EntryToRemove,
@@ -653,6 +691,14 @@ Return Value:
     ULONG CurrentOffset;
 
 
+    // The entry table can find the middle of the buffer without
+    // walking the first half of it.
+
+    if( _EntryTable.IsValid() || BuildEntryTable() ) {
+
+        return _EntryTable.FindSplitPoint( &(_Data->IndexHeader) );
+    }
+
     CurrentOffset = _Data->IndexHeader.FirstIndexEntry;
     CurrentEntry = GetFirstEntry();
 
@@ -755,6 +801,8 @@ Notes:
 
     _Data->IndexHeader.FirstFreeByte += LengthOfClump;
 
+    _EntryTable.Invalidate();
+
 }
 
  
@@ -812,6 +860,8 @@ Notes:
     // what we just did:
 
     _Data->IndexHeader.FirstFreeByte -= LengthOfClump;
+
+    _EntryTable.Invalidate();
 }
 
 
@@ -884,5 +934,33 @@ Return Value:
     }
 
     memcpy(_Data, p->_Data, _BufferSize);
+    _EntryTable.Invalidate();
     return TRUE;
 }
+
+
+BOOLEAN
+NTFS_INDEX_BUFFER::BuildEntryTable(
+    )
+/*++
+
+Routine Description:
+
+    This method records the offsets of the entries in the buffer.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the entry table is valid.  If it is not, the buffer's
+    entries must be walked.
+
+--*/
+{
+    return _EntryTable.Build( &(_Data->IndexHeader),
+                              QuerySize() -
+                                (ULONG)( (PBYTE)&(_Data->IndexHeader) -
+                                         (PBYTE)_Data ) );
+}
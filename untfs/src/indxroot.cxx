@@ -87,6 +87,7 @@ Return Value:
     FREE( _Data );
     _IsModified = FALSE;
     _UpcaseTable = NULL;
+    _EntryTable.Invalidate();
 
 }
 
@@ -172,6 +173,11 @@ Notes:
 
     _UpcaseTable = UpcaseTable;
 
+    // Record where the entries are, so that lookups in the root
+    // can binary search them.
+    //
+    BuildEntryTable();
+
     return TRUE;
 }
 
@@ -267,6 +273,8 @@ Notes:
     EndEntry->AttributeLength = 0;
     EndEntry->Flags = INDEX_ENTRY_END;
 
+    _EntryTable.Invalidate();
+
     return TRUE;
 }
 
@@ -324,6 +332,20 @@ Notes:
     BOOLEAN Found;
     int CompareResult;
 
+    // If the root's entries can be located through the entry
+    // table, binary search them.  Otherwise, fall back to walking
+    // the root.
+
+    if( _EntryTable.IsValid() || BuildEntryTable() ) {
+
+        return _EntryTable.FindEntry( &(_Data->IndexHeader),
+                                      SearchEntry,
+                                      _Data->CollationRule,
+                                      _UpcaseTable,
+                                      Ordinal,
+                                      EntryFound );
+    }
+
     CurrentEntry = GetFirstEntry();
     Found = FALSE;
 
@@ -456,6 +478,10 @@ Notes:
 
     _DataLength += NewEntry->Length;
 
+    _EntryTable.NoteInsert(
+        (ULONG)((PBYTE)InsertPoint - (PBYTE)&(_Data->IndexHeader)),
+        NewEntry->Length );
+
     return TRUE;
 }
 
@@ -504,6 +530,10 @@ Notes:
     BytesToMove = _Data->IndexHeader.FirstFreeByte -
                   (ULONG)( NextEntry - (PBYTE)&(_Data->IndexHeader) );
 
+    _EntryTable.NoteRemove(
+        (ULONG)((PBYTE)EntryToRemove - (PBYTE)&(_Data->IndexHeader)),
+        EntryToRemove->Length );
+
     _Data->IndexHeader.FirstFreeByte -= EntryToRemove->Length;
     _Data->IndexHeader.BytesAvailable = _Data->IndexHeader.FirstFreeByte;
 
@@ -588,6 +618,8 @@ Notes:
         EndEntry->Flags |= INDEX_ENTRY_NODE;
         GetDownpointer( EndEntry ) = EndEntryDownpointer;
     }
+
+    _EntryTable.Invalidate();
 }
 
  
@@ -627,3 +659,35 @@ Return Value:
                                   NULL ) &&
             BytesWritten == _DataLength );
 }
+
+
+BOOLEAN
+NTFS_INDEX_ROOT::BuildEntryTable(
+    )
+/*++
+
+Routine Description:
+
+    This method records the offsets of the entries in the index root.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the entry table is valid.  If it is not, the root's
+    entries must be walked.
+
+--*/
+{
+    if( _DataLength < FIELD_OFFSET( INDEX_ROOT, IndexHeader ) ) {
+
+        _EntryTable.Invalidate();
+        return FALSE;
+    }
+
+    return _EntryTable.Build( &(_Data->IndexHeader),
+                              _DataLength -
+                                FIELD_OFFSET( INDEX_ROOT, IndexHeader ) );
+}
@@ -0,0 +1,540 @@
+#include "stdafx.h"
+
+/*++
+
+Module Name:
+
+    indxtab.cxx
+
+Abstract:
+
+    This module contains the member function definitions for
+    NTFS_INDEX_ENTRY_TABLE, which records the offsets of the entries
+    in an index root or index allocation buffer.
+
+--*/
+
+
+#include "ulib.hxx"
+
+#include "untfs.hxx"
+
+#include "indxtree.hxx"
+#include "indxtab.hxx"
+
+
+DEFINE_CONSTRUCTOR( NTFS_INDEX_ENTRY_TABLE, OBJECT );
+
+
+NTFS_INDEX_ENTRY_TABLE::~NTFS_INDEX_ENTRY_TABLE(
+    )
+/*++
+
+Routine Description:
+
+    Destructor for NTFS_INDEX_ENTRY_TABLE.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Destroy();
+}
+
+
+VOID
+NTFS_INDEX_ENTRY_TABLE::Construct(
+    )
+/*++
+
+Routine Description:
+
+    Worker method for NTFS_INDEX_ENTRY_TABLE construction.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _Offsets = NULL;
+    _NumberOfEntries = 0;
+    _MaximumEntries = 0;
+    _IsValid = FALSE;
+}
+
+
+VOID
+NTFS_INDEX_ENTRY_TABLE::Destroy(
+    )
+/*++
+
+Routine Description:
+
+    Worker method for NTFS_INDEX_ENTRY_TABLE destruction.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DELETE_ARRAY( _Offsets );
+    _NumberOfEntries = 0;
+    _MaximumEntries = 0;
+    _IsValid = FALSE;
+}
+
+
+BOOLEAN
+NTFS_INDEX_ENTRY_TABLE::Build(
+    IN  PINDEX_HEADER   Header,
+    IN  ULONG           BlockLength
+    )
+/*++
+
+Routine Description:
+
+    This method walks the entries of an index block and records
+    their offsets.
+
+Arguments:
+
+    Header      --  supplies the index header of the block.
+    BlockLength --  supplies the number of bytes, starting at Header,
+                    that may be examined.
+
+Return Value:
+
+    TRUE if the table is now valid.  FALSE if the entries could not
+    be walked or memory could not be allocated; the owner must then
+    fall back to walking the block itself.
+
+--*/
+{
+    PINDEX_ENTRY CurrentEntry;
+    ULONG CurrentOffset, Count;
+
+    DebugPtrAssert( Header );
+
+    _IsValid = FALSE;
+    _NumberOfEntries = 0;
+
+    if( Header->FirstFreeByte > BlockLength ) {
+
+        return FALSE;
+    }
+
+    // Count the entries, making sure each one lies within the
+    // used part of the block.
+
+    Count = 0;
+    CurrentOffset = Header->FirstIndexEntry;
+
+    while( TRUE ) {
+
+        if( CurrentOffset > Header->FirstFreeByte ||
+            Header->FirstFreeByte - CurrentOffset < sizeof(INDEX_ENTRY) ) {
+
+            return FALSE;
+        }
+
+        CurrentEntry = (PINDEX_ENTRY)((PBYTE)Header + CurrentOffset);
+
+        if( CurrentEntry->Length < sizeof(INDEX_ENTRY) ||
+            CurrentEntry->Length > Header->FirstFreeByte - CurrentOffset ) {
+
+            return FALSE;
+        }
+
+        Count += 1;
+
+        if( CurrentEntry->Flags & INDEX_ENTRY_END ) {
+
+            break;
+        }
+
+        CurrentOffset += CurrentEntry->Length;
+    }
+
+    if( Count > _MaximumEntries ) {
+
+        DELETE_ARRAY( _Offsets );
+        _MaximumEntries = 0;
+
+        // Leave some slack so that a few inserts don't force
+        // the table to be rebuilt.
+
+        if( (_Offsets = NEW ULONG[Count + 16]) == NULL ) {
+
+            return FALSE;
+        }
+
+        _MaximumEntries = Count + 16;
+    }
+
+    CurrentOffset = Header->FirstIndexEntry;
+
+    while( _NumberOfEntries < Count ) {
+
+        CurrentEntry = (PINDEX_ENTRY)((PBYTE)Header + CurrentOffset);
+
+        _Offsets[_NumberOfEntries++] = CurrentOffset;
+        CurrentOffset += CurrentEntry->Length;
+    }
+
+    _IsValid = TRUE;
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_INDEX_ENTRY_TABLE::FindEntry(
+    IN      PINDEX_HEADER       Header,
+    IN      PCINDEX_ENTRY       SearchEntry,
+    IN      COLLATION_RULE      CollationRule,
+    IN      PNTFS_UPCASE_TABLE  UpcaseTable,
+    IN OUT  PULONG              Ordinal,
+    OUT     PINDEX_ENTRY*       EntryFound
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method locates an entry in the block by binary search.  It
+    has the same semantics as NTFS_INDEX_BUFFER::FindEntry and
+    NTFS_INDEX_ROOT::FindEntry.
+
+Arguments:
+
+    Header          --  supplies the index header of the block.
+    SearchEntry     --  supplies an entry with the search key.
+    CollationRule   --  supplies the collation rule for the index.
+    UpcaseTable     --  supplies the volume upcase table.
+    Ordinal         --  supplies an ordinal showing which matching
+                        entry to return.  A value of INDEX_SKIP
+                        indicates that all matching entries should
+                        be skipped.
+    EntryFound      --  receives a pointer to the located entry, or
+                        to the point at which the search key would
+                        be inserted.
+
+Return Value:
+
+    TRUE if a matching entry is found.
+
+Notes:
+
+    The table must be valid.  Only the run of entries that match
+    the search key is walked one at a time.
+
+--*/
+{
+    ULONG Low, High, Middle, LastEntry;
+    LONG CompareResult;
+
+    DebugAssert( _IsValid && _NumberOfEntries != 0 );
+
+    // The END entry is last and does not take part in the search.
+
+    LastEntry = _NumberOfEntries - 1;
+
+    // Find the first entry that is not less than the search key.
+    // If all matching entries are to be skipped, find the first
+    // entry that is greater than the search key instead.
+
+    Low = 0;
+    High = LastEntry;
+
+    while( Low < High ) {
+
+        Middle = Low + (High - Low)/2;
+
+        CompareResult = CompareNtfsIndexEntries(
+                            SearchEntry,
+                            (PINDEX_ENTRY)((PBYTE)Header + _Offsets[Middle]),
+                            CollationRule,
+                            UpcaseTable );
+
+        if( CompareResult > 0 ||
+            ( CompareResult == 0 && *Ordinal == INDEX_SKIP ) ) {
+
+            Low = Middle + 1;
+
+        } else {
+
+            High = Middle;
+        }
+    }
+
+    // Now step through the matching entries, if any, counting off
+    // the ordinal.
+
+    while( Low < LastEntry && *Ordinal != INDEX_SKIP ) {
+
+        CompareResult = CompareNtfsIndexEntries(
+                            SearchEntry,
+                            (PINDEX_ENTRY)((PBYTE)Header + _Offsets[Low]),
+                            CollationRule,
+                            UpcaseTable );
+
+        if( CompareResult != 0 ) {
+
+            break;
+        }
+
+        if( *Ordinal == 0 ) {
+
+            *EntryFound = (PINDEX_ENTRY)((PBYTE)Header + _Offsets[Low]);
+            return TRUE;
+        }
+
+        *Ordinal -= 1;
+        Low += 1;
+    }
+
+    *EntryFound = (PINDEX_ENTRY)((PBYTE)Header + _Offsets[Low]);
+    return FALSE;
+}
+
+
+PINDEX_ENTRY
+NTFS_INDEX_ENTRY_TABLE::FindSplitPoint(
+    IN  PINDEX_HEADER   Header
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method picks the entry at which an index buffer should be
+    split.  It makes the same choice as NTFS_INDEX_BUFFER::FindSplitPoint:
+    the first entry at or beyond the middle of the used space, backed
+    up one if that entry is, or is followed by, the END entry.
+
+Arguments:
+
+    Header  --  supplies the index header of the block.
+
+Return Value:
+
+    A pointer to the entry which will be promoted in the split, or
+    NULL if the block has too few entries to split.
+
+--*/
+{
+    ULONG Low, High, Middle, LastEntry, HalfOffset;
+
+    DebugAssert( _IsValid && _NumberOfEntries != 0 );
+
+    LastEntry = _NumberOfEntries - 1;
+    HalfOffset = Header->FirstFreeByte/2;
+
+    Low = 0;
+    High = LastEntry;
+
+    while( Low < High ) {
+
+        Middle = Low + (High - Low)/2;
+
+        if( _Offsets[Middle] < HalfOffset ) {
+
+            Low = Middle + 1;
+
+        } else {
+
+            High = Middle;
+        }
+    }
+
+    // We must not pick the END entry, nor the entry just before it,
+    // since the entry after the split point gets promoted.
+
+    if( Low + 1 >= LastEntry ) {
+
+        if( Low == 0 ) {
+
+            return NULL;
+        }
+
+        Low -= 1;
+    }
+
+    return (PINDEX_ENTRY)((PBYTE)Header + _Offsets[Low]);
+}
+
+
+VOID
+NTFS_INDEX_ENTRY_TABLE::NoteInsert(
+    IN  ULONG   EntryOffset,
+    IN  ULONG   EntryLength
+    )
+/*++
+
+Routine Description:
+
+    This method records that an entry has been inserted into the
+    block.  The entry that used to be at EntryOffset, and all the
+    entries after it, have moved up by EntryLength.
+
+Arguments:
+
+    EntryOffset --  supplies the offset of the new entry.
+    EntryLength --  supplies the length of the new entry.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PULONG NewOffsets;
+    ULONG EntryIndex, i;
+
+    if( !_IsValid ) {
+
+        return;
+    }
+
+    if( !QueryIndexFromOffset( EntryOffset, &EntryIndex ) ) {
+
+        _IsValid = FALSE;
+        return;
+    }
+
+    if( _NumberOfEntries == _MaximumEntries ) {
+
+        if( (NewOffsets = NEW ULONG[2*_MaximumEntries + 16]) == NULL ) {
+
+            _IsValid = FALSE;
+            return;
+        }
+
+        memcpy( NewOffsets, _Offsets, _NumberOfEntries * sizeof(ULONG) );
+        DELETE_ARRAY( _Offsets );
+
+        _Offsets = NewOffsets;
+        _MaximumEntries = 2*_MaximumEntries + 16;
+    }
+
+    for( i = _NumberOfEntries; i > EntryIndex; i-- ) {
+
+        _Offsets[i] = _Offsets[i - 1] + EntryLength;
+    }
+
+    _NumberOfEntries += 1;
+}
+
+
+VOID
+NTFS_INDEX_ENTRY_TABLE::NoteRemove(
+    IN  ULONG   EntryOffset,
+    IN  ULONG   EntryLength
+    )
+/*++
+
+Routine Description:
+
+    This method records that the entry at EntryOffset has been
+    removed from the block, and the entries after it have moved
+    down by EntryLength.
+
+Arguments:
+
+    EntryOffset --  supplies the offset of the removed entry.
+    EntryLength --  supplies the length of the removed entry.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG EntryIndex, i;
+
+    if( !_IsValid ) {
+
+        return;
+    }
+
+    if( !QueryIndexFromOffset( EntryOffset, &EntryIndex ) ||
+        EntryIndex + 1 >= _NumberOfEntries ) {
+
+        // Either the offset is wrong or the caller removed the
+        // END entry; either way, the table no longer applies.
+
+        _IsValid = FALSE;
+        return;
+    }
+
+    for( i = EntryIndex; i + 1 < _NumberOfEntries; i++ ) {
+
+        _Offsets[i] = _Offsets[i + 1] - EntryLength;
+    }
+
+    _NumberOfEntries -= 1;
+}
+
+
+BOOLEAN
+NTFS_INDEX_ENTRY_TABLE::QueryIndexFromOffset(
+    IN  ULONG   EntryOffset,
+    OUT PULONG  EntryIndex
+    ) CONST
+/*++
+
+Routine Description:
+
+    This method finds the index of the entry at a given offset.
+
+Arguments:
+
+    EntryOffset --  supplies the offset of the entry.
+    EntryIndex  --  receives the index of the entry.
+
+Return Value:
+
+    TRUE if an entry starts at EntryOffset.
+
+--*/
+{
+    ULONG Low, High, Middle;
+
+    Low = 0;
+    High = _NumberOfEntries;
+
+    while( Low < High ) {
+
+        Middle = Low + (High - Low)/2;
+
+        if( _Offsets[Middle] < EntryOffset ) {
+
+            Low = Middle + 1;
+
+        } else {
+
+            High = Middle;
+        }
+    }
+
+    if( Low == _NumberOfEntries || _Offsets[Low] != EntryOffset ) {
+
+        return FALSE;
+    }
+
+    *EntryIndex = Low;
+    return TRUE;
+}
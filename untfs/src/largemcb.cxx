@@ -333,6 +333,12 @@ PFAST_MUTEX FsRtlFreeFastMutexArray[FREE_FAST_MUTEX_ARRAY_SIZE];
 UCHAR FsRtlFreeFastMutexSize = 0;
 
 ULONG FsRtlNetFastMutex = 0;
+
+//
+//  The lock that guards the globals above
+//
+
+KSPIN_LOCK FsRtlStrucSupSpinLock = 0;
  
 VOID
 FsRtlInitializeLargeMcb (
@@ -2778,4 +2784,69 @@ Return Value:
 }
 
 
+//
+//  Private Routine
+//
+
+VOID
+FsRtlAcquireSpinLock (
+    IN PKSPIN_LOCK SpinLock
+    )
+
+/*++
+
+Routine Description:
+
+    This routine takes a lock used in place of a kernel spin lock or
+    fast mutex.  The lock is only ever held for a few instructions, so
+    the routine spins until the lock is free.
+
+Arguments:
+
+    SpinLock - Supplies the lock to take.
+
+Return Value:
+
+    None.
+
+--*/
 
+{
+    while (InterlockedExchange( SpinLock, 1 ) != 0) {
+
+        while (*(volatile LONG *)SpinLock != 0) {
+
+            YieldProcessor();
+        }
+    }
+}
+
+
+//
+//  Private Routine
+//
+
+VOID
+FsRtlReleaseSpinLock (
+    IN PKSPIN_LOCK SpinLock
+    )
+
+/*++
+
+Routine Description:
+
+    This routine releases a lock taken with FsRtlAcquireSpinLock.
+
+Arguments:
+
+    SpinLock - Supplies the lock to release.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    InterlockedExchange( SpinLock, 0 );
+}
@@ -56,6 +56,8 @@ Return Value:
     _VolumeSectors = 0;
     _MethodsEnabled = FALSE;
     _ReadOnly = FALSE;
+    _ReflectedSegmentsModified = FALSE;
+    _LastAllocatedFileNumber = 0;
 }
 
 
@@ -87,6 +89,8 @@ Return Value:
     _VolumeSectors = 0;
     _MethodsEnabled = FALSE;
     _ReadOnly = FALSE;
+    _ReflectedSegmentsModified = FALSE;
+    _LastAllocatedFileNumber = 0;
 }
 
 
@@ -187,35 +191,12 @@ Notes:
 
 --*/
 {
-    VCN                 vcn, reserved_vcn;
-    BIG_INT             run_length;
-    HMEM                hmem;
-    NTFS_FRS_STRUCTURE  frs;
-    NUMBER_SET          bad_cluster_list;
-    BOOLEAN             reserve_allocated;
-    ULONG               cluster_size;
-
-    //
-    // This should really be a VCN instead of a LARGE_INTEGER, but the
-    // VCN causes the compiler to insert a reference to atexit(), which
-    // we want to avoid. -mjb.
-    //
-
-    STATIC LARGE_INTEGER LastAllocatedVcn;
-
     DebugAssert(_MftBitmap);
 
     if (!_MethodsEnabled) {
         return FALSE;
     }
 
-    cluster_size = QueryClusterFactor() * _SectorSize;
-
-    if (LastAllocatedVcn * QueryFrsSize() < cluster_size) {
-
-        LastAllocatedVcn.QuadPart = cluster_size / QueryFrsSize();
-    }
-
     if( IsMft ) {
 
         // If the MFT has asked for a sector to be allocated,
@@ -229,6 +210,79 @@ Notes:
         return _MftBitmap->AllocateClusters(1, 1, FileNumber, 1);
     }
 
+    return AllocateFileRecordSegments(_LastAllocatedFileNumber, 1, FileNumber);
+}
+
+
+BOOLEAN
+NTFS_MASTER_FILE_TABLE::AllocateFileRecordSegments(
+    IN  VCN     NearFileNumber,
+    IN  ULONG   NumberOfSegments,
+    OUT PVCN    FirstFileNumber
+    )
+/*++
+
+Routine Description:
+
+    Allocate a run of contiguous File Record Segments from the Master
+    File Table for a client other than the MFT itself.  The run is
+    found in a single scan of the MFT bitmap, starting near the given
+    file number; the segments never come from the first cluster of
+    the mft's allocation.
+
+Arguments:
+
+    NearFileNumber      -- supplies the file number near which the
+                           caller would like the segments, typically
+                           that of the base file record segment.
+    NumberOfSegments    -- supplies the number of segments to allocate.
+    FirstFileNumber     -- Returns the file number of the first
+                           allocated segment.
+
+Return Value:
+
+    TRUE upon successful completion.
+
+    FALSE if the segments cannot be allocated.  When more than one
+    segment is asked for and there is no free run of them, but there
+    are enough free segments scattered through the MFT, nothing is
+    allocated and the MFT is not extended: the caller should take them
+    one at a time instead.
+
+Notes:
+
+    As with AllocateFileRecordSegment, one segment is held in reserve
+    while the run is allocated, so that the MFT can always find a free
+    segment for itself.
+
+    Any bad clusters discovered by this routine are added to the volume
+    bitmap but not added to the bad clusters file.
+
+--*/
+{
+    VCN                 vcn, reserved_vcn, near_vcn, file_number;
+    BIG_INT             run_length;
+    HMEM                hmem;
+    NTFS_FRS_STRUCTURE  frs;
+    NUMBER_SET          bad_cluster_list;
+    BOOLEAN             reserve_allocated;
+    ULONG               cluster_size;
+    ULONG               i;
+
+    DebugAssert(_MftBitmap);
+
+    if (!_MethodsEnabled || NumberOfSegments == 0) {
+        return FALSE;
+    }
+
+    cluster_size = QueryClusterFactor() * _SectorSize;
+
+    near_vcn = NearFileNumber;
+
+    if (near_vcn * QueryFrsSize() < cluster_size) {
+
+        near_vcn = cluster_size / QueryFrsSize();
+    }
 
     // Grab a reserved VCN for the MFT.
     //
@@ -236,17 +290,34 @@ Notes:
 
 
     if (reserve_allocated &&
-        _MftBitmap->AllocateClusters(LastAllocatedVcn, 1, FileNumber, 1)) {
+        _MftBitmap->AllocateClusters(near_vcn, NumberOfSegments,
+                                     FirstFileNumber, 1)) {
 
-        LastAllocatedVcn = FileNumber->GetLargeInteger();
+        _LastAllocatedFileNumber = *FirstFileNumber + (NumberOfSegments - 1);
         _MftBitmap->SetFree( reserved_vcn, 1 );
         return TRUE;
     }
 
-    // Grow the data attribute (and the MFT Bitmap) to
-    // include another File Record Segment.
+    // There is no free run long enough.  If the free segments would
+    // do when taken one at a time, leave them to the caller rather
+    // than grow the MFT just to get them contiguous.
+    //
+    if (reserve_allocated &&
+        NumberOfSegments > 1 &&
+        _MftBitmap->QueryFreeClusters() >= NumberOfSegments) {
+
+        _MftBitmap->SetFree( reserved_vcn, 1 );
+        return FALSE;
+    }
+
+    // Grow the data attribute (and the MFT Bitmap) to include
+    // the requested File Record Segments and the reserved one.
     //
-    if( !Extend(8) ) {
+    if( !Extend(max((ULONG)8, NumberOfSegments + 1)) ) {
+
+        if (reserve_allocated) {
+            _MftBitmap->SetFree( reserved_vcn, 1 );
+        }
 
         return FALSE;
     }
@@ -259,37 +330,44 @@ Notes:
         return FALSE;
     }
 
-    // And now allocate the FRS we will return to the client.
+    // And now allocate the FRS's we will return to the client.
     //
-    if (!_MftBitmap->AllocateClusters(LastAllocatedVcn, 1, FileNumber, 1)) {
+    if (!_MftBitmap->AllocateClusters(near_vcn, NumberOfSegments,
+                                      FirstFileNumber, 1)) {
 
+        _MftBitmap->SetFree( reserved_vcn, 1 );
         return FALSE;
     }
 
 
-    // Now read in the new FRS to make sure that it is good.
+    // Now read in the new FRS's to make sure that they are good.
     // Since we won't be manipulating any named attributes, we can
     // pass in NULL for the upcase table.
 
-    if (hmem.Initialize() &&
-        bad_cluster_list.Initialize() &&
-        frs.Initialize(&hmem, _DataAttribute, *FileNumber,
-                       QueryClusterFactor(),
-                       QueryVolumeSectors(),
-                       QueryFrsSize(),
-                       NULL)) {
+    for (i = 0; i < NumberOfSegments; i++) {
+
+        file_number = *FirstFileNumber + i;
 
-        if (!frs.Read()) {
+        if (hmem.Initialize() &&
+            bad_cluster_list.Initialize() &&
+            frs.Initialize(&hmem, _DataAttribute, file_number,
+                           QueryClusterFactor(),
+                           QueryVolumeSectors(),
+                           QueryFrsSize(),
+                           NULL)) {
 
-            vcn = (*FileNumber*QueryFrsSize() + (cluster_size - 1))/cluster_size;
+            if (!frs.Read()) {
 
-            run_length = (QueryFrsSize() + (cluster_size - 1))/cluster_size;
+                vcn = (file_number*QueryFrsSize() + (cluster_size - 1))/cluster_size;
 
-            if (!_VolumeBitmap ||
-                !_DataAttribute->Hotfix(vcn, run_length, _VolumeBitmap,
-                                        &bad_cluster_list)) {
+                run_length = (QueryFrsSize() + (cluster_size - 1))/cluster_size;
 
-                return FALSE;
+                if (!_VolumeBitmap ||
+                    !_DataAttribute->Hotfix(vcn, run_length, _VolumeBitmap,
+                                            &bad_cluster_list)) {
+
+                    return FALSE;
+                }
             }
         }
     }
@@ -297,11 +375,10 @@ Notes:
     // Free the reserved FRS and return success.
     //
     _MftBitmap->SetFree( reserved_vcn, 1 );
-    LastAllocatedVcn = FileNumber->GetLargeInteger();
+    _LastAllocatedFileNumber = *FirstFileNumber + (NumberOfSegments - 1);
     return TRUE;
 }
 
-
  
 BOOLEAN
 NTFS_MASTER_FILE_TABLE::Extend(
@@ -38,6 +38,7 @@ Notes:
 #include "mftfile.hxx"
 #include "clusrun.hxx"
 #include "indxtree.hxx"
+#include "iostats.hxx"
 
 #define LOGFILE_PLACEMENT_V1    1
 
@@ -321,6 +322,7 @@ Notes:
     LCN FirstMirrorLcn;
     BIG_INT OldValidLength;
     BOOLEAN Error;
+    ULONG Stream;
 
     if( !_Mft.AreMethodsEnabled() ) {
 
@@ -461,13 +463,39 @@ Notes:
         return FALSE;
     }
 
-    if( !_VolumeBitmap->Write( &VolumeBitmapAttribute, NULL ) ||
-        !WriteMirror( &MirrorDataAttribute ) ){
+    // The mirror only reflects the first few File Record Segments,
+    // so it need not be rewritten unless one of them was.  If the
+    // writes are being batched, the bitmap and the mirror go in
+    // their own phases.
+    //
+    GetDrive()->SetWriteBatchPhase( NTFS_WRITE_PHASE_BITMAP );
+    Stream = GetDrive()->SetIoStream( IO_STATS_STREAM_BITMAP );
+
+    if( !_VolumeBitmap->Write( &VolumeBitmapAttribute, NULL ) ) {
 
-        DebugPrint( "Failed write of MFT Mirror or volume bitmap.\n" );
+        GetDrive()->SetWriteBatchPhase( NTFS_WRITE_PHASE_METADATA );
+        GetDrive()->SetIoStream( Stream );
+        DebugPrint( "Failed write of volume bitmap.\n" );
         return FALSE;
     }
 
+    GetDrive()->SetWriteBatchPhase( NTFS_WRITE_PHASE_MIRROR );
+    GetDrive()->SetIoStream( IO_STATS_STREAM_MIRROR );
+
+    if( _Mft.AreReflectedSegmentsModified() &&
+        !WriteMirror( &MirrorDataAttribute ) ) {
+
+        GetDrive()->SetWriteBatchPhase( NTFS_WRITE_PHASE_METADATA );
+        GetDrive()->SetIoStream( Stream );
+        DebugPrint( "Failed write of MFT Mirror.\n" );
+        return FALSE;
+    }
+
+    GetDrive()->SetWriteBatchPhase( NTFS_WRITE_PHASE_METADATA );
+    GetDrive()->SetIoStream( Stream );
+
+    _Mft.ClearReflectedSegmentsModified();
+
     return TRUE;
 }
 
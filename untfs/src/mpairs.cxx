@@ -0,0 +1,241 @@
+#include "stdafx.h"
+
+/*++
+
+Module Name:
+
+    mpairs.cxx
+
+Abstract:
+
+    This module contains the definitions for NTFS_MAPPING_PAIRS_DECODER,
+    which expands a compressed mapping pairs list one run at a time,
+    and the lookup table used to size compressed deltas.
+
+--*/
+
+
+#include "ulib.hxx"
+
+#include "untfs.hxx"
+#include "mpairs.hxx"
+
+
+DEFINE_CONSTRUCTOR( NTFS_MAPPING_PAIRS_DECODER, OBJECT );
+
+
+CONST UCHAR MappingPairsWidthFromLeadingZeros[65] = {
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 7, 7, 7, 7, 7, 7, 7,
+    7, 6, 6, 6, 6, 6, 6, 6,
+    6, 5, 5, 5, 5, 5, 5, 5,
+    5, 4, 4, 4, 4, 4, 4, 4,
+    4, 3, 3, 3, 3, 3, 3, 3,
+    3, 2, 2, 2, 2, 2, 2, 2,
+    2, 1, 1, 1, 1, 1, 1, 1,
+    1
+};
+
+
+NTFS_MAPPING_PAIRS_DECODER::~NTFS_MAPPING_PAIRS_DECODER(
+    )
+/*++
+
+Routine Description:
+
+    Destructor for NTFS_MAPPING_PAIRS_DECODER.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Destroy();
+}
+
+
+VOID
+NTFS_MAPPING_PAIRS_DECODER::Construct(
+    )
+/*++
+
+Routine Description:
+
+    Worker method for NTFS_MAPPING_PAIRS_DECODER construction.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    _Data = NULL;
+    _BufferSize = 0;
+    _Offset = 0;
+    _NumberOfPairs = 0;
+    _CurrentVcn = 0;
+    _CurrentLcn = 0;
+    _Corrupt = FALSE;
+    _Done = TRUE;
+}
+
+
+VOID
+NTFS_MAPPING_PAIRS_DECODER::Destroy(
+    )
+/*++
+
+Routine Description:
+
+    Worker method for NTFS_MAPPING_PAIRS_DECODER destruction.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Construct();
+}
+
+
+BOOLEAN
+NTFS_MAPPING_PAIRS_DECODER::Initialize(
+    IN  PCVOID  CompressedPairs,
+    IN  ULONG   BufferSize,
+    IN  VCN     StartingVcn
+    )
+/*++
+
+Routine Description:
+
+    This method prepares the decoder to walk a compressed mapping
+    pairs list.  The list itself is not copied; it must stay valid
+    while the decoder is in use.
+
+Arguments:
+
+    CompressedPairs - Supplies the compressed mapping pairs.
+    BufferSize      - Supplies the number of bytes that may be
+                        referenced starting at CompressedPairs.
+    StartingVcn     - Supplies the lowest VCN mapped by the list.
+
+Return Value:
+
+    TRUE upon successful completion.
+
+Notes:
+
+    This class is reinitializable.
+
+--*/
+{
+    DebugPtrAssert(CompressedPairs);
+
+    Destroy();
+
+    _Data = (PCUCHAR)CompressedPairs;
+    _BufferSize = BufferSize;
+    _CurrentVcn = StartingVcn.GetQuadPart();
+    _Done = FALSE;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_MAPPING_PAIRS_DECODER::QueryNextRun(
+    OUT PVCN        Vcn,
+    OUT PLCN        Lcn,
+    OUT PBIG_INT    RunLength
+    )
+/*++
+
+Routine Description:
+
+    This method decodes the next mapping pair.
+
+Arguments:
+
+    Vcn         - Receives the starting VCN of the run.
+    Lcn         - Receives the starting LCN of the run, or
+                    LCN_NOT_PRESENT if the run is a hole.
+    RunLength   - Receives the length of the run in clusters.
+
+Return Value:
+
+    TRUE if a run was returned.  FALSE means either that the list
+    is exhausted (IsDone) or that it is malformed (IsCorrupt).
+
+--*/
+{
+    UCHAR       count_byte;
+    UCHAR       v, l;
+    ULONG       field;
+    LONGLONG    delta_vcn;
+
+    if (_Done || _Corrupt) {
+        return FALSE;
+    }
+
+    if (_Offset >= _BufferSize) {
+        _Corrupt = TRUE;
+        return FALSE;
+    }
+
+    count_byte = _Data[_Offset];
+
+    if (count_byte == 0) {
+        _Offset++;
+        _Done = TRUE;
+        return FALSE;
+    }
+
+    v = VcnBytesFromCountByte(count_byte);
+    l = LcnBytesFromCountByte(count_byte);
+    field = _Offset + 1;
+
+    if (v > 8 || l > 8 || _BufferSize - field < (ULONG)v + l) {
+        _Corrupt = TRUE;
+        return FALSE;
+    }
+
+    delta_vcn = MappingPairsLoadField(_Data + field, v, _BufferSize - field);
+    field += v;
+
+    *Vcn = _CurrentVcn;
+    *RunLength = delta_vcn;
+    _CurrentVcn += delta_vcn;
+
+    if (l == 0) {
+
+        // a delta-LCN count value of 0 indicates a
+        // non-present run.
+        //
+        *Lcn = LCN_NOT_PRESENT;
+
+    } else {
+
+        _CurrentLcn += MappingPairsLoadField(_Data + field, l,
+                                             _BufferSize - field);
+        *Lcn = _CurrentLcn;
+    }
+
+    _Offset = field + l;
+    _NumberOfPairs++;
+
+    return TRUE;
+}
@@ -69,6 +69,7 @@ Return Value:
     _Mft = NULL;
     _ClusterFactor = 0;
     _Drive = NULL;
+    _AllDirty = TRUE;
 }
 
 VOID
@@ -96,6 +97,7 @@ Return Value:
     FREE( _BitmapData );
     _NextAlloc = 0;
     _Mft = NULL;
+    _AllDirty = TRUE;
 }
 
 
@@ -167,7 +169,10 @@ Notes:
     if( (_BitmapData = MALLOC( _BitmapSize )) == NULL ||
         !_Bitmap.Initialize( _BitmapSize * 8,
                              RESET,
-                             (PPT)_BitmapData ) ) {
+                             (PPT)_BitmapData ) ||
+        !_DirtyChunks.Initialize( (_BitmapSize + NTFS_BITMAP_DIRTY_CHUNK_SIZE - 1) /
+                                        NTFS_BITMAP_DIRTY_CHUNK_SIZE,
+                                  RESET ) ) {
 
         // Note that Destroy will clean up _BitmapData
 
@@ -193,6 +198,10 @@ Notes:
     //
     SetFree( 0, _NumberOfClusters );
 
+    // Nothing of this bitmap is known to be on disk yet.
+    //
+    _AllDirty = TRUE;
+
     return TRUE;
 }
 
@@ -225,21 +234,118 @@ Notes:
     The attribute will, if necessary, allocate space from the
     bitmap to write it.
 
+    Only the chunks of the bitmap which have changed since it was
+    last read or written are written, unless the attribute had to
+    be resized, in which case the whole bitmap is written.
+
 --*/
 {
     ULONG BytesWritten;
 
     DebugPtrAssert( _BitmapData );
 
+    if( BitmapAttribute->QueryValueLength() != _BitmapSize ) {
+
+        if( !CheckAttributeSize( BitmapAttribute, VolumeBitmap ) ) {
+
+            return FALSE;
+        }
+
+        _AllDirty = TRUE;
+    }
 
+    if( !_AllDirty ) {
 
-    return( CheckAttributeSize( BitmapAttribute, VolumeBitmap ) &&
-            BitmapAttribute->Write( _BitmapData,
-                                    0,
-                                    _BitmapSize,
-                                    &BytesWritten,
-                                    VolumeBitmap ) &&
-            BytesWritten == _BitmapSize );
+        return WriteDirtyChunks( BitmapAttribute, VolumeBitmap );
+    }
+
+    if( !BitmapAttribute->Write( _BitmapData,
+                                 0,
+                                 _BitmapSize,
+                                 &BytesWritten,
+                                 VolumeBitmap ) ||
+        BytesWritten != _BitmapSize ) {
+
+        return FALSE;
+    }
+
+    _DirtyChunks.ResetAll();
+    _AllDirty = FALSE;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_BITMAP::WriteDirtyChunks(
+    IN OUT  PNTFS_ATTRIBUTE BitmapAttribute,
+    IN OUT  PNTFS_BITMAP    VolumeBitmap
+    )
+/*++
+
+Routine Description:
+
+    This method writes those chunks of the bitmap which have been
+    marked dirty.  Adjacent dirty chunks are written together.
+
+Arguments:
+
+    BitmapAttribute -- supplies the attribute which describes the
+                        bitmap's location on disk.
+    VolumeBitmap    -- supplies the volume's bitmap for possible
+                        allocation during write.
+
+Return Value:
+
+    TRUE upon successful completion.
+
+Notes:
+
+    The attribute must already be the size of the bitmap.
+
+--*/
+{
+    ULONG NumberOfChunks, FirstChunk, LastChunk;
+    ULONG Offset, Length, BytesWritten;
+
+    NumberOfChunks = _DirtyChunks.QuerySize();
+    FirstChunk = 0;
+
+    while( FirstChunk < NumberOfChunks ) {
+
+        if( !_DirtyChunks.IsBitSet( FirstChunk ) ) {
+
+            FirstChunk++;
+            continue;
+        }
+
+        LastChunk = FirstChunk;
+
+        while( LastChunk + 1 < NumberOfChunks &&
+               _DirtyChunks.IsBitSet( LastChunk + 1 ) ) {
+
+            LastChunk++;
+        }
+
+        Offset = FirstChunk * NTFS_BITMAP_DIRTY_CHUNK_SIZE;
+        Length = min( (LastChunk + 1) * NTFS_BITMAP_DIRTY_CHUNK_SIZE,
+                      _BitmapSize ) - Offset;
+
+        if( !BitmapAttribute->Write( (PBYTE)_BitmapData + Offset,
+                                     Offset,
+                                     Length,
+                                     &BytesWritten,
+                                     VolumeBitmap ) ||
+            BytesWritten != Length ) {
+
+            return FALSE;
+        }
+
+        _DirtyChunks.ResetBit( FirstChunk, LastChunk - FirstChunk + 1 );
+        FirstChunk = LastChunk + 1;
+    }
+
+    return TRUE;
 }
  
  
@@ -666,6 +772,16 @@ Notes:
                         RESET,
                         (PPT)NewBitmapData );
 
+    // The attribute will have to be resized to match, and then
+    // written in full, so there is no point tracking chunks of
+    // the old size.
+
+    _DirtyChunks.SetSize( (NewSize + NTFS_BITMAP_DIRTY_CHUNK_SIZE - 1) /
+                                NTFS_BITMAP_DIRTY_CHUNK_SIZE,
+                          RESET );
+    _DirtyChunks.ResetAll();
+    _AllDirty = TRUE;
+
     if( NewNumberOfClusters < _NumberOfClusters )
     {
         // Copy the part of the old bitmap that we wish to
@@ -23,13 +23,23 @@
 #include "upcase.hxx"
 #include "upfile.hxx"
 #include "ifssys.hxx"
+#include "undojrnl.hxx"
+#include "iostats.hxx"
 
 
 #include "path.hxx"
 
 
-UCHAR NTFS_SA::_MajorVersion = NTFS_CURRENT_MAJOR_VERSION,
-      NTFS_SA::_MinorVersion = NTFS_CURRENT_MINOR_VERSION;
+// The context of the volume each thread is working on, or NULL.  Code
+// that runs outside any super area sees the default context.
+//
+STATIC __declspec(thread) PNTFS_VOLUME_CONTEXT CurrentContext = NULL;
+
+STATIC NTFS_VOLUME_CONTEXT DefaultContext = {
+    NTFS_CURRENT_MAJOR_VERSION,
+    NTFS_CURRENT_MINOR_VERSION,
+    0
+};
 
 DEFINE_CONSTRUCTOR( NTFS_SA, SUPERAREA   );
 
@@ -61,6 +71,10 @@ Return Value:
     _NumberOfStages = 0;
     _cvt_zone = 0;
     _cvt_zone_size = 0;
+    _snapshot = NULL;
+    _mark = NULL;
+    _context = DefaultContext;
+    _context.SkippedFileNameUpdates = 0;
 }
 
 
@@ -90,6 +104,12 @@ Return Value:
     _boot3 = 0;
     _cvt_zone = 0;
     _cvt_zone_size = 0;
+    _snapshot = NULL;
+    DELETE(_mark);
+
+    if (CurrentContext == &_context) {
+        CurrentContext = NULL;
+    }
 }
 
 
@@ -303,8 +323,8 @@ NTFS_SA::SetVersionNumber(
     IN  UCHAR   Minor
     )
 {
-    _MajorVersion = Major;
-    _MinorVersion = Minor;
+    _context.MajorVersion = Major;
+    _context.MinorVersion = Minor;
 }
 
 
@@ -313,9 +333,78 @@ NTFS_SA::QueryVersionNumber(
     OUT PUCHAR  Major,
     OUT PUCHAR  Minor
     )
+/*++
+
+Routine Description:
+
+    This routine returns the version of the volume the calling thread
+    is working on.
+
+Arguments:
+
+    Major   - Returns the major version number.
+    Minor   - Returns the minor version number.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PNTFS_VOLUME_CONTEXT Context = QueryCurrentContext();
+
+    *Major = Context->MajorVersion;
+    *Minor = Context->MinorVersion;
+}
+
+
+PNTFS_VOLUME_CONTEXT
+NTFS_SA::QueryCurrentContext(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the context of the volume the calling thread
+    is working on, or a default context if it is not working on any.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The current volume context.
+
+--*/
 {
-    *Major = _MajorVersion;
-    *Minor = _MinorVersion;
+    return CurrentContext ? CurrentContext : &DefaultContext;
+}
+
+
+VOID
+NTFS_SA::MakeContextCurrent(
+    )
+/*++
+
+Routine Description:
+
+    This routine makes the context of this volume the current context
+    of the calling thread.  Every marking method calls it first, so a
+    volume may be marked from any thread, as long as only one thread
+    works on it at a time.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CurrentContext = &_context;
 }
 
 
@@ -349,9 +438,11 @@ Return Value:
     HMEM                    hmem;
     LCN                     cluster_number, alternate;
     ULONG                   cluster_offset, alternate_offset;
-    PVOID                   p;
+    PVOID                   record;
     NTFS_ATTRIBUTE_RECORD   attr_rec;
-    PVOLUME_INFORMATION     vol_info;
+    PCVOID                  p;
+    ULONG                   length;
+    CONST VOLUME_INFORMATION* vol_info;
 
     if (CorruptVolume) {
         *CorruptVolume = FALSE;
@@ -401,10 +492,10 @@ Return Value:
             }
         }
 
-        p = NULL;
-        while (p = frs.GetNextAttributeRecord(p)) 
+        record = NULL;
+        while (record = frs.GetNextAttributeRecord(record)) 
         {
-            if (!attr_rec.Initialize(GetDrive(), p)) 
+            if (!attr_rec.Initialize(GetDrive(), record)) 
             {
                 // the attribute record containing the volume flags
                 // is not available--this means that the volume is
@@ -418,31 +509,36 @@ Return Value:
 #endif
 
             if (attr_rec.QueryTypeCode() == $VOLUME_INFORMATION &&
-                attr_rec.QueryNameLength() == 0 &&
-                attr_rec.QueryRecordLength() > SIZE_OF_RESIDENT_HEADER &&
-                attr_rec.QueryResidentValueLength() < attr_rec.QueryRecordLength() &&
-                (attr_rec.QueryRecordLength() - attr_rec.QueryResidentValueLength()) >=
-                attr_rec.QueryResidentValueOffset() &&
-                attr_rec.QueryResidentValueLength() >= sizeof(VOLUME_INFORMATION) &&
-                (vol_info = (PVOLUME_INFORMATION) attr_rec.GetResidentValue())) 
+                attr_rec.QueryNameLength() == 0) 
             {
-                if (MajorVersion) 
-                {
-                    *MajorVersion = vol_info->MajorVersion;
-                }
+                break;
+            }
+        }
+
+        // The volume information is resident and only a few bytes
+        // long, so look at it in place rather than copying it out.
+
+        if (frs.QueryResidentValue($VOLUME_INFORMATION, NULL, &p, &length) &&
+            length >= sizeof(VOLUME_INFORMATION))
+        {
+            vol_info = (CONST VOLUME_INFORMATION*) p;
 
-                if (MinorVersion) 
-                {
-                    *MinorVersion = vol_info->MinorVersion;
-                }
+            if (MajorVersion) 
+            {
+                *MajorVersion = vol_info->MajorVersion;
+            }
 
-                if (vol_info->MajorVersion > 3) 
-                {
-                    break;  // try the mirror copy
-                }
+            if (MinorVersion) 
+            {
+                *MinorVersion = vol_info->MinorVersion;
+            }
 
+            if (vol_info->MajorVersion <= 3) 
+            {
                 return (vol_info->VolumeFlags);
             }
+
+            // Otherwise try the mirror copy.
         }
 
         // If the desired attribute wasn't found in the first
@@ -683,28 +779,113 @@ Return Value:
 }
 
 
+//
+// The metadata that marking works on.  BeginMarking loads it and it is
+// kept until EndMarking, so that any number of batches of sectors can
+// be marked and committed with one load.
+//
+struct NTFS_MARK_STATE {
+    NTFS_ATTRIBUTE          BitmapAttribute;
+    NTFS_MFT_FILE           MftFile;
+    NTFS_BITMAP_FILE        BitmapFile;
+    NTFS_BAD_CLUSTER_FILE   BadClusterFile;
+    NTFS_BITMAP             VolumeBitmap;
+    NTFS_UPCASE_FILE        UpcaseFile;
+    NTFS_ATTRIBUTE          UpcaseAttribute;
+    NTFS_UPCASE_TABLE       UpcaseTable;
+    NUMBER_SET              BadClusterList;     // marked, not yet committed
+    BOOLEAN                 FromSnapshot;       // bitmap taken from the snapshot
+    BOOLEAN                 Changed;            // something has been committed
+    BOOLEAN                 Failed;             // a commit failed part way
+};
+
+
 BOOLEAN
 NTFS_SA::MarkBad(
-    IN const std::vector<sectors_range>& physicalDriveSectorsTargets,
+    IN OUT sectors_range_source& physicalDriveSectorsTargets,
     IN OUT  PMESSAGE    Message
 )
 {
-    NTFS_ATTRIBUTE BitmapAttribute;
-    NTFS_MFT_FILE MftFile;
-    NTFS_BITMAP_FILE BitmapFile;
-    NTFS_BAD_CLUSTER_FILE BadClusterFile;
-    NTFS_BITMAP VolumeBitmap;
-    NTFS_UPCASE_FILE UpcaseFile;
-    NTFS_ATTRIBUTE UpcaseAttribute;
-    NTFS_UPCASE_TABLE UpcaseTable;
+    NTFS_MARK_COUNTS Counts;
+    BOOLEAN r;
+
+    if (!BeginMarking(Message))
+    {
+        return FALSE;
+    }
+
+    Message->Out("Scanning volume...");
+
+    Message->Out("First volume sector: ", _drive->QueryHiddenSectors().GetQuadPart());
+    Message->Out("Last volume sector: ", (_drive->QueryHiddenSectors() + _drive->QuerySectors() - 1).GetQuadPart());
+    Message->Out("Bytes per sector: ", _drive->QuerySectorSize());
+    Message->Out("Sectors per cluster: ", (ULONG)QueryClusterFactor());
+    Message->Out("Total cluster count: ", _mark->VolumeBitmap.QuerySize().GetQuadPart());
+
+    r = MarkSectors(physicalDriveSectorsTargets, &Counts, Message);
+
+    if (r && physicalDriveSectorsTargets.count() != 0)
+    {
+        Message->Out("The number of clusters skipped since they already marked bad: ", Counts.AlreadyBad);
+        Message->Out("The number of clusters skipped since they are in use: ", Counts.InUse);
+        Message->Out("The number of selected clusters: ", Counts.Marked);
+
+        if (Counts.Marked == 0)
+        {
+            Message->Out("No clusters to add to the Bad Clusters File.");
+        }
+    }
+
+    r = r && CommitMarking(Message);
+
+    EndMarking(Message);
+
+    return r;
+}
+
+
+BOOLEAN
+NTFS_SA::BeginMarking(
+    IN OUT  PMESSAGE    Message,
+    IN      BOOLEAN     Lock
+    )
+/*++
+
+Routine Description:
+
+    This routine locks the volume and loads the metadata needed to
+    mark clusters as bad: the MFT, the volume bitmap and the bad
+    cluster file.  It stays loaded, and the volume locked, until
+    EndMarking.
+
+Arguments:
+
+    Message - Supplies an outlet for messages.
+    Lock    - Supplies whether to lock the volume.  Without the lock
+              the metadata may change under the loaded copy, so it
+              can only be used by PlanMarking.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    NTFS_SNAPSHOT_KEY SnapshotKey;
     BOOLEAN Error = FALSE;
     UCHAR Major, Minor;
     BOOLEAN CorruptVolume;
 
+    DebugAssert(_mark == NULL);
+
+    MakeContextCurrent();
+
+    _drive->SetIoPhase(IO_STATS_PHASE_LOAD);
 
     // Lock the drive.
 
-    if (!_drive->Lock())
+    if (Lock && !_drive->Lock())
     {
         Message->Out("Cannot lock the drive. The volume is still in use.");
         return FALSE;
@@ -720,7 +901,7 @@ NTFS_SA::MarkBad(
         return FALSE;
     }
 
-    if (Major > 3 || (Major = 3 && Minor > 1))
+    if (Major > 3 || (Major == 3 && Minor > 1))
     {
         Message->Out("Unsupported NTFS version.");
         return FALSE;
@@ -728,113 +909,656 @@ NTFS_SA::MarkBad(
 
     SetVersionNumber(Major, Minor);
 
+    if ((_mark = NEW NTFS_MARK_STATE) == NULL)
+    {
+        Message->Out("Out of memory.");
+        return FALSE;
+    }
+
+    _mark->FromSnapshot = FALSE;
+    _mark->Changed = FALSE;
+    _mark->Failed = FALSE;
+
     // Initialize and read the MFT, the Bitmap File, the Bitmap, and the
     // Bad Cluster File.
     //
-    if (!VolumeBitmap.Initialize(QueryVolumeSectors() /
+    if (!_mark->VolumeBitmap.Initialize(QueryVolumeSectors() /
         ((ULONG)QueryClusterFactor()),
         FALSE, _drive, QueryClusterFactor()) ||
-        !MftFile.Initialize(_drive,
+        !_mark->MftFile.Initialize(_drive,
             QueryMftStartingLcn(),
             QueryClusterFactor(),
             QueryFrsSize(),
             QueryVolumeSectors(),
-            &VolumeBitmap,
-            NULL)) 
+            &_mark->VolumeBitmap,
+            NULL) ||
+        !_mark->BadClusterList.Initialize())
     {
+        DELETE(_mark);
         Message->Out("Out of memory.");
         return FALSE;
     }
 
-    if (!MftFile.Read())
+    _drive->SetIoStream(IO_STATS_STREAM_MFT);
+
+    if (!_mark->MftFile.Read())
     {
         //DebugPrint("NTFS_SA::RecoverFile: Cannot read MFT.\n");
+        DELETE(_mark);
         Message->Out("The volume is corrupt. Run CHKDSK.");
         return FALSE;
     }
 
-    // Get the upcase table.
+    // Get the upcase table.  Its value is only read if a name
+    // comparison needs a character outside the ASCII range, so
+    // UpcaseAttribute must stay in scope as long as UpcaseTable.
+    // If that read fails, StageMarking refuses to write the batch.
     //
-    if (!UpcaseFile.Initialize(MftFile.GetMasterFileTable()) ||
-        !UpcaseFile.Read() ||
-        !UpcaseFile.QueryAttribute(&UpcaseAttribute, &Error, $DATA) ||
-        !UpcaseTable.Initialize(&UpcaseAttribute))
+    _drive->SetIoStream(IO_STATS_STREAM_UPCASE);
+
+    if (!_mark->UpcaseFile.Initialize(_mark->MftFile.GetMasterFileTable()) ||
+        !_mark->UpcaseFile.Read() ||
+        !_mark->UpcaseFile.QueryAttribute(&_mark->UpcaseAttribute, &Error, $DATA) ||
+        !_mark->UpcaseTable.Initialize(&_mark->UpcaseAttribute, TRUE))
     {
         //DebugPrint("UNTFS RecoverFile:Can't get the upcase table.\n");
 
+        DELETE(_mark);
         Message->Out("The volume is corrupt. Run CHKDSK.");
         return FALSE;
     }
 
-    MftFile.SetUpcaseTable((PNTFS_UPCASE_TABLE)&UpcaseTable);
-    MftFile.GetMasterFileTable()->SetUpcaseTable((PNTFS_UPCASE_TABLE)&UpcaseTable);
+    _mark->MftFile.SetUpcaseTable((PNTFS_UPCASE_TABLE)&_mark->UpcaseTable);
+    _mark->MftFile.GetMasterFileTable()->SetUpcaseTable((PNTFS_UPCASE_TABLE)&_mark->UpcaseTable);
 
 
     // Initialize the Bitmap file and the Bad Cluster file, and
     // read the volume bitmap.
     //
-    if (!BitmapFile.Initialize(MftFile.GetMasterFileTable()) ||
-        !BadClusterFile.Initialize(MftFile.GetMasterFileTable())) 
+    if (!_mark->BitmapFile.Initialize(_mark->MftFile.GetMasterFileTable()) ||
+        !_mark->BadClusterFile.Initialize(_mark->MftFile.GetMasterFileTable())) 
     {
+        DELETE(_mark);
         Message->Out("Out of memory.");
         return FALSE;
     }
 
-    if (!BitmapFile.Read() ||
-        !BitmapFile.QueryAttribute(&BitmapAttribute, &Error, $DATA) ||
-        !VolumeBitmap.Read(&BitmapAttribute) ||
-        !BadClusterFile.Read()) 
+    _drive->SetIoStream(IO_STATS_STREAM_BITMAP);
+
+    if (!_mark->BitmapFile.Read() ||
+        !_mark->BitmapFile.QueryAttribute(&_mark->BitmapAttribute, &Error, $DATA)) 
     {
+        DELETE(_mark);
+        Message->Out("The volume is corrupt. Run CHKDSK.");
+        return FALSE;
+    }
+
+    _drive->SetIoStream(IO_STATS_STREAM_BADCLUS);
 
+    if (!_mark->BadClusterFile.Read()) 
+    {
+        DELETE(_mark);
         Message->Out("The volume is corrupt. Run CHKDSK.");
         return FALSE;
     }
 
-    NUMBER_SET BadClusterList;
-    if (!BadClusterList.Initialize())
+    // The volume bitmap is the bulk of what has to be read.  If the
+    // volume has not changed since the snapshot was saved, take the
+    // bitmap from the snapshot instead.
+    //
+    _drive->SetIoStream(IO_STATS_STREAM_OTHER);
+
+    if (_snapshot &&
+        QuerySnapshotKey(_mark->MftFile.GetMasterFileTable(), &SnapshotKey) &&
+        _snapshot->Load(&SnapshotKey, &_mark->VolumeBitmap))
+    {
+        Message->Out("Volume bitmap taken from the metadata snapshot.");
+        _mark->FromSnapshot = TRUE;
+    }
+    else
+    {
+        _drive->SetIoStream(IO_STATS_STREAM_BITMAP);
+
+        if (!_mark->VolumeBitmap.Read(&_mark->BitmapAttribute))
+        {
+            DELETE(_mark);
+            Message->Out("The volume is corrupt. Run CHKDSK.");
+            return FALSE;
+        }
+    }
+
+    _drive->SetIoStream(IO_STATS_STREAM_OTHER);
+    _drive->SetIoPhase(IO_STATS_PHASE_NONE);
+
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_SA::MarkSectors(
+    IN OUT  sectors_range_source&   physicalDriveSectorsTargets,
+    OUT     PNTFS_MARK_COUNTS       Counts,
+    IN OUT  PMESSAGE                Message
+    )
+/*++
+
+Routine Description:
+
+    This routine marks the free clusters holding the given sectors as
+    allocated in the loaded volume bitmap, and adds them to the list
+    that the next CommitMarking writes to the bad cluster file.
+
+    If it fails part way, every cluster marked since the last commit
+    is unmarked, by this call or an earlier one, so the batch fails
+    as a whole and the loaded metadata still matches the volume.
+
+Arguments:
+
+    physicalDriveSectorsTargets
+                - Supplies the sectors to mark, in order.
+    Counts      - Returns what was done with the clusters.
+    Message     - Supplies an outlet for messages.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    BOOLEAN r;
+
+    DebugAssert(_mark);
+
+    MakeContextCurrent();
+
+    _drive->SetIoPhase(IO_STATS_PHASE_SCAN);
+
+    r = MarkInFreeSpace(_mark->MftFile.GetMasterFileTable(),
+                        physicalDriveSectorsTargets,
+                        &_mark->BadClusterList,
+                        &_mark->BadClusterFile,
+                        Counts,
+                        Message);
+
+    if (!r)
+    {
+        DiscardMarking();
+    }
+
+    _drive->SetIoPhase(IO_STATS_PHASE_NONE);
+
+    return r;
+}
+
+
+VOID
+NTFS_SA::DiscardMarking(
+    )
+/*++
+
+Routine Description:
+
+    This routine unmarks the clusters marked since the last commit:
+    they are freed again in the loaded volume bitmap and dropped from
+    the list of clusters to add to the bad cluster file.  Every one of
+    them was free when it was marked.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PNTFS_BITMAP bitmap = &_mark->VolumeBitmap;
+    BIG_INT start, length;
+
+    // Take the first range each time; trimming it from the front never
+    // splits it, so this needs no memory.
+
+    while (_mark->BadClusterList.QueryNumDisjointRanges() != 0)
+    {
+        _mark->BadClusterList.QueryDisjointRange(0, &start, &length);
+
+        bitmap->SetFree(start, length);
+
+        for (; length > 0; length -= 1)
+        {
+            _mark->BadClusterList.Remove(start);
+            start += 1;
+        }
+    }
+}
+
+
+BOOLEAN
+NTFS_SA::CommitMarking(
+    IN OUT  PMESSAGE    Message
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the clusters marked since the last commit to
+    the bad cluster file, along with the MFT and the volume bitmap, in
+    one write batch.  If it fails, the loaded metadata no longer
+    matches the volume, and nothing more can be marked before
+    EndMarking.
+
+Arguments:
+
+    Message - Supplies an outlet for messages.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    ULONG badClusterCount;
+    ULONG skipped;
+    PUNDO_JOURNAL journal;
+    PIO_STATS stats;
+
+    DebugAssert(_mark);
+
+    MakeContextCurrent();
+
+    if (_mark->Failed)
     {
         return FALSE;
     }
 
-    if (!MarkInFreeSpace(MftFile.GetMasterFileTable(), physicalDriveSectorsTargets, &BadClusterList, &BadClusterFile, Message))
+    if (_mark->BadClusterList.QueryCardinality() == 0)
+    {
+        return TRUE;
+    }
+
+    // If any bad clusters were found, we need to flush the bad cluster
+    // file and the MFT and write the bitmap.  If no bad clusters were
+    // found, then these structures will be unchanged.
+
+    _mark->Failed = TRUE;
+
+    badClusterCount = _mark->BadClusterList.QueryCardinality().GetLowPart();
+    if (badClusterCount == 1)
+        Message->Out("Adding 1 cluster to the Bad Clusters File...");
+    else
+        Message->Out("Adding ", badClusterCount, " clusters to the Bad Clusters File...");
+
+    skipped = QuerySkippedFileNameUpdates();
+
+    if (!StageMarking(Message))
     {
         return FALSE;
     }
 
-    if (BadClusterList.QueryCardinality() != 0)
+    _drive->SetIoPhase(IO_STATS_PHASE_COMMIT);
+
+    if (!_drive->CommitWriteBatch())
     {
-        // If any bad clusters were found, we need to flush the bad cluster
-        // file and the MFT and write the bitmap.  If no bad clusters were
-        // found, then these structures will be unchanged.
+        _drive->SetIoPhase(IO_STATS_PHASE_NONE);
+
+        // A journal that cannot be written stops the commit before
+        // anything reaches the volume.
+
+        journal = _drive->QueryUndoJournal();
 
-        ULONG badClusterCount = BadClusterList.QueryCardinality().GetLowPart();
-        if (badClusterCount == 1)
-            Message->Out("Adding 1 cluster to the Bad Clusters File...");
+        if (journal && journal->QueryWriteError() != ERROR_SUCCESS)
+            Message->Out("Cannot write the undo journal (error ", (LONGLONG)journal->QueryWriteError(),
+                "). The metadata changes were not written.");
         else
-            Message->Out("Adding ", badClusterCount, " clusters to the Bad Clusters File...");
+            Message->Out("Cannot write the volume metadata.");
+
+        return FALSE;
+    }
+
+    _drive->SetIoPhase(IO_STATS_PHASE_NONE);
+
+    if ((stats = _drive->QueryIoStats()) != NULL)
+    {
+        stats->RecordSkippedFileNameUpdates(QuerySkippedFileNameUpdates() - skipped);
+    }
+
+    _mark->BadClusterList.RemoveAll();
+    _mark->Changed = TRUE;
+    _mark->Failed = FALSE;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_SA::PlanMarking(
+    OUT     PNTFS_MARK_PLAN Plan,
+    IN OUT  PNUMBER_SET     Sectors,
+    IN OUT  PMESSAGE        Message
+    )
+/*++
+
+Routine Description:
+
+    This routine works out what CommitMarking would do with the
+    clusters marked so far, without writing anything: the runs and
+    file records $BadClus would gain, and the sectors the commit would
+    write.  The changes are only made to the loaded metadata, which
+    then no longer matches the volume, so nothing more can be marked
+    or committed before EndMarking.
+
+Arguments:
+
+    Plan    - Returns what the commit would change.
+    Sectors - Supplies an initialized set, to which the sectors the
+              commit would write are added, numbered on the volume.
+    Message - Supplies an outlet for messages.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    PNTFS_BITMAP MftBitmap;
+    BIG_INT RecordsBefore;
+    ULONG RunsBefore;
+    ULONG RunsAfter;
+
+    DebugAssert(_mark);
+
+    MakeContextCurrent();
+
+    memset(Plan, 0, sizeof(NTFS_MARK_PLAN));
+
+    if (_mark->Failed)
+    {
+        return FALSE;
+    }
+
+    if (_mark->BadClusterList.QueryCardinality() == 0)
+    {
+        return TRUE;
+    }
+
+    _mark->Failed = TRUE;
+
+    MftBitmap = _mark->MftFile.GetMasterFileTable()->GetMftBitmap();
+    RecordsBefore = MftBitmap->QuerySize() - MftBitmap->QueryFreeClusters();
+
+    if (!_mark->BadClusterFile.QueryRunCount(&RunsBefore) ||
+        !StageMarking(Message))
+    {
+        return FALSE;
+    }
+
+    if (!_mark->BadClusterFile.QueryRunCount(&RunsAfter) ||
+        !_drive->QueryWriteBatch(Sectors, &Plan->WriteCount))
+    {
+        _drive->AbortWriteBatch();
+        Message->Out("Out of memory.");
+        return FALSE;
+    }
+
+    _drive->AbortWriteBatch();
+
+    Plan->AddedRuns = RunsAfter - RunsBefore;
+    Plan->AddedFileRecords = (MftBitmap->QuerySize() - MftBitmap->QueryFreeClusters() -
+                              RecordsBefore).GetQuadPart();
+
+    return TRUE;
+}
+
+
+BOOLEAN
+NTFS_SA::StageMarking(
+    IN OUT  PMESSAGE    Message
+    )
+/*++
+
+Routine Description:
+
+    This routine adds the marked clusters to the bad cluster file and
+    collects the writes of the bad cluster file, the MFT and the volume
+    bitmap in a write batch, in sector order; the volume bitmap goes
+    first and the MFT Mirror last.  The batch is left open for the
+    caller to commit or abort.
+
+Arguments:
+
+    Message - Supplies an outlet for messages.
+
+Return Value:
+
+    FALSE   - Failure.  No batch is open.
+    TRUE    - Success.
+
+--*/
+{
+    BOOLEAN r;
+
+    _drive->SetIoPhase(IO_STATS_PHASE_INSERT);
+    _drive->SetIoStream(IO_STATS_STREAM_BADCLUS);
+
+    if (!_mark->BadClusterFile.Add(&_mark->BadClusterList))
+    {
+        Message->Out("Insufficient disk space to record bad clusters.");
+        r = FALSE;
+    }
+    else if (!_drive->BeginWriteBatch())
+    {
+        r = FALSE;
+    }
+    else
+    {
+        _drive->SetIoPhase(IO_STATS_PHASE_FLUSH);
+        _drive->SetWriteBatchPhase(NTFS_WRITE_PHASE_METADATA);
 
-        if (BadClusterFile.Add(&BadClusterList))
+        r = _mark->BadClusterFile.Flush(&_mark->VolumeBitmap);
+
+        _drive->SetIoStream(IO_STATS_STREAM_MFT);
+
+        r = r && _mark->MftFile.Flush();
+
+        if (r)
         {
-            if (!BadClusterFile.Flush(&VolumeBitmap) ||
-                !MftFile.Flush() ||
-                !VolumeBitmap.Write(&BitmapAttribute, &VolumeBitmap))
-            {
-                Message->Out("Insufficient disk space to record bad clusters.");
-                return FALSE;
-            }
+            _drive->SetWriteBatchPhase(NTFS_WRITE_PHASE_BITMAP);
+            _drive->SetIoStream(IO_STATS_STREAM_BITMAP);
+
+            r = _mark->VolumeBitmap.Write(&_mark->BitmapAttribute, &_mark->VolumeBitmap);
         }
-        else 
+
+        if (!r)
         {
+            _drive->AbortWriteBatch();
             Message->Out("Insufficient disk space to record bad clusters.");
-            return FALSE;
+        }
+        else if (_mark->UpcaseTable.QueryReadFailed())
+        {
+            // Names were compared without the upcase table, so the
+            // index changes in the batch may be out of order.
+            _drive->AbortWriteBatch();
+            Message->Out("Cannot read the upcase table. Run CHKDSK.");
+            r = FALSE;
         }
     }
-    else
+
+    _drive->SetIoStream(IO_STATS_STREAM_OTHER);
+    _drive->SetIoPhase(IO_STATS_PHASE_NONE);
+
+    return r;
+}
+
+
+VOID
+NTFS_SA::EndMarking(
+    IN OUT  PMESSAGE    Message
+    )
+/*++
+
+Routine Description:
+
+    This routine releases the metadata loaded by BeginMarking.  Any
+    clusters marked since the last commit are dropped.  If a snapshot
+    is set, the volume bitmap is saved to it first, unless it already
+    holds it or the bitmap no longer matches the volume.
+
+Arguments:
+
+    Message - Supplies an outlet for messages.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    NTFS_SNAPSHOT_KEY SnapshotKey;
+
+    if (_mark == NULL)
+    {
+        return;
+    }
+
+    MakeContextCurrent();
+
+    // The key is taken again, since committing has rewritten the bad
+    // cluster file record.
+    //
+    if (_snapshot &&
+        !_mark->Failed &&
+        _mark->BadClusterList.QueryCardinality() == 0 &&
+        (!_mark->FromSnapshot || _mark->Changed))
     {
-        if (!physicalDriveSectorsTargets.empty())
+        _drive->SetIoPhase(IO_STATS_PHASE_SNAPSHOT);
+
+        if (!QuerySnapshotKey(_mark->MftFile.GetMasterFileTable(), &SnapshotKey) ||
+            !_snapshot->Save(&SnapshotKey, &_mark->VolumeBitmap))
         {
-            Message->Out("No clusters to add to the Bad Clusters File.");
+            Message->Out("Cannot save the metadata snapshot.");
+        }
+
+        _drive->SetIoPhase(IO_STATS_PHASE_NONE);
+    }
+
+    DELETE(_mark);
+
+    CurrentContext = NULL;
+}
+
+
+BOOLEAN
+NTFS_SA::QuerySnapshotKey(
+    IN OUT  PNTFS_MASTER_FILE_TABLE Mft,
+    OUT     PNTFS_SNAPSHOT_KEY      Key
+    )
+/*++
+
+Routine Description:
+
+    This routine computes the key of a metadata snapshot for the
+    volume as it is on disk now.  It only takes a few small reads:
+    file records 0 through BAD_CLUSTER_FILE_NUMBER of the MFT, of
+    which the key covers $MFT, $Bitmap and $BadClus, and the two
+    restart pages of the log file.
+
+Arguments:
+
+    Mft - Supplies the master file table.
+    Key - Returns the key.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    NTFS_FILE_RECORD_SEGMENT    LogFile;
+    NTFS_ATTRIBUTE              LogFileData;
+    PUCHAR                      records;
+    UCHAR                       page[SEQUENCE_NUMBER_STRIDE];
+    PLFS_RESTART_PAGE_HEADER    restart_page;
+    BIG_INT                     page_offset;
+    LONGLONG                    lsn;
+    ULONG                       frs_size, sector_size, sectors, bytes_read, i;
+    BOOLEAN                     error = FALSE;
+
+    memset(Key, 0, sizeof(NTFS_SNAPSHOT_KEY));
+
+    Key->SerialNumber = _boot_sector->SerialNumber.QuadPart;
+    Key->VolumeSectors = QueryVolumeSectors().GetQuadPart();
+    Key->SectorSize = _drive->QuerySectorSize();
+    Key->ClusterFactor = QueryClusterFactor();
+
+    // The file records of $MFT, $Bitmap and $BadClus hold the mapping
+    // pairs of the metadata this program reads, and the key covers
+    // those three records and no others.  The system file records are
+    // contiguous at the start of the MFT, so records 0 ($MFT) through
+    // BAD_CLUSTER_FILE_NUMBER (8, $BadClus) are read raw, in one go,
+    // and $Bitmap (6) and $BadClus are moved up behind $MFT.
+    //
+    frs_size = QueryFrsSize();
+    sector_size = _drive->QuerySectorSize();
+    sectors = ((BAD_CLUSTER_FILE_NUMBER + 1) * frs_size + sector_size - 1) / sector_size;
+
+    if (!(records = (PUCHAR) MALLOC(sectors * sector_size))) {
+        return FALSE;
+    }
+
+    if (!_drive->Read(QueryMftStartingLcn() * (ULONG) QueryClusterFactor(), sectors, records)) {
+        FREE(records);
+        return FALSE;
+    }
+
+    memmove(records + frs_size, records + BIT_MAP_FILE_NUMBER * frs_size, frs_size);
+    memmove(records + 2 * frs_size, records + BAD_CLUSTER_FILE_NUMBER * frs_size, frs_size);
+
+    Key->FrsChecksum = UNDO_JOURNAL::ComputeChecksum(records, 3 * frs_size);
+
+    FREE(records);
+
+    // Every change the file system makes is logged, so the current
+    // LSN of the log file moves whenever the bitmap changes.  There
+    // are two copies of the restart area; take the later one.
+    //
+    if (!LogFile.Initialize(LOG_FILE_NUMBER, Mft) ||
+        !LogFile.Read() ||
+        !LogFile.QueryAttribute(&LogFileData, &error, $DATA)) {
+
+        return FALSE;
+    }
+
+    page_offset = 0;
+
+    for (i = 0; i < 2; i++) {
+
+        if (!LogFileData.Read(page, page_offset, sizeof(page), &bytes_read) ||
+            bytes_read != sizeof(page)) {
+
+            return FALSE;
+        }
+
+        restart_page = (PLFS_RESTART_PAGE_HEADER) page;
+
+        if (memcmp(restart_page->MultiSectorHeader.Signature, "RSTR", 4) ||
+            restart_page->RestartOffset > sizeof(page) - sizeof(LSN) ||
+            restart_page->SystemPageSize < sizeof(page)) {
+
+            return FALSE;
         }
+
+        lsn = ((PLFS_RESTART_AREA) (page + restart_page->RestartOffset))->CurrentLsn.QuadPart;
+
+        if (i == 0 || lsn > Key->CurrentLsn) {
+            Key->CurrentLsn = lsn;
+        }
+
+        page_offset = restart_page->SystemPageSize;
     }
 
     return TRUE;
@@ -844,9 +1568,10 @@ NTFS_SA::MarkBad(
 BOOLEAN
 NTFS_SA::MarkInFreeSpace(
     IN OUT  PNTFS_MASTER_FILE_TABLE Mft,
-    IN      const std::vector<sectors_range>& physicalDriveSectorsTargets,
+    IN OUT  sectors_range_source&   physicalDriveSectorsTargets,
     IN OUT  PNUMBER_SET             BadClusters,
     IN      PNTFS_BAD_CLUSTER_FILE  BadClusterFile,
+    OUT     PNTFS_MARK_COUNTS       Counts,
     IN OUT  PMESSAGE                Message
 )
 /*++
@@ -859,7 +1584,11 @@ Routine Description:
 Arguments:
 
     Mft         - Supplies the master file table.
+    physicalDriveSectorsTargets
+                - Supplies the sectors to mark, in order.  They are
+                  read once, as the clusters are marked.
     BadClusters - Supplies the current list of bad clusters.
+    Counts      - Returns what was done with the clusters.
     Message     - Supplies an outlet for messages.
 
 Return Value:
@@ -869,38 +1598,30 @@ Return Value:
 
 --*/
 {
-    Message->Out("Scanning volume...");
-
     PLOG_IO_DP_DRIVE drive = Mft->GetDataAttribute()->GetDrive();
 
     BIG_INT firstDriveSector = drive->QueryHiddenSectors();
     BIG_INT lastDriveSector = firstDriveSector + drive->QuerySectors() - 1;
 
-    Message->Out("First volume sector: ", firstDriveSector.GetQuadPart());
-    Message->Out("Last volume sector: ", lastDriveSector.GetQuadPart());
-
     PNTFS_BITMAP bitmap = Mft->GetVolumeBitmap();
     BIG_INT clustersCount = bitmap->QuerySize();
     ULONG clusterFactor = Mft->QueryClusterFactor();
 
-    ULONG sectorSize = drive->QuerySectorSize();
-    Message->Out("Bytes per sector: ", sectorSize);
-    Message->Out("Sectors per cluster: ", clusterFactor);
-    Message->Out("Total cluster count: ", clustersCount.GetQuadPart());
-    
     BIG_INT skippedAlreadyBadClusters = 0;
     BIG_INT skippedInUseClusters = 0;
     BIG_INT markedClusters = 0;
 
     BIG_INT lastProcessedCluster = -1;
 
-    for (std::vector<sectors_range>::const_iterator physicalDriveSectorsPair = physicalDriveSectorsTargets.begin(); physicalDriveSectorsPair != physicalDriveSectorsTargets.end(); ++physicalDriveSectorsPair)
+    sectors_range physicalDriveSectorsPair(0, 0);
+
+    while (physicalDriveSectorsTargets.next(physicalDriveSectorsPair))
     {
-        BIG_INT firstPhysicalDriveSectorToMark = physicalDriveSectorsPair->firstSector;
+        BIG_INT firstPhysicalDriveSectorToMark = physicalDriveSectorsPair.firstSector;
         if (firstPhysicalDriveSectorToMark < firstDriveSector) firstPhysicalDriveSectorToMark = firstDriveSector;
         if (firstPhysicalDriveSectorToMark > lastDriveSector) continue;
 
-    	BIG_INT lastPhysicalDriveSectorToMark = physicalDriveSectorsPair->lastSector;
+    	BIG_INT lastPhysicalDriveSectorToMark = physicalDriveSectorsPair.lastSector;
         if (lastPhysicalDriveSectorToMark > lastDriveSector) lastPhysicalDriveSectorToMark = lastDriveSector;
         if (lastPhysicalDriveSectorToMark < firstDriveSector) continue;
 
@@ -916,7 +1637,10 @@ Return Value:
 
             if (clusterNumber < 0 || clusterNumber >= clustersCount) continue; //check clusterNumber is valid 
 
-            if (BadClusterFile->IsInList(clusterNumber))
+            // Clusters marked earlier but not yet committed count as
+            // already bad too.
+            if (BadClusterFile->IsInList(clusterNumber) ||
+                BadClusters->DoesIntersectSet(clusterNumber, 1))
             {
                 ++skippedAlreadyBadClusters;
                 continue;
@@ -942,13 +1666,15 @@ Return Value:
         }
     }
 
-    if (!physicalDriveSectorsTargets.empty())
+    if (physicalDriveSectorsTargets.failed())
     {
-        Message->Out("The number of clusters skipped since they already marked bad: ", skippedAlreadyBadClusters.GetQuadPart());
-        Message->Out("The number of clusters skipped since they are in use: ", skippedInUseClusters.GetQuadPart());
-        Message->Out("The number of selected clusters: ", markedClusters.GetQuadPart());
+        Message->Out("Cannot read the sectors list.");
+        return FALSE;
     }
 
+    Counts->AlreadyBad = skippedAlreadyBadClusters.GetQuadPart();
+    Counts->InUse = skippedInUseClusters.GetQuadPart();
+    Counts->Marked = markedClusters.GetQuadPart();
+
     return TRUE;
 }
-
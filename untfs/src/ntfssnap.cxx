@@ -0,0 +1,511 @@
+#include "stdafx.h"
+
+/*++
+
+Module Name:
+
+    ntfssnap.cxx
+
+Abstract:
+
+    This module contains the member function definitions for
+    NTFS_SNAPSHOT, which keeps a copy of the volume bitmap between
+    runs.
+
+--*/
+
+
+#include "ulib.hxx"
+
+#include "ntfsbit.hxx"
+#include "ntfssnap.hxx"
+#include "undojrnl.hxx"
+
+
+//
+// Tokens of the encoded bitmap.  Each token is followed by a length
+// in bytes, as a little-endian base-128 number; a literal run is
+// followed by that many bytes.  Runs of zero or all-ones bytes
+// shorter than NTFS_SNAPSHOT_MIN_RUN are stored as literals.
+//
+#define NTFS_SNAPSHOT_ZEROS     0x00
+#define NTFS_SNAPSHOT_ONES      0x01
+#define NTFS_SNAPSHOT_LITERAL   0x02
+
+#define NTFS_SNAPSHOT_MIN_RUN   8
+
+//
+// The longest encoding of a bitmap of Size bytes: every literal run
+// but the last is followed by a fill run of at least
+// NTFS_SNAPSHOT_MIN_RUN bytes, and no token takes more than six bytes
+// besides its literal data.
+//
+#define NTFS_SNAPSHOT_MAX_ENCODED(Size)     ((Size) + (Size) / NTFS_SNAPSHOT_MIN_RUN * 6 + 12)
+
+
+DEFINE_CONSTRUCTOR( NTFS_SNAPSHOT, OBJECT );
+
+
+STATIC
+ULONG
+PutLength(
+    OUT PUCHAR  Output,
+    IN  ULONG   Offset,
+    IN  ULONG   Length
+    )
+{
+    while (Length >= 0x80) {
+        Output[Offset++] = (UCHAR) (Length | 0x80);
+        Length >>= 7;
+    }
+
+    Output[Offset++] = (UCHAR) Length;
+    return Offset;
+}
+
+
+STATIC
+BOOLEAN
+GetLength(
+    IN      PCUCHAR Data,
+    IN      ULONG   DataLength,
+    IN OUT  PULONG  Offset,
+    OUT     PULONG  Length
+    )
+{
+    ULONG   shift;
+
+    *Length = 0;
+
+    for (shift = 0; shift < 32; shift += 7) {
+
+        if (*Offset >= DataLength) {
+            return FALSE;
+        }
+
+        *Length |= (ULONG) (Data[*Offset] & 0x7F) << shift;
+
+        if (!(Data[(*Offset)++] & 0x80)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+NTFS_SNAPSHOT::~NTFS_SNAPSHOT(
+    )
+/*++
+
+Routine Description:
+
+    Destructor for NTFS_SNAPSHOT.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Destroy();
+}
+
+
+VOID
+NTFS_SNAPSHOT::Construct(
+    )
+/*++
+
+Routine Description:
+
+    Constructor for NTFS_SNAPSHOT.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+}
+
+
+VOID
+NTFS_SNAPSHOT::Destroy(
+    )
+/*++
+
+Routine Description:
+
+    This routine returns an NTFS_SNAPSHOT object to its initial state.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+}
+
+
+BOOLEAN
+NTFS_SNAPSHOT::Initialize(
+    IN  PCWSTRING   FileName
+    )
+/*++
+
+Routine Description:
+
+    This routine initializes an NTFS_SNAPSHOT object.  The file need
+    not exist; it is only read by Load and written by Save.
+
+Arguments:
+
+    FileName    - Supplies the name of the snapshot file.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    Destroy();
+
+    DebugAssert(FileName);
+
+    return _file_name.Initialize(FileName);
+}
+
+
+BOOLEAN
+NTFS_SNAPSHOT::Load(
+    IN      PCNTFS_SNAPSHOT_KEY Key,
+    IN OUT  PNTFS_BITMAP        VolumeBitmap
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the volume bitmap from the snapshot file, if the
+    file exists, is intact, and was saved with the same key.
+
+Arguments:
+
+    Key             - Supplies the key of the volume as it is now.
+    VolumeBitmap    - Supplies the volume bitmap, which must be
+                      initialized to the size of the volume.
+
+Return Value:
+
+    FALSE   - There is no usable snapshot; the bitmap is unchanged
+              and must be read from the volume.
+    TRUE    - Success.
+
+--*/
+{
+    NTFS_SNAPSHOT_HEADER    header;
+    ULONG                   checksum, bitmap_size;
+    PUCHAR                  data, bitmap;
+    HANDLE                  handle;
+    LARGE_INTEGER           file_size;
+    DWORD                   bytes_read;
+    BOOLEAN                 r;
+
+    DebugAssert(Key);
+    DebugAssert(VolumeBitmap);
+
+    handle = CreateFileW((LPCWSTR) _file_name.GetWSTR(),
+                         GENERIC_READ,
+                         FILE_SHARE_READ,
+                         NULL,
+                         OPEN_EXISTING,
+                         FILE_FLAG_SEQUENTIAL_SCAN,
+                         NULL);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    VolumeBitmap->GetBitmapData(&bitmap_size);
+
+    if (!GetFileSizeEx(handle, &file_size) ||
+        file_size.QuadPart < (LONGLONG) sizeof(NTFS_SNAPSHOT_HEADER) ||
+        !ReadFile(handle, &header, sizeof(header), &bytes_read, NULL) ||
+        bytes_read != sizeof(header)) {
+
+        CloseHandle(handle);
+        return FALSE;
+    }
+
+    checksum = header.Checksum;
+    header.Checksum = 0;
+
+    if (memcmp(header.Signature, NTFS_SNAPSHOT_SIGNATURE, sizeof(header.Signature)) ||
+        header.Version != NTFS_SNAPSHOT_VERSION ||
+        UNDO_JOURNAL::ComputeChecksum(&header, sizeof(header)) != checksum ||
+        memcmp(&header.Key, Key, sizeof(NTFS_SNAPSHOT_KEY)) ||
+        header.BitmapSize != bitmap_size ||
+        file_size.QuadPart != (LONGLONG) sizeof(header) + header.DataLength) {
+
+        CloseHandle(handle);
+        return FALSE;
+    }
+
+    data = (PUCHAR) MALLOC(max(header.DataLength, (ULONG) 1));
+    bitmap = (PUCHAR) MALLOC(bitmap_size);
+
+    r = data != NULL && bitmap != NULL &&
+        ReadFile(handle, data, header.DataLength, &bytes_read, NULL) &&
+        bytes_read == header.DataLength &&
+        UNDO_JOURNAL::ComputeChecksum(data, header.DataLength) == header.DataChecksum &&
+        Decode(data, header.DataLength, bitmap, bitmap_size) &&
+        VolumeBitmap->Load(bitmap, bitmap_size);
+
+    CloseHandle(handle);
+
+    FREE(data);
+    FREE(bitmap);
+
+    return r;
+}
+
+
+BOOLEAN
+NTFS_SNAPSHOT::Save(
+    IN  PCNTFS_SNAPSHOT_KEY Key,
+    IN  PCNTFS_BITMAP       VolumeBitmap
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the volume bitmap to the snapshot file,
+    replacing what it held.
+
+Arguments:
+
+    Key             - Supplies the key of the volume as it is now,
+                      that is, after any changes this run has made.
+    VolumeBitmap    - Supplies the volume bitmap as it is on disk.
+
+Return Value:
+
+    FALSE   - Failure.
+    TRUE    - Success.
+
+--*/
+{
+    PNTFS_SNAPSHOT_HEADER   header;
+    PCUCHAR                 bitmap;
+    ULONG                   bitmap_size, length;
+    PUCHAR                  buffer;
+    HANDLE                  handle;
+    DWORD                   bytes_written;
+    BOOL                    r;
+
+    DebugAssert(Key);
+    DebugAssert(VolumeBitmap);
+
+    bitmap = (PCUCHAR) VolumeBitmap->GetBitmapData(&bitmap_size);
+
+    if (bitmap_size > (MAXULONG - sizeof(NTFS_SNAPSHOT_HEADER) - 12) / 2) {
+        return FALSE;
+    }
+
+    buffer = (PUCHAR) MALLOC(sizeof(NTFS_SNAPSHOT_HEADER) +
+                             NTFS_SNAPSHOT_MAX_ENCODED(bitmap_size));
+
+    if (buffer == NULL) {
+        return FALSE;
+    }
+
+    length = Encode(bitmap, bitmap_size, buffer + sizeof(NTFS_SNAPSHOT_HEADER));
+
+    DebugAssert(length <= NTFS_SNAPSHOT_MAX_ENCODED(bitmap_size));
+
+    header = (PNTFS_SNAPSHOT_HEADER) buffer;
+    memset(header, 0, sizeof(NTFS_SNAPSHOT_HEADER));
+    memcpy(header->Signature, NTFS_SNAPSHOT_SIGNATURE, sizeof(header->Signature));
+    header->Version = NTFS_SNAPSHOT_VERSION;
+    header->BitmapSize = bitmap_size;
+    header->Key = *Key;
+    header->DataLength = length;
+    header->DataChecksum = UNDO_JOURNAL::ComputeChecksum(buffer + sizeof(NTFS_SNAPSHOT_HEADER), length);
+    header->Checksum = UNDO_JOURNAL::ComputeChecksum(header, sizeof(NTFS_SNAPSHOT_HEADER));
+
+    length += sizeof(NTFS_SNAPSHOT_HEADER);
+
+    handle = CreateFileW((LPCWSTR) _file_name.GetWSTR(),
+                         GENERIC_WRITE,
+                         0,
+                         NULL,
+                         CREATE_ALWAYS,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                         NULL);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        FREE(buffer);
+        return FALSE;
+    }
+
+    r = WriteFile(handle, buffer, length, &bytes_written, NULL) &&
+        bytes_written == length;
+
+    CloseHandle(handle);
+    FREE(buffer);
+
+    return r ? TRUE : FALSE;
+}
+
+
+ULONG
+NTFS_SNAPSHOT::Encode(
+    IN  PCUCHAR Data,
+    IN  ULONG   Size,
+    OUT PUCHAR  Output
+    )
+/*++
+
+Routine Description:
+
+    This routine run-length encodes a bitmap.
+
+Arguments:
+
+    Data    - Supplies the bitmap.
+    Size    - Supplies the size of the bitmap in bytes.
+    Output  - Receives the encoded bitmap.  It must have room for
+              NTFS_SNAPSHOT_MAX_ENCODED(Size) bytes.
+
+Return Value:
+
+    The length of the encoded bitmap.
+
+--*/
+{
+    ULONG   offset, i, j, literal;
+
+    offset = 0;
+    literal = 0;
+    i = 0;
+
+    while (i < Size) {
+
+        if (Data[i] != 0x00 && Data[i] != 0xFF) {
+            i++;
+            continue;
+        }
+
+        for (j = i + 1; j < Size && Data[j] == Data[i]; j++) {
+        }
+
+        if (j - i < NTFS_SNAPSHOT_MIN_RUN) {
+            i = j;
+            continue;
+        }
+
+        if (i > literal) {
+            Output[offset++] = NTFS_SNAPSHOT_LITERAL;
+            offset = PutLength(Output, offset, i - literal);
+            memcpy(Output + offset, Data + literal, i - literal);
+            offset += i - literal;
+        }
+
+        Output[offset++] = Data[i] ? NTFS_SNAPSHOT_ONES : NTFS_SNAPSHOT_ZEROS;
+        offset = PutLength(Output, offset, j - i);
+
+        i = literal = j;
+    }
+
+    if (Size > literal) {
+        Output[offset++] = NTFS_SNAPSHOT_LITERAL;
+        offset = PutLength(Output, offset, Size - literal);
+        memcpy(Output + offset, Data + literal, Size - literal);
+        offset += Size - literal;
+    }
+
+    return offset;
+}
+
+
+BOOLEAN
+NTFS_SNAPSHOT::Decode(
+    IN  PCUCHAR Data,
+    IN  ULONG   Length,
+    OUT PUCHAR  Output,
+    IN  ULONG   Size
+    )
+/*++
+
+Routine Description:
+
+    This routine decodes a bitmap encoded by Encode.
+
+Arguments:
+
+    Data    - Supplies the encoded bitmap.
+    Length  - Supplies the length of the encoded bitmap.
+    Output  - Receives the bitmap.
+    Size    - Supplies the size of the bitmap in bytes.
+
+Return Value:
+
+    FALSE   - The encoded bitmap is damaged or not of this size.
+    TRUE    - Success.
+
+--*/
+{
+    ULONG   offset, done, run;
+    UCHAR   token;
+
+    offset = 0;
+    done = 0;
+
+    while (offset < Length) {
+
+        token = Data[offset++];
+
+        if (!GetLength(Data, Length, &offset, &run) || run > Size - done) {
+            return FALSE;
+        }
+
+        switch (token) {
+
+            case NTFS_SNAPSHOT_ZEROS:
+                memset(Output + done, 0x00, run);
+                break;
+
+            case NTFS_SNAPSHOT_ONES:
+                memset(Output + done, 0xFF, run);
+                break;
+
+            case NTFS_SNAPSHOT_LITERAL:
+                if (run > Length - offset) {
+                    return FALSE;
+                }
+                memcpy(Output + done, Data + offset, run);
+                offset += run;
+                break;
+
+            default:
+                return FALSE;
+        }
+
+        done += run;
+    }
+
+    return done == Size;
+}
@@ -22,6 +22,7 @@ Abstract:
 
 DECLARE_CLASS( NTFS_ATTRIBUTE );
 DECLARE_CLASS( NTFS_ATTRIBUTE_LIST );
+DECLARE_CLASS( NTFS_ATTRIBUTE_OFFSET_TABLE );
 DECLARE_CLASS( NTFS_ATTRIBUTE_RECORD );
 DECLARE_CLASS( NTFS_BAD_CLUSTER_FILE );
 DECLARE_CLASS( NTFS_BITMAP_FILE );
@@ -31,8 +32,10 @@ DECLARE_CLASS( NTFS_EXTENT_LIST );
 DECLARE_CLASS( NTFS_FILE_RECORD_SEGMENT );
 DECLARE_CLASS( NTFS_FRS_STRUCTURE );
 DECLARE_CLASS( NTFS_INDEX_BUFFER );
+DECLARE_CLASS( NTFS_INDEX_ENTRY_TABLE );
 DECLARE_CLASS( NTFS_INDEX_ROOT );
 DECLARE_CLASS( NTFS_INDEX_TREE );
+DECLARE_CLASS( NTFS_MAPPING_PAIRS_DECODER );
 DECLARE_CLASS( NTFS_MASTER_FILE_TABLE );
 DECLARE_CLASS( NTFS_MFT_FILE );
 DECLARE_CLASS( NTFS_REFLECTED_MASTER_FILE_TABLE );
@@ -41,6 +44,7 @@ DECLARE_CLASS( NTFS_UPCASE_FILE );
 DECLARE_CLASS( NTFS_UPCASE_TABLE );
 DECLARE_CLASS( NTFS_VOL );
 DECLARE_CLASS( NTFS_SA );
+DECLARE_CLASS( NTFS_SNAPSHOT );
 
 BOOLEAN
 UntfsDefineClassDescriptors(
@@ -49,6 +53,7 @@ UntfsDefineClassDescriptors(
         if( 
         DEFINE_CLASS_DESCRIPTOR( NTFS_ATTRIBUTE                     ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_ATTRIBUTE_LIST                ) &&
+        DEFINE_CLASS_DESCRIPTOR( NTFS_ATTRIBUTE_OFFSET_TABLE        ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_ATTRIBUTE_RECORD              ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_BAD_CLUSTER_FILE              ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_BITMAP_FILE                   ) &&
@@ -58,8 +63,10 @@ UntfsDefineClassDescriptors(
         DEFINE_CLASS_DESCRIPTOR( NTFS_FILE_RECORD_SEGMENT           ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_FRS_STRUCTURE                 ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_INDEX_BUFFER                  ) &&
+        DEFINE_CLASS_DESCRIPTOR( NTFS_INDEX_ENTRY_TABLE             ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_INDEX_ROOT                    ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_INDEX_TREE                    ) &&
+        DEFINE_CLASS_DESCRIPTOR( NTFS_MAPPING_PAIRS_DECODER         ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_MASTER_FILE_TABLE             ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_MFT_FILE                      ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_REFLECTED_MASTER_FILE_TABLE   ) &&
@@ -67,6 +74,7 @@ UntfsDefineClassDescriptors(
         DEFINE_CLASS_DESCRIPTOR( NTFS_UPCASE_TABLE                  ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_VOL                           ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_SA                            ) &&
+        DEFINE_CLASS_DESCRIPTOR( NTFS_SNAPSHOT                      ) &&
         DEFINE_CLASS_DESCRIPTOR( NTFS_BITMAP                        ) ) {
 
                 return TRUE;
@@ -84,6 +92,7 @@ UntfsUndefineClassDescriptors(
 {
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_ATTRIBUTE                     );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_ATTRIBUTE_LIST                );
+    UNDEFINE_CLASS_DESCRIPTOR( NTFS_ATTRIBUTE_OFFSET_TABLE        );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_ATTRIBUTE_RECORD              );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_BAD_CLUSTER_FILE              );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_BITMAP_FILE                   );
@@ -93,8 +102,10 @@ UntfsUndefineClassDescriptors(
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_FILE_RECORD_SEGMENT           );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_FRS_STRUCTURE                 );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_INDEX_BUFFER                  );
+    UNDEFINE_CLASS_DESCRIPTOR( NTFS_INDEX_ENTRY_TABLE             );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_INDEX_ROOT                    );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_INDEX_TREE                    );
+    UNDEFINE_CLASS_DESCRIPTOR( NTFS_MAPPING_PAIRS_DECODER         );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_MASTER_FILE_TABLE             );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_MFT_FILE                      );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_REFLECTED_MASTER_FILE_TABLE   );
@@ -102,6 +113,7 @@ UntfsUndefineClassDescriptors(
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_UPCASE_TABLE                  );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_VOL                           );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_SA                            );
+    UNDEFINE_CLASS_DESCRIPTOR( NTFS_SNAPSHOT                      );
     UNDEFINE_CLASS_DESCRIPTOR( NTFS_BITMAP                        );
     return TRUE;
 }
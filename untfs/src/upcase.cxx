@@ -13,6 +13,9 @@ Abstract:
     stored on an NTFS volume, which is used to upper-case characters
     in attribute and file names for comparison.
 
+    NtfsUpcaseCompare folds runs of ASCII characters eight at a time
+    with SSE2 and only goes to the table for other characters.
+
 
 --*/
 
@@ -30,6 +33,12 @@ extern "C" {
 #include <ctype.h>
 }
 
+#if defined(_M_IX86) || defined(_M_AMD64)
+#include <intrin.h>
+#include <emmintrin.h>
+#define NTFS_UPCASE_USE_SSE2
+#endif
+
 
 DEFINE_CONSTRUCTOR( NTFS_UPCASE_TABLE, OBJECT   );
 
@@ -77,6 +86,9 @@ Return Value:
 {
     _Data = NULL;
     _Length = 0;
+    _Attribute = NULL;
+    _AsciiFoldable = FALSE;
+    _ReadFailed = FALSE;
 }
 
 VOID
@@ -101,6 +113,9 @@ Return Value:
 {
     FREE( _Data );
     _Length = 0;
+    _Attribute = NULL;
+    _AsciiFoldable = FALSE;
+    _ReadFailed = FALSE;
 }
 
 
@@ -108,7 +123,8 @@ Return Value:
  
 BOOLEAN
 NTFS_UPCASE_TABLE::Initialize(
-    IN PNTFS_ATTRIBUTE Attribute
+    IN PNTFS_ATTRIBUTE Attribute,
+    IN BOOLEAN         Deferred
     )
 /*++
 
@@ -121,6 +137,10 @@ Arguments:
 
     Attribute   --  Supplies the attribute whose value is the
                     upcase table.
+    Deferred    --  Supplies a flag which, if TRUE, indicates that
+                    the value should not be read until it is first
+                    needed.  In that case the attribute must remain
+                    valid for the life of this object.
 
 
 Return Value:
@@ -154,28 +174,201 @@ Return Value:
         return FALSE;
     }
 
+    // _Length is the number of WCHAR's in the table.
+
+    _Length = BytesInValue / sizeof(WCHAR);
+    _AsciiFoldable = ( _Length >= 0x80 );
+    _Attribute = Attribute;
+
+    return( Deferred || Materialize() );
+}
+
+
+BOOLEAN
+NTFS_UPCASE_TABLE::Materialize(
+    )
+/*++
+
+Routine Description:
+
+    This method reads the value of the upcase table attribute, if
+    that has not been done yet.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE upon successful completion.
+
+Notes:
+
+    If the read fails, the table is left empty and later calls do not
+    retry.  Characters then upcase to themselves, which is the wrong
+    collation for names outside the ASCII range, so QueryReadFailed
+    reports the failure for the caller to fail the operation.
+
+--*/
+{
+    ULONG BytesInValue, BytesRead;
+
+    if( _Data != NULL || _Attribute == NULL ) {
+
+        return( _Data != NULL );
+    }
+
     // Allocate the buffer for the upcase data and read the attribute
     // value into it.
 
+    BytesInValue = _Length * sizeof(WCHAR);
+
     if( (_Data = (PWCHAR)MALLOC( BytesInValue )) == NULL ||
-        !Attribute->Read( _Data,
-                          0,
-                          BytesInValue,
-                          &BytesRead ) ||
+        !_Attribute->Read( _Data,
+                           0,
+                           BytesInValue,
+                           &BytesRead ) ||
         BytesRead != BytesInValue ) {
 
-        Destroy();
+        DebugPrint( "Could not read the upcase table.\n" );
+
+        FREE( _Data );
+        _Length = 0;
+        _Attribute = NULL;
+        _ReadFailed = TRUE;
         return FALSE;
     }
 
-    // _Length is the number of WCHAR's in the table.
+    _Attribute = NULL;
+    return TRUE;
+}
 
-    _Length = BytesInValue / sizeof(WCHAR);
 
-    return TRUE;
+STATIC
+WCHAR
+NtfsUpcaseChar(
+    IN WCHAR                Character,
+    IN PCNTFS_UPCASE_TABLE  UpcaseTable,
+    IN BOOLEAN              AsciiFoldable
+    )
+/*++
+
+Routine Description:
+
+    This function upcases a single character, going to the upcase
+    table only for characters outside the ASCII range.
+
+Arguments:
+
+    Character       --  Supplies the character to upcase.
+    UpcaseTable     --  Supplies the volume upcase table.
+    AsciiFoldable   --  Supplies whether ASCII characters may be
+                        upcased without the table.
+
+Return Value:
+
+    The upcased character.
+
+--*/
+{
+    if( AsciiFoldable && Character < 0x80 ) {
+
+        return( (Character >= 'a' && Character <= 'z') ?
+                    (WCHAR)(Character - ('a' - 'A')) : Character );
+    }
+
+    return UpcaseTable->UpperCase( Character );
 }
 
 
+#if defined(NTFS_UPCASE_USE_SSE2)
+
+STATIC
+ULONG
+NtfsUpcaseCompareAscii(
+    IN  PCWSTR  LeftName,
+    IN  PCWSTR  RightName,
+    IN  ULONG   Length,
+    OUT PLONG   Result
+    )
+/*++
+
+Routine Description:
+
+    This function compares two names case-insensitive, eight
+    characters at a time, for as long as both names are pure ASCII.
+
+Arguments:
+
+    LeftName    --  Supplies the left-hand operand of the comparison.
+    RightName   --  Supplies the right-hand operand of the comparison.
+    Length      --  Supplies the number of characters to compare.
+    Result      --  Receives the result of the comparison if the
+                    names differ within the characters examined,
+                    zero otherwise.
+
+Return Value:
+
+    The number of characters examined.  The caller must compare any
+    remaining characters; if *Result is non-zero, there are none.
+
+--*/
+{
+    CONST __m128i NonAscii = _mm_set1_epi16( (SHORT)0xFF80 );
+    CONST __m128i BelowLower = _mm_set1_epi16( 'a' - 1 );
+    CONST __m128i AboveLower = _mm_set1_epi16( 'z' + 1 );
+    CONST __m128i CaseBit = _mm_set1_epi16( 'a' - 'A' );
+    __m128i Left, Right, Lower;
+    ULONG i, Mismatch, Lane;
+
+    *Result = 0;
+
+    for( i = 0; i + 8 <= Length; i += 8 ) {
+
+        Left = _mm_loadu_si128( (const __m128i*)(LeftName + i) );
+        Right = _mm_loadu_si128( (const __m128i*)(RightName + i) );
+
+        // Stop at the first block with a non-ASCII character in
+        // either name; the caller handles it with the table.
+        //
+        if( _mm_movemask_epi8(
+                _mm_cmpeq_epi16( _mm_and_si128( _mm_or_si128( Left, Right ),
+                                                NonAscii ),
+                                 _mm_setzero_si128() ) ) != 0xFFFF ) {
+
+            break;
+        }
+
+        // All lanes are below 0x80, so signed compares are safe.
+        //
+        Lower = _mm_and_si128( _mm_cmpgt_epi16( Left, BelowLower ),
+                               _mm_cmplt_epi16( Left, AboveLower ) );
+        Left = _mm_sub_epi16( Left, _mm_and_si128( Lower, CaseBit ) );
+
+        Lower = _mm_and_si128( _mm_cmpgt_epi16( Right, BelowLower ),
+                               _mm_cmplt_epi16( Right, AboveLower ) );
+        Right = _mm_sub_epi16( Right, _mm_and_si128( Lower, CaseBit ) );
+
+        Mismatch = ~_mm_movemask_epi8( _mm_cmpeq_epi16( Left, Right ) ) &
+                   0xFFFF;
+
+        if( Mismatch != 0 ) {
+
+            _BitScanForward( (unsigned long*)&Lane, Mismatch );
+            Lane /= sizeof(WCHAR);
+
+            *Result = NtfsUpcaseChar( LeftName[i + Lane], NULL, TRUE ) -
+                      NtfsUpcaseChar( RightName[i + Lane], NULL, TRUE );
+            return i + Lane + 1;
+        }
+    }
+
+    return i;
+}
+
+#endif
+
+
  
 LONG
 NtfsUpcaseCompare(
@@ -221,8 +414,9 @@ Notes:
 
 --*/
 {
-    ULONG ShorterLength, i;
+    ULONG ShorterLength, Limit, i;
     LONG Result;
+    BOOLEAN AsciiFoldable;
 
     // First, if both names have zero length, then they're equal.
     //
@@ -259,15 +453,46 @@ Notes:
     DebugPtrAssert( UpcaseTable );
 
     ShorterLength = MIN( LeftNameLength, RightNameLength );
+    AsciiFoldable = UpcaseTable->IsAsciiFoldable();
+
+    i = 0;
+
+    while( i < ShorterLength ) {
+
+        Limit = ShorterLength;
+
+#if defined(NTFS_UPCASE_USE_SSE2)
 
-    for( i = 0; i < ShorterLength; i++ ) {
+        // Take runs of ASCII characters a block at a time; the block
+        // that stopped the run is finished below, one character at
+        // a time.
+        //
+        if( AsciiFoldable ) {
+
+            i += NtfsUpcaseCompareAscii( LeftName + i,
+                                         RightName + i,
+                                         ShorterLength - i,
+                                         &Result );
+
+            if( Result != 0 ) {
+
+                return Result;
+            }
 
-        Result =  UpcaseTable->UpperCase( LeftName[i] ) -
-                  UpcaseTable->UpperCase( RightName[i] );
+            Limit = MIN( i + 8, ShorterLength );
+        }
+
+#endif
 
-        if( Result != 0 ) {
+        for( ; i < Limit; i++ ) {
 
-            return Result;
+            Result =  NtfsUpcaseChar( LeftName[i], UpcaseTable, AsciiFoldable ) -
+                      NtfsUpcaseChar( RightName[i], UpcaseTable, AsciiFoldable );
+
+            if( Result != 0 ) {
+
+                return Result;
+            }
         }
     }
 